@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+#ifndef INC_ASIO_EXECUTOR_HPP_
+#define INC_ASIO_EXECUTOR_HPP_
+
+//
+// Executors of promise-cpp based on boost::asio
+//
+// Functions --
+//   std::shared_ptr<Executor> asioExecutor(boost::asio::io_context &io);
+//   std::shared_ptr<Executor> asioExecutor(const boost::asio::strand<EXECUTOR> &strand);
+//
+//   std::shared_ptr<AsioHandoff<...>> asioHandoff(boost::asio::io_context &io);
+//   std::shared_ptr<AsioHandoff<...>> asioHandoff(const boost::asio::strand<EXECUTOR> &strand);
+//
+// The tasks are posted to the io_context or strand, and called at once by
+// Promise::thenOn() if the caller is running in it already.
+//
+// AsioHandoff resolves or rejects the defers in the io_context or strand from any thread,
+// the items are queued lock free and one handler is posted for each batch of them,
+// to a strand of the io_context.
+//
+
+#include "promise-cpp/promise.hpp"
+#include "promise-cpp/handoff.hpp"
+#include <boost/asio.hpp>
+
+#if BOOST_VERSION < 106600
+#error "asio executors require boost 1.66 or later"
+#endif
+
+namespace promise {
+
+template<typename ASIO_EXECUTOR>
+class AsioExecutor : public Executor {
+public:
+    explicit AsioExecutor(const ASIO_EXECUTOR &executor)
+        : executor_(executor) {
+    }
+
+    void post(const std::function<void()> &task) override {
+        boost::asio::post(executor_, task);
+    }
+
+    bool isCurrent() const override {
+        return executor_.running_in_this_thread();
+    }
+
+private:
+    ASIO_EXECUTOR executor_;
+};
+
+inline std::shared_ptr<Executor> asioExecutor(boost::asio::io_context &io) {
+    return std::make_shared<AsioExecutor<boost::asio::io_context::executor_type>>(io.get_executor());
+}
+
+template<typename ASIO_EXECUTOR>
+inline std::shared_ptr<Executor> asioExecutor(const boost::asio::strand<ASIO_EXECUTOR> &strand) {
+    return std::make_shared<AsioExecutor<boost::asio::strand<ASIO_EXECUTOR>>>(strand);
+}
+
+template<typename ASIO_EXECUTOR>
+class AsioHandoff;
+
+template<typename ASIO_EXECUTOR>
+inline std::shared_ptr<AsioHandoff<boost::asio::strand<ASIO_EXECUTOR>>> asioHandoff(const boost::asio::strand<ASIO_EXECUTOR> &strand);
+
+// Created by asioHandoff(), the posted handler keeps it alive until the batch is drained.
+// The handlers are posted to a strand, a new batch may be scheduled while the last one is
+// being drained, and the queue must not be consumed by two threads at once.
+template<typename ASIO_EXECUTOR>
+class AsioHandoff : public std::enable_shared_from_this<AsioHandoff<ASIO_EXECUTOR>> {
+public:
+    void resolve(const Defer &defer, any value = any()) {
+        handoff_.resolve(defer, std::move(value));
+    }
+
+    void reject(const Defer &defer, any reason) {
+        handoff_.reject(defer, std::move(reason));
+    }
+
+    void post(const std::function<void()> &func) {
+        handoff_.post(func);
+    }
+
+private:
+    enum { kBatch = 1024 };
+
+    // Post again if the batch is too large, so that other handlers have a chance to run
+    void schedule() {
+        std::shared_ptr<AsioHandoff> self = this->shared_from_this();
+        boost::asio::post(executor_, [self]() {
+            if (!self->handoff_.drain(kBatch))
+                self->schedule();
+        });
+    }
+
+    // Owned by shared_ptr, which is required by shared_from_this()
+    explicit AsioHandoff(const ASIO_EXECUTOR &executor)
+        : executor_(executor)
+        , handoff_([this]() { schedule(); }) {
+    }
+
+    template<typename EXECUTOR>
+    friend std::shared_ptr<AsioHandoff<boost::asio::strand<EXECUTOR>>> asioHandoff(const boost::asio::strand<EXECUTOR> &strand);
+
+    ASIO_EXECUTOR executor_;
+    Handoff       handoff_;
+};
+
+template<typename ASIO_EXECUTOR>
+inline std::shared_ptr<AsioHandoff<boost::asio::strand<ASIO_EXECUTOR>>> asioHandoff(const boost::asio::strand<ASIO_EXECUTOR> &strand) {
+    return std::shared_ptr<AsioHandoff<boost::asio::strand<ASIO_EXECUTOR>>>(new AsioHandoff<boost::asio::strand<ASIO_EXECUTOR>>(strand));
+}
+
+// The io_context may be run by many threads, so the batches are drained in a strand of it
+inline std::shared_ptr<AsioHandoff<boost::asio::strand<boost::asio::io_context::executor_type>>> asioHandoff(boost::asio::io_context &io) {
+    return asioHandoff(boost::asio::strand<boost::asio::io_context::executor_type>(io.get_executor()));
+}
+
+}
+#endif
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+#ifndef INC_ASIO_HTTP_POOL_HPP_
+#define INC_ASIO_HTTP_POOL_HPP_
+
+//
+// Pool of keep-alive http connections based on boost::beast
+//
+// class HttpConnectionPool --
+//   Promise request(const std::string &host, const std::string &port, Request request);
+//   Promise get(const std::string &host, const std::string &port, const std::string &target);
+//   void close();
+//
+// The promises are resolved with the response (HttpConnectionPool::Response),
+// or rejected with boost::system::error_code.
+//
+// - The resolved endpoints of each host are cached for Options::dnsTtl.
+// - Connections are kept alive and reused by the later requests to the same host.
+// - At most Options::maxConnectionsPerHost connections are opened to each host,
+//   other requests wait in the queue of the host.
+// - If Options::maxPipelineDepth > 1 and no more connections can be opened, requests are
+//   written to the busy connections without waiting for the previous responses (HTTP/1.1
+//   pipelining), and the responses are read in order.
+// - Idempotent requests on a reused connection are sent again once if the connection
+//   is found closed by the server.
+//
+// The pool is not thread safe, it should be used in the thread running the io_context.
+//
+
+#include "io.hpp"
+#include <chrono>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/beast/version.hpp>
+
+namespace promise {
+
+class HttpConnectionPool {
+public:
+    using Request  = boost::beast::http::request<boost::beast::http::string_body>;
+    using Response = boost::beast::http::response<boost::beast::http::string_body>;
+    using Clock    = std::chrono::steady_clock;
+
+    struct Options {
+        size_t          maxConnectionsPerHost;
+        size_t          maxPipelineDepth;   // max count of requests in flight on one connection
+        Clock::duration dnsTtl;             // time to keep the resolved endpoints
+
+        Options()
+            : maxConnectionsPerHost(4)
+            , maxPipelineDepth(1)
+            , dnsTtl(std::chrono::seconds(60)) {
+        }
+    };
+
+    explicit HttpConnectionPool(boost::asio::io_context &io, const Options &options = Options())
+        : state_(std::make_shared<State>(io, options)) {
+    }
+
+    ~HttpConnectionPool() {
+        close();
+    }
+
+    // Send the request to host:port, "Host" field is set if it is missing
+    Promise request(const std::string &host, const std::string &port, Request request) {
+        return newPromise([&](Defer &defer) {
+            if (state_->isClosed_) {
+                defer.reject(boost::system::error_code(boost::asio::error::operation_aborted));
+                return;
+            }
+            if (request.find(boost::beast::http::field::host) == request.end())
+                request.set(boost::beast::http::field::host, host);
+            request.keep_alive(true);
+            request.prepare_payload();
+
+            std::shared_ptr<Host> &slot = state_->hosts_[host + ":" + port];
+            if (!slot)
+                slot = std::make_shared<Host>(state_->io_, host, port);
+            slot->queue_.push_back(std::make_shared<Job>(std::move(request), defer));
+            dispatch(state_, slot);
+        });
+    }
+
+    Promise get(const std::string &host, const std::string &port, const std::string &target) {
+        Request request(boost::beast::http::verb::get, target, 11);
+        request.set(boost::beast::http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+        return this->request(host, port, std::move(request));
+    }
+
+    // Close all the connections, the pending requests are rejected with operation_aborted
+    void close() {
+        state_->isClosed_ = true;
+        boost::system::error_code aborted(boost::asio::error::operation_aborted);
+        std::vector<std::shared_ptr<Job>> rejected;
+        for (auto &item : state_->hosts_) {
+            std::shared_ptr<Host> host = item.second;
+            host->resolver_.cancel();
+            while (!host->connections_.empty()) {
+                std::shared_ptr<Connection> conn = host->connections_.front();
+                rejected.insert(rejected.end(), conn->inFlight_.begin(), conn->inFlight_.end());
+                conn->inFlight_.clear();
+                remove(host, conn);
+            }
+            rejected.insert(rejected.end(), host->queue_.begin(), host->queue_.end());
+            host->queue_.clear();
+        }
+        state_->hosts_.clear();
+        for (std::shared_ptr<Job> &job : rejected)
+            job->defer_.reject(aborted);
+    }
+
+private:
+    // Not copied, the destructor of a copy would close the pool shared with the others
+    HttpConnectionPool(const HttpConnectionPool &) = delete;
+    HttpConnectionPool &operator=(const HttpConnectionPool &) = delete;
+
+    using tcp = boost::asio::ip::tcp;
+
+    struct Job {
+        Job(Request &&request, const Defer &defer)
+            : request_(std::move(request))
+            , defer_(defer)
+            , isRetried_(false) {
+        }
+        Request  request_;
+        Response response_;
+        Defer    defer_;
+        bool     isRetried_;
+    };
+    using Jobs = std::deque<std::shared_ptr<Job>>;
+
+    struct Connection {
+        explicit Connection(boost::asio::io_context &io)
+            : socket_(io)
+            , isWriting_(false)
+            , isReading_(false)
+            , isReusable_(true)
+            , responses_(0) {
+        }
+        tcp::socket                socket_;
+        boost::beast::flat_buffer  buffer_;
+        Jobs                       inFlight_;   // written or being written, in order of the responses
+        bool                       isWriting_;
+        bool                       isReading_;
+        bool                       isReusable_;
+        size_t                     responses_;  // count of the responses read
+    };
+
+    struct Host {
+        Host(boost::asio::io_context &io, const std::string &host, const std::string &port)
+            : host_(host)
+            , port_(port)
+            , resolver_(io)
+            , connecting_(0) {
+        }
+        std::string                            host_;
+        std::string                            port_;
+        tcp::resolver                          resolver_;
+        tcp::resolver::results_type            endpoints_;
+        Clock::time_point                      resolvedTime_;
+        std::vector<Defer>                     resolving_;     // waiting for the resolver
+        size_t                                 connecting_;
+        std::list<std::shared_ptr<Connection>> connections_;
+        Jobs                                   queue_;         // waiting for a connection
+    };
+
+    struct State {
+        State(boost::asio::io_context &io, const Options &options)
+            : io_(io)
+            , options_(options)
+            , isClosed_(false) {
+        }
+        boost::asio::io_context                      &io_;
+        Options                                      options_;
+        std::map<std::string, std::shared_ptr<Host>> hosts_;   // by "host:port"
+        bool                                         isClosed_;
+    };
+
+    // The handlers keep the state alive, so that they are safe to be called after the pool is destroyed
+    using StatePtr = std::shared_ptr<State>;
+    using HostPtr  = std::shared_ptr<Host>;
+    using ConnPtr  = std::shared_ptr<Connection>;
+
+    // Resolve by the cached endpoints, or by the pending lookup of the same host
+    static Promise resolve(const StatePtr &state, const HostPtr &host) {
+        if (!host->endpoints_.empty() && Clock::now() - host->resolvedTime_ < state->options_.dnsTtl)
+            return promise::resolve(host->endpoints_);
+
+        return newPromise([&](Defer &defer) {
+            host->resolving_.push_back(defer);
+            if (host->resolving_.size() > 1)
+                return;
+            HostPtr self = host;
+            host->resolver_.async_resolve(host->host_, host->port_,
+                [self](boost::system::error_code err, tcp::resolver::results_type results) {
+                    if (!err) {
+                        self->endpoints_ = results;
+                        self->resolvedTime_ = Clock::now();
+                    }
+                    std::vector<Defer> waiters;
+                    waiters.swap(self->resolving_);
+                    for (Defer &waiter : waiters) {
+                        if (err)
+                            waiter.reject(err);
+                        else
+                            waiter.resolve(results);
+                    }
+            });
+        });
+    }
+
+    static void connect(const StatePtr &state, const HostPtr &host) {
+        ++host->connecting_;
+        ConnPtr conn = std::make_shared<Connection>(state->io_);
+        resolve(state, host).then([conn](tcp::resolver::results_type &results) {
+            return async_connect(conn->socket_, results);
+        }).then([state, host, conn]() {
+            --host->connecting_;
+            if (state->isClosed_) {
+                boost::system::error_code ignored;
+                conn->socket_.close(ignored);
+                return;
+            }
+            boost::system::error_code ignored;
+            conn->socket_.set_option(tcp::no_delay(true), ignored);
+            host->connections_.push_back(conn);
+            dispatch(state, host);
+        }, [state, host](const boost::system::error_code &err) {
+            --host->connecting_;
+            // Look up again for the next connection
+            host->endpoints_ = tcp::resolver::results_type();
+            if (state->isClosed_ || !host->connections_.empty() || host->connecting_ > 0)
+                return;
+
+            // No connection to send the queued requests
+            Jobs jobs;
+            jobs.swap(host->queue_);
+            for (std::shared_ptr<Job> &job : jobs)
+                job->defer_.reject(err);
+        });
+    }
+
+    // Assign the queued requests to the connections, open new connections if necessary
+    static void dispatch(const StatePtr &state, const HostPtr &host) {
+        const Options &options = state->options_;
+        while (!state->isClosed_ && !host->queue_.empty()) {
+            bool isFull = (host->connections_.size() + host->connecting_ >= options.maxConnectionsPerHost);
+
+            // The idle connection, or the connection with the least requests in flight
+            ConnPtr best;
+            for (const ConnPtr &conn : host->connections_) {
+                if (conn->isWriting_ || !conn->isReusable_ || conn->inFlight_.size() >= options.maxPipelineDepth)
+                    continue;
+                if (!best || conn->inFlight_.size() < best->inFlight_.size())
+                    best = conn;
+            }
+
+            // Pipeline to a busy connection only if no more connections can be opened
+            if (best && (best->inFlight_.empty() || isFull)) {
+                std::shared_ptr<Job> job = host->queue_.front();
+                host->queue_.pop_front();
+                send(state, host, best, job);
+            }
+            else if (!isFull && host->connecting_ < host->queue_.size())
+                connect(state, host);
+            else
+                break;
+        }
+    }
+
+    static void send(const StatePtr &state, const HostPtr &host, const ConnPtr &conn, const std::shared_ptr<Job> &job) {
+        conn->isWriting_ = true;
+        conn->inFlight_.push_back(job);
+        async_write(conn->socket_, job->request_).then([state, host, conn](size_t) {
+            conn->isWriting_ = false;
+            read(state, host, conn);
+            dispatch(state, host);
+        }, [state, host, conn](const boost::system::error_code &err) {
+            conn->isWriting_ = false;
+            fail(state, host, conn, err);
+        });
+    }
+
+    // Read the response of the first request in flight
+    static void read(const StatePtr &state, const HostPtr &host, const ConnPtr &conn) {
+        if (conn->isReading_ || conn->inFlight_.empty())
+            return;
+        conn->isReading_ = true;
+        std::shared_ptr<Job> job = conn->inFlight_.front();
+        async_read(conn->socket_, conn->buffer_, job->response_).then([state, host, conn, job](size_t) {
+            conn->isReading_ = false;
+            // Removed from the connection by close() or fail()
+            if (conn->inFlight_.empty() || conn->inFlight_.front() != job)
+                return;
+            conn->inFlight_.pop_front();
+            ++conn->responses_;
+
+            if (!job->response_.keep_alive()) {
+                // The requests after it will not be answered by the server, send them again
+                conn->isReusable_ = false;
+                host->queue_.insert(host->queue_.begin(), conn->inFlight_.begin(), conn->inFlight_.end());
+                conn->inFlight_.clear();
+                remove(host, conn);
+            }
+            else
+                read(state, host, conn);
+            dispatch(state, host);
+            job->defer_.resolve(std::move(job->response_));
+        }, [state, host, conn](const boost::system::error_code &err) {
+            conn->isReading_ = false;
+            fail(state, host, conn, err);
+        });
+    }
+
+    static bool isIdempotent(const Request &request) {
+        using boost::beast::http::verb;
+        switch (request.method()) {
+        case verb::get: case verb::head: case verb::put: case verb::delete_:
+        case verb::options: case verb::trace:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static void fail(const StatePtr &state, const HostPtr &host, const ConnPtr &conn, const boost::system::error_code &err) {
+        Jobs jobs;
+        jobs.swap(conn->inFlight_);
+        remove(host, conn);
+
+        // The server may close a kept-alive connection at any time
+        std::vector<std::shared_ptr<Job>> rejected;
+        Jobs retried;
+        for (std::shared_ptr<Job> &job : jobs) {
+            if (!state->isClosed_ && conn->responses_ > 0 && !job->isRetried_ && isIdempotent(job->request_)) {
+                job->isRetried_ = true;
+                job->response_ = Response();
+                retried.push_back(job);
+            }
+            else
+                rejected.push_back(job);
+        }
+        host->queue_.insert(host->queue_.begin(), retried.begin(), retried.end());
+        dispatch(state, host);
+
+        for (std::shared_ptr<Job> &job : rejected)
+            job->defer_.reject(err);
+    }
+
+    static void remove(const HostPtr &host, const ConnPtr &conn) {
+        host->connections_.remove(conn);
+        conn->isReusable_ = false;
+        boost::system::error_code ignored;
+        conn->socket_.close(ignored);
+    }
+
+    StatePtr state_;
+};
+
+}
+#endif
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+#ifndef INC_ASIO_HTTP_SERVER_HPP_
+#define INC_ASIO_HTTP_SERVER_HPP_
+
+//
+// Http server based on boost::beast, run by one io_context for each thread
+//
+// class HttpServer --
+//   HttpServer(const tcp::endpoint &endpoint, Handler handler, const Options &options);
+//   void run();
+//   void stop();
+//
+// Handler is called with the request in the thread of the session, and returns a Promise
+// resolved with the response (HttpServer::Response). Response of status 500 is sent
+// if the promise is rejected.
+//
+// - Each thread runs its own io_context, the sessions stay in the thread which accepted them.
+// - With Options::isReusePort and SO_REUSEPORT supported, each thread has its own acceptor
+//   on the same port and the kernel spreads the connections. Otherwise the only acceptor
+//   hands the connections to the threads in turn.
+// - Session objects, with the buffers and messages in them, are recycled by the pool of each
+//   thread. Internal objects of promises are allocated from the pool allocator of each
+//   thread already, see getPoolAllocator().
+//
+
+#include "io.hpp"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio/post.hpp>
+#include <boost/beast/version.hpp>
+
+#if !PROMISE_MULTITHREAD
+#error "HttpServer requires PROMISE_MULTITHREAD"
+#endif
+
+namespace promise {
+
+class HttpServer {
+public:
+    using tcp      = boost::asio::ip::tcp;
+    using Request  = boost::beast::http::request<boost::beast::http::string_body>;
+    using Response = boost::beast::http::response<boost::beast::http::string_body>;
+    using Handler  = std::function<Promise(Request &request)>;
+
+    struct Options {
+        size_t threadCount;         // count of threads and io_contexts, including the thread calling run()
+        bool   isReusePort;         // one acceptor for each thread by SO_REUSEPORT
+        size_t maxPooledSessions;   // max count of free sessions kept in each thread
+
+        Options()
+            : threadCount(std::max<size_t>(1, std::thread::hardware_concurrency()))
+            , isReusePort(true)
+            , maxPooledSessions(256) {
+        }
+    };
+
+    // Listen on the endpoint, throws boost::system::system_error if failed
+    HttpServer(const tcp::endpoint &endpoint, const Handler &handler, const Options &options = Options())
+        : handler_(handler)
+        , options_(options)
+        , isSharedAcceptor_(true)
+        , next_(0) {
+        if (options_.threadCount == 0)
+            options_.threadCount = 1;
+        for (size_t i = 0; i < options_.threadCount; ++i)
+            workers_.emplace_back(new Worker(options_.maxPooledSessions));
+
+#ifdef SO_REUSEPORT
+        isSharedAcceptor_ = !options_.isReusePort || workers_.size() == 1;
+#endif
+        workers_[0]->acceptor_ = listen(workers_[0]->io_, endpoint, !isSharedAcceptor_);
+        // Others are bound to the real port if port 0 is used
+        endpoint_ = workers_[0]->acceptor_->local_endpoint();
+        if (!isSharedAcceptor_) {
+            for (size_t i = 1; i < workers_.size(); ++i)
+                workers_[i]->acceptor_ = listen(workers_[i]->io_, endpoint_, true);
+        }
+    }
+
+    const tcp::endpoint &endpoint() const {
+        return endpoint_;
+    }
+
+    // Run the server in this thread and (threadCount - 1) new threads, returns after stop()
+    void run() {
+        for (const std::unique_ptr<Worker> &worker : workers_) {
+            if (worker->acceptor_)
+                accept(worker.get());
+        }
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers_.size(); ++i) {
+            Worker *worker = workers_[i].get();
+            threads.emplace_back([worker]() {
+                runWorker(worker);
+            });
+        }
+        runWorker(workers_[0].get());
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    // Stop all the threads, it can be called in any thread
+    void stop() {
+        for (const std::unique_ptr<Worker> &worker : workers_)
+            worker->io_.stop();
+    }
+
+private:
+    struct Session {
+        explicit Session(boost::asio::io_context &io)
+            : socket_(io) {
+        }
+        tcp::socket               socket_;
+        boost::beast::flat_buffer buffer_;
+        Request                   req_;
+        Response                  res_;
+    };
+
+    struct SessionPool {
+        std::vector<std::unique_ptr<Session>> sessions_;
+        size_t                                maxCount_;
+    };
+
+    struct Worker {
+        explicit Worker(size_t maxPooledSessions)
+            : io_(1)
+            , pool_(std::make_shared<SessionPool>()) {
+            pool_->maxCount_ = maxPooledSessions;
+        }
+        boost::asio::io_context        io_;
+        // Destroyed before io_, the free sessions hold sockets of io_
+        std::shared_ptr<SessionPool>   pool_;
+        std::unique_ptr<tcp::acceptor> acceptor_;
+    };
+
+    static std::unique_ptr<tcp::acceptor> listen(boost::asio::io_context &io, const tcp::endpoint &endpoint, bool isReusePort) {
+        std::unique_ptr<tcp::acceptor> acceptor(new tcp::acceptor(io));
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+        if (isReusePort)
+            acceptor->set_option(reuse_port(true));
+#else
+        (void)isReusePort;
+#endif
+        acceptor->bind(endpoint);
+        acceptor->listen(tcp::socket::max_listen_connections);
+        return acceptor;
+    }
+
+    static void runWorker(Worker *worker) {
+        // Keep running when there is no session
+        auto guard = boost::asio::make_work_guard(worker->io_);
+        worker->io_.run();
+    }
+
+    // Get a free session of the worker, it is returned to the pool when released
+    static std::shared_ptr<Session> acquire(Worker *worker) {
+        std::unique_ptr<Session> session;
+        std::vector<std::unique_ptr<Session>> &sessions = worker->pool_->sessions_;
+        if (!sessions.empty()) {
+            session = std::move(sessions.back());
+            sessions.pop_back();
+        }
+        else
+            session.reset(new Session(worker->io_));
+
+        std::weak_ptr<SessionPool> pool = worker->pool_;
+        return std::shared_ptr<Session>(session.release(), [pool](Session *released) {
+            std::unique_ptr<Session> session(released);
+            boost::system::error_code ignored;
+            session->socket_.close(ignored);
+            std::shared_ptr<SessionPool> owner = pool.lock();
+            if (!owner || owner->sessions_.size() >= owner->maxCount_)
+                return;
+            // Keep the memory of the buffer
+            session->buffer_.clear();
+            session->req_ = Request();
+            session->res_ = Response();
+            owner->sessions_.push_back(std::move(session));
+        });
+    }
+
+    void accept(Worker *worker) {
+        // Accepted to the io_context of the worker in turn if the acceptor is shared
+        Worker *target = worker;
+        if (isSharedAcceptor_)
+            target = workers_[next_++ % workers_.size()].get();
+
+        worker->acceptor_->async_accept(target->io_,
+            [this, worker, target](boost::system::error_code err, tcp::socket socket) {
+            if (err == boost::asio::error::operation_aborted)
+                return;
+            if (!err) {
+                if (target == worker)
+                    start(target, std::move(socket));
+                else {
+                    std::shared_ptr<tcp::socket> moved = std::make_shared<tcp::socket>(std::move(socket));
+                    boost::asio::post(target->io_, [this, target, moved]() {
+                        start(target, std::move(*moved));
+                    });
+                }
+            }
+            accept(worker);
+        });
+    }
+
+    // Exceptions thrown by the handler are rejected as well
+    static Promise callHandler(const Handler &handler, Request &req) {
+        try {
+            return handler(req);
+        }
+        catch (...) {
+            return promise::reject(std::current_exception());
+        }
+    }
+
+    // Read the requests and write the responses until the connection is closed
+    void start(Worker *worker, tcp::socket &&socket) {
+        std::shared_ptr<Session> session = acquire(worker);
+        session->socket_ = std::move(socket);
+        boost::system::error_code ignored;
+        session->socket_.set_option(tcp::no_delay(true), ignored);
+
+        const Handler &handler = handler_;
+        doWhile([session, &handler](DeferLoop &loop) {
+            session->req_ = Request();
+            async_read(session->socket_, session->buffer_, session->req_).then([session, &handler](size_t) {
+                return callHandler(handler, session->req_).then([session](Response &res) {
+                    session->res_ = std::move(res);
+                }, [session]() {
+                    session->res_ = Response(boost::beast::http::status::internal_server_error, session->req_.version());
+                    session->res_.set(boost::beast::http::field::server, BOOST_BEAST_VERSION_STRING);
+                    session->res_.keep_alive(false);
+                }).then([session]() {
+                    Response &res = session->res_;
+                    res.version(session->req_.version());
+                    if (!session->req_.keep_alive())
+                        res.keep_alive(false);
+                    else if (res.find(boost::beast::http::field::connection) == res.end())
+                        res.keep_alive(true);
+                    res.prepare_payload();
+                    return async_write(session->socket_, res);
+                });
+            }).then([session, loop](size_t) {
+                if (session->res_.need_eof()) {
+                    boost::system::error_code ignored;
+                    session->socket_.shutdown(tcp::socket::shutdown_send, ignored);
+                    loop.doBreak();
+                }
+                else
+                    loop.doContinue();
+            }, [loop]() {
+                loop.doBreak();
+            });
+        });
+    }
+
+    Handler                              handler_;
+    Options                              options_;
+    tcp::endpoint                        endpoint_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    bool                                 isSharedAcceptor_;
+    size_t                               next_;     // used in the thread of the shared acceptor only
+};
+
+}
+#endif
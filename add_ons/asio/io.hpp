@@ -27,11 +27,42 @@
 #ifndef INC_ASIO_IO_HPP_
 #define INC_ASIO_IO_HPP_
 
+//
+// Promisified io functions based on promise-cpp and boost::asio
+//
+// Functions --
+//   Promise async_resolve(Resolver &resolver, host, port);
+//   Promise async_connect(Socket &socket, const ResolverResult &results);
+//   Promise async_read(Stream &stream, Buffer &buffer, Content &content);   // beast::http message
+//   Promise async_write(Stream &stream, Content &content);                   // beast::http message
+//
+//   Promise async_read_some(Stream &stream, const MutableBufferSequence &buffers);
+//   Promise async_write_some(Stream &stream, const ConstBufferSequence &buffers);
+//   Promise async_write_buffers(Stream &stream, const ConstBufferSequence &buffers);
+//   Promise async_read_until(Stream &stream, DynamicBuffer &buffer, char delim);
+//
+// The promises are resolved with bytes_transferred, or rejected with boost::system::error_code.
+// Data is read to or written from the buffers of the caller directly, the stream and
+// the buffers must be kept valid until the promise is settled.
+//
+// Define PROMISE_ASIO_LOG_ERROR to print the errors to std::cerr.
+//
+
 #include "promise-cpp/promise.hpp"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <utility>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/connect.hpp>
+#include <boost/asio/buffers_iterator.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
+#ifdef PROMISE_ASIO_LOG_ERROR
+#include <iostream>
+#endif
 
 namespace promise{
 
@@ -39,13 +70,17 @@ template<typename RESULT>
 inline void setPromise(Defer defer,
     boost::system::error_code err,
     const char *errorString,
-    const RESULT &result) {
+    RESULT &&result) {
     if (err) {
+#ifdef PROMISE_ASIO_LOG_ERROR
         std::cerr << errorString << ": " << err.message() << "\n";
+#else
+        (void)errorString;
+#endif
         defer.reject(err);
     }
     else
-        defer.resolve(result);
+        defer.resolve(std::forward<RESULT>(result));
 }
 
 // Promisified functions
@@ -110,6 +145,124 @@ inline Promise async_write(Stream &stream, Content &content) {
     });
 }
 
+// Read at least one byte to the buffers
+template<typename Stream, typename MutableBufferSequence>
+inline Promise async_read_some(Stream &stream, const MutableBufferSequence &buffers) {
+    return newPromise([&](Defer &defer) {
+        stream.async_read_some(buffers,
+            [defer](boost::system::error_code err,
+                std::size_t bytes_transferred) {
+                setPromise(defer, err, "read_some", bytes_transferred);
+        });
+    });
+}
+
+// Write at least one byte of the buffers
+template<typename Stream, typename ConstBufferSequence>
+inline Promise async_write_some(Stream &stream, const ConstBufferSequence &buffers) {
+    return newPromise([&](Defer &defer) {
+        stream.async_write_some(buffers,
+            [defer](boost::system::error_code err,
+                std::size_t bytes_transferred) {
+                setPromise(defer, err, "write_some", bytes_transferred);
+        });
+    });
+}
+
+// Write all of the buffers, a sequence of buffers is written by gather-write without copy
+template<typename Stream, typename ConstBufferSequence>
+inline Promise async_write_buffers(Stream &stream, const ConstBufferSequence &buffers) {
+    return newPromise([&](Defer &defer) {
+        boost::asio::async_write(stream, buffers,
+            [defer](boost::system::error_code err,
+                std::size_t bytes_transferred) {
+                setPromise(defer, err, "write", bytes_transferred);
+        });
+    });
+}
+
+// Read to the dynamic buffer (e.g. beast::flat_buffer) until it contains delim,
+// resolved with the bytes up to and including delim, the data after that is left in the buffer.
+// The buffer is used by reference (boost::asio::async_read_until takes a copy of the beast
+// buffers), data is read into the free space of it directly, readSize bytes at most each time.
+template<typename Stream, typename DynamicBuffer>
+inline Promise async_read_until(Stream &stream, DynamicBuffer &buffer, char delim, size_t readSize = 512) {
+    std::shared_ptr<size_t> searched = std::make_shared<size_t>(0);
+    return doWhile([&stream, &buffer, delim, readSize, searched](DeferLoop &loop) {
+        auto data = buffer.data();
+        auto begin = boost::asio::buffers_begin(data);
+        auto end = boost::asio::buffers_end(data);
+        auto found = std::find(begin + *searched, end, delim);
+        if (found != end) {
+            loop.doBreak((size_t)(found - begin) + 1);
+            return;
+        }
+        *searched = buffer.size();
+
+        stream.async_read_some(buffer.prepare(readSize),
+            [&buffer, loop](boost::system::error_code err,
+                std::size_t bytes_transferred) {
+                if (err) {
+#ifdef PROMISE_ASIO_LOG_ERROR
+                    std::cerr << "read_until: " << err.message() << "\n";
+#endif
+                    loop.reject(err);
+                    return;
+                }
+                buffer.commit(bytes_transferred);
+                loop.doContinue();
+        });
+    });
+}
+
+// Pool of beast::flat_buffer, the released buffers are cleared and reused without
+// releasing their memory, so that the buffers are not allocated again for each request.
+// The buffers can be released after the pool is destroyed.
+class FlatBufferPool {
+public:
+    using Buffer = boost::beast::flat_buffer;
+
+    // At most maxCount buffers are kept in the pool
+    explicit FlatBufferPool(size_t maxCount = 64)
+        : state_(std::make_shared<State>()) {
+        state_->maxCount_ = maxCount;
+    }
+
+    // Get a buffer from the pool, it is returned to the pool when released
+    std::shared_ptr<Buffer> acquire() {
+        std::unique_ptr<Buffer> buffer;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+            if (!state_->buffers_.empty()) {
+                buffer = std::move(state_->buffers_.back());
+                state_->buffers_.pop_back();
+            }
+        }
+        if (!buffer)
+            buffer.reset(new Buffer());
+
+        std::weak_ptr<State> state = state_;
+        return std::shared_ptr<Buffer>(buffer.release(), [state](Buffer *released) {
+            std::unique_ptr<Buffer> buffer(released);
+            std::shared_ptr<State> pool = state.lock();
+            if (!pool)
+                return;
+            buffer->clear();
+            std::lock_guard<std::mutex> lock(pool->mutex_);
+            if (pool->buffers_.size() < pool->maxCount_)
+                pool->buffers_.push_back(std::move(buffer));
+        });
+    }
+
+private:
+    struct State {
+        std::mutex                           mutex_;
+        std::vector<std::unique_ptr<Buffer>> buffers_;
+        size_t                               maxCount_;
+    };
+    std::shared_ptr<State> state_;
+};
+
 
 }
 #endif
@@ -40,6 +40,8 @@
 //                      uint64_t time_ms);
 //   void clearTimeout(Promise promise);
 //
+//   Promise withTimeout(Promise promise, boost::asio::io_service &io, uint64_t time_ms);
+//
 
 #include "promise-cpp/promise.hpp"
 #include <chrono>
@@ -96,6 +98,31 @@ inline void clearTimeout(Promise promise) {
     cancelDelay(promise);
 }
 
+// Returns "promise", which is rejected with TimeoutError if it is not settled in time_ms.
+// The timer is cancelled when the promise is settled first.
+inline Promise withTimeout(Promise promise, boost::asio::io_service &io, uint64_t time_ms) {
+    auto timer = std::make_shared<boost::asio::steady_timer>(io, std::chrono::milliseconds(time_ms));
+    // The promise may be settled in other threads, the timer is cancelled in the io thread
+    std::function<void()> expire = armTimeout(promise, [timer]() {
+#if BOOST_VERSION >= 106600
+        boost::asio::post(timer->get_executor(), [timer]() {
+            timer->cancel();
+        });
+#else
+        timer->get_io_service().post([timer]() {
+            timer->cancel();
+        });
+#endif
+    });
+    if (expire) {
+        timer->async_wait([timer, expire](const boost::system::error_code &error_code) {
+            if (!error_code)
+                expire();
+        });
+    }
+    return promise;
+}
+
 #if 0
 inline Promise wait(boost::asio::io_service &io, Defer d, uint64_t time_ms) {
     return newPromise([&io, d, time_ms](Defer &dTimer) {
@@ -40,6 +40,8 @@
 //                    uint64_t time_ms);
 //   void clearTimeout(Defer d);
 //
+//   std::shared_ptr<Executor> qtMainThreadExecutor();
+//
 
 #include "promise-cpp/promise.hpp"
 #include <chrono>
@@ -137,6 +139,9 @@ PROMISE_QT_API Promise setTimeout(const std::function<void(bool)> &func,
 PROMISE_QT_API void cancelDelay(Promise promise);
 PROMISE_QT_API void clearTimeout(Promise promise);
 
+// Executor which calls the tasks in the main thread of QCoreApplication
+PROMISE_QT_API std::shared_ptr<Executor> qtMainThreadExecutor();
+
 
 // Low level set timeout
 struct PROMISE_QT_API QtPromiseTimerHandler {
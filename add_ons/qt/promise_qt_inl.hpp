@@ -43,24 +43,52 @@
 #include "promise-cpp/promise.hpp"
 #include "promise_qt.hpp"
 #include <chrono>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
 #include <QObject>
 #include <QTimerEvent>
 #include <QApplication>
 #include <QTimer>
+#include <QBasicTimer>
 #include <QThread>
 
 namespace promise {
 
 class PromiseEventListener {
 public:
-    using Listeners = std::multimap<std::pair<QObject *, QEvent::Type>, std::shared_ptr<PromiseEventListener>>;
     std::function<bool(QObject *, QEvent *)> cb_;
-    Listeners::iterator self_;
+    QObject      *object_;
+    QEvent::Type  eventType_;
+    bool          isRemoved_;
 };
 
 class PromiseEventPrivate {
 public:
-    PromiseEventListener::Listeners listeners_;
+    using Listeners = std::vector<std::shared_ptr<PromiseEventListener>>;
+
+    struct ObjectListeners {
+        ObjectListeners() : dispatching_(0), removed_(0) {}
+        Listeners listeners_;
+        int       dispatching_; // count of nested eventFilter() calls of this object
+        size_t    removed_;     // count of removed listeners which are not erased yet
+    };
+
+    // Events of objects without listeners are passed by one hash lookup
+    std::unordered_map<QObject *, ObjectListeners> objects_;
+
+    // Erase the removed listeners, and the object if it has no more listeners
+    void compact(std::unordered_map<QObject *, ObjectListeners>::iterator found) {
+        Listeners &listeners = found->second.listeners_;
+        listeners.erase(std::remove_if(listeners.begin(), listeners.end(),
+            [](const std::shared_ptr<PromiseEventListener> &listener) {
+                return listener->isRemoved_;
+            }), listeners.end());
+        found->second.removed_ = 0;
+        if (listeners.empty())
+            objects_.erase(found);
+    }
 };
 
 PromiseEventFilter::PromiseEventFilter() 
@@ -69,18 +97,27 @@ PromiseEventFilter::PromiseEventFilter()
 
 std::weak_ptr<PromiseEventListener> PromiseEventFilter::addEventListener(QObject *object, QEvent::Type eventType, const std::function<bool(QObject *, QEvent *)> &func) {
     std::shared_ptr<PromiseEventListener> listener = std::make_shared<PromiseEventListener>();
-    std::pair<QObject *, QEvent::Type> key = { object, eventType };
-    auto itr = private_->listeners_.insert({ key, listener });
     listener->cb_ = func;
-    listener->self_ = itr;
+    listener->object_ = object;
+    listener->eventType_ = eventType;
+    listener->isRemoved_ = false;
+    private_->objects_[object].listeners_.push_back(listener);
     return listener;
 }
 
 void PromiseEventFilter::removeEventListener(std::weak_ptr<PromiseEventListener> listener) {
     auto sListener = listener.lock();
-    if (sListener) {
-        private_->listeners_.erase(sListener->self_);
-    }
+    if (!sListener || sListener->isRemoved_)
+        return;
+    sListener->isRemoved_ = true;
+
+    auto found = private_->objects_.find(sListener->object_);
+    if (found == private_->objects_.end())
+        return;
+    ++found->second.removed_;
+    // Listeners of the object in dispatching are erased after the dispatch
+    if (found->second.dispatching_ == 0)
+        private_->compact(found);
 }
 
 PromiseEventFilter &PromiseEventFilter::getSingleInstance() {
@@ -89,22 +126,28 @@ PromiseEventFilter &PromiseEventFilter::getSingleInstance() {
 }
 
 bool PromiseEventFilter::eventFilter(QObject *object, QEvent *event) {
-    std::pair<QObject *, QEvent::Type> key = { object, event->type() };
-
+    auto found = private_->objects_.find(object);
+    if (found == private_->objects_.end())
+        return QObject::eventFilter(object, event);
+
+    // The entry is not erased while dispatching_ > 0, and references to the elements
+    // of unordered_map are kept on rehash, so "entry" is valid during the callbacks.
+    // Listeners added by the callbacks are called from the next event.
+    PromiseEventPrivate::ObjectListeners &entry = found->second;
+    QEvent::Type eventType = event->type();
+    size_t count = entry.listeners_.size();
     bool filtered = false;
 
-    std::list<std::weak_ptr<PromiseEventListener>> listeners;
-    for (auto itr = private_->listeners_.lower_bound(key);
-        itr != private_->listeners_.end() && key == itr->first; ++itr) {
-        listeners.push_back(itr->second);
-    }
-    for (const auto &listener : listeners) {
-        auto sListener = listener.lock();
-        if (sListener) {
-            bool res = sListener->cb_(object, event);
-            if (res) filtered = true;
-        }
+    ++entry.dispatching_;
+    for (size_t i = 0; i < count; ++i) {
+        PromiseEventListener *listener = entry.listeners_[i].get();
+        if (listener->eventType_ != eventType || listener->isRemoved_)
+            continue;
+        bool res = listener->cb_(object, event);
+        if (res) filtered = true;
     }
+    if (--entry.dispatching_ == 0 && entry.removed_ > 0)
+        private_->compact(private_->objects_.find(object));
 
     if (filtered) return true;
     else return QObject::eventFilter(object, event);
@@ -204,11 +247,76 @@ std::shared_ptr<QtPromiseTimerHandler> qtPromiseSetTimeout(const std::function<v
     return handler;
 }
 
+// Timers of delay() in one thread share one QBasicTimer, which is started for the first deadline
+class QtTimerScheduler : public QObject {
+public:
+    using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+
+    // The scheduler of current thread, deleted when the thread is finished
+    static QtTimerScheduler *current() {
+        static thread_local QtTimerScheduler *s_scheduler = nullptr;
+        if (s_scheduler == nullptr) {
+            QtTimerScheduler *scheduler = new QtTimerScheduler();
+            s_scheduler = scheduler;
+            QObject::connect(QThread::currentThread(), &QThread::finished, scheduler, [scheduler]() {
+                s_scheduler = nullptr;
+                scheduler->clear();
+                scheduler->deleteLater();
+            }, Qt::DirectConnection);
+        }
+        return s_scheduler;
+    }
+
+    void add(int time_ms, const Defer &defer) {
+        TimePoint time = std::chrono::steady_clock::now() + std::chrono::milliseconds(time_ms < 0 ? 0 : time_ms);
+        if (timers_.emplace(time, defer) == timers_.begin())
+            restart();
+    }
+
+protected:
+    void timerEvent(QTimerEvent *event) override {
+        if (event->timerId() != timer_.timerId()) {
+            QObject::timerEvent(event);
+            return;
+        }
+
+        timer_.stop();
+        // Erase before resolve, delay() may be called by the resolved tasks
+        TimePoint now = std::chrono::steady_clock::now();
+        while (timers_.size() > 0 && timers_.begin()->first <= now) {
+            Defer defer = timers_.begin()->second;
+            timers_.erase(timers_.begin());
+            defer.resolve();
+        }
+        restart();
+    }
+
+private:
+    void restart() {
+        if (timers_.size() == 0) {
+            timer_.stop();
+            return;
+        }
+        auto duration = timers_.begin()->first - std::chrono::steady_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count();
+        timer_.start(ms < 0 ? 0 : (int)ms, Qt::PreciseTimer, this);
+    }
+
+    void clear() {
+        timer_.stop();
+        std::multimap<TimePoint, Defer> timers;
+        timers.swap(timers_);
+        for (auto &timer : timers)
+            timer.second.reject();
+    }
+
+    QBasicTimer                      timer_;
+    std::multimap<TimePoint, Defer>  timers_;
+};
+
 Promise QtTimerHolder::delay(int time_ms) {
     return newPromise([time_ms](Defer &defer) {
-        qtPromiseSetTimeout([defer] {
-            defer.resolve();
-        }, time_ms);
+        QtTimerScheduler::current()->add(time_ms, defer);
     });
 }
 
@@ -262,6 +370,23 @@ void clearTimeout(Promise promise) {
     cancelDelay(promise);
 }
 
+class QtMainThreadExecutor : public Executor {
+public:
+    void post(const std::function<void()> &task) override {
+        QMetaObject::invokeMethod(QCoreApplication::instance(), task, Qt::QueuedConnection);
+    }
+
+    bool isCurrent() const override {
+        QCoreApplication *app = QCoreApplication::instance();
+        return app != nullptr && QThread::currentThread() == app->thread();
+    }
+};
+
+std::shared_ptr<Executor> qtMainThreadExecutor() {
+    static std::shared_ptr<Executor> s_executor = std::make_shared<QtMainThreadExecutor>();
+    return s_executor;
+}
+
 }
 
 #endif
@@ -0,0 +1,1024 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style 
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+#ifndef INC_IO_SERVICE_HPP_
+#define INC_IO_SERVICE_HPP_
+
+//
+// Service with the same API as Service in simple_task.hpp, and promisified I/O of
+// the file descriptors, for Linux only.
+//
+// Functions --
+//   Promise accept(int fd);                                              // resolved with the new fd (int)
+//   Promise recv(int fd, void *buf, size_t len, int flags = 0);          // resolved with the bytes (size_t)
+//   Promise send(int fd, const void *buf, size_t len, int flags = 0);
+//   Promise read(int fd, void *buf, size_t len, int64_t offset = -1);    // -1 for the current file position
+//   Promise write(int fd, const void *buf, size_t len, int64_t offset = -1);
+//   bool registerBuffers(const struct iovec *iovecs, unsigned count);
+//
+// The promises are resolved with the result of the system call, 0 bytes received means the end of stream,
+// or rejected with std::exception_ptr of std::system_error. The buffers must be kept valid until the promise is settled.
+// The requests are issued in the io thread, the functions called in other threads are handed off to it.
+//
+// io_uring is used if the kernel supports it (5.11 or later). The requests are queued in the submission
+// ring and submitted by the same io_uring_enter() which waits for the completions, and the defers are
+// resolved from the completion ring directly. Reads and writes in the registered buffers are issued as
+// the fixed buffer operations.
+// Otherwise it falls back to epoll, the pipes and other fds used by read() and write() should be
+// non-blocking then, and the regular files are read and written at once without polling.
+//
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <utility>
+#include <stdexcept>
+#include <system_error>
+#include <exception>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "promise-cpp/promise.hpp"
+#include "promise-cpp/handoff.hpp"
+#include "timer_wheel.hpp"
+
+#ifndef PROMISE_IO_URING
+#   if defined(__has_include)
+#       if __has_include(<linux/io_uring.h>)
+#           define PROMISE_IO_URING 1
+#       endif
+#   endif
+#endif
+#ifndef PROMISE_IO_URING
+#   define PROMISE_IO_URING 0
+#endif
+
+#if PROMISE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+class IoService {
+    using Defer     = promise::Defer;
+    using Promise   = promise::Promise;
+    using Clock     = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+    using Timers    = TimerWheel<Defer>;
+    using Tasks     = std::deque<Defer>;
+
+    // One I/O request, owned by the backend until it is completed
+    struct Op {
+        enum Kind {
+            kAccept,
+            kRecv,
+            kSend,
+            kRead,
+            kWrite
+        };
+
+        Op(Kind kind, int fd, void *buf, size_t len, int flags, int64_t offset, const Defer &defer)
+            : kind_(kind)
+            , fd_(fd)
+            , buf_(buf)
+            , len_(len)
+            , flags_(flags)
+            , offset_(offset)
+            , defer_(defer)
+            , prev_(nullptr)
+            , next_(nullptr)
+            , isPolling_(false)
+            , isCancelled_(false) {
+        }
+
+        bool isInput() const {
+            return kind_ == kAccept || kind_ == kRecv || kind_ == kRead;
+        }
+
+        Kind    kind_;
+        int     fd_;
+        void   *buf_;
+        size_t  len_;
+        int     flags_;
+        int64_t offset_;
+        Defer   defer_;
+        Op     *prev_;
+        Op     *next_;
+        bool    isPolling_;     // waiting for the readiness after EAGAIN
+        bool    isCancelled_;
+    };
+
+    struct OpList {
+        OpList()
+            : head_(nullptr)
+            , tail_(nullptr) {
+        }
+
+        bool empty() const {
+            return head_ == nullptr;
+        }
+
+        void push_back(Op *op) {
+            op->prev_ = tail_;
+            op->next_ = nullptr;
+            if (tail_ != nullptr)
+                tail_->next_ = op;
+            else
+                head_ = op;
+            tail_ = op;
+        }
+
+        void remove(Op *op) {
+            if (op->prev_ != nullptr)
+                op->prev_->next_ = op->next_;
+            else
+                head_ = op->next_;
+            if (op->next_ != nullptr)
+                op->next_->prev_ = op->prev_;
+            else
+                tail_ = op->prev_;
+            op->prev_ = op->next_ = nullptr;
+        }
+
+        Op *pop_front() {
+            Op *op = head_;
+            if (op != nullptr)
+                remove(op);
+            return op;
+        }
+
+        void splice(OpList &other) {
+            while (!other.empty())
+                push_back(other.pop_front());
+        }
+
+        Op *head_;
+        Op *tail_;
+    };
+
+    class Backend {
+    public:
+        Backend()
+            : pending_(0) {
+        }
+        virtual ~Backend() {}
+        virtual const char *name() const = 0;
+        // Queue the request, it is completed by poll() later
+        virtual void submit(Op *op) = 0;
+        // Wait for at most timeout (negative for no limit), and complete the finished requests
+        virtual void poll(std::chrono::nanoseconds timeout) = 0;
+        // Called in any thread, poll() returns soon
+        virtual void wakeup() = 0;
+        virtual bool registerBuffers(const struct iovec *iovecs, unsigned count) = 0;
+        // The pending requests are completed with ECANCELED by poll()
+        virtual void cancel() = 0;
+
+        // Count of the submitted requests which are not completed
+        size_t pending() const {
+            return pending_;
+        }
+    protected:
+        size_t pending_;
+    };
+
+    class EpollBackend;
+#if PROMISE_IO_URING
+    class UringBackend;
+#endif
+
+    Timers                   timers_;
+    Tasks                    tasks_;
+    std::unique_ptr<Backend> backend_;
+    promise::Handoff         handoff_;      // items pushed by other threads
+    std::atomic<bool>        isAutoStop_;
+    std::atomic<bool>        isStop_;
+    bool                     isStopped_;    // the loop is finished, new requests are rejected
+
+public:
+    // io_uring is not tried if isUringEnabled is false, tick is the resolution of the timers
+    explicit IoService(bool isUringEnabled = true,
+                       std::chrono::steady_clock::duration tick = std::chrono::milliseconds(1));
+
+    // "io_uring" or "epoll"
+    const char *backend() const {
+        return backend_->name();
+    }
+
+    // delay for milliseconds,
+    // the timer is removed if the returned promise is rejected.
+    Promise delay(uint64_t time_ms) {
+        if (!isInIoThread()) {
+            return callInIoThread([this, time_ms]() {
+                return delay(time_ms);
+            });
+        }
+
+        Timers::Handle timer;
+        Promise promise = promise::newPromise([&](Defer &defer) {
+            timer = timers_.add(std::chrono::milliseconds(time_ms), defer);
+        });
+        return promise.then(nullptr, [this, timer](const promise::any &reason) {
+            inIoThread([this, timer]() {
+                timers_.cancel(timer);
+            });
+            return promise::reject(reason);
+        });
+    }
+
+    // yield for other tasks to run
+    Promise yield() {
+        return promise::newPromise([this](Defer &defer) {
+            if (isInIoThread())
+                tasks_.push_back(defer);
+            else
+                handoff_.resolve(defer);
+        });
+    }
+
+    // Call func in this io thread
+    void runInIoThread(const std::function<void()> &func) {
+        handoff_.post(func);
+    }
+
+    // Resolve or reject the defer object in this io thread
+    void resolveInIoThread(const Defer &defer, promise::any value = promise::any()) {
+        handoff_.resolve(defer, std::move(value));
+    }
+
+    void rejectInIoThread(const Defer &defer, promise::any reason) {
+        handoff_.reject(defer, std::move(reason));
+    }
+
+    // Executor which calls the tasks in the io thread, it should not be used after the service is destroyed
+    std::shared_ptr<promise::Executor> executor() {
+        return std::make_shared<Executor>(this);
+    }
+
+    // Returns true if it is called in the io thread
+    bool isInIoThread() const {
+        return current() == this;
+    }
+
+    // Set if the io thread will auto exist if no waiting tasks, timers and requests.
+    void setAutoStop(bool isAutoExit) {
+        isAutoStop_ = isAutoExit;
+        backend_->wakeup();
+    }
+
+    Promise accept(int fd) {
+        return request(Op::kAccept, fd, nullptr, 0, 0, -1);
+    }
+
+    Promise recv(int fd, void *buf, size_t len, int flags = 0) {
+        return request(Op::kRecv, fd, buf, len, flags, -1);
+    }
+
+    Promise send(int fd, const void *buf, size_t len, int flags = 0) {
+        return request(Op::kSend, fd, const_cast<void *>(buf), len, flags, -1);
+    }
+
+    Promise read(int fd, void *buf, size_t len, int64_t offset = -1) {
+        return request(Op::kRead, fd, buf, len, 0, offset);
+    }
+
+    Promise write(int fd, const void *buf, size_t len, int64_t offset = -1) {
+        return request(Op::kWrite, fd, const_cast<void *>(buf), len, 0, offset);
+    }
+
+    // Register the buffers once before run(), returns false if it is not supported by the backend,
+    // the buffers can be used as the others anyway.
+    bool registerBuffers(const struct iovec *iovecs, unsigned count) {
+        return backend_->registerBuffers(iovecs, count);
+    }
+
+    // run the service loop
+    void run() {
+        Tasks batch;
+        CurrentGuard current(this);
+
+        while (!isStop_ && (!isAutoStop_ || tasks_.size() > 0 || timers_.size() > 0
+                            || backend_->pending() > 0 || !handoff_.empty())) {
+            // Settle a limited batch of the handed off items, so that others are not starved
+            if (!handoff_.empty())
+                handoff_.drain(kHandoffBatch);
+
+            if (timers_.size() > 0) {
+                timers_.expire(Clock::now(), [this](Defer &defer) {
+                    tasks_.push_back(std::move(defer));
+                });
+            }
+
+            // Tasks added meanwhile run in next loop, after the I/O is polled
+            if (!isStop_ && tasks_.size() > 0) {
+                batch.swap(tasks_);
+                while (!isStop_ && batch.size() > 0) {
+                    Defer defer = std::move(batch.front());
+                    batch.pop_front();
+                    defer.resolve();
+                }
+                // Stopped, the left tasks are rejected with the pending ones
+                while (batch.size() > 0) {
+                    tasks_.push_front(std::move(batch.back()));
+                    batch.pop_back();
+                }
+            }
+            if (isStop_)
+                break;
+
+            // Wait for the I/O only if there is nothing else to do
+            std::chrono::nanoseconds timeout(-1);
+            if (tasks_.size() > 0 || !handoff_.empty())
+                timeout = std::chrono::nanoseconds(0);
+            else if (timers_.size() > 0)
+                timeout = std::max(std::chrono::nanoseconds(0),
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(timers_.nextTime() - Clock::now()));
+            else if (isAutoStop_ && backend_->pending() == 0)
+                continue;
+            backend_->poll(timeout);
+        }
+
+        // Cancel the pending requests, they are rejected with std::system_error of ECANCELED
+        isStopped_ = true;
+        backend_->cancel();
+        while (backend_->pending() > 0)
+            backend_->poll(std::chrono::nanoseconds(-1));
+
+        // Clear pending timers, tasks and handed off items
+        while (timers_.size() > 0 || tasks_.size() > 0 || !handoff_.empty()) {
+            handoff_.clear(std::runtime_error("service stopped"));
+            timers_.clear([this](Defer &defer) {
+                tasks_.push_back(std::move(defer));
+            });
+            while (tasks_.size() > 0) {
+                Defer defer = tasks_.front();
+                tasks_.pop_front();
+                defer.reject(std::runtime_error("service stopped"));
+            }
+        }
+    }
+
+    // stop the service loop
+    void stop() {
+        isStop_ = true;
+        backend_->wakeup();
+    }
+
+private:
+    enum { kHandoffBatch = 1024 };
+
+    class Executor : public promise::Executor {
+    public:
+        explicit Executor(IoService *service)
+            : service_(service) {
+        }
+        void post(const std::function<void()> &task) override {
+            service_->runInIoThread(task);
+        }
+        bool isCurrent() const override {
+            return service_->isInIoThread();
+        }
+    private:
+        IoService *service_;
+    };
+
+    // The service which runs in this thread
+    static IoService *&current() {
+        static thread_local IoService *s_current = nullptr;
+        return s_current;
+    }
+
+    struct CurrentGuard {
+        explicit CurrentGuard(IoService *service)
+            : previous_(current()) {
+            current() = service;
+        }
+        ~CurrentGuard() {
+            current() = previous_;
+        }
+        IoService *previous_;
+    };
+
+    void inIoThread(const std::function<void()> &func) {
+        if (isInIoThread())
+            func();
+        else
+            handoff_.post(func);
+    }
+
+    // Call func in the io thread, the returned promise is settled as the one returned by func.
+    // It is rejected as the other pending tasks if the service is stopped.
+    Promise callInIoThread(const std::function<Promise()> &func) {
+        return promise::newPromise([this, &func](Defer &defer) {
+            defer.getPromise().then(func);
+            handoff_.resolve(defer);
+        });
+    }
+
+    Promise request(Op::Kind kind, int fd, void *buf, size_t len, int flags, int64_t offset) {
+        if (!isInIoThread()) {
+            return callInIoThread([this, kind, fd, buf, len, flags, offset]() {
+                return request(kind, fd, buf, len, flags, offset);
+            });
+        }
+
+        return promise::newPromise([&](Defer &defer) {
+            if (isStopped_)
+                defer.reject(std::runtime_error("service stopped"));
+            else
+                backend_->submit(createOp(kind, fd, buf, len, flags, offset, defer));
+        });
+    }
+
+    static Op *createOp(Op::Kind kind, int fd, void *buf, size_t len, int flags, int64_t offset, const Defer &defer) {
+        void *memory = promise::getAllocator().allocate(sizeof(Op));
+        return new (memory) Op(kind, fd, buf, len, flags, offset, defer);
+    }
+
+    // Called by the backends, result is negative errno on error
+    static void complete(Op *op, long result) {
+        Defer defer = op->defer_;
+        Op::Kind kind = op->kind_;
+        op->~Op();
+        promise::getAllocator().deallocate(op, sizeof(Op));
+
+        if (result < 0)
+            defer.reject(std::make_exception_ptr(std::system_error((int)-result, std::generic_category())));
+        else if (kind == Op::kAccept)
+            defer.resolve((int)result);
+        else
+            defer.resolve((size_t)result);
+    }
+
+    // The system call of the request without blocking, returns negative errno on error
+    static long perform(Op *op) {
+        while (true) {
+            ssize_t ret = -1;
+            switch (op->kind_) {
+            case Op::kAccept:
+                ret = ::accept4(op->fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                break;
+            case Op::kRecv:
+                ret = ::recv(op->fd_, op->buf_, op->len_, op->flags_ | MSG_DONTWAIT);
+                break;
+            case Op::kSend:
+                ret = ::send(op->fd_, op->buf_, op->len_, op->flags_ | MSG_DONTWAIT | MSG_NOSIGNAL);
+                break;
+            case Op::kRead:
+                ret = (op->offset_ < 0 ? ::read(op->fd_, op->buf_, op->len_)
+                                       : ::pread(op->fd_, op->buf_, op->len_, (off_t)op->offset_));
+                break;
+            case Op::kWrite:
+                ret = (op->offset_ < 0 ? ::write(op->fd_, op->buf_, op->len_)
+                                       : ::pwrite(op->fd_, op->buf_, op->len_, (off_t)op->offset_));
+                break;
+            }
+            if (ret >= 0)
+                return (long)ret;
+            if (errno != EINTR)
+                return (errno == EWOULDBLOCK ? -EAGAIN : -errno);
+        }
+    }
+};
+
+// Readiness of the fds by epoll, the requests are performed when the fd is ready
+class IoService::EpollBackend : public IoService::Backend {
+public:
+    EpollBackend()
+        : epollFd_(::epoll_create1(EPOLL_CLOEXEC))
+        , eventFd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (epollFd_ < 0 || eventFd_ < 0) {
+            int error = errno;
+            close();
+            throw std::system_error(error, std::generic_category(), "epoll");
+        }
+        struct epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = eventFd_;
+        ::epoll_ctl(epollFd_, EPOLL_CTL_ADD, eventFd_, &event);
+    }
+
+    ~EpollBackend() {
+        close();
+    }
+
+    const char *name() const override {
+        return "epoll";
+    }
+
+    void submit(Op *op) override {
+        ++pending_;
+        Waiting &waiting = fds_[op->fd_];
+        (op->isInput() ? waiting.readers_ : waiting.writers_).push_back(op);
+        update(op->fd_);
+    }
+
+    void poll(std::chrono::nanoseconds timeout) override {
+        int timeoutMs = -1;
+        if (!ready_.empty())
+            timeoutMs = 0;
+        else if (timeout.count() >= 0)
+            timeoutMs = (int)std::min<int64_t>((timeout.count() + 999999) / 1000000, 0x7fffffff);
+
+        struct epoll_event events[kMaxEvents];
+        int count = ::epoll_wait(epollFd_, events, kMaxEvents, timeoutMs);
+
+        // Completed after all the events are handled, the callbacks may add new requests
+        std::vector<std::pair<Op *, long>> done;
+        done.swap(done_);
+
+        OpList ready;
+        ready.splice(ready_);
+        while (!ready.empty()) {
+            Op *op = ready.pop_front();
+            done.emplace_back(op, op->isCancelled_ ? -ECANCELED : perform(op));
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == eventFd_) {
+                uint64_t value;
+                while (::read(eventFd_, &value, sizeof(value)) > 0) {}
+                continue;
+            }
+            std::map<int, Waiting>::iterator it = fds_.find(fd);
+            if (it == fds_.end())
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                performAll(it->second.readers_, done);
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                performAll(it->second.writers_, done);
+            update(fd);
+        }
+
+        pending_ -= done.size();
+        for (const std::pair<Op *, long> &item : done)
+            IoService::complete(item.first, item.second);
+        done.clear();
+        done_.swap(done);
+    }
+
+    void wakeup() override {
+        uint64_t value = 1;
+        ssize_t ret = ::write(eventFd_, &value, sizeof(value));
+        (void)ret;
+    }
+
+    bool registerBuffers(const struct iovec *, unsigned) override {
+        return false;
+    }
+
+    void cancel() override {
+        for (std::map<int, Waiting>::iterator it = fds_.begin(); it != fds_.end(); ++it) {
+            if (it->second.events_ != 0)
+                ::epoll_ctl(epollFd_, EPOLL_CTL_DEL, it->first, nullptr);
+            ready_.splice(it->second.readers_);
+            ready_.splice(it->second.writers_);
+        }
+        fds_.clear();
+        for (Op *op = ready_.head_; op != nullptr; op = op->next_)
+            op->isCancelled_ = true;
+    }
+
+private:
+    enum { kMaxEvents = 64 };
+
+    struct Waiting {
+        Waiting()
+            : events_(0) {
+        }
+        OpList   readers_;
+        OpList   writers_;
+        uint32_t events_;   // registered to epoll
+    };
+
+    void close() {
+        if (epollFd_ >= 0)
+            ::close(epollFd_);
+        if (eventFd_ >= 0)
+            ::close(eventFd_);
+    }
+
+    static void performAll(OpList &ops, std::vector<std::pair<Op *, long>> &done) {
+        while (!ops.empty()) {
+            long result = perform(ops.head_);
+            if (result == -EAGAIN)
+                break;
+            done.emplace_back(ops.pop_front(), result);
+        }
+    }
+
+    // Register the events of the waiting requests of fd
+    void update(int fd) {
+        std::map<int, Waiting>::iterator it = fds_.find(fd);
+        Waiting &waiting = it->second;
+        uint32_t events = (waiting.readers_.empty() ? 0 : (uint32_t)EPOLLIN)
+                        | (waiting.writers_.empty() ? 0 : (uint32_t)EPOLLOUT);
+        if (events == 0) {
+            if (waiting.events_ != 0)
+                ::epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+            fds_.erase(it);
+            return;
+        }
+        if (events == waiting.events_)
+            return;
+
+        struct epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.fd = fd;
+        if (::epoll_ctl(epollFd_, waiting.events_ == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) == 0) {
+            waiting.events_ = events;
+            return;
+        }
+
+        // Regular files are not supported by epoll, they are always ready.
+        // Other errors are returned by the system calls.
+        if (waiting.events_ != 0)
+            ::epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+        ready_.splice(waiting.readers_);
+        ready_.splice(waiting.writers_);
+        fds_.erase(it);
+    }
+
+    int                                epollFd_;
+    int                                eventFd_;
+    std::map<int, Waiting>             fds_;
+    OpList                             ready_;   // performed by next poll() without waiting
+    std::vector<std::pair<Op *, long>> done_;
+};
+
+#if PROMISE_IO_URING
+// Requests submitted in batches to io_uring, the rings are used without liburing
+class IoService::UringBackend : public IoService::Backend {
+public:
+    // Returns nullptr if io_uring or the required features are not supported
+    static UringBackend *create(unsigned entries = 256) {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int ringFd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd < 0)
+            return nullptr;
+
+        const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP
+                                | IORING_FEAT_RW_CUR_POS | IORING_FEAT_EXT_ARG;
+        UringBackend *backend = new UringBackend(ringFd, params);
+        if ((params.features & required) != required || !backend->isValid()) {
+            delete backend;
+            return nullptr;
+        }
+        backend->armWakeup();
+        return backend;
+    }
+
+    ~UringBackend() {
+        // The kernel may write to eventValue_ until the read is completed
+        if (isWakeupArmed_) {
+            isClosing_ = true;
+            isWakeupToCancel_ = true;
+            while (isWakeupArmed_)
+                poll(std::chrono::nanoseconds(-1));
+        }
+        if (sqes_ != MAP_FAILED)
+            ::munmap(sqes_, sqesSize_);
+        if (ring_ != MAP_FAILED)
+            ::munmap(ring_, ringSize_);
+        ::close(ringFd_);
+        if (eventFd_ >= 0)
+            ::close(eventFd_);
+    }
+
+    const char *name() const override {
+        return "io_uring";
+    }
+
+    void submit(Op *op) override {
+        ++pending_;
+        inflight_.push_back(op);
+        issue(op);
+    }
+
+    void poll(std::chrono::nanoseconds timeout) override {
+        // Not waiting until all the cancel requests are queued, or the cancelled requests may never complete
+        bool isCancelQueued = queueCancels();
+        unsigned queued = *sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        bool isWaiting = (timeout.count() != 0 && isCancelQueued && !hasCompletions());
+        if (queued > 0 || isWaiting) {
+            // Submit the queued requests and wait for the completions by one system call
+            unsigned flags = 0;
+            struct io_uring_getevents_arg arg;
+            struct __kernel_timespec ts;
+            if (isWaiting) {
+                flags |= IORING_ENTER_GETEVENTS;
+                if (timeout.count() > 0) {
+                    ts.tv_sec  = timeout.count() / 1000000000;
+                    ts.tv_nsec = timeout.count() % 1000000000;
+                    std::memset(&arg, 0, sizeof(arg));
+                    arg.ts = (uint64_t)(uintptr_t)&ts;
+                    flags |= IORING_ENTER_EXT_ARG;
+                }
+            }
+            // Errors such as ETIME, EINTR and EBUSY are handled by reaping the completions
+            ::syscall(__NR_io_uring_enter, ringFd_, queued, isWaiting ? 1 : 0, flags,
+                      (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr,
+                      (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+        }
+        reap();
+    }
+
+    void wakeup() override {
+        uint64_t value = 1;
+        ssize_t ret = ::write(eventFd_, &value, sizeof(value));
+        (void)ret;
+    }
+
+    bool registerBuffers(const struct iovec *iovecs, unsigned count) override {
+        if (!buffers_.empty() || count == 0)
+            return false;
+        if (::syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, iovecs, count) < 0)
+            return false;
+        buffers_.assign(iovecs, iovecs + count);
+        return true;
+    }
+
+    void cancel() override {
+        if (toCancel_ == nullptr)
+            toCancel_ = inflight_.head_;
+        queueCancels();
+    }
+
+private:
+    // user_data of the internal requests, never the address of an Op
+    enum : uint64_t {
+        kWakeupData = 1,
+        kCancelData = 2
+    };
+
+    UringBackend(int ringFd, const struct io_uring_params &params)
+        : ringFd_(ringFd)
+        , eventFd_(::eventfd(0, EFD_CLOEXEC))
+        , ringSize_(std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                     params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe)))
+        , sqesSize_(params.sq_entries * sizeof(struct io_uring_sqe))
+        , ring_(::mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING))
+        , sqes_(::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES))
+        , eventValue_(0)
+        , isWakeupArmed_(false)
+        , isWakeupToCancel_(false)
+        , isClosing_(false)
+        , toCancel_(nullptr) {
+        if (!isValid())
+            return;
+        char *ring = static_cast<char *>(ring_);
+        sqHead_    = reinterpret_cast<unsigned *>(ring + params.sq_off.head);
+        sqTail_    = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+        sqMask_    = *reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+        sqEntries_ = params.sq_entries;
+        sqArray_   = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+        cqHead_    = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+        cqTail_    = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+        cqMask_    = *reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+        cqes_      = reinterpret_cast<struct io_uring_cqe *>(ring + params.cq_off.cqes);
+    }
+
+    bool isValid() const {
+        return eventFd_ >= 0 && ring_ != MAP_FAILED && sqes_ != MAP_FAILED;
+    }
+
+    bool hasCompletions() const {
+        return *cqHead_ != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    }
+
+    // Queue a request, it is submitted by next poll(), or at once if the ring is full.
+    // Returns nullptr if the ring is still full.
+    io_uring_sqe *prepare(uint8_t opcode, int fd, uint64_t userData) {
+        unsigned tail = *sqTail_;
+        if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+            ::syscall(__NR_io_uring_enter, ringFd_, sqEntries_, 0, 0, nullptr, 0);
+            if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_)
+                return nullptr;
+        }
+        unsigned index = tail & sqMask_;
+        io_uring_sqe *sqe = &static_cast<io_uring_sqe *>(sqes_)[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = userData;
+        sqArray_[index] = index;
+        // Read by the kernel in io_uring_enter() only
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    // Index of the registered buffer which contains [buf, buf + len), or -1
+    int bufferIndex(const void *buf, size_t len) const {
+        const char *begin = static_cast<const char *>(buf);
+        for (size_t i = 0; i < buffers_.size(); ++i) {
+            const char *base = static_cast<const char *>(buffers_[i].iov_base);
+            if (begin >= base && begin + len <= base + buffers_[i].iov_len)
+                return (int)i;
+        }
+        return -1;
+    }
+
+    void issue(Op *op) {
+        static const uint8_t opcodes[] = {
+            IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITE
+        };
+        int index = ((op->kind_ == Op::kRead || op->kind_ == Op::kWrite) ? bufferIndex(op->buf_, op->len_) : -1);
+        uint8_t opcode = opcodes[op->kind_];
+        if (index >= 0)
+            opcode = (op->kind_ == Op::kRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+
+        io_uring_sqe *sqe = prepare(opcode, op->fd_, (uint64_t)(uintptr_t)op);
+        if (sqe == nullptr) {
+            finish(op, -EBUSY);
+            return;
+        }
+        switch (op->kind_) {
+        case Op::kAccept:
+            sqe->accept_flags = SOCK_CLOEXEC;
+            break;
+        case Op::kRecv:
+        case Op::kSend:
+            sqe->addr = (uint64_t)(uintptr_t)op->buf_;
+            sqe->len = (uint32_t)op->len_;
+            sqe->msg_flags = (uint32_t)(op->kind_ == Op::kSend ? (op->flags_ | MSG_NOSIGNAL) : op->flags_);
+            break;
+        case Op::kRead:
+        case Op::kWrite:
+            sqe->addr = (uint64_t)(uintptr_t)op->buf_;
+            sqe->len = (uint32_t)op->len_;
+            sqe->off = (uint64_t)op->offset_;   // -1 for the current position
+            if (index >= 0)
+                sqe->buf_index = (uint16_t)index;
+            break;
+        }
+    }
+
+    // Old kernels return EAGAIN for the non-blocking fds, poll and issue again
+    void pollFor(Op *op) {
+        io_uring_sqe *sqe = prepare(IORING_OP_POLL_ADD, op->fd_, (uint64_t)(uintptr_t)op);
+        if (sqe == nullptr) {
+            finish(op, -EBUSY);
+            return;
+        }
+        sqe->poll32_events = (op->isInput() ? POLLIN : POLLOUT);
+        op->isPolling_ = true;
+    }
+
+    void armWakeup() {
+        io_uring_sqe *sqe = prepare(IORING_OP_READ, eventFd_, kWakeupData);
+        if (sqe == nullptr)
+            return;
+        sqe->addr = (uint64_t)(uintptr_t)&eventValue_;
+        sqe->len = sizeof(eventValue_);
+        sqe->off = (uint64_t)-1;
+        isWakeupArmed_ = true;
+    }
+
+    // Queue the cancel requests from toCancel_ on. Returns false if the ring is still full,
+    // the rest are queued by next poll().
+    bool queueCancels() {
+        if (isWakeupToCancel_) {
+            io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, kCancelData);
+            if (sqe == nullptr)
+                return false;
+            sqe->addr = kWakeupData;
+            isWakeupToCancel_ = false;
+        }
+        for (; toCancel_ != nullptr; toCancel_ = toCancel_->next_) {
+            toCancel_->isCancelled_ = true;
+            io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, kCancelData);
+            if (sqe == nullptr)
+                return false;
+            sqe->addr = (uint64_t)(uintptr_t)toCancel_;
+        }
+        return true;
+    }
+
+    void reap() {
+        unsigned head = *cqHead_;
+        while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes_[head & cqMask_];
+            uint64_t userData = cqe->user_data;
+            int result = cqe->res;
+            __atomic_store_n(cqHead_, ++head, __ATOMIC_RELEASE);
+            dispatch(userData, result);
+        }
+    }
+
+    void dispatch(uint64_t userData, int result) {
+        if (userData == kCancelData)
+            return;
+        if (userData == kWakeupData) {
+            isWakeupArmed_ = false;
+            isWakeupToCancel_ = false;
+            if (!isClosing_)
+                armWakeup();
+            return;
+        }
+
+        Op *op = reinterpret_cast<Op *>((uintptr_t)userData);
+        if (op->isPolling_) {
+            op->isPolling_ = false;
+            if (result >= 0 && !op->isCancelled_) {
+                issue(op);
+                return;
+            }
+            if (result >= 0)
+                result = -ECANCELED;
+        }
+        else if (result == -EAGAIN && !op->isCancelled_) {
+            pollFor(op);
+            return;
+        }
+        finish(op, result);
+    }
+
+    void finish(Op *op, long result) {
+        if (op == toCancel_)
+            toCancel_ = op->next_;
+        inflight_.remove(op);
+        --pending_;
+        IoService::complete(op, result);
+    }
+
+    int                       ringFd_;
+    int                       eventFd_;
+    size_t                    ringSize_;
+    size_t                    sqesSize_;
+    void                     *ring_;
+    void                     *sqes_;
+    unsigned                 *sqHead_;
+    unsigned                 *sqTail_;
+    unsigned                  sqMask_;
+    unsigned                  sqEntries_;
+    unsigned                 *sqArray_;
+    unsigned                 *cqHead_;
+    unsigned                 *cqTail_;
+    unsigned                  cqMask_;
+    struct io_uring_cqe      *cqes_;
+    uint64_t                  eventValue_;      // read from eventFd_ by the wakeup request
+    bool                      isWakeupArmed_;
+    bool                      isWakeupToCancel_; // the cancel of the wakeup request is not queued yet
+    bool                      isClosing_;
+    OpList                    inflight_;
+    Op                       *toCancel_;        // first request whose cancel is not queued yet
+    std::vector<struct iovec> buffers_;
+};
+#endif
+
+inline IoService::IoService(bool isUringEnabled, std::chrono::steady_clock::duration tick)
+    : timers_(tick)
+    , handoff_([this]() { backend_->wakeup(); })
+    , isAutoStop_(true)
+    , isStop_(false)
+    , isStopped_(false) {
+#if PROMISE_IO_URING
+    if (isUringEnabled)
+        backend_.reset(UringBackend::create());
+#else
+    (void)isUringEnabled;
+#endif
+    if (!backend_)
+        backend_.reset(new EpollBackend());
+}
+
+#endif
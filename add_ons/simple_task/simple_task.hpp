@@ -35,6 +35,8 @@
 #include <map>
 #include <list>
 #include <deque>
+#include <vector>
+#include <algorithm>
 #include <chrono>
 #include <thread>
 #include <mutex>
@@ -43,20 +45,52 @@
 #include <utility>
 #include <stdexcept>
 #include "promise-cpp/promise.hpp"
+#include "promise-cpp/handoff.hpp"
+#include "timer_wheel.hpp"
 
 
+//
+// Ready tasks have priorities and deadlines.
+// The deadline of a task is the time it is ready plus the slack of its priority, or given by
+// yieldUntil(), and the tasks are run in the order of their deadlines (earliest deadline first).
+// So the tasks of one priority are run in FIFO order, and a task of lower priority is run
+// before the tasks of higher priorities which are ready later than its deadline.
+//
 class Service {
+public:
+    enum Priority {
+        kHigh,      // slack 0 by default
+        kNormal,    // slack 10 ms by default
+        kLow,       // slack 100 ms by default
+        kPriorities
+    };
+
+private:
     using Defer     = promise::Defer;
     using Promise   = promise::Promise;
     using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
-    using Timers    = std::multimap<TimePoint, Defer>;
-    using Tasks     = std::deque<Defer>;
+    using Duration  = std::chrono::steady_clock::duration;
 #if PROMISE_MULTITHREAD
     using Mutex     = promise::Mutex;
 #endif
 
+    struct Ready {
+        Defer     defer_;
+        TimePoint deadline_;    // not used by the timers
+        Priority  priority_;
+    };
+    using Timers    = TimerWheel<Ready>;
+    using Queue     = std::deque<Ready>;
+
     Timers timers_;
-    Tasks  tasks_;
+    Queue  queues_[kPriorities];    // in the order of deadlines, since the slack is same
+    std::vector<Ready> deadlines_;  // heap of the tasks of yieldUntil()
+    size_t readyCount_;
+    Duration slacks_[kPriorities];
+    std::atomic<size_t> depths_[kPriorities];
+    std::atomic<int64_t> nextTimer_;    // nextTime() of timers_, read without mutex_ by the loop
+    std::atomic<int64_t> earliestQueued_;   // earliest deadline of the tasks queued while a batch is run
+    std::vector<Ready> batch_;          // the ready tasks being run by the loop
 #if PROMISE_MULTITHREAD
     //std::recursive_mutex mutex_;
     std::shared_ptr<Mutex> mutex_;
@@ -64,6 +98,8 @@ class Service {
     std::condition_variable_any cond_;
     std::atomic<bool> isAutoStop_;
     std::atomic<bool> isStop_;
+    bool isWaiting_;    // the loop is waiting on cond_, protected by mutex_
+    promise::Handoff handoff_;  // items pushed by other threads without mutex_
     //Unlock and then lock
 #if PROMISE_MULTITHREAD
     struct unlock_guard_t {
@@ -80,55 +116,153 @@ class Service {
     };
 #endif
 public:
-    Service()
-        : isAutoStop_(true)
-        , isStop_(false)
+    // tick is the resolution of the timers
+    explicit Service(std::chrono::steady_clock::duration tick = std::chrono::milliseconds(1))
+        : timers_(tick)
+        , readyCount_(0)
+        , nextTimer_(TimePoint::max().time_since_epoch().count())
+        , earliestQueued_(TimePoint::max().time_since_epoch().count())
 #if PROMISE_MULTITHREAD
         , mutex_(std::make_shared<Mutex>())
 #endif
+        , isAutoStop_(true)
+        , isStop_(false)
+        , isWaiting_(false)
+        , handoff_([this]() { wakeup(); })
     {
+        slacks_[kHigh]   = Duration(0);
+        slacks_[kNormal] = std::chrono::milliseconds(10);
+        slacks_[kLow]    = std::chrono::milliseconds(100);
+        for (std::atomic<size_t> &depth : depths_)
+            depth = 0;
     }
 
-    // delay for milliseconds
-    Promise delay(uint64_t time_ms) {
-        return promise::newPromise([&](Defer &defer) {
-            TimePoint now = std::chrono::steady_clock::now();
-            TimePoint time = now + std::chrono::milliseconds(time_ms);
-            timers_.emplace(time, defer);
+    // Set the slack of the priority, the tasks queued after it are ordered by the new one
+    void setSlack(Priority priority, Duration slack) {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<Mutex> lock(*mutex_);
+#endif
+        slacks_[priority] = slack;
+    }
+
+    // Count of the ready tasks of the priority, it can be read in any thread
+    size_t queueDepth(Priority priority) const {
+        return depths_[priority].load(std::memory_order_relaxed);
+    }
+
+    // delay for milliseconds, and then it is ready with the priority,
+    // the timer is removed at once if the returned promise is rejected.
+    Promise delay(uint64_t time_ms, Priority priority = kNormal) {
+        Timers::Handle timer;
+        Promise promise = promise::newPromise([&](Defer &defer) {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(*mutex_);
+#endif
+            timer = timers_.add(std::chrono::milliseconds(time_ms), Ready{ defer, TimePoint(), priority });
+            updateNextTimer();
+            notify();
+        });
+
+        return promise.then(nullptr, [this, timer](const promise::any &reason) {
+            {
+#if PROMISE_MULTITHREAD
+                std::lock_guard<Mutex> lock(*mutex_);
+#endif
+                timers_.cancel(timer);
+            }
+            return promise::reject(reason);
+        });
+    }
+
+    // Returns "promise", which is rejected with TimeoutError if it is not settled in time_ms.
+    // The timer is cancelled when the promise is settled first, which may be in any thread.
+    Promise withTimeout(Promise promise, uint64_t time_ms) {
+        Timers::Handle timer;
+        Promise expired = promise::newPromise([&](Defer &defer) {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(*mutex_);
+#endif
+            timer = timers_.add(std::chrono::milliseconds(time_ms), Ready{ defer, TimePoint(), kHigh });
+            updateNextTimer();
+            notify();
+        });
+
+        std::function<void()> expire = promise::armTimeout(promise, [this, timer]() {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(*mutex_);
+#endif
+            timers_.cancel(timer);
         });
+        // The timer is rejected when the service is stopped, it is disarmed silently then
+        if (expire)
+            expired.then(expire, []() {});
+        return promise;
     }
 
     // yield for other tasks to run
-    Promise yield() {
+    Promise yield(Priority priority = kNormal) {
         return promise::newPromise([&](Defer &defer) {
 #if PROMISE_MULTITHREAD
             std::lock_guard<Mutex> lock(*mutex_);
 #endif
-            tasks_.push_back(defer);
-            cond_.notify_one();
+            push(defer, priority, std::chrono::steady_clock::now() + slacks_[priority]);
         });
     }
 
-    // Resolve the defer object in this io thread
-    void runInIoThread(const std::function<void()> &func) {
-        promise::newPromise([=](Defer &defer) {
+    // yield to run before the tasks of later deadlines, it is counted in the depth of priority
+    Promise yieldUntil(const TimePoint &deadline, Priority priority = kNormal) {
+        return promise::newPromise([&](Defer &defer) {
 #if PROMISE_MULTITHREAD
             std::lock_guard<Mutex> lock(*mutex_);
 #endif
-            tasks_.push_back(defer);
-            cond_.notify_one();
-        }).then([func]() {
-            func();
+            lowerEarliestQueued(deadline);
+            deadlines_.push_back(Ready{ defer, deadline, priority });
+            std::push_heap(deadlines_.begin(), deadlines_.end(), isLater);
+            ++depths_[priority];
+            ++readyCount_;
+            notify();
         });
     }
 
+    // Call func in this io thread, in the order they are handed off and before the ready tasks
+    void runInIoThread(const std::function<void()> &func) {
+        handoff_.post(func);
+    }
+
+    // Call func in this io thread as a ready task of the priority
+    void runInIoThread(const std::function<void()> &func, Priority priority) {
+        handoff_.post([this, func, priority]() {
+            yield(priority).then(func);
+        });
+    }
+
+    // Resolve or reject the defer object in this io thread,
+    // it can be called in any thread without locking the service.
+    void resolveInIoThread(const Defer &defer, promise::any value = promise::any()) {
+        handoff_.resolve(defer, std::move(value));
+    }
+
+    void rejectInIoThread(const Defer &defer, promise::any reason) {
+        handoff_.reject(defer, std::move(reason));
+    }
+
+    // Executor which calls the tasks in the io thread, it should not be used after the service is destroyed
+    std::shared_ptr<promise::Executor> executor() {
+        return std::make_shared<Executor>(this);
+    }
+
+    // Returns true if it is called in the io thread
+    bool isInIoThread() const {
+        return current() == this;
+    }
+
     // Set if the io thread will auto exist if no waiting tasks and timers.
     void setAutoStop(bool isAutoExit) {
 #if PROMISE_MULTITHREAD
         std::lock_guard<Mutex> lock(*mutex_);
 #endif
         isAutoStop_ = isAutoExit;
-        cond_.notify_one();
+        notify();
     }
 
 
@@ -136,63 +270,82 @@ public:
     void run() {
 #if PROMISE_MULTITHREAD
         std::unique_lock<Mutex> lock(*mutex_);
+#else
+        // Not shared with other threads, only for waiting on cond_
+        std::mutex mutex;
+        std::unique_lock<std::mutex> lock(mutex);
 #endif
+        CurrentGuard current(this);
+
+        while(!isStop_ && (!isAutoStop_ || readyCount_ > 0 || timers_.size() > 0 || !handoff_.empty())) {
 
-        while(!isStop_ && (!isAutoStop_ || tasks_.size() > 0 || timers_.size() > 0)) {
+            // Settle a limited batch of the handed off items, so that tasks and timers are not starved.
+            // Do not wait then, the items may have stopped the loop.
+            bool isDrained = !handoff_.empty();
+            if (isDrained) {
+#if PROMISE_MULTITHREAD
+                unlock_guard_t unlock(mutex_);
+#endif
+                handoff_.drain(kHandoffBatch);
+            }
 
-            if (tasks_.size() == 0 && timers_.size() == 0) {
-                cond_.wait(lock);
+            if (readyCount_ == 0 && timers_.size() == 0) {
+                if (!isDrained && handoff_.empty())
+                    wait(lock);
                 continue;
             }
 
-            while (!isStop_ && timers_.size() > 0) {
-                TimePoint now = std::chrono::steady_clock::now();
-                TimePoint time = timers_.begin()->first;
-                if (time <= now) {
-                    Defer &defer = timers_.begin()->second;
-                    tasks_.push_back(defer);
-                    timers_.erase(timers_.begin());
-                }
-                else if (tasks_.size() == 0) {
-                    //std::this_thread::sleep_for(time - now);
-                    cond_.wait_for(lock, time - now);
-                }
-                else {
-                    break;
+            if (!isStop_ && timers_.size() > 0) {
+                expireTimers();
+                if (readyCount_ == 0) {
+                    if (!isDrained && handoff_.empty())
+                        waitUntil(lock, timers_.nextTime());
+                    continue;
                 }
             }
 
-            // Check fixed size of tasks in this loop, so that timer have a chance to run.
-            if(!isStop_ && tasks_.size() > 0) {
-                size_t size = tasks_.size();
-                for(size_t i = 0; i < size; ++i){
-                    Defer defer = tasks_.front();
-                    tasks_.pop_front();
-
+            // Take the tasks ready now in the order of deadlines by one lock, and run them unlocked.
+            // The batch is broken before a task if one of earlier deadline is queued meanwhile, or
+            // when the timers are expired, so that the timers and the handed off items are not delayed
+            // by a long queue. The tasks left are queued again by their deadlines, and they are
+            // rejected with the pending ones if it is stopped.
+            for (size_t budget = readyCount_; budget > 0; --budget)
+                batch_.push_back(pop());
+            earliestQueued_.store(TimePoint::max().time_since_epoch().count(), std::memory_order_relaxed);
+            size_t count = 0;
+            {
 #if PROMISE_MULTITHREAD
-                    unlock_guard_t unlock(mutex_);
-                    defer.resolve();
-                    break; // for only once
-#else
-                    defer.resolve(); // loop with the size
+                unlock_guard_t unlock(mutex_);
 #endif
+                while (count < batch_.size() && !isStop_) {
+                    if (earliestQueued_.load(std::memory_order_relaxed) < batch_[count].deadline_.time_since_epoch().count())
+                        break;
+                    // Released at once, so that the memory of the chain is reused by the next tasks
+                    Defer defer = std::move(batch_[count].defer_);
+                    defer.resolve();
+                    if (++count % kTimerCheck == 0
+                        && std::chrono::steady_clock::now().time_since_epoch().count() >= nextTimer_.load(std::memory_order_relaxed))
+                        break;
                 }
             }
+            for (size_t i = count; i < batch_.size(); ++i)
+                requeue(std::move(batch_[i]));
+            batch_.clear();
         }
 
-        // Clear pending timers and tasks
-        while (timers_.size() > 0 || tasks_.size()) {
-            while (timers_.size() > 0) {
-                Defer defer = timers_.begin()->second;
-                timers_.erase(timers_.begin());
+        // Clear pending timers, tasks and handed off items
+        while (timers_.size() > 0 || readyCount_ > 0 || !handoff_.empty()) {
+            if (!handoff_.empty()) {
 #if PROMISE_MULTITHREAD
                 unlock_guard_t unlock(mutex_);
 #endif
-                defer.reject(std::runtime_error("service stopped"));
+                handoff_.clear(std::runtime_error("service stopped"));
             }
-            while (tasks_.size() > 0) {
-                Defer defer = tasks_.front();
-                tasks_.pop_front();
+            timers_.clear([this](Ready &timer) {
+                push(std::move(timer.defer_), timer.priority_, TimePoint());
+            });
+            while (readyCount_ > 0) {
+                Defer defer = std::move(pop().defer_);
 #if PROMISE_MULTITHREAD
                 unlock_guard_t unlock(mutex_);
 #endif
@@ -207,7 +360,139 @@ public:
         std::lock_guard<Mutex> lock(*mutex_);
 #endif
         isStop_ = true;
-        cond_.notify_one();
+        notify();
+    }
+
+private:
+    class Executor : public promise::Executor {
+    public:
+        explicit Executor(Service *service)
+            : service_(service) {
+        }
+        void post(const std::function<void()> &task) override {
+            service_->runInIoThread(task);
+        }
+        bool isCurrent() const override {
+            return service_->isInIoThread();
+        }
+    private:
+        Service *service_;
+    };
+
+    // The service which runs in this thread
+    static Service *&current() {
+        static thread_local Service *s_current = nullptr;
+        return s_current;
+    }
+
+    struct CurrentGuard {
+        explicit CurrentGuard(Service *service)
+            : previous_(current()) {
+            current() = service;
+        }
+        ~CurrentGuard() {
+            current() = previous_;
+        }
+        Service *previous_;
+    };
+
+    enum {
+        kHandoffBatch = 1024,
+        kTimerCheck   = 16      // the clock is read once for this count of tasks
+    };
+
+    static bool isLater(const Ready &left, const Ready &right) {
+        return right.deadline_ < left.deadline_;
+    }
+
+    // Queue a ready task, called with mutex_ locked
+    void push(Defer defer, Priority priority, const TimePoint &deadline) {
+        lowerEarliestQueued(deadline);
+        queues_[priority].push_back(Ready{ std::move(defer), deadline, priority });
+        ++depths_[priority];
+        ++readyCount_;
+        notify();
+    }
+
+    // Called with mutex_ locked, the loop reads it without lock
+    void lowerEarliestQueued(const TimePoint &deadline) {
+        int64_t time = deadline.time_since_epoch().count();
+        if (time < earliestQueued_.load(std::memory_order_relaxed))
+            earliestQueued_.store(time, std::memory_order_relaxed);
+    }
+
+    // Queue a task taken by pop() again, it is run before the tasks of later deadlines
+    void requeue(Ready &&ready) {
+        ++depths_[ready.priority_];
+        ++readyCount_;
+        deadlines_.push_back(std::move(ready));
+        std::push_heap(deadlines_.begin(), deadlines_.end(), isLater);
+    }
+
+    // Take the task of the earliest deadline, or of the higher priority if they are same.
+    // Called with mutex_ locked, and readyCount_ > 0
+    Ready pop() {
+        Queue *queue = nullptr;
+        for (Queue &candidate : queues_) {
+            if (candidate.size() > 0 && (queue == nullptr || candidate.front().deadline_ < queue->front().deadline_))
+                queue = &candidate;
+        }
+
+        bool isDeadline = (deadlines_.size() > 0
+            && (queue == nullptr || deadlines_.front().deadline_ < queue->front().deadline_));
+        if (isDeadline)
+            std::pop_heap(deadlines_.begin(), deadlines_.end(), isLater);
+        Ready ready = std::move(isDeadline ? deadlines_.back() : queue->front());
+        if (isDeadline)
+            deadlines_.pop_back();
+        else
+            queue->pop_front();
+        --depths_[ready.priority_];
+        --readyCount_;
+        return ready;
+    }
+
+    // Queue the expired timers, their deadlines are counted from now
+    void expireTimers() {
+        TimePoint now = std::chrono::steady_clock::now();
+        timers_.expire(now, [this, &now](Ready &timer) {
+            push(std::move(timer.defer_), timer.priority_, now + slacks_[timer.priority_]);
+        });
+        updateNextTimer();
+    }
+
+    // Called with mutex_ locked after the timers are added or expired.
+    // It is not updated when a timer is cancelled, the loop may take a look at the timers earlier.
+    void updateNextTimer() {
+        nextTimer_.store(timers_.nextTime().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    // Called by handoff_ in the producer thread when the first item of a batch is pushed
+    void wakeup() {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<Mutex> lock(*mutex_);
+#endif
+        notify();
+    }
+
+    // Wake up the loop only if it is waiting, called with mutex_ locked
+    void notify() {
+        if (isWaiting_)
+            cond_.notify_one();
+    }
+
+    template<typename LOCK>
+    void wait(LOCK &lock) {
+        isWaiting_ = true;
+        cond_.wait(lock);
+        isWaiting_ = false;
+    }
+
+    template<typename LOCK>
+    void waitUntil(LOCK &lock, const TimePoint &time) {
+        isWaiting_ = true;
+        cond_.wait_until(lock, time);
+        isWaiting_ = false;
     }
 };
 
@@ -0,0 +1,363 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+#ifndef INC_THREAD_POOL_SERVICE_HPP_
+#define INC_THREAD_POOL_SERVICE_HPP_
+
+//
+// Service with the same API as Service in simple_task.hpp, but run by a pool of threads.
+//
+// Each worker thread has its own task queue, tasks created by yield() and runInIoThread()
+// in a worker thread are queued to this worker, and idle workers steal tasks from others.
+// Tasks created in other threads are queued to a shared queue.
+//
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <utility>
+#include <stdexcept>
+#include "promise-cpp/promise.hpp"
+
+#if !PROMISE_MULTITHREAD
+#error "ThreadPoolService requires PROMISE_MULTITHREAD"
+#endif
+
+class ThreadPoolService {
+    using Defer     = promise::Defer;
+    using Promise   = promise::Promise;
+    using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+    using Timers    = std::multimap<TimePoint, Defer>;
+    using Tasks     = std::deque<Defer>;
+
+    struct Worker {
+        size_t     index_;
+        std::mutex mutex_;
+        Tasks      tasks_;
+    };
+
+    struct Current {
+        ThreadPoolService *service_;
+        Worker            *worker_;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    Worker                  injected_;      // tasks queued from other threads
+    std::mutex              timersMutex_;
+    Timers                  timers_;
+    std::mutex              sleepMutex_;
+    std::condition_variable cond_;
+    std::atomic<size_t>     queued_;        // count of tasks in the queues
+    std::atomic<size_t>     outstanding_;   // count of tasks queued or running
+    std::atomic<size_t>     timerCount_;
+    std::atomic<size_t>     sleepers_;
+    std::atomic<bool>       isAutoStop_;
+    std::atomic<bool>       isStop_;
+
+public:
+    // threadCount includes the thread which calls run()
+    explicit ThreadPoolService(size_t threadCount = std::thread::hardware_concurrency())
+        : queued_(0)
+        , outstanding_(0)
+        , timerCount_(0)
+        , sleepers_(0)
+        , isAutoStop_(true)
+        , isStop_(false) {
+        if (threadCount == 0) threadCount = 1;
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers_.emplace_back(new Worker());
+            workers_.back()->index_ = i;
+        }
+        injected_.index_ = threadCount;
+    }
+
+    size_t threadCount() const {
+        return workers_.size();
+    }
+
+    // delay for milliseconds
+    Promise delay(uint64_t time_ms) {
+        return promise::newPromise([&](Defer &defer) {
+            TimePoint now = std::chrono::steady_clock::now();
+            TimePoint time = now + std::chrono::milliseconds(time_ms);
+            bool isFirst;
+            {
+                std::lock_guard<std::mutex> lock(timersMutex_);
+                isFirst = (timers_.emplace(time, defer) == timers_.begin());
+                ++timerCount_;
+            }
+            // Sleeping workers should wait for the new deadline
+            if (isFirst)
+                wakeAll();
+        });
+    }
+
+    // yield for other tasks to run
+    Promise yield() {
+        return promise::newPromise([&](Defer &defer) {
+            push(defer);
+        });
+    }
+
+    // Resolve the defer object in the worker threads
+    void runInIoThread(const std::function<void()> &func) {
+        promise::newPromise([=](Defer &defer) {
+            push(defer);
+        }).then([func]() {
+            func();
+        });
+    }
+
+    // Executor which calls the tasks in the worker threads, it should not be used after the service is destroyed
+    std::shared_ptr<promise::Executor> executor() {
+        return std::make_shared<Executor>(this);
+    }
+
+    // Returns true if it is called in one of the worker threads
+    bool isInIoThread() const {
+        return current().service_ == this;
+    }
+
+    // Set if the io threads will auto exist if no waiting tasks and timers.
+    void setAutoStop(bool isAutoExit) {
+        isAutoStop_ = isAutoExit;
+        wakeAll();
+    }
+
+    // run the service loop in this thread and (threadCount - 1) new threads
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers_.size(); ++i) {
+            Worker *worker = workers_[i].get();
+            threads.emplace_back([this, worker]() {
+                runWorker(worker);
+            });
+        }
+        runWorker(workers_[0].get());
+        for (std::thread &thread : threads)
+            thread.join();
+
+        // Clear pending timers and tasks
+        while (true) {
+            Tasks tasks;
+            {
+                std::lock_guard<std::mutex> lock(timersMutex_);
+                for (auto &timer : timers_)
+                    tasks.push_back(timer.second);
+                timerCount_ -= timers_.size();
+                timers_.clear();
+            }
+            for (size_t i = 0; i <= workers_.size(); ++i) {
+                Worker *worker = (i < workers_.size() ? workers_[i].get() : &injected_);
+                std::lock_guard<std::mutex> lock(worker->mutex_);
+                queued_ -= worker->tasks_.size();
+                outstanding_ -= worker->tasks_.size();
+                for (Defer &defer : worker->tasks_)
+                    tasks.push_back(defer);
+                worker->tasks_.clear();
+            }
+            if (tasks.size() == 0)
+                break;
+            for (Defer &defer : tasks)
+                defer.reject(std::runtime_error("service stopped"));
+        }
+    }
+
+    // stop the service loop
+    void stop() {
+        isStop_ = true;
+        wakeAll();
+    }
+
+private:
+    class Executor : public promise::Executor {
+    public:
+        explicit Executor(ThreadPoolService *service)
+            : service_(service) {
+        }
+        void post(const std::function<void()> &task) override {
+            service_->runInIoThread(task);
+        }
+        bool isCurrent() const override {
+            return service_->isInIoThread();
+        }
+    private:
+        ThreadPoolService *service_;
+    };
+
+    static Current &current() {
+        static thread_local Current s_current = { nullptr, nullptr };
+        return s_current;
+    }
+
+    bool isExit() const {
+        return isStop_ || (isAutoStop_ && outstanding_ == 0 && timerCount_ == 0);
+    }
+
+    void wakeOne() {
+        if (sleepers_ > 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            cond_.notify_one();
+        }
+    }
+
+    void wakeAll() {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        cond_.notify_all();
+    }
+
+    void push(const Defer &defer) {
+        Current &current = ThreadPoolService::current();
+        Worker *worker = (current.service_ == this ? current.worker_ : &injected_);
+        ++outstanding_;
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex_);
+            worker->tasks_.push_back(defer);
+        }
+        ++queued_;
+        wakeOne();
+    }
+
+    static bool popFront(Worker *worker, Tasks &out) {
+        std::lock_guard<std::mutex> lock(worker->mutex_);
+        if (worker->tasks_.size() == 0)
+            return false;
+        out.push_back(std::move(worker->tasks_.front()));
+        worker->tasks_.pop_front();
+        return true;
+    }
+
+    static bool popBack(Worker *worker, Tasks &out) {
+        std::unique_lock<std::mutex> lock(worker->mutex_, std::try_to_lock);
+        if (!lock.owns_lock() || worker->tasks_.size() == 0)
+            return false;
+        out.push_back(std::move(worker->tasks_.back()));
+        worker->tasks_.pop_back();
+        return true;
+    }
+
+    // Move the expired timers to the worker
+    void fireTimers(Worker *worker) {
+        if (timerCount_ == 0)
+            return;
+        std::unique_lock<std::mutex> lock(timersMutex_, std::try_to_lock);
+        if (!lock.owns_lock())
+            return;
+
+        TimePoint now = std::chrono::steady_clock::now();
+        size_t count = 0;
+        while (timers_.size() > 0 && timers_.begin()->first <= now) {
+            {
+                std::lock_guard<std::mutex> lock_tasks(worker->mutex_);
+                worker->tasks_.push_back(timers_.begin()->second);
+            }
+            timers_.erase(timers_.begin());
+            ++count;
+        }
+        if (count > 0) {
+            outstanding_ += count;
+            timerCount_ -= count;
+            queued_ += count;
+            if (count > 1)
+                wakeOne();
+        }
+    }
+
+    // Get a task from own queue, shared queue, timers, or steal from other workers
+    bool take(Worker *worker, Tasks &out) {
+        if (queued_ > 0) {
+            if (popFront(worker, out) || popFront(&injected_, out))
+                return true;
+        }
+        fireTimers(worker);
+        if (queued_ > 0) {
+            if (popFront(worker, out))
+                return true;
+            for (size_t i = 1; i < workers_.size(); ++i) {
+                Worker *victim = workers_[(worker->index_ + i) % workers_.size()].get();
+                if (popBack(victim, out))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    void sleep() {
+        std::unique_lock<std::mutex> lock(sleepMutex_);
+        ++sleepers_;
+        if (queued_ == 0 && !isExit()) {
+            bool hasTimer = false;
+            TimePoint time;
+            {
+                std::lock_guard<std::mutex> lock_timers(timersMutex_);
+                if (timers_.size() > 0) {
+                    hasTimer = true;
+                    time = timers_.begin()->first;
+                }
+            }
+            if (hasTimer)
+                cond_.wait_until(lock, time);
+            else
+                cond_.wait(lock);
+        }
+        --sleepers_;
+    }
+
+    void runWorker(Worker *worker) {
+        Current &current = ThreadPoolService::current();
+        Current previous = current;
+        current.service_ = this;
+        current.worker_  = worker;
+
+        Tasks tasks;
+        while (!isExit()) {
+            if (!take(worker, tasks)) {
+                sleep();
+                continue;
+            }
+
+            --queued_;
+            tasks.front().resolve();
+            tasks.pop_front();
+            if (--outstanding_ == 0 && isExit())
+                wakeAll();
+        }
+
+        current = previous;
+    }
+};
+
+#endif
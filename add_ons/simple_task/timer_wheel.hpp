@@ -0,0 +1,293 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+#ifndef INC_TIMER_WHEEL_HPP_
+#define INC_TIMER_WHEEL_HPP_
+
+//
+// Hierarchical timer wheel, 4 levels with 64 slots in each level.
+//
+// Add and cancel are O(1), the timers are expired by slots when the wheel is advanced.
+// Timers are fired no earlier than the expected time, and at most one tick later.
+// Timers beyond the range of the wheel (64^4 ticks) are moved down when the top level turns.
+//
+// TimerWheel is not thread safe, it should be protected by the owner's mutex.
+//
+
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include "promise-cpp/promise.hpp"
+
+template<typename VALUE>
+class TimerWheel {
+public:
+    using Clock     = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+    using Duration  = Clock::duration;
+
+    class Timer {
+    public:
+        Timer(VALUE &&value)
+            : prev_(nullptr)
+            , next_(nullptr)
+            , expire_(0)
+            , level_(-1)
+            , slot_(0)
+            , value_(std::move(value)) {
+        }
+    private:
+        friend class TimerWheel;
+        Timer                 *prev_;
+        Timer                 *next_;
+        uint64_t               expire_;  // in ticks
+        int                    level_;   // -1 if not in the wheel
+        int                    slot_;
+        VALUE                  value_;
+        std::shared_ptr<Timer> self_;    // keep alive while it is in the wheel
+    };
+
+    // The handle returned by add(), which is used to cancel the timer
+    using Handle = std::weak_ptr<Timer>;
+
+    explicit TimerWheel(Duration tick = std::chrono::milliseconds(1))
+        : tick_(tick.count() > 0 ? tick : Duration(1))
+        , start_(Clock::now())
+        , now_(0)
+        , size_(0) {
+        for (int level = 0; level < kLevels; ++level) {
+            masks_[level] = 0;
+            for (int slot = 0; slot < kSlots; ++slot)
+                slots_[level][slot].head_ = slots_[level][slot].tail_ = nullptr;
+        }
+    }
+
+    ~TimerWheel() {
+        clear([](VALUE &) {});
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    Duration tick() const {
+        return tick_;
+    }
+
+    // Add a timer which expires after "duration" from now
+    Handle add(Duration duration, VALUE value) {
+        return addAt(Clock::now() + duration, std::move(value));
+    }
+
+    Handle addAt(TimePoint time, VALUE value) {
+        std::shared_ptr<Timer> timer = promise::pm_make_shared<Timer>(std::move(value));
+        Duration elapsed = time - start_;
+        uint64_t expire = (elapsed.count() <= 0 ? 0
+            : (uint64_t)((elapsed.count() + tick_.count() - 1) / tick_.count()));
+        timer->expire_ = expire;
+        timer->self_ = timer;
+        link(timer.get());
+        ++size_;
+        return timer;
+    }
+
+    // Returns false if the timer is not in the wheel (already expired or cancelled)
+    bool cancel(const Handle &handle) {
+        std::shared_ptr<Timer> timer = handle.lock();
+        if (!timer || timer->level_ < 0)
+            return false;
+        unlink(timer.get());
+        --size_;
+        timer->self_.reset();
+        return true;
+    }
+
+    // Advance the wheel to "now", onExpired(VALUE &) is called for each expired timer
+    template<typename FUNC>
+    void expire(TimePoint now, FUNC &&onExpired) {
+        Duration elapsed = now - start_;
+        if (elapsed.count() < 0)
+            return;
+        uint64_t to = (uint64_t)(elapsed.count() / tick_.count());
+
+        while (now_ < to) {
+            if (size_ == 0) {
+                now_ = to;
+                break;
+            }
+            // Skip to the end of this round if level 0 is empty
+            if (masks_[0] == 0)
+                now_ = std::min<uint64_t>(now_ | (kSlots - 1), to - 1);
+            ++now_;
+
+            // Move timers from upper levels
+            for (int level = 1; level < kLevels; ++level) {
+                if ((now_ & (((uint64_t)1 << (kBits * level)) - 1)) != 0)
+                    break;
+                cascade(level, (int)((now_ >> (kBits * level)) & (kSlots - 1)));
+            }
+
+            Slot &slot = slots_[0][now_ & (kSlots - 1)];
+            while (slot.head_ != nullptr) {
+                Timer *timer = slot.head_;
+                std::shared_ptr<Timer> holder = std::move(timer->self_);
+                unlink(timer);
+                --size_;
+                onExpired(timer->value_);
+            }
+        }
+    }
+
+    // The time to call expire() again, it may be earlier than the first timer
+    TimePoint nextTime() const {
+        if (size_ == 0)
+            return TimePoint::max();
+
+        int current = (int)(now_ & (kSlots - 1));
+        uint64_t ticks = kSlots - current;  // next cascade
+        // Rotate so that bit 0 is slot of the next tick
+        uint64_t mask = rotateRight(masks_[0], (current + 1) & (kSlots - 1));
+        if (mask != 0) {
+            // The slots after the next cascade are later than the timers in upper levels
+            uint64_t slotTicks = 1 + countTrailingZeros(mask);
+            bool hasUpper = false;
+            for (int level = 1; level < kLevels; ++level)
+                hasUpper = hasUpper || masks_[level] != 0;
+            if (!hasUpper || slotTicks < ticks)
+                ticks = slotTicks;
+        }
+        return start_ + tick_ * (int64_t)(now_ + ticks);
+    }
+
+    // Remove all timers, onRemoved(VALUE &) is called for each timer
+    template<typename FUNC>
+    void clear(FUNC &&onRemoved) {
+        for (int level = 0; level < kLevels; ++level) {
+            for (int slot = 0; slot < kSlots; ++slot) {
+                while (slots_[level][slot].head_ != nullptr) {
+                    Timer *timer = slots_[level][slot].head_;
+                    std::shared_ptr<Timer> holder = std::move(timer->self_);
+                    unlink(timer);
+                    --size_;
+                    onRemoved(timer->value_);
+                }
+            }
+        }
+    }
+
+private:
+    enum {
+        kBits   = 6,
+        kSlots  = 1 << kBits,
+        kLevels = 4
+    };
+
+    struct Slot {
+        Timer *head_;
+        Timer *tail_;
+    };
+
+    static uint64_t rotateRight(uint64_t value, int shift) {
+        return shift == 0 ? value : ((value >> shift) | (value << (64 - shift)));
+    }
+
+    static int countTrailingZeros(uint64_t value) {
+        int count = 0;
+        while ((value & 1) == 0) {
+            value >>= 1;
+            ++count;
+        }
+        return count;
+    }
+
+    void link(Timer *timer) {
+        uint64_t expire = timer->expire_;
+        if (expire <= now_)
+            expire = now_ + 1;
+
+        uint64_t delta = expire - now_;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= ((uint64_t)1 << (kBits * (level + 1))))
+            ++level;
+        if (delta >= ((uint64_t)1 << (kBits * kLevels)))  // out of range, moved down later
+            expire = now_ + ((uint64_t)1 << (kBits * kLevels)) - 1;
+
+        int slotIndex = (int)((expire >> (kBits * level)) & (kSlots - 1));
+        Slot &slot = slots_[level][slotIndex];
+        timer->level_ = level;
+        timer->slot_  = slotIndex;
+        timer->prev_  = slot.tail_;
+        timer->next_  = nullptr;
+        if (slot.tail_ != nullptr)
+            slot.tail_->next_ = timer;
+        else
+            slot.head_ = timer;
+        slot.tail_ = timer;
+        masks_[level] |= ((uint64_t)1 << slotIndex);
+    }
+
+    void unlink(Timer *timer) {
+        Slot &slot = slots_[timer->level_][timer->slot_];
+        if (timer->prev_ != nullptr)
+            timer->prev_->next_ = timer->next_;
+        else
+            slot.head_ = timer->next_;
+        if (timer->next_ != nullptr)
+            timer->next_->prev_ = timer->prev_;
+        else
+            slot.tail_ = timer->prev_;
+        if (slot.head_ == nullptr)
+            masks_[timer->level_] &= ~((uint64_t)1 << timer->slot_);
+        timer->prev_ = timer->next_ = nullptr;
+        timer->level_ = -1;
+    }
+
+    void cascade(int level, int slotIndex) {
+        Slot &slot = slots_[level][slotIndex];
+        while (slot.head_ != nullptr) {
+            Timer *timer = slot.head_;
+            unlink(timer);
+            link(timer);
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    Duration  tick_;
+    TimePoint start_;
+    uint64_t  now_;     // current tick, slots of this tick have been expired
+    size_t    size_;
+    uint64_t  masks_[kLevels];  // bit set for non-empty slots
+    Slot      slots_[kLevels][kSlots];
+};
+
+#endif
@@ -42,9 +42,23 @@
 //   void clearTimeout(Defer d);
 //
 
+//
+// All pending delays of one thread are kept in one sorted map, and only one thread pool
+// timer is set for the earliest of them, so the timeouts are not rounded to WM_TIMER
+// resolution and no kernel timer is created for each delay.
+// The expired delays are resolved in the thread which called delay(), by one message
+// posted to a message-only window, so that thread should run a message loop.
+//
+
 #include "promise-cpp/promise.hpp"
 #include <chrono>
 #include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <cstdint>
+#include <stdexcept>
 #include <windows.h>
 
 namespace promise {
@@ -52,24 +66,180 @@ namespace promise {
 inline void cancelDelay(Defer d);
 inline void clearTimeout(Defer d);
 
+class WindowsTimerScheduler {
+public:
+    using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+    using Key       = std::pair<TimePoint, uint64_t>;
+
+    // The scheduler of current thread, created at the first call and destroyed when the thread exits.
+    // Other threads should keep it by weak_ptr.
+    static std::shared_ptr<WindowsTimerScheduler> current() {
+        static thread_local std::shared_ptr<WindowsTimerScheduler> s_scheduler;
+        if (!s_scheduler)
+            s_scheduler.reset(new WindowsTimerScheduler());
+        return s_scheduler;
+    }
+
+    // The pending delays are rejected, they will never be resolved after the thread exits
+    ~WindowsTimerScheduler() {
+        if (timer_ != NULL) {
+            ::SetThreadpoolTimer(timer_, NULL, 0, 0);
+            ::WaitForThreadpoolTimerCallbacks(timer_, TRUE);
+            ::CloseThreadpoolTimer(timer_);
+        }
+        if (hwnd_ != NULL)
+            ::DestroyWindow(hwnd_);
+
+        std::vector<Defer> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending.swap(ready_);
+            for (auto &timer : timers_)
+                pending.push_back(timer.second);
+            timers_.clear();
+        }
+        for (Defer &defer : pending)
+            defer.reject(std::runtime_error("timer scheduler destroyed"));
+    }
+
+    // It can be called in any thread, the defer is resolved in the thread of this scheduler
+    Key add(int time_ms, const Defer &defer) {
+        TimePoint time = std::chrono::steady_clock::now() + std::chrono::milliseconds(time_ms < 0 ? 0 : time_ms);
+        std::lock_guard<std::mutex> lock(mutex_);
+        Key key(time, ++sequence_);
+        if (timers_.emplace(key, defer).first == timers_.begin())
+            arm();
+        return key;
+    }
+
+    // Remove the timer if it is not expired
+    void cancel(const Key &key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        timers_.erase(key);
+    }
+
+private:
+    enum { kMessage = WM_APP + 1 };
+
+    WindowsTimerScheduler()
+        : hwnd_(NULL)
+        , timer_(NULL)
+        , sequence_(0)
+        , isPosted_(false) {
+        static ATOM s_atom = registerClass();
+        (void)s_atom;
+        hwnd_ = ::CreateWindowExA(0, "promise_cpp_timer", "", 0, 0, 0, 0, 0,
+                                  HWND_MESSAGE, NULL, ::GetModuleHandleA(NULL), NULL);
+        if (hwnd_ != NULL)
+            ::SetWindowLongPtrA(hwnd_, GWLP_USERDATA, (LONG_PTR)this);
+        timer_ = ::CreateThreadpoolTimer(&WindowsTimerScheduler::onTimer, this, NULL);
+    }
+
+    static ATOM registerClass() {
+        WNDCLASSEXA wc;
+        ::ZeroMemory(&wc, sizeof(wc));
+        wc.cbSize        = sizeof(wc);
+        wc.lpfnWndProc   = &WindowsTimerScheduler::wndProc;
+        wc.hInstance     = ::GetModuleHandleA(NULL);
+        wc.lpszClassName = "promise_cpp_timer";
+        return ::RegisterClassExA(&wc);
+    }
+
+    // Set the thread pool timer for the first deadline, called with mutex_ locked
+    void arm() {
+        if (timer_ == NULL)
+            return;
+        if (timers_.size() == 0) {
+            ::SetThreadpoolTimer(timer_, NULL, 0, 0);
+            return;
+        }
+
+        // Negative due time is relative, in 100 nanoseconds
+        auto duration = timers_.begin()->first.first - std::chrono::steady_clock::now();
+        int64_t ticks = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / 100;
+        ULARGE_INTEGER due;
+        due.QuadPart = (ULONGLONG)(-(ticks < 1 ? 1 : ticks));
+        FILETIME dueTime;
+        dueTime.dwLowDateTime  = due.LowPart;
+        dueTime.dwHighDateTime = due.HighPart;
+        ::SetThreadpoolTimer(timer_, &dueTime, 0, 0);
+    }
+
+    // Called in the thread pool, move the expired timers to ready_ and post one message
+    static VOID CALLBACK onTimer(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+        (void)instance;
+        (void)timer;
+        WindowsTimerScheduler *self = static_cast<WindowsTimerScheduler *>(context);
+        bool isPost = false;
+        {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            TimePoint now = std::chrono::steady_clock::now();
+            while (self->timers_.size() > 0 && self->timers_.begin()->first.first <= now) {
+                self->ready_.push_back(self->timers_.begin()->second);
+                self->timers_.erase(self->timers_.begin());
+            }
+            if (self->ready_.size() > 0 && !self->isPosted_)
+                isPost = self->isPosted_ = true;
+            self->arm();
+        }
+        if (isPost)
+            ::PostMessageA(self->hwnd_, kMessage, 0, 0);
+    }
+
+    static LRESULT CALLBACK wndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
+        if (message == kMessage) {
+            WindowsTimerScheduler *self = (WindowsTimerScheduler *)::GetWindowLongPtrA(hwnd, GWLP_USERDATA);
+            if (self != nullptr)
+                self->fire();
+            return 0;
+        }
+        return ::DefWindowProcA(hwnd, message, wParam, lParam);
+    }
+
+    // Resolve the expired timers, in the thread of this scheduler.
+    // Swapped to a local vector, a callback which runs a modal message loop may call fire() again.
+    void fire() {
+        std::vector<Defer> firing;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            firing.swap(ready_);
+            isPosted_ = false;
+        }
+        for (Defer &defer : firing)
+            defer.resolve();
+    }
+
+    WindowsTimerScheduler(const WindowsTimerScheduler &) = delete;
+    WindowsTimerScheduler &operator=(const WindowsTimerScheduler &) = delete;
+
+    HWND                 hwnd_;
+    PTP_TIMER            timer_;
+    std::mutex           mutex_;
+    std::map<Key, Defer> timers_;
+    std::vector<Defer>   ready_;    // expired, waiting for the posted message
+    uint64_t             sequence_;
+    bool                 isPosted_;
+};
+
 struct WindowsTimerHolder {
     WindowsTimerHolder() {};
 public:
     static Promise delay(int time_ms) {
-        UINT_PTR timerId = ::SetTimer(NULL, 0, (UINT)time_ms, &WindowsTimerHolder::timerEvent);
+        std::shared_ptr<WindowsTimerScheduler> scheduler = WindowsTimerScheduler::current();
+        // Cancelled in any thread, the scheduler may be destroyed with its thread then
+        std::weak_ptr<WindowsTimerScheduler> weakScheduler = scheduler;
+        std::shared_ptr<WindowsTimerScheduler::Key> key = std::make_shared<WindowsTimerScheduler::Key>();
 
-        return newPromise([timerId](Defer &Defer) {
-            //printf("timerId = %d\n", (int)timerId);
-            WindowsTimerHolder::getDefers().insert({ timerId, Defer });
-        }).then([timerId]() {
-            WindowsTimerHolder::getDefers().erase(timerId);
+        return newPromise([scheduler, key, time_ms](Defer &defer) {
+            *key = scheduler->add(time_ms, defer);
+        }).then([]() {
             return promise::resolve();
-        }, [timerId]() {
-            ::KillTimer(NULL, timerId);
-            WindowsTimerHolder::getDefers().erase(timerId);
+        }, [weakScheduler, key]() {
+            std::shared_ptr<WindowsTimerScheduler> scheduler = weakScheduler.lock();
+            if (scheduler)
+                scheduler->cancel(*key);
             return promise::reject();
         });
-
     }
 
     static Promise yield() {
@@ -84,30 +254,6 @@ public:
             func(true);
         });
     }
-
-protected:
-    static void CALLBACK timerEvent(HWND unnamedParam1,
-                                    UINT unnamedParam2,
-                                    UINT_PTR timerId,
-                                    DWORD unnamedParam4) {
-        (void)unnamedParam1;
-        (void)unnamedParam2;
-        (void)unnamedParam4;
-        //printf("%d %d %d %d\n", (int)unnamedParam1, (int)unnamedParam2, (int)unnamedParam3, (int)unnamedParam4);
-        auto found = getDefers().find(timerId);
-        if (found != getDefers().end()) {
-            Defer d = found->second;
-            d.resolve();
-        }
-    }
-
-private:
-    friend void cancelDelay(Defer d);
-
-    inline static std::map<UINT_PTR, promise::Defer> &getDefers() {
-        static std::map<UINT_PTR, promise::Defer>  s_defers_;
-        return s_defers_;
-    }
 };
 
 inline Promise delay(int time_ms) {
@@ -0,0 +1,129 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+// The results are in the order of the promises, single values are unwrapped
+static bool testAll() {
+    Promise first = newPromise();
+    Promise second = newPromise();
+    std::vector<any> results;
+    bool isResolved = false;
+    all(first, second, resolve(std::string("three")), resolve(), resolve(4, 5)).then([&](const std::vector<any> &values) {
+        results = values;
+        isResolved = true;
+    });
+    // Settled in the reverse order
+    second.resolve(2);
+    first.resolve(1);
+
+    if (!isResolved || results.size() != 5
+        || any_cast<int>(results[0]) != 1
+        || any_cast<int>(results[1]) != 2
+        || any_cast<std::string>(results[2]) != "three"
+        || !results[3].empty()
+        || results[4].type() != type_id<std::vector<any>>()
+        || any_cast<std::vector<any> &>(results[4]).size() != 2) {
+        printf("FAIL testAll isResolved = %d, size = %d\n", (int)isResolved, (int)results.size());
+        return false;
+    }
+    return true;
+}
+
+// Rejected by the first rejection, without waiting for the pending ones
+static bool testAllRejected() {
+    Promise pending = newPromise();
+    int reason = 0;
+    int resolved = 0;
+    int rejected = 0;
+    all(pending, reject(7), reject(8)).then([&resolved]() {
+        ++resolved;
+    }, [&reason, &rejected](int value) {
+        reason = value;
+        ++rejected;
+    });
+    bool isShortCircuit = (rejected == 1);
+    pending.resolve(1);
+
+    if (!isShortCircuit || reason != 7 || rejected != 1 || resolved != 0) {
+        printf("FAIL testAllRejected reason = %d, rejected = %d, resolved = %d\n", reason, rejected, resolved);
+        return false;
+    }
+    return true;
+}
+
+// Resolved with the state and value of each promise, in the order of the promises
+static bool testAllSettled() {
+    Promise pending = newPromise();
+    std::vector<SettledResult> results;
+    bool isResolved = false;
+    allSettled(pending, reject(std::string("error")), resolve(3)).then([&](const std::vector<SettledResult> &values) {
+        results = values;
+        isResolved = true;
+    });
+    bool isEarly = isResolved;
+    pending.resolve(1);
+
+    if (isEarly || !isResolved || results.size() != 3
+        || results[0].state_ != TaskState::kResolved || any_cast<int>(results[0].value_) != 1
+        || results[1].state_ != TaskState::kRejected || any_cast<std::string>(results[1].value_) != "error"
+        || results[2].state_ != TaskState::kResolved || any_cast<int>(results[2].value_) != 3) {
+        printf("FAIL testAllSettled isEarly = %d, isResolved = %d, size = %d\n", (int)isEarly, (int)isResolved, (int)results.size());
+        return false;
+    }
+    return true;
+}
+
+// Empty inputs are resolved at once with empty results
+static bool testEmpty() {
+    int allSize = -1;
+    int settledSize = -1;
+    all(std::vector<Promise>()).then([&allSize](const std::vector<any> &values) {
+        allSize = (int)values.size();
+    });
+    allSettled(std::vector<Promise>()).then([&settledSize](const std::vector<SettledResult> &values) {
+        settledSize = (int)values.size();
+    });
+
+    if (allSize != 0 || settledSize != 0) {
+        printf("FAIL testEmpty all = %d, allSettled = %d\n", allSize, settledSize);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool isOk = testAll() && testAllRejected() && testAllSettled() && testEmpty();
+    if (!isOk)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -162,18 +162,22 @@ Promise do_session(
 
     }).then([=](size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
-        //<5> Write the message to standard out
-        std::cout << session->res_ << std::endl;
+        //<5> Pass the response to next task, it is moved without copy of the body
+        return std::move(session->res_);
+
+    }).then([](http::response<http::string_body> res) {
+        //<6> Write the message to standard out
+        std::cout << res << std::endl;
 
     }).then([]() {
-        //<6> success, return default error_code
+        //<7> success, return default error_code
         return boost::system::error_code();
     }, [](const boost::system::error_code err) {
-        //<6> failed, return the error_code
+        //<7> failed, return the error_code
         return err;
 
     }).then([=](boost::system::error_code &err) {
-        //<7> Gracefully close the socket
+        //<8> Gracefully close the socket
         std::cout << "shutdown..." << std::endl;
         session->socket_.shutdown(tcp::socket::shutdown_both, err);
     });
@@ -0,0 +1,159 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+//
+// Requests to a local http server by HttpConnectionPool,
+// the count of accepted connections shows that the connections are reused.
+//
+
+#include <stdio.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <iostream>
+#include "add_ons/asio/http_pool.hpp"
+
+using namespace promise;
+namespace asio = boost::asio;
+namespace http = boost::beast::http;
+using tcp      = boost::asio::ip::tcp;
+
+// Answer the requests by the target, the connection is closed after "/close"
+void serve(const std::shared_ptr<tcp::socket> &socket) {
+    struct Session {
+        boost::beast::flat_buffer         buffer_;
+        http::request<http::string_body>  req_;
+        http::response<http::string_body> res_;
+    };
+    std::shared_ptr<Session> session = std::make_shared<Session>();
+
+    doWhile([socket, session](DeferLoop &loop) {
+        session->req_ = http::request<http::string_body>();
+        async_read(*socket, session->buffer_, session->req_).then([socket, session](size_t) {
+            http::response<http::string_body> &res = session->res_;
+            res = http::response<http::string_body>(http::status::ok, session->req_.version());
+            res.body() = std::string(session->req_.target());
+            res.keep_alive(session->req_.keep_alive() && session->req_.target() != "/close");
+            res.prepare_payload();
+            return async_write(*socket, res);
+        }).then([socket, session, loop](size_t) {
+            if (session->res_.keep_alive())
+                loop.doContinue();
+            else {
+                boost::system::error_code ignored;
+                socket->shutdown(tcp::socket::shutdown_send, ignored);
+                loop.doBreak();
+            }
+        }, [loop]() {
+            loop.doBreak();
+        });
+    });
+}
+
+// Send the requests at the same time, resolved with the bodies of the responses
+Promise requestAll(HttpConnectionPool &pool, const std::string &port, const std::vector<std::string> &targets) {
+    std::shared_ptr<std::vector<std::string>> bodies = std::make_shared<std::vector<std::string>>(targets.size());
+    std::vector<Promise> promises;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        promises.push_back(pool.get("127.0.0.1", port, targets[i]).then([bodies, i](HttpConnectionPool::Response &res) {
+            (*bodies)[i] = res.body();
+        }));
+    }
+    return all(promises).then([bodies]() {
+        return *bodies;
+    });
+}
+
+int main() {
+    asio::io_context io;
+
+    tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::string port = std::to_string(acceptor.local_endpoint().port());
+    int accepted = 0;
+    doWhile([&](DeferLoop &loop) {
+        std::shared_ptr<tcp::socket> socket = std::make_shared<tcp::socket>(io);
+        acceptor.async_accept(*socket, [&, socket, loop](boost::system::error_code err) {
+            if (err) {
+                loop.doBreak();
+                return;
+            }
+            ++accepted;
+            serve(socket);
+            loop.doContinue();
+        });
+    });
+
+    std::vector<std::string> targets;
+    for (int i = 0; i < 8; ++i)
+        targets.push_back("/" + std::to_string(i));
+
+    HttpConnectionPool pool(io);            // 4 connections at most
+
+    HttpConnectionPool::Options options;
+    options.maxConnectionsPerHost = 1;
+    options.maxPipelineDepth = 4;
+    HttpConnectionPool pipelined(io, options);
+
+    std::vector<std::string> errors;
+    auto check = [&](const std::string &name, bool ok) {
+        if (!ok)
+            errors.push_back(name);
+    };
+
+    requestAll(pool, port, targets).then([&](const std::vector<std::string> &bodies) {
+        check("responses", bodies == targets);
+        check("limited connections", accepted == 4);
+        // Sent by the kept-alive connections
+        return requestAll(pool, port, targets);
+    }).then([&](const std::vector<std::string> &bodies) {
+        check("reused responses", bodies == targets);
+        check("reused connections", accepted == 4);
+        return requestAll(pipelined, port, targets);
+    }).then([&](const std::vector<std::string> &bodies) {
+        check("pipelined responses", bodies == targets);
+        check("pipelined connections", accepted == 5);
+        // The requests after "/close" are sent again by a new connection
+        return requestAll(pipelined, port, { "/a", "/close", "/b", "/c" });
+    }).then([&](const std::vector<std::string> &bodies) {
+        check("closed responses", bodies == std::vector<std::string>{ "/a", "/close", "/b", "/c" });
+        check("closed connections", accepted == 6);
+    }).fail([&](const boost::system::error_code &err) {
+        errors.push_back(err.message());
+    }).finally([&]() {
+        pool.close();
+        pipelined.close();
+        io.stop();
+    });
+
+    io.run();
+
+    for (const std::string &error : errors)
+        std::cout << "FAIL " << error << ", accepted = " << accepted << std::endl;
+    if (!errors.empty())
+        return 1;
+    std::cout << "PASS" << std::endl;
+    return 0;
+}
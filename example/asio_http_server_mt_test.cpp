@@ -0,0 +1,114 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+//
+// HttpServer run by 4 threads, requested by HttpConnectionPool in another thread,
+// with the acceptors of SO_REUSEPORT and with the shared acceptor.
+//
+
+#include <stdio.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+#include <iostream>
+#include "add_ons/asio/http_server.hpp"
+#include "add_ons/asio/http_pool.hpp"
+
+using namespace promise;
+namespace asio = boost::asio;
+namespace http = boost::beast::http;
+using tcp      = boost::asio::ip::tcp;
+
+bool test(bool isReusePort) {
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+
+    HttpServer::Options serverOptions;
+    serverOptions.threadCount = 4;
+    serverOptions.isReusePort = isReusePort;
+    HttpServer server(tcp::endpoint(asio::ip::address_v4::loopback(), 0), [&](HttpServer::Request &req) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.insert(std::this_thread::get_id());
+        }
+        if (req.target() == "/throw")
+            throw std::runtime_error("error");
+        HttpServer::Response res(http::status::ok, req.version());
+        res.body() = std::string(req.target());
+        return promise::resolve(std::move(res));
+    }, serverOptions);
+    std::thread serverThread([&server]() {
+        server.run();
+    });
+
+    asio::io_context io;
+    HttpConnectionPool::Options poolOptions;
+    poolOptions.maxConnectionsPerHost = 8;
+    HttpConnectionPool pool(io, poolOptions);
+    std::string port = std::to_string(server.endpoint().port());
+
+    const int count = 400;
+    int ok = 0;
+    int errors = 0;
+    std::vector<Promise> promises;
+    for (int i = 0; i < count; ++i) {
+        std::string target = "/" + std::to_string(i);
+        promises.push_back(pool.get("127.0.0.1", port, target).then([&ok, target](HttpConnectionPool::Response &res) {
+            if (res.body() == target)
+                ++ok;
+        }));
+    }
+    bool isThrowOk = false;
+    all(promises).then([&]() {
+        return pool.get("127.0.0.1", port, "/throw");
+    }).then([&](HttpConnectionPool::Response &res) {
+        isThrowOk = (res.result() == http::status::internal_server_error);
+    }).fail([&]() {
+        ++errors;
+    }).finally([&]() {
+        pool.close();
+    });
+    io.run();
+
+    server.stop();
+    serverThread.join();
+
+    // The connections are spread by the kernel with SO_REUSEPORT, it is not checked
+    bool isSpread = (isReusePort || threads.size() == 4);
+    std::cout << (isReusePort ? "reuse port" : "shared acceptor") << ": "
+              << ok << " ok, " << errors << " errors, " << threads.size() << " threads" << std::endl;
+    return ok == count && errors == 0 && isThrowOk && isSpread;
+}
+
+int main() {
+    bool isOk = test(true) && test(false);
+    std::cout << (isOk ? "PASS" : "FAIL") << std::endl;
+    return isOk ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Echo lines between a client and a server on the loopback interface,
+// by the promisified stream functions with pooled buffers.
+//
+
+#include <stdio.h>
+#include <string>
+#include <memory>
+#include <iostream>
+#include "add_ons/asio/io.hpp"
+
+using namespace promise;
+namespace asio = boost::asio;
+using tcp      = boost::asio::ip::tcp;
+
+Promise connect(tcp::socket &socket, const tcp::endpoint &endpoint) {
+    return newPromise([&](Defer &defer) {
+        socket.async_connect(endpoint, [defer](boost::system::error_code err) {
+            if (err)
+                defer.reject(err);
+            else
+                defer.resolve();
+        });
+    });
+}
+
+// Echo the lines back until the client closes it
+Promise echo(const std::shared_ptr<tcp::socket> &socket, FlatBufferPool &pool) {
+    std::shared_ptr<FlatBufferPool::Buffer> buffer = pool.acquire();
+    return doWhile([socket, buffer](DeferLoop &loop) {
+        async_read_until(*socket, *buffer, '\n').then([socket, buffer](size_t size) {
+            // Write the line from the buffer without copy, then remove it from the buffer
+            return async_write_buffers(*socket, asio::buffer(buffer->data().data(), size)).then([buffer, size]() {
+                buffer->consume(size);
+            });
+        }).then(loop);
+    });
+}
+
+int main() {
+    asio::io_context io;
+    FlatBufferPool pool;
+
+    tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::shared_ptr<tcp::socket> server = std::make_shared<tcp::socket>(io);
+    std::shared_ptr<tcp::socket> client = std::make_shared<tcp::socket>(io);
+
+    const std::string header = "hello, ";
+    const std::string lines[] = { "world\n", "promise\n" };
+    std::string received;
+    std::string result = "FAIL";
+    char readBuffer[4];
+
+    acceptor.async_accept(*server, [&](boost::system::error_code err) {
+        if (err)
+            return;
+        echo(server, pool).fail([&](const boost::system::error_code &) {
+            // closed by the client
+            if (received == header + lines[0] + header + lines[1])
+                result = "PASS";
+        });
+    });
+
+    connect(*client, acceptor.local_endpoint()).then([&]() {
+        // Gather-write of 3 buffers in one call
+        std::vector<asio::const_buffer> buffers = {
+            asio::buffer(header), asio::buffer(lines[0]), asio::buffer(header)
+        };
+        return async_write_buffers(*client, buffers);
+    }).then([&]() {
+        return async_write_some(*client, asio::buffer(lines[1]));
+    }).then([&](size_t size) {
+        if (size != lines[1].size())
+            return promise::reject(std::string("partial write"));
+        // Read the echo by small pieces
+        return doWhile([&](DeferLoop &loop) {
+            async_read_some(*client, asio::buffer(readBuffer)).then([&, loop](size_t size) {
+                received.append(readBuffer, size);
+                if (received.size() >= 2 * header.size() + lines[0].size() + lines[1].size())
+                    loop.doBreak();
+                else
+                    loop.doContinue();
+            }, [loop](const boost::system::error_code &err) {
+                loop.reject(err);
+            });
+        });
+    }).then([&]() {
+        client->shutdown(tcp::socket::shutdown_send);
+    }).fail([&]() {
+        client->close();
+    });
+
+    io.run();
+
+    std::cout << result << std::endl;
+    return result == "PASS" ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <boost/asio.hpp>
+#include "add_ons/asio/timer.hpp"
+
+using namespace promise;
+using steady_clock = std::chrono::steady_clock;
+
+static int elapsedMs(steady_clock::time_point start) {
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - start).count();
+}
+
+int main() {
+    bool isPass = true;
+
+    // finally() keeps the resolved value and the rejected reason
+    std::string result;
+    resolve(std::string("value")).finally([&result]() {
+        result += "finally ";
+    }).then([&result](const std::string &value) {
+        result += value + " ";
+    });
+    reject(std::runtime_error("error")).finally([&result](const any &) {
+        result += "finally ";
+    }).fail([&result](const std::runtime_error &err) {
+        result += err.what();
+    });
+    if (result != "finally value finally error") {
+        printf("FAIL finally result = %s\n", result.c_str());
+        isPass = false;
+    }
+
+    boost::asio::io_service io;
+
+    // Timed out, the operation is rejected by TimeoutError
+    steady_clock::time_point start = steady_clock::now();
+    int timedOut = -1;
+    withTimeout(delay(io, 1000), io, 20).then([]() {
+    }, [&timedOut, start](const TimeoutError &) {
+        timedOut = elapsedMs(start);
+    });
+
+    // Settled in time, the timer is cancelled so that io.run() is not kept by it
+    int resolved = -1;
+    withTimeout(delay(io, 10).then([]() {
+        return 10;
+    }), io, 5000).then([&resolved](int value) {
+        resolved = value;
+    });
+
+    io.run();
+    int elapsed = elapsedMs(start);
+    if (timedOut < 0 || timedOut >= 1000 || resolved != 10 || elapsed >= 1000) {
+        printf("FAIL withTimeout timedOut = %d, resolved = %d, elapsed = %d\n", timedOut, resolved, elapsed);
+        isPass = false;
+    }
+
+    if (!isPass)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+#include "promise-cpp/channel.hpp"
+
+using namespace promise;
+
+// Send "count" values, the next one is sent when the previous send is resolved
+Promise produce(AsyncChannel<int> channel, int count) {
+    std::shared_ptr<int> next = std::make_shared<int>(0);
+    return doWhile([channel, count, next](DeferLoop &loop) {
+        if (*next == count) {
+            channel.close();
+            loop.doBreak();
+            return;
+        }
+        channel.send((*next)++).then(loop);
+    });
+}
+
+Promise consume(AsyncChannel<int> channel, std::vector<int> &received) {
+    return doWhile([channel, &received](DeferLoop &loop) {
+        channel.receiveSome(16).then([&received, loop](std::vector<int> &values) {
+            received.insert(received.end(), values.begin(), values.end());
+            loop.doContinue();
+        }, [loop](const ChannelClosedError &) {
+            loop.doBreak();
+        });
+    });
+}
+
+int main() {
+    bool isPass = true;
+
+    // Backpressure, send() is pending while the buffer is full
+    AsyncChannel<std::string> channel(2);
+    int sent = 0;
+    for (int i = 0; i < 3; ++i) {
+        channel.send(std::to_string(i)).then([&sent]() {
+            ++sent;
+        });
+    }
+    std::string received;
+    if (sent != 2 || channel.size() != 2) {
+        printf("FAIL backpressure sent = %d\n", sent);
+        isPass = false;
+    }
+    for (int i = 0; i < 3; ++i) {
+        channel.receive().then([&received](const std::string &value) {
+            received += value;
+        });
+    }
+    if (sent != 3 || received != "012") {
+        printf("FAIL receive sent = %d received = %s\n", sent, received.c_str());
+        isPass = false;
+    }
+
+    // Waiting receivers are resolved by send(), and rejected by close()
+    int closed = 0;
+    for (int i = 0; i < 2; ++i) {
+        channel.receive().then([&received](const std::string &value) {
+            received += value;
+        }, [&closed](const ChannelClosedError &) {
+            ++closed;
+        });
+    }
+    channel.send("3");
+    channel.close();
+    channel.send("4").fail([&closed](const ChannelClosedError &) {
+        ++closed;
+    });
+    if (received != "0123" || closed != 2) {
+        printf("FAIL close received = %s closed = %d\n", received.c_str(), closed);
+        isPass = false;
+    }
+
+    // Matched by the handlers of the base classes
+    int closedAsBase = 0;
+    AsyncChannel<std::string> waiting(1);
+    waiting.receive().fail([&closedAsBase](const std::exception &error) {
+        if (std::string(error.what()) == "channel closed")
+            ++closedAsBase;
+    });
+    waiting.close();
+    waiting.send("5").fail([&closedAsBase](const std::runtime_error &) {
+        ++closedAsBase;
+    });
+    waiting.receiveSome(4).fail([&closedAsBase](const std::runtime_error &) {
+        ++closedAsBase;
+    });
+    if (closedAsBase != 3) {
+        printf("FAIL closed as base class = %d\n", closedAsBase);
+        isPass = false;
+    }
+
+    // Producer and consumer pipeline, unbuffered and buffered
+    for (size_t capacity : { 0, 1, 64 }) {
+        AsyncChannel<int> numbers(capacity);
+        std::vector<int> values;
+        bool isFinished = false;
+        consume(numbers, values).then([&isFinished]() {
+            isFinished = true;
+        });
+        produce(numbers, 10000);
+        bool isInOrder = (values.size() == 10000);
+        for (size_t i = 0; isInOrder && i < values.size(); ++i)
+            isInOrder = (values[i] == (int)i);
+        if (!isFinished || !isInOrder) {
+            printf("FAIL pipeline capacity = %d received = %d\n", (int)capacity, (int)values.size());
+            isPass = false;
+        }
+    }
+
+    if (!isPass)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
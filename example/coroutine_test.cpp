@@ -0,0 +1,97 @@
+#include "promise-cpp/coroutine.hpp"
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace promise;
+
+// Pending defers, resolved later in main to simulate async operations
+static std::vector<Defer> g_pending;
+
+Promise asyncValue() {
+    return newPromise([](Defer &defer) {
+        g_pending.push_back(defer);
+    });
+}
+
+TypedPromise<int> add(int a, int b) {
+    int value = any_cast<int>(co_await asyncValue());
+    co_return a + b + value;
+}
+
+TypedPromise<void> run(std::ostream &out) {
+    int sum = 0;
+    for (int i = 0; i < 3; ++i)
+        sum += co_await add(i, 1);
+    out << sum << " ";
+
+    // already resolved promises continue the coroutine without suspending
+    for (int i = 0; i < 100000; ++i)
+        sum += any_cast<int>(co_await promise::resolve(1));
+    out << sum << " ";
+
+    try {
+        co_await newPromise([](Defer &) {
+            throw std::runtime_error("error");
+        });
+    }
+    catch (const std::runtime_error &err) {
+        out << err.what() << " ";
+    }
+
+    // reasons other than exceptions are thrown as "any"
+    try {
+        co_await promise::reject(2);
+    }
+    catch (const any &reason) {
+        sum += any_cast<int>(reason);
+    }
+    out << sum << " ";
+
+    // converted from untyped promise
+    std::string str = co_await TypedPromise<std::string>(newPromise([](Defer &defer) {
+        defer.resolve(std::string("done"));
+    }));
+    out << str;
+}
+
+Promise untyped() {
+    asyncValue();
+    // a Defer can be awaited too
+    co_await g_pending.back();
+    throw std::runtime_error("thrown");
+    co_return 0;
+}
+
+int main() {
+    std::ostringstream out;
+
+    bool finished = false;
+    run(out).then([&finished]() {
+        finished = true;
+    });
+
+    untyped().fail([&out](const std::runtime_error &err) {
+        out << err.what() << " ";
+    });
+
+    // resolve the pending defers in a loop
+    while (!g_pending.empty()) {
+        std::vector<Defer> pending;
+        pending.swap(g_pending);
+        for (Defer &defer : pending)
+            defer.resolve(10);
+    }
+
+    std::string expected = "thrown 36 100036 error 100038 done";
+    if (!finished || out.str() != expected) {
+        std::cout << "FAIL coroutine_test got \"" << out.str() << "\", "
+                  << "expected \"" << expected << "\"\n";
+        return 1;
+    }
+
+    std::cout << "PASS\n";
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+// The synchronous iterations are run by a loop, and the value of doBreak() resolves the loop
+static bool testSyncLoop() {
+    const int kCount = 1000000;
+    int count = 0;
+    int result = -1;
+    std::string text;
+    doWhile([&count](DeferLoop &loop) {
+        if (++count < kCount)
+            loop.doContinue();
+        else
+            loop.doBreak(count, std::string("done"));
+    }).then([&result, &text](int value, const std::string &str) {
+        result = value;
+        text = str;
+    });
+
+    if (count != kCount || result != kCount || text != "done") {
+        printf("FAIL testSyncLoop count = %d, result = %d, text = \"%s\"\n", count, result, text.c_str());
+        return false;
+    }
+    return true;
+}
+
+// The iterations which continue later are resumed by the pending promise
+static bool testAsyncLoop() {
+    Promise pending;
+    int count = 0;
+    int result = -1;
+    doWhile([&pending, &count](DeferLoop &loop) {
+        if (++count == 3) {
+            loop.doBreak(count);
+            return;
+        }
+        pending = newPromise();
+        pending.then([loop]() {
+            loop.doContinue();
+        });
+    }).then([&result](int value) {
+        result = value;
+    });
+    while (result < 0 && pending) {
+        Promise promise = pending;
+        pending.clear();
+        promise.resolve();
+    }
+
+    if (count != 3 || result != 3) {
+        printf("FAIL testAsyncLoop count = %d, result = %d\n", count, result);
+        return false;
+    }
+    return true;
+}
+
+// The rejection in the loop rejects the promise of the loop
+static bool testRejected() {
+    int reason = 0;
+    int count = 0;
+    doWhile([&count](DeferLoop &loop) {
+        if (++count < 10)
+            loop.doContinue();
+        else
+            loop.reject(count);
+    }).fail([&reason](int value) {
+        reason = value;
+    });
+
+    if (reason != 10) {
+        printf("FAIL testRejected reason = %d\n", reason);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool isOk = testSyncLoop() && testAsyncLoop() && testRejected();
+    if (!isOk)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
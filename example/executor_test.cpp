@@ -0,0 +1,95 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <string>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/simple_task.hpp"
+
+using namespace promise;
+
+// Run the continuations in the threads of two services, "io" and "ui"
+int main() {
+    Service io;
+    Service ui;
+    io.setAutoStop(false);
+    ui.setAutoStop(false);
+    std::thread ioThread([&io]() { io.run(); });
+    std::thread uiThread([&ui]() { ui.run(); });
+
+    std::shared_ptr<Executor> ioExecutor = io.executor();
+    std::shared_ptr<Executor> uiExecutor = ui.executor();
+    std::atomic<int> errors(0);
+    std::atomic<bool> finished(false);
+    std::string trace;
+
+    // Settled in this thread, the callbacks are moved to the io and ui threads
+    Promise promise = newPromise();
+    promise.thenOn(ioExecutor, [&](int value) {
+        if (!io.isInIoThread()) ++errors;
+        trace += "io ";
+        return value + 1;
+    }).thenOn(uiExecutor, [&](int value) {
+        if (!ui.isInIoThread()) ++errors;
+        trace += "ui ";
+        return value + 1;
+    }).thenOn(uiExecutor, [&](int value) {
+        // Already in the ui thread, called without posting again
+        if (!ui.isInIoThread()) ++errors;
+        trace += "ui ";
+        return value + 1;
+    }).setExecutor(ioExecutor).then([&](int value) {
+        // then() and fail() are called in the default executor
+        if (!io.isInIoThread()) ++errors;
+        trace += "io ";
+        if (value != 3) ++errors;
+        throw std::runtime_error("error");
+    }).fail([&](const std::runtime_error &) {
+        if (!io.isInIoThread()) ++errors;
+        trace += "fail ";
+    }).setExecutor(nullptr).thenOn(uiExecutor, [&]() {
+        if (!ui.isInIoThread()) ++errors;
+        trace += "ui";
+        finished = true;
+    });
+    promise.resolve(0);
+
+    while (!finished)
+        std::this_thread::yield();
+    io.stop();
+    ui.stop();
+    ioThread.join();
+    uiThread.join();
+
+    if (errors != 0 || trace != "io ui ui io fail ui") {
+        printf("FAIL errors = %d, trace = \"%s\"\n", (int)errors, trace.c_str());
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
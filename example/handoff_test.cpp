@@ -0,0 +1,140 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/simple_task.hpp"
+
+using namespace promise;
+
+// Producer threads settle the defers in the io thread of the service,
+// the order of each producer is kept.
+static bool testProducers() {
+    const int producers = 4;
+    const int count = 10000;
+    Service service;
+    service.setAutoStop(false);
+
+    std::vector<std::vector<Defer>> defers(producers);
+    std::vector<int> last(producers, -1);
+    std::atomic<int> resolved(0);
+    std::atomic<int> rejected(0);
+    std::atomic<int> called(0);
+    std::atomic<int> bad(0);
+
+    for (int t = 0; t < producers; ++t) {
+        for (int i = 0; i < count; ++i) {
+            Promise promise = newPromise([&defers, t](Defer &defer) {
+                defers[t].push_back(defer);
+            });
+            promise.then([&, t, i](int value) {
+                if (!service.isInIoThread() || value != i || last[t] != i - 1)
+                    ++bad;
+                last[t] = i;
+                ++resolved;
+            }, [&, t, i](int reason) {
+                if (!service.isInIoThread() || reason != i || last[t] != i - 1)
+                    ++bad;
+                last[t] = i;
+                ++rejected;
+            });
+        }
+    }
+
+    std::thread controller([&]() {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < producers; ++t) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < count; ++i) {
+                    if (i % 10 == 9)
+                        service.rejectInIoThread(defers[t][i], i);
+                    else
+                        service.resolveInIoThread(defers[t][i], i);
+                    if (i % 100 == 0) {
+                        service.runInIoThread([&]() {
+                            if (!service.isInIoThread())
+                                ++bad;
+                            ++called;
+                        });
+                    }
+                }
+            });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+        // Queued after all the items of the producers
+        service.runInIoThread([&service]() {
+            service.stop();
+        });
+    });
+
+    service.run();
+    controller.join();
+
+    if (bad != 0 || resolved != producers * count * 9 / 10
+        || rejected != producers * count / 10 || called != producers * count / 100) {
+        printf("FAIL producers bad = %d, resolved = %d, rejected = %d, called = %d\n",
+            (int)bad, (int)resolved, (int)rejected, (int)called);
+        return false;
+    }
+    return true;
+}
+
+// Items left in the queue are rejected when the service is stopped
+static bool testStop() {
+    Service service;
+    int rejected = 0;
+    int called = 0;
+    for (int i = 0; i < 10; ++i) {
+        newPromise([&service](Defer &defer) {
+            service.resolveInIoThread(defer, 1);
+        }).fail([&rejected](const std::runtime_error &) {
+            ++rejected;
+        });
+    }
+    service.runInIoThread([&called]() {
+        ++called;
+    });
+    service.stop();
+    service.run();
+
+    if (rejected != 10 || called != 0) {
+        printf("FAIL stop rejected = %d, called = %d\n", rejected, called);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    if (!testProducers() || !testStop())
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+//
+// Counters and hooks of the instrumentation, built with PROMISE_INSTRUMENT=1
+//
+
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static std::atomic<int> g_events[4];
+
+static void onEvent(InstrumentEvent event, const void *id, std::chrono::steady_clock::time_point time, void *userData) {
+    (void)id;
+    (void)time;
+    (void)userData;
+    ++g_events[(int)event];
+}
+
+static std::vector<std::string> g_errors;
+
+static void check(const char *name, int64_t value, int64_t expected) {
+    if (value != expected) {
+        printf("%s = %lld, expected %lld\n", name, (long long)value, (long long)expected);
+        g_errors.push_back(name);
+    }
+}
+
+int main() {
+#if !PROMISE_INSTRUMENT
+    printf("PROMISE_INSTRUMENT is not enabled\n");
+    return 1;
+#endif
+    handleUncaughtException([](Promise &d) {
+        d.fail([]() {
+        });
+    });
+    setInstrumentHook(onEvent, nullptr);
+    Stats base = getStats();
+
+    {
+        std::vector<Defer> pending;
+        Promise promise = newPromise([&pending](Defer &defer) {
+            pending.push_back(defer);
+        }).then([]() {
+            return 1;
+        }).then([](int value) {
+            return value + 1;
+        });
+
+        Stats stats = getStats();
+        check("livePromises", stats.livePromises - base.livePromises, 1);
+        check("pendingTasks", stats.pendingTasks - base.pendingTasks, 3);
+        check("liveTasks", stats.liveTasks - base.liveTasks, 3);
+
+        pending[0].resolve();
+        stats = getStats();
+        check("pendingTasks after resolved", stats.pendingTasks - base.pendingTasks, 0);
+    }
+    check("livePromises after released", getStats().livePromises - base.livePromises, 0);
+    check("liveTasks after released", getStats().liveTasks - base.liveTasks, 0);
+
+    // The promise returned by the callback is joined
+    {
+        std::vector<Defer> inner;
+        newPromise([](Defer &defer) {
+            defer.resolve();
+        }).then([&inner]() {
+            return newPromise([&inner](Defer &defer) {
+                inner.push_back(defer);
+            });
+        });
+        inner[0].resolve();
+    }
+    check("joins", getStats().joins - base.joins, 1);
+
+    promise::reject(std::string("uncaught"));
+    check("uncaughtRejections", getStats().uncaughtRejections - base.uncaughtRejections, 1);
+
+    // The uncaught handler is called with a new rejected promise
+    check("create events", g_events[(int)InstrumentEvent::kCreate], 5);
+    check("settle events", g_events[(int)InstrumentEvent::kSettle], 5);
+    check("continuation start events", g_events[(int)InstrumentEvent::kContinuationStart], 4);
+    check("continuation end events", g_events[(int)InstrumentEvent::kContinuationEnd], 4);
+
+    setInstrumentHook(nullptr);
+    newPromise([](Defer &defer) {
+        defer.resolve();
+    });
+    check("events without hook", g_events[(int)InstrumentEvent::kCreate], 5);
+
+    Stats stats = getStats();
+    printf("livePromises = %lld, liveTasks = %lld, pendingTasks = %lld, joins = %lld, "
+           "maxForwardHops = %lld, uncaughtRejections = %lld, lockContentions = %lld\n",
+        (long long)stats.livePromises, (long long)stats.liveTasks, (long long)stats.pendingTasks,
+        (long long)stats.joins, (long long)stats.maxForwardHops, (long long)stats.uncaughtRejections,
+        (long long)stats.lockContentions);
+
+    if (!g_errors.empty()) {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/io_service.hpp"
+
+using namespace promise;
+
+static void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Echo between a pair of sockets, and the end of stream after it is closed
+static bool testEcho(bool isUring) {
+    IoService service(isUring);
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return false;
+    setNonBlocking(fds[0]);
+    setNonBlocking(fds[1]);
+
+    char received[16] = { 0 };
+    char echoed[16] = { 0 };
+    bool isEof = false;
+    service.recv(fds[1], received, sizeof(received)).then([&](size_t size) {
+        return service.send(fds[1], received, size);
+    }).then([&](size_t) {
+        return service.recv(fds[0], echoed, sizeof(echoed));
+    }).then([&](size_t) {
+        close(fds[1]);
+        return service.recv(fds[0], echoed, sizeof(echoed));
+    }).then([&](size_t size) {
+        isEof = (size == 0);
+    });
+    service.send(fds[0], "hello", 5);
+
+    service.run();
+    close(fds[0]);
+    if (strcmp(received, "hello") != 0 || strcmp(echoed, "hello") != 0 || !isEof) {
+        printf("FAIL %s echo: %s, %s, %d\n", service.backend(), received, echoed, (int)isEof);
+        return false;
+    }
+    return true;
+}
+
+// Accept a connection of localhost
+static bool testAccept(bool isUring) {
+    IoService service(isUring);
+    int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 4) != 0
+        || getsockname(listenFd, (struct sockaddr *)&addr, &addrLen) != 0)
+        return false;
+
+    int accepted = -1;
+    char received[16] = { 0 };
+    service.accept(listenFd).then([&](int fd) {
+        accepted = fd;
+        setNonBlocking(fd);
+        return service.recv(fd, received, sizeof(received));
+    });
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client, (struct sockaddr *)&addr, sizeof(addr)) != 0 || send(client, "accepted", 8, 0) != 8)
+        return false;
+
+    service.run();
+    close(client);
+    close(accepted);
+    close(listenFd);
+    if (accepted < 0 || strcmp(received, "accepted") != 0) {
+        printf("FAIL %s accept: %d, %s\n", service.backend(), accepted, received);
+        return false;
+    }
+    return true;
+}
+
+// Write and read a file at the offsets, in the registered buffer
+static bool testFile(bool isUring) {
+    IoService service(isUring);
+    char path[] = "/tmp/io_service_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return false;
+    unlink(path);
+
+    static char buffer[4096];
+    struct iovec iov = { buffer, sizeof(buffer) };
+    bool isRegistered = service.registerBuffers(&iov, 1);
+    strcpy(buffer, "0123456789");
+
+    std::string result;
+    service.write(fd, buffer, 10, 0).then([&](size_t) {
+        return service.write(fd, buffer, 4, 10);
+    }).then([&](size_t) {
+        return service.read(fd, buffer + 100, 14, 0);
+    }).then([&](size_t size) {
+        result.assign(buffer + 100, size);
+        return service.read(fd, buffer + 200, 10, 14);
+    }).then([&](size_t size) {
+        if (size != 0)
+            result = "no end of file";
+    });
+
+    service.run();
+    close(fd);
+    if (result != "01234567890123" || isRegistered != (strcmp(service.backend(), "io_uring") == 0)) {
+        printf("FAIL %s file: %s, %d\n", service.backend(), result.c_str(), (int)isRegistered);
+        return false;
+    }
+    return true;
+}
+
+// The pending requests are rejected when the service is stopped
+// More requests are cancelled than the ring of io_uring holds
+static bool testStop(bool isUring) {
+    IoService service(isUring);
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return false;
+    setNonBlocking(fds[0]);
+
+    const int count = 1000;
+    char buffer[16];
+    int rejected = 0;
+    for (int i = 0; i < count; ++i) {
+        service.recv(fds[0], buffer, sizeof(buffer)).fail([&](const std::runtime_error &) {
+            ++rejected;
+        });
+    }
+    service.delay(20).then([&]() {
+        service.stop();
+    });
+
+    service.run();
+    close(fds[0]);
+    close(fds[1]);
+    if (rejected != count) {
+        printf("FAIL %s stop: %d\n", service.backend(), rejected);
+        return false;
+    }
+    return true;
+}
+
+// Requests and functions are handed off from another thread
+static bool testThreads(bool isUring) {
+    IoService service(isUring);
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return false;
+    setNonBlocking(fds[0]);
+    setNonBlocking(fds[1]);
+
+    const int count = 1000;
+    std::atomic<int> calls(0);
+    std::atomic<bool> isInIoThread(true);
+    char received[4] = { 0 };
+    service.setAutoStop(false);
+
+    std::thread thread([&]() {
+        for (int i = 0; i < count; ++i) {
+            service.runInIoThread([&]() {
+                if (!service.isInIoThread())
+                    isInIoThread = false;
+                ++calls;
+            });
+        }
+        service.send(fds[0], "abc", 3).then([&](size_t) {
+            return service.recv(fds[1], received, 3);
+        }).then([&]() {
+            service.stop();
+        });
+    });
+
+    service.run();
+    thread.join();
+    close(fds[0]);
+    close(fds[1]);
+    if (calls != count || !isInIoThread || strcmp(received, "abc") != 0) {
+        printf("FAIL %s threads: %d, %d, %s\n", service.backend(), (int)calls, (int)isInIoThread, received);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool isOk = true;
+    for (bool isUring : { true, false }) {
+        printf("backend %s\n", IoService(isUring).backend());
+        isOk = testEcho(isUring) && isOk;
+        isOk = testAccept(isUring) && isOk;
+        isOk = testFile(isUring) && isOk;
+        isOk = testStop(isUring) && isOk;
+        isOk = testThreads(isUring) && isOk;
+    }
+    if (!isOk)
+        return 1;
+
+    printf("PASS\n");
+    return 0;
+}
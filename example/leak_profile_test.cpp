@@ -0,0 +1,220 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+//
+// Registry of the live promises, built with PROMISE_INSTRUMENT=1
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static std::vector<std::string> g_errors;
+
+static void check(const char *name, long long value, long long expected) {
+    if (value != expected) {
+        printf("%s = %lld, expected %lld\n", name, value, expected);
+        g_errors.push_back(name);
+    }
+}
+
+static int g_stuckLine = 0;
+
+// The defer is kept by the caller, as it is lost in a timer or handler which never fires
+static Promise startStuckRequest(std::vector<Defer> &lost) {
+    PROMISE_LEAK_SITE(); g_stuckLine = __LINE__;
+    return newPromise([&lost](Defer &defer) {
+        lost.push_back(defer);
+    }).then([]() {
+        return 1;
+    });
+}
+
+static void testPending() {
+    setLeakSampling(1);
+    std::vector<Defer> lost;
+    std::vector<Promise> promises;
+    for (int i = 0; i < 3; ++i) {
+        promises.push_back(startStuckRequest(lost));
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    Promise settled = promise::resolve(100);
+    setLeakSampling(0);
+
+    std::vector<LivePromise> pending = getLivePromises(20);
+    check("pending promises", (long long)pending.size(), 3);
+    for (size_t i = 0; i < pending.size(); ++i) {
+        check("pending site", pending[i].site != nullptr && pending[i].site->line == g_stuckLine, 1);
+        check("pending caller", pending[i].caller != nullptr, 1);
+        check("pending tasks", (long long)pending[i].pendingTasks, 2);
+        check("pending state", (int)pending[i].state, (int)LiveState::kPending);
+        if (i > 0)
+            check("oldest first", pending[i - 1].age >= pending[i].age, 1);
+    }
+    check("limit", (long long)getLivePromises(2).size(), 2);
+
+    std::vector<LivePromise> all = getLivePromises(20, false);
+    check("all promises", (long long)all.size(), 4);
+    bool hasValue = false;
+    for (const LivePromise &promise : all) {
+        if (promise.state == LiveState::kResolved)
+            hasValue = (promise.site == nullptr && promise.valueSize >= sizeof(int));
+    }
+    check("resolved value size", hasValue, 1);
+
+    std::vector<LivePromiseSite> sites = getLivePromiseSites(20);
+    check("sites", (long long)sites.size(), 1);
+    if (sites.size() == 1) {
+        check("site count", (long long)sites[0].count, 3);
+        check("site tasks", (long long)sites[0].pendingTasks, 6);
+        check("site oldest", sites[0].oldestAge >= pending[0].age, 1);
+        check("site function", strcmp(sites[0].site->function, "startStuckRequest"), 0);
+    }
+
+    for (Defer &defer : lost)
+        defer.resolve();
+    check("settled", (long long)getLivePromises(20).size(), 0);
+    check("resolved kept", (long long)getLivePromises(20, false).size(), 4);
+
+    lost.clear();
+    promises.clear();
+    settled.clear();
+    check("released", (long long)getLivePromises(20, false).size(), 0);
+}
+
+static void testSampling() {
+    setLeakSampling(4);
+    std::vector<Defer> lost;
+    for (int i = 0; i < 100; ++i) {
+        newPromise([&lost](Defer &defer) {
+            lost.push_back(defer);
+        });
+    }
+    setLeakSampling(0);
+    check("sampled", (long long)getLivePromises(1000).size(), 25);
+
+    // Scaled by the sampling rate
+    std::string profile = getLeakProfile();
+    long long count = -1;
+    long long bytes = -1;
+    sscanf(profile.c_str(), "heap profile: %lld: %lld", &count, &bytes);
+    check("profile count", count, 100);
+    check("profile bytes", bytes > (long long)(100 * sizeof(PromiseHolder)), 1);
+    check("profile entry", profile.find("] @ 0x") != std::string::npos, 1);
+
+    lost.clear();
+    check("sampled released", (long long)getLivePromises(1000, false).size(), 0);
+}
+
+// The promise returned by a callback is joined, and holds the tasks of the chain
+static void testJoined() {
+    setLeakSampling(1);
+    std::vector<Defer> inner;
+    Promise outer = promise::resolve().then([&inner]() {
+        return newPromise([&inner](Defer &defer) {
+            inner.push_back(defer);
+        });
+    }).then([]() {
+    });
+    setLeakSampling(0);
+
+    std::vector<LivePromise> all = getLivePromises(20, false);
+    int joined = 0;
+    int pending = 0;
+    for (const LivePromise &promise : all) {
+        if (promise.state == LiveState::kJoined)
+            ++joined;
+        else if (promise.state == LiveState::kPending && promise.pendingTasks > 0)
+            ++pending;
+    }
+    check("joined", joined, 1);
+    check("pending root", pending, 1);
+
+    inner[0].resolve();
+    check("joined settled", (long long)getLivePromises(20).size(), 0);
+}
+
+#if PROMISE_MULTITHREAD
+// Promises created and released in other threads while the registry is queried
+static void testThreads() {
+    setLeakSampling(2);
+    std::atomic<bool> isDone(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 2000; ++i) {
+                std::vector<Defer> saved;
+                Promise promise = newPromise([&saved](Defer &defer) {
+                    saved.push_back(defer);
+                }).then([](int value) {
+                    return value + 1;
+                });
+                saved[0].resolve(i);
+            }
+        });
+    }
+    std::thread reader([&isDone]() {
+        while (!isDone) {
+            getLivePromiseSites(20, false);
+            getLeakProfile(false);
+        }
+    });
+    for (std::thread &thread : threads)
+        thread.join();
+    isDone = true;
+    reader.join();
+    setLeakSampling(0);
+    check("threads released", (long long)getLivePromises(1000, false).size(), 0);
+}
+#endif
+
+int main() {
+#if !PROMISE_INSTRUMENT
+    printf("PROMISE_INSTRUMENT is not enabled\n");
+    return 1;
+#endif
+    check("not tracked by default", (long long)getLivePromises().size(), 0);
+
+    testPending();
+    testSampling();
+    testJoined();
+#if PROMISE_MULTITHREAD
+    testThreads();
+#endif
+
+    if (!g_errors.empty()) {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
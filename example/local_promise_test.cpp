@@ -0,0 +1,168 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static int g_failed = 0;
+
+#define CHECK(expr) do { \
+    if (!(expr)) { \
+        printf("FAIL line %d: %s\n", __LINE__, #expr); \
+        ++g_failed; \
+    } \
+} while (0)
+
+// The local chain used in one thread, same as newPromise()
+static void testLocalChain() {
+    int result = 0;
+    Promise promise = newLocalPromise();
+    promise.then([](int value) {
+        return value + 1;
+    }).then([](int value) {
+        return newLocalPromise([value](Defer &defer) {
+            defer.resolve(value * 2);
+        });
+    }).then([](int value) {
+        throw value;
+    }).fail([&result](int value) {
+        result = value;
+    });
+    promise.resolve(1);
+    CHECK(result == 4);
+}
+
+#if PROMISE_MULTITHREAD
+// The shared promise resolved by other thread is joined to the local chain
+static void testJoinShared() {
+    std::atomic<int> result(0);
+    Promise shared = newPromise();
+    newLocalPromise([](Defer &defer) {
+        defer.resolve();
+    }).then([shared]() {
+        return shared;
+    }).then([&result](int value) {
+        result = value;
+    });
+
+    std::thread thread([shared]() {
+        shared.resolve(5);
+    });
+    thread.join();
+    CHECK(result == 5);
+}
+
+// The local promise is joined to a shared chain, after that it is used by many threads
+static void testUpgrade() {
+    const int count = 1000;
+    std::atomic<int> finished(0);
+    for (int i = 0; i < count; ++i) {
+        Promise local = newLocalPromise();
+        Promise chain = newPromise();
+        chain.then([local]() {
+            return local;
+        });
+        chain.resolve();
+
+        std::thread resolver([local]() {
+            local.resolve();
+        });
+        std::thread adder([chain, &finished]() mutable {
+            chain.then([&finished]() {
+                ++finished;
+            });
+        });
+        resolver.join();
+        adder.join();
+    }
+    CHECK(finished == count);
+}
+
+// The shared promise is joined to the local one, after that other thread resolves it
+// while the local chain is still used by this thread
+static void testJoinLocal() {
+    const int count = 1000;
+    int failed = 0;
+    for (int i = 0; i < count; ++i) {
+        std::atomic<int> calls(0);
+        Promise local = newLocalPromise();
+        local.then([&calls]() {
+            ++calls;
+        });
+        Promise shared = newPromise();
+        local.then(shared);
+        std::thread resolver([shared]() {
+            shared.resolve();
+        });
+        local.then([&calls]() {
+            ++calls;
+        });
+        resolver.join();
+        if (calls != 2)
+            ++failed;
+    }
+    CHECK(failed == 0);
+}
+
+// Refused inside a task of the local promise, which is not guarded by lock until the task returns
+static void testJoinInTask() {
+    bool isRefused = false;
+    Promise shared = newPromise();
+    std::thread resolver;
+    Promise local = newLocalPromise();
+    local.then([local, shared, &resolver]() mutable {
+        resolver = std::thread([shared]() {
+            shared.resolve();
+        });
+        local.then(shared);
+    }).fail([&isRefused](const std::runtime_error &) {
+        isRefused = true;
+    });
+    local.resolve();
+    resolver.join();
+    CHECK(isRefused);
+}
+#endif
+
+int main() {
+    testLocalChain();
+#if PROMISE_MULTITHREAD
+    testJoinShared();
+    testUpgrade();
+    testJoinLocal();
+    testJoinInTask();
+#endif
+
+    if (g_failed != 0)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
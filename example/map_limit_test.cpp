@@ -0,0 +1,135 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+// Pending tasks, resolved later in main to simulate async operations
+static std::vector<Promise> g_pending;
+
+int main() {
+    bool isPass = true;
+
+    // At most "limit" items are in flight, the results are in the order of items
+    std::vector<int> items;
+    for (int i = 0; i < 1000; ++i)
+        items.push_back(i);
+    size_t running = 0;
+    size_t maxRunning = 0;
+    std::vector<any> results;
+    mapLimit(items, 8, [&running, &maxRunning](int item) {
+        if (++running > maxRunning)
+            maxRunning = running;
+        Promise promise = newPromise();
+        g_pending.push_back(promise);
+        return promise.then([&running, item]() {
+            --running;
+            return item * 2;
+        });
+    }).then([&results](const std::vector<any> &values) {
+        results = values;
+    });
+    while (!g_pending.empty()) {
+        std::vector<Promise> pending;
+        pending.swap(g_pending);
+        for (Promise &promise : pending)
+            promise.resolve();
+    }
+    if (maxRunning != 8 || results.size() != items.size()) {
+        printf("FAIL mapLimit maxRunning = %d, results = %d\n", (int)maxRunning, (int)results.size());
+        isPass = false;
+    }
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (any_cast<int>(results[i]) != (int)i * 2) {
+            printf("FAIL mapLimit results[%d]\n", (int)i);
+            isPass = false;
+            break;
+        }
+    }
+
+    // Settled synchronously, run by a loop without recursion
+    size_t count = 0;
+    mapLimit(1000000, 64, [](size_t index) {
+        return resolve(index);
+    }).then([&count](const std::vector<any> &values) {
+        count = values.size();
+    });
+    if (count != 1000000) {
+        printf("FAIL mapLimit synchronous count = %d\n", (int)count);
+        isPass = false;
+    }
+
+    // Rejected by the first rejected one, no more is started after that
+    size_t started = 0;
+    std::string reason;
+    mapLimit(100, 4, [&started](size_t index) {
+        ++started;
+        if (index == 10)
+            throw std::runtime_error("rejected");
+        return resolve();
+    }).fail([&reason](const std::runtime_error &err) {
+        reason = err.what();
+    });
+    if (started != 11 || reason != "rejected") {
+        printf("FAIL mapLimit rejected started = %d, reason = %s\n", (int)started, reason.c_str());
+        isPass = false;
+    }
+
+    // Semaphore, the waiters are resolved in order
+    Semaphore semaphore(2);
+    std::string order;
+    for (int i = 0; i < 5; ++i) {
+        semaphore.run([i, &order]() {
+            order += std::to_string(i);
+            Promise promise = newPromise();
+            g_pending.push_back(promise);
+            return promise;
+        });
+    }
+    if (order != "01" || semaphore.tryAcquire()) {
+        printf("FAIL semaphore order = %s\n", order.c_str());
+        isPass = false;
+    }
+    while (!g_pending.empty()) {
+        Promise promise = g_pending.front();
+        g_pending.erase(g_pending.begin());
+        promise.resolve();
+    }
+    if (order != "01234" || !semaphore.tryAcquire() || !semaphore.tryAcquire() || semaphore.tryAcquire()) {
+        printf("FAIL semaphore order = %s\n", order.c_str());
+        isPass = false;
+    }
+
+    if (!isPass)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/simple_task.hpp"
+
+using namespace promise;
+using steady_clock = std::chrono::steady_clock;
+
+static bool check(bool condition, const char *what) {
+    if (!condition)
+        printf("FAIL %s\n", what);
+    return condition;
+}
+
+static void spin(std::chrono::microseconds duration) {
+    steady_clock::time_point end = steady_clock::now() + duration;
+    while (steady_clock::now() < end) {
+    }
+}
+
+static int elapsedMs(steady_clock::time_point start) {
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - start).count();
+}
+
+// Tasks of one priority are FIFO, and the higher priority runs first if they are ready at the same time
+static bool testOrder() {
+    Service service;
+    std::string order;
+    for (int i = 0; i < 3; ++i) {
+        service.yield(Service::kLow).then([&order, i]() { order += (char)('a' + i); });
+        service.yield().then([&order, i]() { order += (char)('A' + i); });
+        service.yield(Service::kHigh).then([&order, i]() { order += (char)('0' + i); });
+    }
+
+    bool isCounted = (service.queueDepth(Service::kHigh) == 3 && service.queueDepth(Service::kNormal) == 3
+                      && service.queueDepth(Service::kLow) == 3);
+    service.run();
+    return check(order == "012ABCabc", "priority order")
+        && check(isCounted && service.queueDepth(Service::kNormal) == 0, "queue depth");
+}
+
+// Tasks of yieldUntil() are run in the order of their deadlines
+static bool testDeadlines() {
+    Service service;
+    std::string order;
+    steady_clock::time_point now = steady_clock::now();
+    service.yieldUntil(now + std::chrono::milliseconds(30)).then([&order]() { order += '3'; });
+    service.yieldUntil(now + std::chrono::milliseconds(10)).then([&order]() { order += '1'; });
+    service.yield(Service::kLow).then([&order]() { order += 'L'; });
+    service.yieldUntil(now + std::chrono::milliseconds(20)).then([&order]() { order += '2'; });
+    service.yield(Service::kHigh).then([&order]() { order += 'H'; });
+    service.run();
+    return check(order == "H123L", "deadline order");
+}
+
+// A low priority task waits about its slack for a busy stream of high priority tasks
+static bool testStarvation() {
+    Service service;
+    service.setSlack(Service::kLow, std::chrono::milliseconds(20));
+    steady_clock::time_point start = steady_clock::now();
+    int waited = -1;
+    bool isDone = false;
+
+    std::function<void()> busy = [&]() {
+        spin(std::chrono::microseconds(100));
+        if (!isDone && elapsedMs(start) < 1000)
+            service.yield(Service::kHigh).then(busy);
+    };
+    for (int i = 0; i < 4; ++i)
+        service.yield(Service::kHigh).then(busy);
+    service.yield(Service::kLow).then([&]() {
+        waited = elapsedMs(start);
+        isDone = true;
+    });
+    service.run();
+    return check(waited >= 15 && waited < 200, "low priority is not starved");
+}
+
+// The expired timer is run before a long queue of bulk tasks
+static bool testTimerPreempt() {
+    Service service;
+    steady_clock::time_point start = steady_clock::now();
+    const int bulk = 5000;
+    int ran = 0;
+    int firedMs = -1;
+    int doneMs = -1;
+    for (int i = 0; i < bulk; ++i) {
+        service.yield(Service::kLow).then([&]() {
+            spin(std::chrono::microseconds(40));
+            if (++ran == bulk)
+                doneMs = elapsedMs(start);
+        });
+    }
+    service.delay(10).then([&]() {
+        firedMs = elapsedMs(start);
+    });
+    service.run();
+    if (!check(firedMs >= 10 && firedMs < doneMs && ran == bulk, "timer preempts the ready queue")) {
+        printf("fired at %d ms, bulk done at %d ms\n", firedMs, doneMs);
+        return false;
+    }
+    return true;
+}
+
+#if PROMISE_MULTITHREAD
+// Functions handed off by other threads are run as the ready tasks of their priorities
+static bool testRunInIoThread() {
+    Service service;
+    service.setAutoStop(false);
+    std::string order;
+    bool isInIoThread = true;
+
+    std::atomic<bool> isPosted(false);
+
+    std::thread thread([&]() {
+        // Both of them are handed off before the io thread goes on
+        service.runInIoThread([&]() {
+            while (!isPosted)
+                std::this_thread::yield();
+        });
+        service.runInIoThread([&]() {
+            isInIoThread = isInIoThread && service.isInIoThread();
+            order += 'L';
+            service.stop();
+        }, Service::kLow);
+        service.runInIoThread([&]() {
+            isInIoThread = isInIoThread && service.isInIoThread();
+            order += 'H';
+        }, Service::kHigh);
+        isPosted = true;
+    });
+    service.run();
+    thread.join();
+    return check(order == "HL" && isInIoThread, "handed off with priorities");
+}
+#endif
+
+int main() {
+    bool isOk = testOrder();
+    isOk = testDeadlines() && isOk;
+    isOk = testStarvation() && isOk;
+    isOk = testTimerPreempt() && isOk;
+#if PROMISE_MULTITHREAD
+    isOk = testRunInIoThread() && isOk;
+#endif
+    if (!isOk)
+        return 1;
+
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Benchmarks of the core operations.
+//
+// Usage: promise_bench [--quick] [filter]
+//   Only the benchmarks whose name contains "filter" are run.
+//
+// Each benchmark is run in samples of a fixed count of operations,
+// one CSV line is printed for each benchmark --
+//   name          name of the benchmark
+//   ops           total count of operations
+//   p50_ns        median latency of one operation in the samples
+//   p99_ns        99th percentile latency of one operation in the samples
+//   ops_per_sec   throughput of all the samples
+//   allocs_per_op count of heap allocations of one operation
+//   pool_allocs_per_op  count of allocations of the internal objects of one operation,
+//                 most of them are recycled by the pool allocator and not from heap
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <stdexcept>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+using steady_clock = std::chrono::steady_clock;
+
+// Count all the heap allocations of the process.
+// The whole set of new and delete is replaced, so that each pair goes to the same allocator.
+// They are not inlined, or GCC takes malloc() and free() in them as mismatched with the new expressions.
+#if defined(_MSC_VER)
+#   define BENCH_NOINLINE __declspec(noinline)
+#elif defined(__GNUC__)
+#   define BENCH_NOINLINE __attribute__((noinline))
+#else
+#   define BENCH_NOINLINE
+#endif
+
+static std::atomic<size_t> g_allocs(0);
+
+static void *countedAllocate(size_t size) {
+    ++g_allocs;
+    return malloc(size == 0 ? 1 : size);
+}
+
+BENCH_NOINLINE void *operator new(size_t size) {
+    void *ptr = countedAllocate(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+BENCH_NOINLINE void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+BENCH_NOINLINE void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size);
+}
+
+BENCH_NOINLINE void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size);
+}
+
+BENCH_NOINLINE void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+BENCH_NOINLINE void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+BENCH_NOINLINE void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+BENCH_NOINLINE void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+BENCH_NOINLINE void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+BENCH_NOINLINE void operator delete[](void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+#if defined(__cpp_aligned_new)
+static void *countedAllocate(size_t size, std::align_val_t align) {
+    ++g_allocs;
+    size_t alignment = std::max((size_t)align, sizeof(void *));
+#if defined(_WIN32)
+    return _aligned_malloc(size == 0 ? 1 : size, alignment);
+#else
+    void *ptr = nullptr;
+    return (posix_memalign(&ptr, alignment, size == 0 ? 1 : size) == 0 ? ptr : nullptr);
+#endif
+}
+
+static void countedFree(void *ptr, std::align_val_t) {
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+BENCH_NOINLINE void *operator new(size_t size, std::align_val_t align) {
+    void *ptr = countedAllocate(size, align);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+BENCH_NOINLINE void *operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+BENCH_NOINLINE void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, align);
+}
+
+BENCH_NOINLINE void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, align);
+}
+
+BENCH_NOINLINE void operator delete(void *ptr, std::align_val_t align) noexcept {
+    countedFree(ptr, align);
+}
+
+BENCH_NOINLINE void operator delete[](void *ptr, std::align_val_t align) noexcept {
+    countedFree(ptr, align);
+}
+
+BENCH_NOINLINE void operator delete(void *ptr, std::align_val_t align, const std::nothrow_t &) noexcept {
+    countedFree(ptr, align);
+}
+
+BENCH_NOINLINE void operator delete[](void *ptr, std::align_val_t align, const std::nothrow_t &) noexcept {
+    countedFree(ptr, align);
+}
+
+BENCH_NOINLINE void operator delete(void *ptr, size_t, std::align_val_t align) noexcept {
+    countedFree(ptr, align);
+}
+
+BENCH_NOINLINE void operator delete[](void *ptr, size_t, std::align_val_t align) noexcept {
+    countedFree(ptr, align);
+}
+#endif
+
+// Count the allocations of the internal objects, and forward to the pool allocator
+static std::atomic<size_t> g_poolAllocs(0);
+
+static void *countingAllocate(size_t size) {
+    ++g_poolAllocs;
+    return getPoolAllocator().allocate(size);
+}
+
+static void countingDeallocate(void *ptr, size_t size) {
+    getPoolAllocator().deallocate(ptr, size);
+}
+
+struct BenchOptions {
+    const char *filter_;
+    int         samples_;
+};
+
+// Run "run(ops)" for "samples" times, and print the result
+static void bench(const BenchOptions &options, const std::string &name,
+                  size_t ops, int samples, const std::function<void(size_t ops)> &run) {
+    if (options.filter_ != nullptr && name.find(options.filter_) == std::string::npos)
+        return;
+    samples = std::max(1, samples * options.samples_ / 100);
+
+    run(ops);   // warm up
+
+    std::vector<double> latencies;
+    latencies.reserve(samples);
+    double totalNs = 0;
+    size_t allocs = 0;
+    size_t poolAllocs = 0;
+    for (int i = 0; i < samples; ++i) {
+        size_t allocsBefore = g_allocs;
+        size_t poolAllocsBefore = g_poolAllocs;
+        steady_clock::time_point start = steady_clock::now();
+        run(ops);
+        steady_clock::time_point end = steady_clock::now();
+        allocs += g_allocs - allocsBefore;
+        poolAllocs += g_poolAllocs - poolAllocsBefore;
+
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        totalNs += ns;
+        latencies.push_back(ns / ops);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t totalOps = ops * samples;
+    double p50 = latencies[(latencies.size() - 1) / 2];
+    double p99 = latencies[(latencies.size() - 1) * 99 / 100];
+    printf("%s,%zu,%.1f,%.1f,%.0f,%.2f,%.2f\n", name.c_str(), totalOps, p50, p99,
+        totalNs > 0 ? totalOps * 1e9 / totalNs : 0.0,
+        (double)allocs / totalOps, (double)poolAllocs / totalOps);
+    fflush(stdout);
+}
+
+static void benchNewPromise(size_t ops) {
+    for (size_t i = 0; i < ops; ++i) {
+        newPromise([](Defer &) {});
+    }
+}
+
+// Resolve a promise with "depth" tasks chained by then()
+static void benchThenChain(size_t ops, int depth, bool isLocal) {
+    for (size_t i = 0; i < ops; ++i) {
+        Promise promise = (isLocal ? newLocalPromise() : newPromise());
+        Promise last = promise;
+        for (int j = 0; j < depth; ++j) {
+            last = last.then([](int value) {
+                return value + 1;
+            });
+        }
+        promise.resolve(0);
+    }
+}
+
+template<typename VALUE>
+static void benchResolve(size_t ops, const VALUE &value, bool isLocal = false) {
+    size_t count = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        Promise promise = (isLocal ? newLocalPromise() : newPromise());
+        promise.then([&count](const VALUE &) {
+            ++count;
+        });
+        promise.resolve(value);
+    }
+    if (count != ops)
+        abort();
+}
+
+// Promise returned by then() is joined to the chain
+static void benchJoin(size_t ops) {
+    size_t count = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        Promise promise = newPromise();
+        Promise inner = newPromise();
+        promise.then([&inner]() {
+            return inner;
+        }).then([&count]() {
+            ++count;
+        });
+        promise.resolve();
+        inner.resolve();
+    }
+    if (count != ops)
+        abort();
+}
+
+// finally() called in place, the value is passed through without a new promise
+static void benchFinally(size_t ops) {
+    size_t count = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        Promise promise = newPromise();
+        promise.finally([&count]() {
+            ++count;
+        });
+        promise.resolve(1);
+    }
+    if (count != ops)
+        abort();
+}
+
+// The exception is passed through the typed handlers of other types before it is caught
+static void benchRejectTyped(size_t ops) {
+    std::exception_ptr exception = std::make_exception_ptr(std::runtime_error("bench"));
+    size_t count = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        Promise promise = newPromise();
+        promise.fail([](const std::logic_error &) {
+        }).fail([](const std::bad_alloc &) {
+        }).fail([](const std::range_error &) {
+        }).fail([&count](const std::runtime_error &) {
+            ++count;
+        });
+        promise.reject(exception);
+    }
+    if (count != ops)
+        abort();
+}
+
+// One value read by "count" branches of share(), one operation is one branch
+static void benchShare(size_t ops, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < ops; i += count) {
+        Promise promise = newPromise();
+        SharedValuePromise shared = promise.share();
+        promise.resolve(std::vector<std::string>(100, "a string longer than the small string buffer"));
+        for (size_t j = 0; j < count; ++j) {
+            shared.then([&total](const std::vector<std::string> &value) {
+                total += value.size();
+            });
+        }
+    }
+    if (total != (ops + count - 1) / count * count * 100)
+        abort();
+}
+
+// all() or race() of "count" promises, one operation is one fan-in
+static void benchFanIn(size_t ops, size_t count, bool isAll) {
+    for (size_t i = 0; i < ops; ++i) {
+        std::list<Promise> promises;
+        for (size_t j = 0; j < count; ++j)
+            promises.push_back(newPromise());
+
+        bool finished = false;
+        (isAll ? all(promises) : race(promises)).then([&finished]() {
+            finished = true;
+        });
+        for (Promise &promise : promises)
+            promise.resolve();
+        if (!finished)
+            abort();
+    }
+}
+
+// One operation is one iteration of doWhile, continued out of the loop body
+static void benchDoWhile(size_t ops) {
+    size_t left = ops;
+    std::vector<DeferLoop> pending;
+    bool finished = false;
+    doWhile([&left, &pending](DeferLoop &loop) {
+        if (--left == 0)
+            loop.doBreak();
+        else
+            pending.push_back(loop);
+    }).then([&finished]() {
+        finished = true;
+    });
+
+    while (!pending.empty()) {
+        DeferLoop loop = pending.back();
+        pending.pop_back();
+        loop.doContinue();
+    }
+    if (!finished)
+        abort();
+}
+
+#if PROMISE_MULTITHREAD
+// "threadCount" threads add tasks to and resolve the same promises at the same time
+static void benchMultithreadResolve(size_t ops, int threadCount) {
+    std::vector<Promise> promises;
+    promises.reserve(ops);
+    for (size_t i = 0; i < ops; ++i)
+        promises.push_back(newPromise());
+
+    std::atomic<size_t> count(0);
+    std::atomic<int> ready(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t]() {
+            ++ready;
+            while (ready < threadCount)
+                std::this_thread::yield();
+            for (size_t i = 0; i < promises.size(); ++i) {
+                Promise &promise = promises[(i + t * promises.size() / threadCount) % promises.size()];
+                promise.then([&count]() {
+                    ++count;
+                });
+                promise.resolve();
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    if (count != ops * threadCount)
+        abort();
+}
+#endif
+
+int main(int argc, char **argv) {
+    BenchOptions options = { nullptr, 100 };
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--quick") == 0)
+            options.samples_ = 10;
+        else
+            options.filter_ = argv[i];
+    }
+
+    Allocator allocator = { countingAllocate, countingDeallocate };
+    setAllocator(allocator);
+
+    printf("name,ops,p50_ns,p99_ns,ops_per_sec,allocs_per_op,pool_allocs_per_op\n");
+
+    bench(options, "new_promise", 1000, 200, benchNewPromise);
+
+    for (int depth : { 1, 10, 100 }) {
+        bench(options, "then_chain_" + std::to_string(depth), 100, 100, [depth](size_t ops) {
+            benchThenChain(ops, depth, false);
+        });
+    }
+    bench(options, "local_then_chain_10", 100, 100, [](size_t ops) {
+        benchThenChain(ops, 10, true);
+    });
+
+    bench(options, "resolve_int", 1000, 100, [](size_t ops) {
+        benchResolve(ops, 1);
+    });
+    bench(options, "local_resolve_int", 1000, 100, [](size_t ops) {
+        benchResolve(ops, 1, true);
+    });
+    bench(options, "resolve_string", 1000, 100, [](size_t ops) {
+        benchResolve(ops, std::string("a string longer than the small string buffer"));
+    });
+    bench(options, "resolve_vector_any", 1000, 100, [](size_t ops) {
+        benchResolve(ops, std::vector<any>{ 1, 2.0, std::string("3") });
+    });
+
+    bench(options, "join", 1000, 100, benchJoin);
+    bench(options, "finally", 1000, 100, benchFinally);
+    bench(options, "reject_typed", 1000, 100, benchRejectTyped);
+
+    bench(options, "share_100", 1000, 100, [](size_t ops) {
+        benchShare(ops, 100);
+    });
+
+    for (size_t count : { 10, 1000, 100000 }) {
+        int samples = (count >= 100000 ? 10 : 100);
+        size_t ops = std::max<size_t>(1, 10000 / count);
+        bench(options, "all_" + std::to_string(count), ops, samples, [count](size_t ops) {
+            benchFanIn(ops, count, true);
+        });
+        bench(options, "race_" + std::to_string(count), ops, samples, [count](size_t ops) {
+            benchFanIn(ops, count, false);
+        });
+    }
+
+    bench(options, "do_while", 1000, 100, benchDoWhile);
+
+#if PROMISE_MULTITHREAD
+    for (int threadCount : { 2, 4 }) {
+        bench(options, "mt_resolve_" + std::to_string(threadCount), 10000, 20, [threadCount](size_t ops) {
+            benchMultithreadResolve(ops, threadCount);
+        });
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+#include "promise-cpp/promise_cache.hpp"
+
+using namespace promise;
+
+// Pending loads, resolved later in main to simulate async operations
+static std::vector<Defer> g_pending;
+
+int main() {
+    bool isPass = true;
+
+    PromiseCache<std::string>::Options options;
+    options.maxEntries = 2;
+    options.shardCount = 1;
+    options.negativeTtl = std::chrono::milliseconds(50);
+    PromiseCache<std::string> cache(options);
+
+    // The concurrent gets share one load
+    int loads = 0;
+    int received = 0;
+    auto load = [&loads](const std::string &value) {
+        return [&loads, value]() {
+            ++loads;
+            return newPromise([value](Defer &defer) {
+                g_pending.push_back(defer);
+            }).then([value]() {
+                return value;
+            });
+        };
+    };
+    for (int i = 0; i < 500; ++i) {
+        cache.get("config", load("blob")).then([&received](const std::string &value) {
+            if (value == "blob")
+                ++received;
+        });
+    }
+    if (loads != 1 || received != 0 || g_pending.size() != 1) {
+        printf("FAIL single flight loads = %d\n", loads);
+        isPass = false;
+    }
+    while (!g_pending.empty()) {
+        std::vector<Defer> pending;
+        pending.swap(g_pending);
+        for (Defer &defer : pending)
+            defer.resolve();
+    }
+    if (received != 500) {
+        printf("FAIL single flight received = %d\n", received);
+        isPass = false;
+    }
+
+    // Resolved from the cache without loading
+    cache.get("config", load("other")).then([&received](const std::string &value) {
+        if (value == "blob")
+            ++received;
+    });
+    if (loads != 1 || received != 501) {
+        printf("FAIL cached loads = %d received = %d\n", loads, received);
+        isPass = false;
+    }
+
+    // Least recently used one is evicted
+    cache.get("a", []() { return resolve(std::string("a")); });
+    cache.get("b", []() { return resolve(std::string("b")); });
+    cache.get("config", load("blob2")).then([&received](const std::string &value) {
+        if (value == "blob2")
+            ++received;
+    });
+    for (Defer &defer : g_pending)
+        defer.resolve();
+    g_pending.clear();
+    if (loads != 2 || received != 502 || cache.size() != 2) {
+        printf("FAIL lru loads = %d received = %d size = %d\n", loads, received, (int)cache.size());
+        isPass = false;
+    }
+
+    // Rejected reasons are kept for negativeTtl
+    int failedLoads = 0;
+    int rejected = 0;
+    auto failedLoad = [&failedLoads]() -> Promise {
+        ++failedLoads;
+        throw std::runtime_error("failed");
+    };
+    for (int i = 0; i < 3; ++i) {
+        cache.get("bad", failedLoad).fail([&rejected](const std::runtime_error &) {
+            ++rejected;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    cache.get("bad", failedLoad).fail([&rejected](const std::runtime_error &) {
+        ++rejected;
+    });
+    if (failedLoads != 2 || rejected != 4) {
+        printf("FAIL negative cache loads = %d rejected = %d\n", failedLoads, rejected);
+        isPass = false;
+    }
+
+    // The waiters and the later gets read the same value, it is not copied for each of them
+    std::vector<const std::string *> values;
+    auto record = [&values](const std::string &value) {
+        values.push_back(&value);
+    };
+    cache.get("shared", load("value")).then(record);
+    cache.get("shared", load("value")).then(record);
+    for (Defer &defer : g_pending)
+        defer.resolve();
+    g_pending.clear();
+    cache.get("shared", load("value")).then(record);
+    if (values.size() != 3 || values[0] != values[1] || values[0] != values[2]) {
+        printf("FAIL shared value count = %d\n", (int)values.size());
+        isPass = false;
+    }
+
+    if (!isPass)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static std::atomic<int> g_uncaught(0);
+
+#if PROMISE_MULTITHREAD
+// The participants are resolved by several threads at the same time, only one of them wins
+static bool testOneWinner() {
+    for (int round = 0; round < 100; ++round) {
+        std::vector<Promise> promises;
+        for (int i = 0; i < 4; ++i)
+            promises.push_back(newPromise());
+        std::atomic<int> called(0);
+        std::atomic<int> winner(-1);
+        race(promises).then([&called, &winner](int index) {
+            ++called;
+            winner = index;
+        });
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            Promise promise = promises[i];
+            threads.emplace_back([promise, i]() {
+                promise.resolve(i);
+            });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+
+        if (called != 1 || winner < 0 || winner >= 4) {
+            printf("FAIL testOneWinner called = %d, winner = %d\n", (int)called, (int)winner);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// The pending loser does not keep the race, nor the value of the winner held by it
+static bool testLoserReleased() {
+    std::weak_ptr<int> weak;
+    Promise loser = newPromise();
+    {
+        std::shared_ptr<int> token = std::make_shared<int>(1);
+        weak = token;
+        Promise winner = newPromise();
+        race(winner, loser);
+        winner.resolve(token);
+    }
+    bool isReleased = weak.expired();
+    loser.resolve();
+    if (!isReleased) {
+        printf("FAIL testLoserReleased use_count = %d\n", (int)weak.use_count());
+        return false;
+    }
+    return true;
+}
+
+// The handlers of the losers added before and after the race see the rejection
+static bool testLoserRejected() {
+    int rejected = 0;
+    int resolved = 0;
+    Promise before = newPromise();
+    before.fail([&rejected]() {
+        ++rejected;
+    });
+    Promise after = newPromise();
+    Promise winner = newPromise();
+    raceAndReject(winner, before, after);
+    after.then([&resolved]() {
+        ++resolved;
+    }, [&rejected]() {
+        ++rejected;
+    });
+    winner.resolve();
+
+    if (rejected != 2 || resolved != 0) {
+        printf("FAIL testLoserRejected rejected = %d, resolved = %d\n", rejected, resolved);
+        return false;
+    }
+    return true;
+}
+
+// The losers without handlers, and the ones added after the winner, are not uncaught
+static bool testNoUncaught() {
+    {
+        Promise winner = newPromise();
+        Promise loser = newPromise();
+        raceAndReject(winner, loser);
+        winner.resolve();
+    }
+    raceAndReject(resolve(1), newPromise(), newPromise());
+    raceAndResolve(reject(1), newPromise()).fail([]() {
+    });
+
+    if (g_uncaught != 0) {
+        printf("FAIL testNoUncaught uncaught = %d\n", (int)g_uncaught);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    handleUncaughtException([](Promise &) {
+        ++g_uncaught;
+    });
+
+    bool isOk = testLoserReleased() && testLoserRejected() && testNoUncaught();
+#if PROMISE_MULTITHREAD
+    isOk = isOk && testOneWinner();
+#endif
+    if (isOk && g_uncaught != 0) {
+        printf("FAIL uncaught = %d\n", (int)g_uncaught);
+        isOk = false;
+    }
+    if (!isOk)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+// Large value which counts its copies
+struct Config {
+    Config(const std::string &name)
+        : name_(name)
+        , entries_(1000, name) {
+    }
+    Config(const Config &other)
+        : name_(other.name_)
+        , entries_(other.entries_) {
+        ++s_copies;
+    }
+    Config(Config &&other) = default;
+
+    std::string              name_;
+    std::vector<std::string> entries_;
+    static std::atomic<int>  s_copies;
+};
+
+std::atomic<int> Config::s_copies(0);
+
+static bool check(bool condition, const char *what) {
+    if (!condition)
+        printf("FAIL %s\n", what);
+    return condition;
+}
+
+// Branches added before and after the value is settled read the same object
+static bool testBranches() {
+    Config::s_copies = 0;
+    Promise promise = newPromise();
+    SharedValuePromise shared = promise.share();
+
+    const int branches = 1000;
+    int called = 0;
+    const Config *first = nullptr;
+    bool isSame = true;
+    auto read = [&](const Config &config) {
+        if (first == nullptr)
+            first = &config;
+        isSame = isSame && (&config == first) && config.name_ == "v1";
+        ++called;
+        return (int)config.entries_.size();
+    };
+
+    int sum = 0;
+    for (int i = 0; i < branches / 2; ++i) {
+        shared.then(read).then([&sum](int size) {
+            sum += size;
+        });
+    }
+    promise.resolve(Config("v1"));
+    bool isSettled = shared.isSettled();
+    for (int i = 0; i < branches / 2; ++i) {
+        shared.then(read).then([&sum](int size) {
+            sum += size;
+        });
+    }
+
+    return check(isSettled, "settled")
+        && check(called == branches && sum == branches * 1000, "branches called")
+        && check(isSame, "same value")
+        && check(Config::s_copies == 0, "no copy");
+}
+
+// The reason is shared too, and the branches without the callback get it
+static bool testReject() {
+    Promise promise = newPromise();
+    SharedValuePromise shared = promise.share();
+    int caught = 0;
+    int skipped = 0;
+    shared.then([&skipped](const Config &) {
+        ++skipped;
+    }).fail([&caught](const std::runtime_error &error) {
+        caught += (std::string(error.what()) == "bad config");
+    });
+    promise.reject(std::make_exception_ptr(std::runtime_error("bad config")));
+    shared.fail([&caught](const std::runtime_error &error) {
+        caught += (std::string(error.what()) == "bad config");
+    });
+
+    return check(caught == 2 && skipped == 0, "rejected branches");
+}
+
+// A branch returns a promise which is joined
+static bool testJoin() {
+    Promise promise = newPromise();
+    SharedValuePromise shared = promise.share();
+    Promise inner = newPromise();
+    std::string result;
+    shared.then([&inner](const std::string &) {
+        return inner;
+    }).then([&result](const std::string &value) {
+        result += value;
+    });
+    promise.resolve(std::string("outer"));
+
+    shared.then([](const std::string &value) {
+        return resolve(value + "!");
+    }).then([&result](const std::string &value) {
+        result += value;
+    });
+    inner.resolve(std::string("inner"));
+
+    return check(result == "outer!inner", "joined branches");
+}
+
+#if PROMISE_MULTITHREAD
+// Branches are added by other threads while it is settled
+static bool testThreads() {
+    Config::s_copies = 0;
+    const int threadCount = 4;
+    const int branches = 2000;
+    Promise promise = newPromise();
+    SharedValuePromise shared = promise.share();
+    std::atomic<int> called(0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&]() {
+            for (int i = 0; i < branches; ++i) {
+                shared.then([&called](const Config &config) {
+                    if (config.name_ == "v2")
+                        ++called;
+                });
+            }
+        });
+    }
+    promise.resolve(Config("v2"));
+    for (std::thread &thread : threads)
+        thread.join();
+
+    return check(called == threadCount * branches, "threads called")
+        && check(Config::s_copies == 0, "no copy in threads");
+}
+#endif
+
+int main() {
+    bool isOk = testBranches();
+    isOk = testReject() && isOk;
+    isOk = testJoin() && isOk;
+#if PROMISE_MULTITHREAD
+    isOk = testThreads() && isOk;
+#endif
+    if (!isOk)
+        return 1;
+
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/thread_pool_service.hpp"
+
+using namespace promise;
+
+// Some CPU work, yield between the steps so that other jobs have a chance to run
+Promise job(ThreadPoolService &service, int steps, std::atomic<uint64_t> &result) {
+    std::shared_ptr<int> step = std::make_shared<int>(0);
+    return doWhile([&service, steps, &result, step](DeferLoop &loop) {
+        if (++*step > steps) {
+            loop.doBreak();
+            return;
+        }
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < 10000; ++i)
+            sum += i * i;
+        result += sum;
+        service.yield().then(loop);
+    });
+}
+
+int main() {
+    ThreadPoolService service(4);
+
+    const int jobs = 64;
+    const int steps = 50;
+    std::atomic<uint64_t> result(0);
+    std::atomic<int> finished(0);
+    std::atomic<bool> timerFired(false);
+
+    for (int i = 0; i < jobs; ++i) {
+        job(service, steps, result).then([&finished]() {
+            ++finished;
+        });
+    }
+
+    service.delay(100).then([&timerFired]() {
+        timerFired = true;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    service.run();
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < 10000; ++i)
+        sum += i * i;
+    uint64_t expected = sum * jobs * steps;
+
+    printf("%d jobs with %d threads in %d ms\n", jobs, (int)service.threadCount(),
+        (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+    if (finished != jobs || result != expected || !timerFired) {
+        printf("FAIL finished = %d, timerFired = %d\n", (int)finished, (int)timerFired);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}
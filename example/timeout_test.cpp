@@ -0,0 +1,159 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <stdexcept>
+#include "promise-cpp/promise.hpp"
+#include "add_ons/simple_task/simple_task.hpp"
+
+using namespace promise;
+
+static int elapsedMs(std::chrono::steady_clock::time_point start) {
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// TimeoutError is caught by the handlers of its base classes
+static bool testTimedOut() {
+    Service service;
+    bool timedOut = false;
+    auto start = std::chrono::steady_clock::now();
+    service.withTimeout(service.delay(1000), 20).then([]() {
+    }).fail([&timedOut](const std::runtime_error &error) {
+        timedOut = (std::string(error.what()) == "timeout");
+    });
+    service.run();
+
+    // The timer of delay() is cancelled when the chain is rejected
+    int elapsed = elapsedMs(start);
+    if (!timedOut || elapsed > 500) {
+        printf("FAIL testTimedOut timedOut = %d, elapsed = %d\n", (int)timedOut, elapsed);
+        return false;
+    }
+    return true;
+}
+
+// The timer is cancelled if the promise is settled first
+static bool testSettled() {
+    Service service;
+    bool resolved = false;
+    bool timedOut = false;
+    auto start = std::chrono::steady_clock::now();
+    service.withTimeout(service.delay(10), 1000).then([&resolved]() {
+        resolved = true;
+    }).fail([&timedOut](const TimeoutError &) {
+        timedOut = true;
+    });
+    service.run();
+
+    int elapsed = elapsedMs(start);
+    if (!resolved || timedOut || elapsed > 500) {
+        printf("FAIL testSettled resolved = %d, timedOut = %d, elapsed = %d\n", (int)resolved, (int)timedOut, elapsed);
+        return false;
+    }
+    return true;
+}
+
+// The timer is disarmed without an uncaught exception if the service is stopped before it expires
+static bool testStopped() {
+    bool isUncaught = false;
+    handleUncaughtException([&isUncaught](Promise &) {
+        isUncaught = true;
+    });
+    bool timedOut = false;
+    int elapsed = 0;
+    {
+        Service service;
+        Promise promise = newPromise([](Defer &) {
+        });
+        service.withTimeout(promise, 10000).fail([&timedOut](const TimeoutError &) {
+            timedOut = true;
+        });
+        service.delay(10).then([&service]() {
+            service.stop();
+        });
+        auto start = std::chrono::steady_clock::now();
+        service.run();
+        elapsed = elapsedMs(start);
+    }
+    handleUncaughtException(any());
+
+    if (isUncaught || timedOut || elapsed > 500) {
+        printf("FAIL testStopped isUncaught = %d, timedOut = %d, elapsed = %d\n", (int)isUncaught, (int)timedOut, elapsed);
+        return false;
+    }
+    return true;
+}
+
+#if PROMISE_MULTITHREAD
+// The timer expires while a slow callback is running in other thread, the callback then waits on
+// a promise which is never settled, and it is rejected by the timeout after the callback returns.
+static bool testSlowCallback() {
+    Service service;
+    std::vector<Defer> starts;
+    std::vector<Defer> nevers;
+    std::atomic<bool> timedOut(false);
+
+    Promise promise = newPromise([&starts](Defer &defer) {
+        starts.push_back(defer);
+    }).then([&nevers]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return newPromise([&nevers](Defer &defer) {
+            nevers.push_back(defer);
+        });
+    });
+    service.withTimeout(promise, 20).fail([&timedOut](const TimeoutError &) {
+        timedOut = true;
+    });
+
+    std::thread thread([&starts]() {
+        starts[0].resolve();
+    });
+    service.run();
+    thread.join();
+
+    if (!timedOut) {
+        printf("FAIL testSlowCallback is not timed out\n");
+        return false;
+    }
+    return true;
+}
+#endif
+
+int main() {
+    bool isOk = testTimedOut() && testSettled() && testStopped();
+#if PROMISE_MULTITHREAD
+    for (int i = 0; isOk && i < 5; ++i)
+        isOk = testSlowCallback();
+#endif
+    if (!isOk)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
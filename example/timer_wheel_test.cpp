@@ -0,0 +1,86 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "add_ons/simple_task/timer_wheel.hpp"
+
+using Wheel = TimerWheel<int>;
+using std::chrono::milliseconds;
+
+static int g_failed = 0;
+
+// Advance the wheel by nextTime() until "until", the value of each timer is its time in ms.
+// Checked with one tick for rounding, and another one for the wheel.
+static void runUntil(Wheel &wheel, Wheel::TimePoint start, Wheel::TimePoint until, const char *name) {
+    while (wheel.size() > 0 && wheel.nextTime() <= until) {
+        Wheel::TimePoint now = wheel.nextTime();
+        wheel.expire(now, [&](int &value) {
+            Wheel::TimePoint expected = start + milliseconds(value);
+            if (now < expected || now > expected + milliseconds(2)) {
+                printf("FAIL %s: timer of %d ms fired at %d ms\n", name, value,
+                       (int)std::chrono::duration_cast<milliseconds>(now - start).count());
+                ++g_failed;
+            }
+        });
+    }
+}
+
+// A timer of level 0 after the next cascade, and an earlier one in level 1
+static void testCascadeFirst() {
+    Wheel wheel;
+    Wheel::TimePoint start = Wheel::Clock::now();
+    wheel.addAt(start + milliseconds(65), 65);
+    wheel.expire(start + milliseconds(60), [](int &) {});
+    wheel.addAt(start + milliseconds(70), 70);
+    runUntil(wheel, start, Wheel::TimePoint::max(), "cascade first");
+}
+
+// Timers in all levels, added while the wheel is advanced
+static void testRandom() {
+    Wheel wheel;
+    Wheel::TimePoint start = Wheel::Clock::now();
+    srand(1);
+    int now = 0;
+    for (int round = 0; round < 100; ++round) {
+        for (int i = 0; i < 20; ++i) {
+            int delay = (i % 4 == 0 ? rand() % 300000 : rand() % 5000);
+            wheel.addAt(start + milliseconds(now + delay), now + delay);
+        }
+        now += rand() % 3000;
+        runUntil(wheel, start, start + milliseconds(now), "random");
+    }
+    runUntil(wheel, start, Wheel::TimePoint::max(), "random");
+}
+
+int main() {
+    testCascadeFirst();
+    testRandom();
+    if (g_failed != 0)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "promise-cpp/promise.hpp"
+
+using namespace promise;
+
+static const int kDepth = 200000;
+
+// Each level returns the promise of the next level, which is resolved synchronously
+static Promise countDown(int level, std::vector<int> &order) {
+    return resolve(level).then([&order](int value) -> Promise {
+        order.push_back(value);
+        if (value == 0)
+            return resolve(kDepth);
+        return countDown(value - 1, order);
+    });
+}
+
+// The deep chain is called without recursion, the levels are called in order
+static bool testDeepChain() {
+    TrampolineScope scope;
+    std::vector<int> order;
+    order.reserve(kDepth + 1);
+    int result = -1;
+    countDown(kDepth, order).then([&result](int value) {
+        result = value;
+    });
+
+    bool isOrdered = (order.size() == (size_t)kDepth + 1);
+    for (size_t i = 0; isOrdered && i < order.size(); ++i)
+        isOrdered = (order[i] == kDepth - (int)i);
+    if (result != kDepth || !isOrdered) {
+        printf("FAIL testDeepChain result = %d, levels = %d, isOrdered = %d\n", result, (int)order.size(), (int)isOrdered);
+        return false;
+    }
+    return true;
+}
+
+// The task settled inside other task is called after the outer one returns
+static bool testNestedOrder() {
+    TrampolineScope scope;
+    std::string order;
+    Promise inner = newPromise();
+    inner.then([&order]() {
+        order += "inner ";
+    });
+    resolve().then([&order, inner]() {
+        order += "begin ";
+        inner.resolve();
+        order += "end ";
+    });
+
+    if (order != "begin end inner ") {
+        printf("FAIL testNestedOrder order = \"%s\"\n", order.c_str());
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool isOk = testDeepChain() && testNestedOrder();
+    if (!isOk)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "promise-cpp/typed_promise.hpp"
+#include <sstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+using namespace promise;
+
+TypedPromise<int> delayedValue(TypedDefer<int> *&defer) {
+    return newTypedPromise<int>([&defer](TypedDefer<int> &d) {
+        defer = new TypedDefer<int>(d);
+    });
+}
+
+int main() {
+    std::ostringstream out;
+
+    // typed chain, the result types are deduced from the callbacks
+    TypedDefer<int> *defer = nullptr;
+    delayedValue(defer).then([&out](int value) {
+        out << value << " ";
+        return std::to_string(value * 2);
+    }).then([&out](const std::string &str) {
+        out << str << " ";
+        return resolveTyped<double>(1.5);
+    }).then([&out](double value) {
+        out << value << " ";
+        throw std::runtime_error("error");
+    }).then([&out]() {
+        out << "never ";
+    }).fail([&out](const std::runtime_error &err) {
+        out << err.what() << " ";
+    }).finally([&out]() {
+        out << "finally ";
+    });
+    defer->resolve(21);
+    delete defer;
+
+    // rejected callbacks with unmatched argument type are skipped
+    TypedPromise<int> rejected = newTypedPromise<int>([](TypedDefer<int> &d) {
+        d.reject(std::string("reason"));
+    });
+    rejected.fail([&out](int) {
+        out << "never ";
+        return 0;
+    }).fail([&out](const std::string &reason) {
+        out << reason << " ";
+        return 7;
+    }).then([&out](int value) {
+        out << value << " ";
+    });
+
+    // converted from and to untyped promise
+    TypedPromise<int>(promise::resolve(5)).then([&out](int value) {
+        out << value << " ";
+        return promise::resolve(value + 1);
+    }).then([&out](int value) {
+        out << value << " ";
+    });
+    resolveTyped<int>(9).toPromise().then([&out](int value) {
+        out << value;
+    });
+
+    // move-only value is passed through fail() and finally() without copies
+    TypedDefer<std::unique_ptr<int>> *movable = nullptr;
+    newTypedPromise<std::unique_ptr<int>>([&movable](TypedDefer<std::unique_ptr<int>> &d) {
+        movable = new TypedDefer<std::unique_ptr<int>>(d);
+    }).fail([](const std::string &) {
+        return std::unique_ptr<int>();
+    }).finally([]() {
+    }).then([&out](std::unique_ptr<int> &value) {
+        out << " " << *value;
+    });
+    movable->resolve(std::unique_ptr<int>(new int(3)));
+    delete movable;
+
+    // continuations added while the settled ones are called run after them, in order
+    TypedDefer<int> *orderDefer = nullptr;
+    TypedPromise<int> pending = delayedValue(orderDefer);
+    pending.then([&out, pending](int) {
+        out << " a";
+        pending.then([&out](int) {
+            out << " b";
+        });
+    });
+    pending.then([&out](int) {
+        out << " c";
+    });
+    orderDefer->resolve(1);
+    delete orderDefer;
+
+    // empty promise returned by the callback rejects the chain
+    resolveTyped<int>(1).then([](int) {
+        return TypedPromise<int>();
+    }).fail([&out](const std::logic_error &) {
+        out << " empty";
+        return 0;
+    });
+
+    std::string expected = "21 42 1.5 error finally reason 7 5 6 9 3 a c b empty";
+    if (out.str() != expected) {
+        std::cout << "FAIL typed_promise_test got \"" << out.str() << "\", "
+                  << "expected \"" << expected << "\"\n";
+        return 1;
+    }
+
+    std::cout << "PASS\n";
+    return 0;
+}
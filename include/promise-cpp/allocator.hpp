@@ -0,0 +1,156 @@
+#pragma once
+#ifndef INC_PM_ALLOCATOR_HPP_
+#define INC_PM_ALLOCATOR_HPP_
+
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Memory allocation of the internal objects (PromiseHolder, Task and list nodes).
+//
+// By default the blocks are recycled by thread local free lists, grouped by
+// fixed block sizes. The allocation functions can be replaced by setAllocator().
+//
+// When an Arena is activated by ArenaScope, all internal objects created in
+// this thread are allocated from the arena, and the memory is released at once
+// when the arena is destroyed. All promises created in the scope must be
+// released before the arena is destroyed.
+//
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+// Blocks larger than this size are not pooled
+#ifndef PROMISE_POOL_MAX_BLOCK_SIZE
+#   define PROMISE_POOL_MAX_BLOCK_SIZE 256
+#endif
+
+// Max count of free blocks cached in each thread for each block size
+#ifndef PROMISE_POOL_MAX_FREE_BLOCKS
+#   define PROMISE_POOL_MAX_FREE_BLOCKS 4096
+#endif
+
+namespace promise {
+
+struct Allocator {
+    void *(*allocate)(size_t size);
+    void  (*deallocate)(void *ptr, size_t size);
+};
+
+// Replace the default allocator, must be called before any promise is created.
+PROMISE_API void setAllocator(const Allocator &allocator);
+PROMISE_API const Allocator &getAllocator();
+// The default allocator, with thread local free lists
+PROMISE_API const Allocator &getPoolAllocator();
+
+class Arena {
+public:
+    PROMISE_API explicit Arena(size_t chunkSize = 16384);
+    PROMISE_API ~Arena();
+    PROMISE_API void *allocate(size_t size);
+
+    // Returns the arena activated in current thread, or nullptr
+    PROMISE_API static Arena *current();
+
+private:
+    friend class ArenaScope;
+    struct Chunk;
+    PROMISE_API static Arena *&currentRef();
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    Chunk *chunks_;
+    char  *pos_;
+    char  *end_;
+    size_t chunkSize_;
+};
+
+// Objects are allocated from the arena during the life time of ArenaScope
+class ArenaScope {
+public:
+    PROMISE_API explicit ArenaScope(Arena &arena);
+    PROMISE_API ~ArenaScope();
+private:
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+    Arena *previous_;
+};
+
+// Standard allocator used by the internal objects.
+// The arena is captured when the allocator is created, so that
+// the memory will be released to where it comes from.
+template<typename T>
+struct pool_allocator {
+    using value_type = T;
+    using propagate_on_container_swap = std::true_type;
+
+    pool_allocator()
+        : arena_(Arena::current()) {
+    }
+
+    template<typename U>
+    pool_allocator(const pool_allocator<U> &other)
+        : arena_(other.arena_) {
+    }
+
+    T *allocate(size_t n) {
+        size_t size = n * sizeof(T);
+        if (arena_ != nullptr)
+            return static_cast<T *>(arena_->allocate(size));
+        else
+            return static_cast<T *>(getAllocator().allocate(size));
+    }
+
+    void deallocate(T *ptr, size_t n) {
+        if (arena_ == nullptr)
+            getAllocator().deallocate(ptr, n * sizeof(T));
+        // else released with the arena
+    }
+
+    template<typename U>
+    bool operator==(const pool_allocator<U> &other) const {
+        return arena_ == other.arena_;
+    }
+
+    template<typename U>
+    bool operator!=(const pool_allocator<U> &other) const {
+        return arena_ != other.arena_;
+    }
+
+    Arena *arena_;
+};
+
+template<typename T, typename ...ARGS>
+inline std::shared_ptr<T> pm_make_shared(ARGS &&...args) {
+    return std::allocate_shared<T>(pool_allocator<T>(), std::forward<ARGS>(args)...);
+}
+
+} // namespace promise
+
+#endif
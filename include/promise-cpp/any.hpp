@@ -33,6 +33,8 @@
 #include <utility>
 #include <type_traits>
 #include <tuple>
+#include <new>
+#include <typeinfo>
 #include "add_ons.hpp"
 #include "call_traits.hpp"
 
@@ -51,7 +53,69 @@ class any;
 template<typename ValueType>
 inline ValueType any_cast(const any &operand);
 
+// Dynamic type of the exception object in ptr, or nullptr if it is not known.
+// libstdc++ tells it without rethrowing, otherwise it is known for the types derived
+// from std::exception.
+inline const std::type_info *exception_type_of(const std::exception_ptr &ptr) {
+#ifdef __cpp_rtti
+    if (!ptr)
+        return nullptr;
+#   if defined(__GLIBCXX__)
+    return ptr.__cxa_exception_type();
+#   else
+    try {
+        std::rethrow_exception(ptr);
+    }
+    catch (const std::exception &ex) {
+        return &typeid(ex);
+    }
+    catch (...) {
+    }
+    return nullptr;
+#   endif
+#else
+    (void)ptr;
+    return nullptr;
+#endif
+}
+
+// Information recorded once when the value is stored in any, and kept by its copies
+template<typename ValueType>
+struct any_value_info {
+    any_value_info(const ValueType &) {
+    }
+    const std::type_info *exception_type() const {
+        return nullptr;
+    }
+};
+
+template<>
+struct any_value_info<std::exception_ptr> {
+    any_value_info(const std::exception_ptr &ptr)
+        : exception_type_(exception_type_of(ptr)) {
+    }
+    const std::type_info *exception_type() const {
+        return exception_type_;
+    }
+    const std::type_info *exception_type_;
+};
+
+// Bytes of inline storage inside any, values whose holder fits in it
+// (and can be moved without throwing) are stored without heap allocation.
+#ifndef PROMISE_ANY_INLINE_SIZE
+#   define PROMISE_ANY_INLINE_SIZE (3 * sizeof(void *))
+#endif
+
 class any {
+public: // types (public so any_cast can be non-friend)
+    class placeholder;
+
+private: // inline storage
+    // one extra pointer for the vtable of the holder
+    struct storage_type {
+        alignas(void *) unsigned char data_[sizeof(void *) + PROMISE_ANY_INLINE_SIZE];
+    };
+
 public: // structors
     any()
         : content(0) {
@@ -59,22 +123,22 @@ public: // structors
 
     template<typename ValueType>
     any(const ValueType &value)
-        : content(new holder<typename std::remove_cvref<ValueType>::type>(value)) {
+        : content(create<typename std::remove_cvref<ValueType>::type>(storage_, value)) {
     }
 
     template<typename RET, typename ...ARG>
     any(RET value(ARG...))
-        : content(new holder<RET (*)(ARG...)>(value)) {
+        : content(create<RET (*)(ARG...)>(storage_, value)) {
     }
 
     any(const any &other)
-        : content(other.content ? other.content->clone() : 0) {
+        : content(other.content ? other.content->clone(&storage_) : 0) {
     }
 
     // Move constructor
-    any(any &&other)
-        : content(other.content) {
-        other.content = 0;
+    any(any &&other) noexcept
+        : content(0) {
+        move_from(other);
     }
 
     // Perfect forwarding of ValueType
@@ -82,17 +146,27 @@ public: // structors
     any(ValueType &&value
         , typename std::enable_if<!std::is_same<any &, ValueType>::value>::type* = nullptr // disable if value has type `any&`
         , typename std::enable_if<!std::is_const<ValueType>::value>::type* = nullptr) // disable if value has type `const ValueType&&`
-        : content(new holder<typename std::remove_cvref<ValueType>::type>(static_cast<ValueType &&>(value))) {
+        : content(create<typename std::remove_cvref<ValueType>::type>(storage_, static_cast<ValueType &&>(value))) {
     }
 
     ~any() {
-        if (content != nullptr) {
-            delete(content);
-        }
+        destroy();
     }
 
     any call(const any &arg) const {
-        return content ? content->call(arg) : any();
+        return content ? content->call(arg, false) : any();
+    }
+
+    // The values in arg may be moved to the parameters which are passed by value or
+    // by rvalue reference, arg should not be used again if the call is matched.
+    any call(any &&arg) const {
+        return content ? content->call(arg, true) : any();
+    }
+
+    // Returns false if call(arg) is known to fail with bad_any_cast, such as arg is an
+    // exception of other type, it is checked without rethrowing the exception.
+    bool may_call(const any &arg) const {
+        return content ? content->may_call(arg) : true;
     }
 
     template<typename ValueType,
@@ -115,7 +189,14 @@ public: // structors
 public: // modifiers
 
     any & swap(any & rhs) {
-        std::swap(content, rhs.content);
+        if (!is_inline() && !rhs.is_inline()) {
+            std::swap(content, rhs.content);
+        }
+        else if (this != &rhs) {
+            any tmp(std::move(rhs));
+            rhs = std::move(*this);
+            *this = std::move(tmp);
+        }
         return *this;
     }
 
@@ -130,19 +211,51 @@ public: // modifiers
         return *this;
     }
 
+    any & operator=(any && rhs) {
+        if (this != &rhs) {
+            destroy();
+            move_from(rhs);
+        }
+        return *this;
+    }
+
 public: // queries
     bool empty() const {
         return !content;
     }
     
     void clear() {
-        any().swap(*this);
+        destroy();
     }
 
     type_index type() const {
         return content ? content->type() : type_id<void>();
     }
 
+    // Dynamic type of the exception if the value is std::exception_ptr, or nullptr if it is not known
+    const std::type_info *exception_type() const {
+        return content ? content->exception_type() : nullptr;
+    }
+
+    // true if the value is stored in the inline buffer
+    bool is_inline() const {
+        return content != 0
+            && static_cast<const void *>(content) == static_cast<const void *>(&storage_);
+    }
+
+    // Bytes of the value type, with the values of std::vector<any> (the packed arguments),
+    // the memory owned by the value itself is not known.
+    size_t size() const {
+        if (content == 0)
+            return 0;
+        size_t bytes = content->size();
+        if (content->type() == type_id<std::vector<any>>()) {
+            for (const any &arg : static_cast<const holder<std::vector<any>> *>(content)->held)
+                bytes += arg.size();
+        }
+        return bytes;
+    }
+
 public: // types (public so any_cast can be non-friend)
     class placeholder {
     public: // structors
@@ -151,15 +264,36 @@ public: // types (public so any_cast can be non-friend)
 
     public: // queries
         virtual type_index type() const = 0;
-        virtual placeholder *clone() const = 0;
-        virtual any call(const any &arg) const = 0;
+        virtual placeholder *clone(storage_type *storage) const = 0;
+        virtual placeholder *move_to(storage_type *storage) = 0;
+        virtual any call(const any &arg, bool is_movable) const = 0;
+        virtual bool may_call(const any &arg) const = 0;
+        virtual const std::type_info *exception_type() const = 0;
+        virtual size_t size() const = 0;
     };
 
     template<typename ValueType>
-    class holder : public placeholder {
+    class holder : public placeholder, private any_value_info<ValueType> {
+        using info_type = any_value_info<ValueType>;
     public: // structors
         holder(const ValueType & value)
-            : held(value) {
+            : info_type(value)
+            , held(value) {
+        }
+
+        holder(ValueType && value)
+            : info_type(value)
+            , held(static_cast<ValueType &&>(value)) {
+        }
+
+        holder(const ValueType & value, const info_type &info)
+            : info_type(info)
+            , held(value) {
+        }
+
+        holder(ValueType && value, const info_type &info)
+            : info_type(info)
+            , held(static_cast<ValueType &&>(value)) {
         }
 
     public: // queries
@@ -167,12 +301,28 @@ public: // types (public so any_cast can be non-friend)
             return type_id<ValueType>();
         }
 
-        virtual placeholder * clone() const {
-            return new holder(held);
+        virtual placeholder * clone(storage_type *storage) const {
+            return any::create<ValueType>(*storage, held, static_cast<const info_type &>(*this));
+        }
+
+        virtual placeholder * move_to(storage_type *storage) {
+            return any::create<ValueType>(*storage, static_cast<ValueType &&>(held), static_cast<const info_type &>(*this));
+        }
+
+        virtual any call(const any &arg, bool is_movable) const {
+            return any_call(held, arg, is_movable);
+        }
+
+        virtual bool may_call(const any &arg) const {
+            return any_may_call(held, arg);
+        }
+
+        virtual const std::type_info *exception_type() const {
+            return info_type::exception_type();
         }
 
-        virtual any call(const any &arg) const {
-            return any_call(held, arg);
+        virtual size_t size() const {
+            return sizeof(ValueType);
         }
     public: // representation
         ValueType held;
@@ -180,8 +330,55 @@ public: // types (public so any_cast can be non-friend)
         holder & operator=(const holder &);
     };
 
+private: // implementation
+    template<typename ValueType>
+    static constexpr bool fits_inline() {
+        return sizeof(holder<ValueType>) <= sizeof(storage_type)
+            && alignof(holder<ValueType>) <= alignof(storage_type)
+            && std::is_nothrow_move_constructible<ValueType>::value;
+    }
+
+    template<typename ValueType, typename ...Args>
+    static placeholder *create(storage_type &storage, Args &&...args) {
+        return construct<ValueType>(std::integral_constant<bool, fits_inline<ValueType>()>(),
+            storage, static_cast<Args &&>(args)...);
+    }
+
+    template<typename ValueType, typename ...Args>
+    static placeholder *construct(std::true_type, storage_type &storage, Args &&...args) {
+        return new (&storage) holder<ValueType>(static_cast<Args &&>(args)...);
+    }
+
+    template<typename ValueType, typename ...Args>
+    static placeholder *construct(std::false_type, storage_type &, Args &&...args) {
+        return new holder<ValueType>(static_cast<Args &&>(args)...);
+    }
+
+    void move_from(any &other) {
+        if (other.is_inline()) {
+            content = other.content->move_to(&storage_);
+            other.destroy();
+        }
+        else {
+            content = other.content;
+            other.content = 0;
+        }
+    }
+
+    void destroy() {
+        if (is_inline()) {
+            content->~placeholder();
+        }
+        else if (content != 0) {
+            delete(content);
+        }
+        content = 0;
+    }
+
 public: // representation (public so any_cast can be non-friend)
     placeholder * content;
+private:
+    storage_type  storage_;
 };
 
 class bad_any_cast : public std::bad_cast {
@@ -228,7 +425,85 @@ inline ValueType any_cast(const any &operand) {
     return any_cast<nonref &>(const_cast<any &>(operand));
 }
 
+// The exception in arg, which is std::exception_ptr itself or the only argument in
+// std::vector<any> (as packed by reject(std::current_exception())), or nullptr if not found.
+inline const any *any_exception(const any &arg) {
+    if (arg.type() == type_id<std::exception_ptr>())
+        return &arg;
+    if (arg.type() == type_id<std::vector<any>>()) {
+        const std::vector<any> &args = any_cast<const std::vector<any> &>(arg);
+        if (args.size() == 1 && args.front().type() == type_id<std::exception_ptr>())
+            return &args.front();
+    }
+    return nullptr;
+}
+
+// Returns false if the exception of "type" is known not to be caught by "catch (const T &)".
+// The result is found by rethrowing ptr for the first time, and cached for each thread.
+template<typename T>
+inline bool exception_may_match(const std::type_info *type, const std::exception_ptr &ptr) {
+    if (type == nullptr)
+        return true;
+#ifdef __cpp_rtti
+    // The thrown any is matched by its value
+    if (*type == typeid(any))
+        return true;
+
+    struct Entry {
+        const std::type_info *type_;
+        bool                  matched_;
+    };
+    enum { kEntries = 8 };
+    static thread_local Entry s_entries[kEntries];
+    static thread_local size_t s_next = 0;
+    for (size_t i = 0; i < kEntries; ++i) {
+        if (s_entries[i].type_ == type)
+            return s_entries[i].matched_;
+    }
+
+    bool matched = false;
+    try {
+        std::rethrow_exception(ptr);
+    }
+    catch (const T &) {
+        matched = true;
+    }
+    catch (...) {
+    }
+    Entry &entry = s_entries[s_next++ % kEntries];
+    entry.type_ = type;
+    entry.matched_ = matched;
+    return matched;
+#else
+    (void)ptr;
+    return true;
+#endif
+}
+
+template<typename T>
+inline bool exception_may_match(const any &exception) {
+    return exception_may_match<T>(exception.exception_type(), any_cast<const std::exception_ptr &>(exception));
+}
+
+
+
+// Pass the value to the parameter of type ARG, it is moved if ARG is not a lvalue reference
+// and is_movable is true, or copied if is_movable is false.
+template<typename ARG, typename ValueType,
+    typename std::enable_if<std::is_lvalue_reference<ARG>::value>::type *dummy = nullptr>
+inline ValueType &any_forward(ValueType &value, bool is_movable) {
+    (void)is_movable;
+    return value;
+}
 
+template<typename ARG, typename ValueType,
+    typename std::enable_if<!std::is_lvalue_reference<ARG>::value>::type *dummy = nullptr>
+inline ValueType any_forward(ValueType &value, bool is_movable) {
+    if (is_movable)
+        return static_cast<ValueType &&>(value);
+    else
+        return value;
+}
 
 template<typename RET, typename NOCVR_ARGS, typename FUNC>
 struct any_call_t;
@@ -236,110 +511,164 @@ struct any_call_t;
 template<typename RET, typename ...NOCVR_ARGS, typename FUNC>
 struct any_call_t<RET, std::tuple<NOCVR_ARGS...>, FUNC> {
 
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg) {
-        return call(func, arg, std::make_index_sequence<sizeof...(NOCVR_ARGS)>());
+    static inline RET call(const typename FUNC::fun_type &func, const any &arg, bool is_movable = false) {
+        return call(func, arg, is_movable, std::make_index_sequence<sizeof...(NOCVR_ARGS)>());
     }
 
     template<size_t ...I>
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg, const std::index_sequence<I...> &) {
+    static inline RET call(const typename FUNC::fun_type &func, const any &arg, bool is_movable, const std::index_sequence<I...> &) {
         using nocvr_argument_type = std::tuple<NOCVR_ARGS...>;
+        using argument_type = typename FUNC::argument_type;
         using any_arguemnt_type = std::vector<any>;
 
-        const any_arguemnt_type &args = (arg.type() != type_id<any_arguemnt_type>()
-            ? any_arguemnt_type{ arg }
-            : any_cast<any_arguemnt_type &>(arg));
-        if(args.size() < sizeof...(NOCVR_ARGS))
+        // arg itself is the only argument if it is not std::vector<any>
+        any *args = const_cast<any *>(&arg);
+        size_t size = 1;
+        if (arg.type() == type_id<any_arguemnt_type>()) {
+            any_arguemnt_type &values = any_cast<any_arguemnt_type &>(arg);
+            args = values.data();
+            size = values.size();
+        }
+        if(size < sizeof...(NOCVR_ARGS))
             throw bad_any_cast(arg.type(), type_id<nocvr_argument_type>());
 
-        return func(any_cast<typename std::tuple_element<I, nocvr_argument_type>::type &>(args[I])...);
+        // All arguments are matched before any of them is moved
+        std::tuple<NOCVR_ARGS *...> matched{ &any_cast<typename std::tuple_element<I, nocvr_argument_type>::type &>(args[I])... };
+        (void)matched;
+        (void)is_movable;
+        return func(any_forward<typename std::tuple_element<I, argument_type>::type>(*std::get<I>(matched), is_movable)...);
+    }
+
+    static inline bool may_call(const any &) {
+        return true;
     }
 };
 
 template<typename RET, typename NOCVR_ARG, typename FUNC>
 struct any_call_t<RET, std::tuple<NOCVR_ARG>, FUNC> {
 
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg) {
+    static inline RET call(const typename FUNC::fun_type &func, const any &arg, bool is_movable = false) {
         using nocvr_argument_type = std::tuple<NOCVR_ARG>;
+        using argument_type = typename std::tuple_element<0, typename FUNC::argument_type>::type;
         using any_arguemnt_type = std::vector<any>;
 
-        if (arg.type() == type_id<std::exception_ptr>()) {
+        // Rethrown only if the type of exception may be matched
+        const any *exception = (is_exception_arg() ? any_exception(arg) : nullptr);
+        if (exception != nullptr && exception_may_match<NOCVR_ARG>(*exception)) {
             try {
-                std::rethrow_exception(any_cast<std::exception_ptr>(arg));
+                std::rethrow_exception(any_cast<std::exception_ptr>(*exception));
             }
             catch (const NOCVR_ARG &ex_arg) {
-                return func(const_cast<NOCVR_ARG &>(ex_arg));
+                // The exception object may be shared by other copies of exception_ptr
+                return func(any_forward<argument_type>(const_cast<NOCVR_ARG &>(ex_arg), false));
+            }
+            catch (...) {
             }
         }
 
         if (type_id<NOCVR_ARG>() == type_id<any_arguemnt_type>()) {
-            return func(any_cast<NOCVR_ARG &>(arg));
+            return func(any_forward<argument_type>(any_cast<NOCVR_ARG &>(arg), is_movable));
         }
 
-        const any_arguemnt_type &args = (arg.type() != type_id<any_arguemnt_type>()
-            ? any_arguemnt_type{ arg }
-            : any_cast<any_arguemnt_type &>(arg));
-        if(args.size() < 1)
-            throw bad_any_cast(arg.type(), type_id<nocvr_argument_type>());
-        //printf("[%s] [%s]\n", args.front().type().name(), type_id<NOCVR_ARG>().name());
-        return func(any_cast<NOCVR_ARG &>(args.front()));
+        any *value = const_cast<any *>(&arg);
+        if (arg.type() == type_id<any_arguemnt_type>()) {
+            any_arguemnt_type &args = any_cast<any_arguemnt_type &>(arg);
+            if(args.size() < 1)
+                throw bad_any_cast(arg.type(), type_id<nocvr_argument_type>());
+            value = &args.front();
+        }
+        //printf("[%s] [%s]\n", value->type().name(), type_id<NOCVR_ARG>().name());
+        return func(any_forward<argument_type>(any_cast<NOCVR_ARG &>(*value), is_movable));
+    }
+
+    static inline bool may_call(const any &arg) {
+        const any *exception = (is_exception_arg() ? any_exception(arg) : nullptr);
+        return exception == nullptr || exception_may_match<NOCVR_ARG>(*exception);
+    }
+
+    // The parameter of exception_ptr or std::vector<any> is matched without rethrowing
+    static constexpr bool is_exception_arg() {
+        return !std::is_same<NOCVR_ARG, std::exception_ptr>::value
+            && !std::is_same<NOCVR_ARG, std::vector<any>>::value;
     }
 };
 
 
 template<typename RET, typename FUNC>
 struct any_call_t<RET, std::tuple<any>, FUNC> {
-    static inline RET call(const typename FUNC::fun_type &func, const any &arg) {
+    static inline RET call(const typename FUNC::fun_type &func, const any &arg, bool is_movable = false) {
+        using argument_type = typename std::tuple_element<0, typename FUNC::argument_type>::type;
         using any_arguemnt_type = std::vector<any>;
         if (arg.type() != type_id<any_arguemnt_type>())
-            return (func(const_cast<any &>(arg)));
+            return (func(any_forward<argument_type>(const_cast<any &>(arg), is_movable)));
 
         any_arguemnt_type &args = any_cast<any_arguemnt_type &>(arg);
         if (args.size() == 0) {
             any empty;
-            return (func(empty));
+            return (func(any_forward<argument_type>(empty, true)));
         }
         else if(args.size() == 1)
-            return (func(args.front()));
+            return (func(any_forward<argument_type>(args.front(), is_movable)));
         else
-            return (func(const_cast<any &>(arg)));
+            return (func(any_forward<argument_type>(const_cast<any &>(arg), is_movable)));
+    }
+
+    static inline bool may_call(const any &) {
+        return true;
     }
 };
 
 template<typename RET, typename NOCVR_ARGS, typename FUNC>
 struct any_call_with_ret_t {
-    static inline any call(const typename FUNC::fun_type &func, const any &arg) {
-        return any_call_t<RET, NOCVR_ARGS, FUNC>::call(func, arg);
+    static inline any call(const typename FUNC::fun_type &func, const any &arg, bool is_movable) {
+        return any_call_t<RET, NOCVR_ARGS, FUNC>::call(func, arg, is_movable);
     }
 };
 
 template<typename NOCVR_ARGS, typename FUNC>
 struct any_call_with_ret_t<void, NOCVR_ARGS, FUNC> {
-    static inline any call(const typename FUNC::fun_type &func, const any &arg) {
-        any_call_t<void, NOCVR_ARGS, FUNC>::call(func, arg);
+    static inline any call(const typename FUNC::fun_type &func, const any &arg, bool is_movable) {
+        any_call_t<void, NOCVR_ARGS, FUNC>::call(func, arg, is_movable);
         return any();
     }
 };
 
 template<typename FUNC>
-inline any any_call(const FUNC &func, const any &arg) {
+inline any any_call(const FUNC &func, const any &arg, bool is_movable = false) {
     using func_t = call_traits<FUNC>;
     using nocvr_argument_type = typename tuple_remove_cvref<typename func_t::argument_type>::type;
     const auto &stdFunc = func_t::to_std_function(func);
     if (!stdFunc)
         return any();
 
-    if (arg.type() == type_id<std::exception_ptr>()) {
+    // Rethrown only if the exception may be an any
+    const any *exception = any_exception(arg);
+    if (exception != nullptr && exception_may_match<any>(*exception)) {
         try {
-            std::rethrow_exception(any_cast<std::exception_ptr>(arg));
+            std::rethrow_exception(any_cast<std::exception_ptr>(*exception));
         }
         catch (const any &ex_arg) {
-            return any_call_with_ret_t<typename call_traits<FUNC>::result_type, nocvr_argument_type, func_t>::call(stdFunc, ex_arg);
+            // The exception object may be shared by other copies of exception_ptr
+            return any_call_with_ret_t<typename call_traits<FUNC>::result_type, nocvr_argument_type, func_t>::call(stdFunc, ex_arg, false);
         }
         catch (...) {
         }
     }
 
-    return any_call_with_ret_t<typename call_traits<FUNC>::result_type, nocvr_argument_type, func_t>::call(stdFunc, arg);
+    return any_call_with_ret_t<typename call_traits<FUNC>::result_type, nocvr_argument_type, func_t>::call(stdFunc, arg, is_movable);
+}
+
+template<typename FUNC>
+inline bool any_may_call(const FUNC &func, const any &arg) {
+    using func_t = call_traits<FUNC>;
+    using nocvr_argument_type = typename tuple_remove_cvref<typename func_t::argument_type>::type;
+    (void)func;
+
+    // The thrown any is passed as the argument
+    const any *exception = any_exception(arg);
+    if (exception != nullptr && exception_may_match<any>(*exception))
+        return true;
+    return any_call_t<typename func_t::result_type, nocvr_argument_type, func_t>::may_call(arg);
 }
 
 using pm_any = any;
@@ -41,6 +41,7 @@
 #include <type_traits>
 #include <functional>
 #include <tuple>
+#include <utility>
 
 namespace promise {
 
@@ -138,7 +139,7 @@ struct call_traits_impl<RET(T::*)(ARG...), false> {
 
     static fun_type to_std_function(T &obj, RET(T::*func)(ARG...)) {
         return [obj, func](ARG...arg) -> RET {
-            return (const_cast<typename std::remove_const<T>::type &>(obj).*func)(arg...);
+            return (const_cast<typename std::remove_const<T>::type &>(obj).*func)(std::forward<ARG>(arg)...);
         };
     }
 
@@ -157,7 +158,7 @@ struct call_traits_impl<RET(T::*)(ARG...) const, false> {
 
     static fun_type to_std_function(T &obj, RET(T:: *func)(ARG...) const) {
         return [obj, func](ARG...arg) -> RET {
-            return (obj.*func)(arg...);
+            return (obj.*func)(std::forward<ARG>(arg)...);
         };
     }
 
@@ -0,0 +1,317 @@
+#pragma once
+#ifndef INC_CHANNEL_HPP_
+#define INC_CHANNEL_HPP_
+
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Bounded channel of values of type T, for producers of more than one value.
+//
+//   send(value)       resolves when the value is put into the buffer or taken by a receiver,
+//                     it is pending while the buffer is full, so producers are slowed down
+//                     by the consumers.
+//   receive()         resolves with the next value (as T).
+//   receiveSome(max)  resolves with std::vector<T> of 1 to "max" values, all the buffered
+//                     values are taken by one wakeup.
+//   close()           no more values can be sent, the waiting senders are rejected, and
+//                     receivers are rejected after the buffered values are taken.
+//                     The rejected reason is ChannelClosedError as std::exception_ptr, so it
+//                     is matched by the handlers of its base classes too.
+//
+// The values are buffered in a ring of "capacity" slots, which is allocated once.
+// If capacity is 0, send() is resolved when a receiver takes the value.
+// Copies of the channel share the same buffer, and all the functions can be called
+// in any thread. The promises are settled after the mutex is unlocked.
+//
+
+#include "promise.hpp"
+#include <new>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+#include <exception>
+#include <type_traits>
+
+namespace promise {
+
+class ChannelClosedError : public std::runtime_error {
+public:
+    ChannelClosedError()
+        : std::runtime_error("channel closed") {
+    }
+};
+
+// Fixed size ring buffer of the channel
+template<typename T>
+class ChannelRing {
+public:
+    explicit ChannelRing(size_t capacity)
+        : slots_(capacity > 0 ? new Slot[capacity] : nullptr)
+        , capacity_(capacity)
+        , head_(0)
+        , size_(0) {
+    }
+
+    ~ChannelRing() {
+        while (size_ > 0)
+            pop();
+    }
+
+    size_t size() const { return size_; }
+    bool full() const { return size_ == capacity_; }
+
+    void push(T &&value) {
+        size_t index = head_ + size_;
+        if (index >= capacity_)
+            index -= capacity_;
+        new (&slots_[index]) T(std::move(value));
+        ++size_;
+    }
+
+    T &front() {
+        return *reinterpret_cast<T *>(&slots_[head_]);
+    }
+
+    void pop() {
+        front().~T();
+        if (++head_ == capacity_)
+            head_ = 0;
+        --size_;
+    }
+
+private:
+    using Slot = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+    ChannelRing(const ChannelRing &) = delete;
+    ChannelRing &operator=(const ChannelRing &) = delete;
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t                  capacity_;
+    size_t                  head_;
+    size_t                  size_;
+};
+
+template<typename T>
+class AsyncChannel {
+public:
+    explicit AsyncChannel(size_t capacity)
+        : state_(pm_make_shared<State>(capacity)) {
+    }
+
+    Promise send(T value) const {
+        std::shared_ptr<State> state = state_;
+#if PROMISE_MULTITHREAD
+        std::unique_lock<std::mutex> lock(state->mutex_);
+#endif
+        if (state->isClosed_)
+            return reject(std::make_exception_ptr(ChannelClosedError()));
+
+        // The buffer is empty if there are waiting receivers
+        if (state->receivers_.size() > 0) {
+            Receiver receiver = std::move(state->receivers_.front());
+            state->receivers_.pop_front();
+#if PROMISE_MULTITHREAD
+            lock.unlock();
+#endif
+            if (receiver.max_ == 0)
+                receiver.promise_.resolve(std::move(value));
+            else
+                receiver.promise_.resolve(std::vector<T>(1, std::move(value)));
+            return resolve();
+        }
+
+        if (!state->buffer_.full()) {
+            state->buffer_.push(std::move(value));
+            return resolve();
+        }
+
+        Promise promise = newPromise();
+        state->senders_.push_back(Sender{ std::move(value), promise });
+        return promise;
+    }
+
+    // Returns false if the value can not be sent now, value is not moved in this case
+    bool trySend(T &value) const {
+        Receiver receiver;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+            if (state_->isClosed_)
+                return false;
+            if (state_->receivers_.size() == 0) {
+                if (state_->buffer_.full())
+                    return false;
+                state_->buffer_.push(std::move(value));
+                return true;
+            }
+            receiver = std::move(state_->receivers_.front());
+            state_->receivers_.pop_front();
+        }
+        if (receiver.max_ == 0)
+            receiver.promise_.resolve(std::move(value));
+        else
+            receiver.promise_.resolve(std::vector<T>(1, std::move(value)));
+        return true;
+    }
+
+    Promise receive() const {
+        return receive(0);
+    }
+
+    Promise receiveSome(size_t max) const {
+        return receive(max == 0 ? 1 : max);
+    }
+
+    // No more values can be sent after close
+    void close() const {
+        std::deque<Sender>   senders;
+        std::deque<Receiver> receivers;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+            if (state_->isClosed_)
+                return;
+            state_->isClosed_ = true;
+            senders.swap(state_->senders_);
+            receivers.swap(state_->receivers_);
+        }
+        std::exception_ptr closed = std::make_exception_ptr(ChannelClosedError());
+        for (Sender &sender : senders)
+            sender.promise_.reject(closed);
+        for (Receiver &receiver : receivers)
+            receiver.promise_.reject(closed);
+    }
+
+    bool isClosed() const {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+        return state_->isClosed_;
+    }
+
+    // Count of the buffered values
+    size_t size() const {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+        return state_->buffer_.size();
+    }
+
+private:
+    struct Sender {
+        T       value_;
+        Promise promise_;
+    };
+
+    struct Receiver {
+        Promise promise_;
+        size_t  max_;   // 0 for receive(), or the max count of receiveSome()
+    };
+
+    struct State {
+        explicit State(size_t capacity)
+            : buffer_(capacity)
+            , isClosed_(false) {
+        }
+
+        ChannelRing<T>       buffer_;
+        std::deque<Sender>   senders_;    // waiting for space in the buffer
+        std::deque<Receiver> receivers_;  // waiting for values
+        bool                 isClosed_;
+#if PROMISE_MULTITHREAD
+        std::mutex           mutex_;
+#endif
+    };
+
+    // Take one value, from the buffer or from the first waiting sender if the buffer is empty.
+    // The sender whose value is taken or moved into the buffer is added to "resolved".
+    static T take(State &state, std::vector<Promise> &resolved) {
+        if (state.buffer_.size() == 0) {
+            Sender &sender = state.senders_.front();
+            T value(std::move(sender.value_));
+            resolved.push_back(std::move(sender.promise_));
+            state.senders_.pop_front();
+            return value;
+        }
+
+        T value(std::move(state.buffer_.front()));
+        state.buffer_.pop();
+        if (state.senders_.size() > 0) {
+            Sender &sender = state.senders_.front();
+            state.buffer_.push(std::move(sender.value_));
+            resolved.push_back(std::move(sender.promise_));
+            state.senders_.pop_front();
+        }
+        return value;
+    }
+
+    Promise receive(size_t max) const {
+        std::shared_ptr<State> state = state_;
+        std::vector<Promise> resolved;  // senders resolved after unlocked
+        Promise promise;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(state->mutex_);
+#endif
+            size_t available = state->buffer_.size() + state->senders_.size();
+            if (available == 0) {
+                if (state->isClosed_)
+                    return reject(std::make_exception_ptr(ChannelClosedError()));
+                promise = newPromise();
+                state->receivers_.push_back(Receiver{ promise, max });
+                return promise;
+            }
+
+            if (max == 0) {
+                promise = resolve(take(*state, resolved));
+            }
+            else {
+                std::vector<T> values;
+                values.reserve(std::min(max, available));
+                while (values.size() < max
+                       && state->buffer_.size() + state->senders_.size() > 0)
+                    values.push_back(take(*state, resolved));
+                promise = resolve(std::move(values));
+            }
+        }
+        for (Promise &sender : resolved)
+            sender.resolve();
+        return promise;
+    }
+
+    std::shared_ptr<State> state_;
+};
+
+} // namespace promise
+
+#endif
@@ -0,0 +1,292 @@
+#pragma once
+#ifndef INC_PM_COROUTINE_HPP_
+#define INC_PM_COROUTINE_HPP_
+
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// C++20 coroutine support, only available if the compiler supports coroutines.
+//
+//   Promise, Defer and TypedPromise<T> can be awaited by co_await --
+//     co_await promise            returns the resolved value as "any"
+//     co_await typedPromise       returns T
+//   the rejected reason is thrown as exception (std::exception_ptr is rethrown,
+//   and other reasons are thrown as "any").
+//
+//   Promise and TypedPromise<T> can be used as the return type of a coroutine --
+//     Promise          resolved by "co_return value;", it must return a value
+//                      ("co_return;" is not supported, use TypedPromise<void> instead)
+//     TypedPromise<T>  resolved by "co_return value;", or "co_return;" if T is void
+//   and rejected if an exception is thrown out of the coroutine.
+//
+// The awaiting coroutine is resumed in the thread and the call stack where the promise
+// is resolved, or continues without suspending if the promise has already been settled.
+//
+
+#include "typed_promise.hpp"
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#   if __has_include(<coroutine>)
+#       define PROMISE_HAS_COROUTINE 1
+#   endif
+#endif
+
+#ifndef PROMISE_HAS_COROUTINE
+#   define PROMISE_HAS_COROUTINE 0
+#endif
+
+#if PROMISE_HAS_COROUTINE
+#include <coroutine>
+#include <atomic>
+
+namespace promise {
+
+// Resume the coroutine when settled.
+// If settled before await_suspend returned, it continues without suspending.
+struct CoroutineResumer {
+    CoroutineResumer()
+        : settled_(false) {
+    }
+
+    void settle() {
+        if (settled_.exchange(true, std::memory_order_acq_rel))
+            handle_.resume();
+    }
+
+    bool suspendIfNotSettled() {
+        return !settled_.exchange(true, std::memory_order_acq_rel);
+    }
+
+    std::coroutine_handle<> handle_;
+    std::atomic<bool>       settled_;
+};
+
+[[noreturn]] inline void throwRejected(const any &reason) {
+    const any *exception = any_exception(reason);
+    if (exception != nullptr)
+        std::rethrow_exception(any_cast<std::exception_ptr>(*exception));
+    throw reason;
+}
+
+// Awaiter of Promise, it is same as then() with the callbacks to resume the coroutine,
+// and the resolved value is passed to the tasks after it
+struct PromiseAwaiter: public CoroutineResumer {
+    explicit PromiseAwaiter(const Promise &promise)
+        : promise_(promise)
+        , rejected_(false) {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        // This awaiter may be destroyed when the coroutine is resumed inside then()
+        Promise promise = promise_;
+        promise.then([this](const any &arg) -> any {
+            value_ = arg;
+            settle();
+            // "arg" is owned by the promise chain, still valid after the awaiter is destroyed
+            return arg;
+        }, [this](const any &arg) {
+            value_ = arg;
+            rejected_ = true;
+            settle();
+        });
+        return suspendIfNotSettled();
+    }
+
+    any await_resume() {
+        if (rejected_)
+            throwRejected(value_);
+        return std::move(value_);
+    }
+
+    Promise promise_;
+    any     value_;
+    bool    rejected_;
+};
+
+template<typename T>
+struct TypedAwaiter: public CoroutineResumer {
+    explicit TypedAwaiter(const TypedPromise<T> &promise)
+        : promise_(promise)
+        , rejected_(false) {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        std::shared_ptr<TypedState<T>> state = promise_.state_;
+        state->addContinuation(pm_make_shared<Continuation>(this));
+        return suspendIfNotSettled();
+    }
+
+    T await_resume() {
+        if (rejected_)
+            throwRejected(reason_);
+        return value_.take();
+    }
+
+private:
+    struct Continuation : public TypedContinuation<T> {
+        explicit Continuation(TypedAwaiter *awaiter)
+            : awaiter_(awaiter) {
+        }
+
+        virtual void onResolved(TypedState<T> &state) {
+            awaiter_->value_.copyFrom(state.value());
+            awaiter_->settle();
+        }
+
+        virtual void onRejected(const any &reason) {
+            awaiter_->reason_ = reason;
+            awaiter_->rejected_ = true;
+            awaiter_->settle();
+        }
+
+        TypedAwaiter *awaiter_;
+    };
+
+    TypedPromise<T> promise_;
+    TypedValue<T>   value_;
+    any             reason_;
+    bool            rejected_;
+};
+
+inline PromiseAwaiter operator co_await(const Promise &promise) {
+    return PromiseAwaiter(promise);
+}
+
+inline PromiseAwaiter operator co_await(const Defer &defer) {
+    return PromiseAwaiter(defer.getPromise());
+}
+
+template<typename T>
+inline TypedAwaiter<T> operator co_await(const TypedPromise<T> &promise) {
+    return TypedAwaiter<T>(promise);
+}
+
+// promise_type of the coroutine which returns Promise.
+// It has only return_value(), since a promise_type can not have both return_value() and return_void().
+struct PromiseCoroutine {
+    PromiseCoroutine()
+        : promise_(newPromise()) {
+    }
+
+    Promise get_return_object() {
+        return promise_;
+    }
+
+    std::suspend_never initial_suspend() noexcept {
+        return {};
+    }
+
+    std::suspend_never final_suspend() noexcept {
+        return {};
+    }
+
+    template<typename V>
+    void return_value(V &&value) {
+        promise_.resolve(std::forward<V>(value));
+    }
+
+    void unhandled_exception() {
+        // same as the exception thrown in then(), the exception_ptr is not wrapped as argument list
+        promise_.reject(any(std::current_exception()));
+    }
+
+    Promise promise_;
+};
+
+// promise_type of the coroutine which returns TypedPromise<T>
+template<typename T>
+struct typed_coroutine_return {
+    typed_coroutine_return()
+        : state_(pm_make_shared<TypedState<T>>()) {
+    }
+
+    template<typename V>
+    void return_value(V &&value) {
+        state_->resolve(std::forward<V>(value));
+    }
+
+    std::shared_ptr<TypedState<T>> state_;
+};
+
+template<>
+struct typed_coroutine_return<void> {
+    typed_coroutine_return()
+        : state_(pm_make_shared<TypedState<void>>()) {
+    }
+
+    void return_void() {
+        state_->resolve();
+    }
+
+    std::shared_ptr<TypedState<void>> state_;
+};
+
+template<typename T>
+struct TypedCoroutinePromise : public typed_coroutine_return<T> {
+    TypedPromise<T> get_return_object() {
+        return TypedPromise<T>(this->state_);
+    }
+
+    std::suspend_never initial_suspend() noexcept {
+        return {};
+    }
+
+    std::suspend_never final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        this->state_->reject(std::current_exception());
+    }
+};
+
+} // namespace promise
+
+template<typename ...ARGS>
+struct std::coroutine_traits<promise::Promise, ARGS...> {
+    using promise_type = promise::PromiseCoroutine;
+};
+
+template<typename T, typename ...ARGS>
+struct std::coroutine_traits<promise::TypedPromise<T>, ARGS...> {
+    using promise_type = promise::TypedCoroutinePromise<T>;
+};
+
+#endif // PROMISE_HAS_COROUTINE
+
+#endif
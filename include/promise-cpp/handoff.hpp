@@ -0,0 +1,320 @@
+#pragma once
+#ifndef INC_HANDOFF_HPP_
+#define INC_HANDOFF_HPP_
+
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Lock free handoff of the defers to be settled in a consumer thread, such as an event loop.
+//
+//   MpscQueue<T>  multi-producer/single-consumer queue, push() never blocks the producers,
+//                 pop() and consume() are called in the consumer thread only.
+//
+//   Handoff       queue of "resolve the defer with a value", "reject the defer with a reason"
+//                 and "call a function", which can be pushed in any thread.
+//                 The wakeup function is called only when the first item of a batch is pushed,
+//                 then the consumer thread calls drain() to settle all the items of the batch.
+//
+// The defers are settled without creating new promises, the order of the pushed items is kept.
+//
+
+#include "promise.hpp"
+#include <new>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <type_traits>
+
+namespace promise {
+
+// Intrusive MPSC queue by Dmitry Vyukov, the nodes are allocated by the allocator of promise
+template<typename T>
+class MpscQueue {
+public:
+    MpscQueue()
+        : head_(&stub_)
+        , tail_(&stub_) {
+        stub_.next_.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~MpscQueue() {
+        while (consume([](T &) {}))
+            ;
+    }
+
+    // Called in any thread
+    template<typename ...ARGS>
+    void emplace(ARGS &&...args) {
+        void *memory = getAllocator().allocate(sizeof(Node));
+        Node *node = new (memory) Node();
+        try {
+            new (&node->storage_) T(std::forward<ARGS>(args)...);
+        }
+        catch (...) {
+            node->~Node();
+            getAllocator().deallocate(memory, sizeof(Node));
+            throw;
+        }
+        pushNode(node);
+    }
+
+    void push(T &&value) {
+        emplace(std::move(value));
+    }
+
+    void push(const T &value) {
+        emplace(value);
+    }
+
+    // Called in the consumer thread, func(T &) is called with the first item before it is removed.
+    // Returns false if the queue is empty, or the first item is being pushed by other thread.
+    template<typename FUNC>
+    bool consume(FUNC &&func) {
+        Node *node = popNode();
+        if (node == nullptr)
+            return false;
+        struct Release {
+            ~Release() {
+                reinterpret_cast<T *>(&node_->storage_)->~T();
+                node_->~Node();
+                getAllocator().deallocate(node_, sizeof(Node));
+            }
+            Node *node_;
+        } release = { node };
+        func(*reinterpret_cast<T *>(&node->storage_));
+        return true;
+    }
+
+    bool pop(T &value) {
+        return consume([&value](T &item) {
+            value = std::move(item);
+        });
+    }
+
+    // Called in the consumer thread, an item being pushed is counted as not empty.
+    // It is ordered with the push() sequenced before other seq_cst operations of the producer.
+    bool empty() const {
+        if (tail_ != &stub_)
+            return false;
+        return stub_.next_.load() == nullptr
+            && head_.load() == &stub_;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node *> next_;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+    };
+
+    void pushNode(Node *node) {
+        node->next_.store(nullptr, std::memory_order_relaxed);
+        Node *prev = head_.exchange(node);
+        prev->next_.store(node);
+    }
+
+    Node *popNode() {
+        Node *tail = tail_;
+        Node *next = tail->next_.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (next == nullptr)
+                return nullptr;
+            tail_ = next;
+            tail = next;
+            next = next->next_.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail_ = next;
+            return tail;
+        }
+        if (tail != head_.load(std::memory_order_acquire))
+            return nullptr;     // the next node is being pushed
+        pushNode(&stub_);
+        next = tail->next_.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail_ = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    std::atomic<Node *> head_;     // pushed by producers
+    Node               *tail_;     // popped by the consumer
+    Node                stub_;
+};
+
+class Handoff {
+public:
+    // wakeup() is called in the producer thread when the first item of a batch is pushed,
+    // it should make the consumer thread call drain() later.
+    explicit Handoff(const std::function<void()> &wakeup)
+        : wakeup_(wakeup)
+        , isSignaled_(false) {
+    }
+
+    // Resolve the defer with value in the consumer thread
+    void resolve(const Defer &defer, any &&value = any()) {
+        queue_.emplace(Item::kResolve, defer, std::move(value));
+        signal();
+    }
+
+    void resolve(const Defer &defer, const any &value) {
+        resolve(defer, any(value));
+    }
+
+    // Reject the defer with reason in the consumer thread
+    void reject(const Defer &defer, any &&reason) {
+        queue_.emplace(Item::kReject, defer, std::move(reason));
+        signal();
+    }
+
+    void reject(const Defer &defer, const any &reason) {
+        reject(defer, any(reason));
+    }
+
+    // Call func in the consumer thread
+    void post(const std::function<void()> &func) {
+        queue_.emplace(func);
+        signal();
+    }
+
+    // Called in the consumer thread, settles at most "max" items.
+    // Returns false if there are items left, drain() should be called again since
+    // they will not be signaled.
+    bool drain(size_t max = std::numeric_limits<size_t>::max()) {
+        for (size_t count = 0; count < max; ++count) {
+            if (!queue_.consume([](Item &item) { item.run(); })) {
+                // Signaled again by the items pushed after it is cleared,
+                // and the items pushed before are found by empty()
+                isSignaled_.store(false);
+                return queue_.empty();
+            }
+        }
+        return false;
+    }
+
+    // Called in the consumer thread, rejects all the defers with reason, and drops the functions
+    void clear(const any &reason) {
+        while (!queue_.empty()) {
+            if (!queue_.consume([&reason](Item &item) { item.cancel(reason); }))
+                std::this_thread::yield();  // the item is being pushed
+        }
+        isSignaled_.store(false);
+    }
+
+    // Called in the consumer thread. If it returns true, the next item pushed is signaled,
+    // so the consumer can wait for the wakeup.
+    bool empty() {
+        if (!queue_.empty())
+            return false;
+        // The flag may be left set by an item which was consumed before it was signaled
+        isSignaled_.store(false);
+        return queue_.empty();
+    }
+
+private:
+    struct Item {
+        enum Kind {
+            kResolve,
+            kReject,
+            kCall
+        };
+
+        Item(Kind kind, const Defer &defer, any &&value)
+            : kind_(kind)
+            , value_(std::move(value)) {
+            new (&defer_) Defer(defer);
+        }
+
+        explicit Item(const std::function<void()> &func)
+            : kind_(kCall) {
+            new (&func_) std::function<void()>(func);
+        }
+
+        ~Item() {
+            if (kind_ == kCall)
+                func_.~function();
+            else
+                defer_.~Defer();
+        }
+
+        void run() {
+            if (kind_ == kResolve)
+                defer_.resolve(std::move(value_));
+            else if (kind_ == kReject)
+                defer_.reject(std::move(value_));
+            else {
+                try {
+                    func_();
+                }
+                catch (...) {
+                    // Same as the exception thrown in then(), it goes to onUncaughtException
+                    promise::reject(std::current_exception());
+                }
+            }
+        }
+
+        void cancel(const any &reason) {
+            if (kind_ != kCall)
+                defer_.reject(reason);
+        }
+
+        Kind kind_;
+        union {
+            Defer                 defer_;
+            std::function<void()> func_;
+        };
+        any  value_;
+
+    private:
+        Item(const Item &) = delete;
+        Item &operator=(const Item &) = delete;
+    };
+
+    // The first producer after drain() wakes up the consumer
+    void signal() {
+        if (!isSignaled_.exchange(true))
+            wakeup_();
+    }
+
+    Handoff(const Handoff &) = delete;
+    Handoff &operator=(const Handoff &) = delete;
+
+    MpscQueue<Item>       queue_;
+    std::function<void()> wakeup_;
+    std::atomic<bool>     isSignaled_;
+};
+
+} // namespace promise
+
+#endif
@@ -0,0 +1,302 @@
+#pragma once
+#ifndef INC_PM_INSTRUMENT_HPP_
+#define INC_PM_INSTRUMENT_HPP_
+
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Counters and hooks of the promise runtime, for monitoring in production.
+//
+// Define PROMISE_INSTRUMENT=1 (for both the library and its users) to enable them,
+// otherwise all the instrumentation code is removed at compile time,
+// getStats() returns zeros, the hook is never called and no promise is tracked.
+//
+// The counters are sharded by threads to avoid contention, getStats() returns
+// the sum of the shards, which may be slightly inconsistent while other threads are running.
+//
+// The registry of live promises tracks one in every N promises set by setLeakSampling(),
+// with the creation site, age, pending tasks and value size, to find the chains which are never settled.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifndef PROMISE_INSTRUMENT
+#   define PROMISE_INSTRUMENT 0
+#endif
+
+namespace promise {
+
+struct Stats {
+    int64_t livePromises;        // internal promise objects (PromiseHolder) alive
+    int64_t liveTasks;           // callbacks added by then(), fail(), ... and not released
+    int64_t pendingTasks;        // callbacks waiting in the chains of unsettled promises
+    int64_t joins;               // promises joined to the promises returned by callbacks
+    int64_t maxForwardHops;      // max count of joined promises walked to find the chain, a large value may be a leak
+    int64_t uncaughtRejections;  // rejected promises released without being handled
+    int64_t lockContentions;     // locks of the promise mutexes which had to wait for other threads
+};
+
+enum class InstrumentEvent {
+    kCreate,             // a promise is created
+    kSettle,             // resolved or rejected by Defer
+    kContinuationStart,  // a callback is going to be called
+    kContinuationEnd     // the callback returned or threw
+};
+
+// "id" is the address of the internal promise object, it may be reused after the promise is released.
+// The hook is called in the thread of the event, it should be fast and must not create promises.
+using InstrumentHook = void (*)(InstrumentEvent event, const void *id,
+                                std::chrono::steady_clock::time_point time, void *userData);
+
+PROMISE_API Stats getStats();
+// Set the hook at start up, or nullptr to remove it.
+PROMISE_API void setInstrumentHook(InstrumentHook hook, void *userData = nullptr);
+
+// Creation site of the promises, see PROMISE_LEAK_SITE()
+struct LeakSite {
+    const char *file;
+    int         line;
+    const char *function;
+};
+
+enum class LiveState {
+    kPending,
+    kResolved,
+    kRejected,
+    kJoined     // joined to the promise returned by a callback, which holds the tasks now
+};
+
+struct LivePromise {
+    const void                          *id;            // address of the internal promise object
+    const LeakSite                      *site;          // the innermost PROMISE_LEAK_SITE() when created, or nullptr
+    const void                          *caller;        // return address of newPromise() or newLocalPromise()
+    std::chrono::steady_clock::duration  age;
+    LiveState                            state;
+    size_t                               pendingTasks;  // callbacks waiting in the chain
+    size_t                               valueSize;     // bytes of the resolved or rejected value
+};
+
+// Tracked promises created at the same site and caller
+struct LivePromiseSite {
+    const LeakSite                      *site;
+    const void                          *caller;
+    size_t                               count;
+    std::chrono::steady_clock::duration  oldestAge;
+    size_t                               pendingTasks;
+    size_t                               valueSize;
+};
+
+// Track one in every "rate" promises created from now on, 0 (the default) to stop tracking new promises.
+PROMISE_API void setLeakSampling(uint32_t rate);
+// Up to "limit" tracked promises, the oldest first.
+PROMISE_API std::vector<LivePromise> getLivePromises(size_t limit = 20, bool pendingOnly = true);
+// Up to "limit" sites of the tracked promises, the site with the oldest promise first.
+PROMISE_API std::vector<LivePromiseSite> getLivePromiseSites(size_t limit = 20, bool pendingOnly = true);
+// Report of the tracked promises in the text format of the gperftools heap profile, one entry for each caller,
+// with the internal objects and values as the bytes, scaled by the sampling rate.
+// It can be read by "pprof --text program file", the mapped libraries are added on Linux.
+PROMISE_API std::string getLeakProfile(bool pendingOnly = true);
+
+namespace instrument {
+
+enum Counter {
+    kLivePromises,
+    kLiveTasks,
+    kPendingTasks,
+    kJoins,
+    kUncaughtRejections,
+    kLockContentions,
+    kCounterCount
+};
+
+#if PROMISE_INSTRUMENT
+enum { kShardCount = 16 };
+
+struct alignas(64) Shard {
+    std::atomic<int64_t> values_[kCounterCount];
+};
+
+PROMISE_API Shard *shards();
+PROMISE_API std::atomic<int64_t> &maxForwardHops();
+PROMISE_API std::atomic<InstrumentHook> &hook();
+PROMISE_API std::atomic<void *> &hookData();
+
+inline unsigned currentShardIndex() {
+    static std::atomic<unsigned> s_next(0);
+    static thread_local unsigned s_index = s_next.fetch_add(1, std::memory_order_relaxed) % kShardCount;
+    return s_index;
+}
+
+inline Shard &currentShard() {
+    static thread_local Shard *s_shard = &shards()[currentShardIndex()];
+    return *s_shard;
+}
+
+// Entry of a tracked promise in the registry, the atomic members are copied from the
+// promise with its lock held, and read by the queries with the lock of the registry shard.
+struct LiveRecord {
+    LiveRecord                           *prev_;
+    LiveRecord                           *next_;
+    unsigned                              shard_;
+    const void                           *id_;
+    const LeakSite                       *site_;
+    const void                           *caller_;
+    uint32_t                              rate_;          // sampling rate when it is tracked
+    std::chrono::steady_clock::time_point created_;
+    std::atomic<int>                      state_;         // LiveState
+    std::atomic<size_t>                   pendingTasks_;
+    std::atomic<size_t>                   valueSize_;
+};
+
+struct RegistryShard;
+
+PROMISE_API RegistryShard *registryShards();
+PROMISE_API std::atomic<uint32_t> &leakSampling();
+PROMISE_API LiveRecord *trackSlow(const void *id, const void *caller, uint32_t rate);
+PROMISE_API void untrack(LiveRecord *record);
+PROMISE_API const LeakSite *&currentSite();
+
+// Returns the record if the promise is sampled, or nullptr
+inline LiveRecord *track(const void *id, const void *caller) {
+    uint32_t rate = leakSampling().load(std::memory_order_relaxed);
+    if (rate == 0)
+        return nullptr;
+    return trackSlow(id, caller, rate);
+}
+#endif
+
+// The promises created in the scope are from "site"
+struct SiteScope {
+#if PROMISE_INSTRUMENT
+    explicit SiteScope(const LeakSite *site)
+        : previous_(currentSite()) {
+        currentSite() = site;
+    }
+    ~SiteScope() {
+        currentSite() = previous_;
+    }
+    const LeakSite *previous_;
+#else
+    explicit SiteScope(const LeakSite *) {
+    }
+#endif
+};
+
+inline void count(Counter counter, int64_t delta = 1) {
+#if PROMISE_INSTRUMENT
+    currentShard().values_[counter].fetch_add(delta, std::memory_order_relaxed);
+#else
+    (void)counter;
+    (void)delta;
+#endif
+}
+
+inline void countForwardHops(size_t hops) {
+#if PROMISE_INSTRUMENT
+    std::atomic<int64_t> &maxHops = maxForwardHops();
+    int64_t current = maxHops.load(std::memory_order_relaxed);
+    while ((int64_t)hops > current
+        && !maxHops.compare_exchange_weak(current, (int64_t)hops, std::memory_order_relaxed)) {
+    }
+#else
+    (void)hops;
+#endif
+}
+
+inline void emit(InstrumentEvent event, const void *id) {
+#if PROMISE_INSTRUMENT
+    InstrumentHook callback = hook().load(std::memory_order_acquire);
+    if (callback != nullptr)
+        callback(event, id, std::chrono::steady_clock::now(), hookData().load(std::memory_order_relaxed));
+#else
+    (void)event;
+    (void)id;
+#endif
+}
+
+// Emits kContinuationStart and kContinuationEnd around a callback
+struct ContinuationScope {
+    explicit ContinuationScope(const void *id)
+        : id_(id) {
+        emit(InstrumentEvent::kContinuationStart, id_);
+    }
+    ~ContinuationScope() {
+        emit(InstrumentEvent::kContinuationEnd, id_);
+    }
+    const void *id_;
+};
+
+// Member of the counted objects, counts the objects alive
+template<Counter COUNTER>
+struct Counted {
+    Counted() {
+        count(COUNTER);
+    }
+    Counted(const Counted &) {
+        count(COUNTER);
+    }
+    Counted &operator=(const Counted &) {
+        return *this;
+    }
+    ~Counted() {
+        count(COUNTER, -1);
+    }
+};
+
+} // namespace instrument
+} // namespace promise
+
+#define PROMISE_LEAK_SITE_CONCAT_(a, b) a##b
+#define PROMISE_LEAK_SITE_NAME_(name, line) PROMISE_LEAK_SITE_CONCAT_(name, line)
+
+// Mark the promises created in the rest of the block with this file, line and function
+#if PROMISE_INSTRUMENT
+#   define PROMISE_LEAK_SITE() \
+        static const ::promise::LeakSite PROMISE_LEAK_SITE_NAME_(promise_leak_site_, __LINE__) = { __FILE__, __LINE__, __func__ }; \
+        ::promise::instrument::SiteScope PROMISE_LEAK_SITE_NAME_(promise_leak_scope_, __LINE__)(&PROMISE_LEAK_SITE_NAME_(promise_leak_site_, __LINE__))
+#else
+#   define PROMISE_LEAK_SITE() do { } while (false)
+#endif
+
+// Return address of the function, recorded as the caller of the tracked promises
+#if !PROMISE_INSTRUMENT
+#   define PROMISE_RETURN_ADDRESS() nullptr
+#elif defined(_MSC_VER)
+#   include <intrin.h>
+#   define PROMISE_RETURN_ADDRESS() _ReturnAddress()
+#elif defined(__GNUC__)
+#   define PROMISE_RETURN_ADDRESS() __builtin_return_address(0)
+#else
+#   define PROMISE_RETURN_ADDRESS() nullptr
+#endif
+
+#endif
@@ -44,12 +44,18 @@
 
 
 #include <list>
+#include <iterator>
 #include <vector>
 #include <memory>
 #include <functional>
+#include <stdexcept>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <thread>
 #include "any.hpp"
+#include "allocator.hpp"
+#include "instrument.hpp"
 
 namespace promise {
 
@@ -60,45 +66,187 @@ enum class TaskState {
 };
 
 struct PromiseHolder;
-struct SharedPromise;
 class Promise;
+class SharedValuePromise;
+class Executor;
 
 struct Task {
-    TaskState state_;
-    std::weak_ptr<PromiseHolder> promiseHolder_;
-    any                          onResolved_;
-    any                          onRejected_;
+    Task(any onResolved, any onRejected, bool isFinally)
+        : state_(TaskState::kPending)
+        , next_()
+        , onResolved_(std::move(onResolved))
+        , onRejected_(std::move(onRejected))
+        , isFinally_(isFinally) {
+    }
+
+    TaskState             state_;
+    std::shared_ptr<Task> next_;    // next task in the pending task chain
+    any                   onResolved_;
+    any                   onRejected_;
+    // onResolved_ is called for both states, and the state and value are kept as is
+    bool                  isFinally_;
+#if PROMISE_INSTRUMENT
+    instrument::Counted<instrument::kLiveTasks> counted_;
+#endif
 };
 
 #if PROMISE_MULTITHREAD
+/*
+ * Recursive mutex.
+ * Lock and unlock without contention only take one atomic operation on state_,
+ * the threads are parked on a shared mutex/condition variable only when contended.
+ * The local mutex does nothing, it is shared by the promises used in one thread only.
+ */
 struct Mutex {
 public:
     PROMISE_API Mutex();
-    PROMISE_API void lock();
-    PROMISE_API void unlock();
+
+    // Shared by all the promises created by newLocalPromise()
+    PROMISE_API static Mutex *local();
+
+    inline bool isLocal() const {
+        return isLocal_;
+    }
+
+    inline void lock() {
+        if (isLocal_) return;
+        std::thread::id id = std::this_thread::get_id();
+        if (owner_.load(std::memory_order_relaxed) == id) {
+            ++lock_count_;
+            return;
+        }
+        int state = kUnlocked;
+        if (!state_.compare_exchange_strong(state, kLocked, std::memory_order_acquire))
+            lockSlow(state);
+        owner_.store(id, std::memory_order_relaxed);
+        lock_count_ = 1;
+    }
+
+    inline bool try_lock() {
+        if (isLocal_) return true;
+        std::thread::id id = std::this_thread::get_id();
+        if (owner_.load(std::memory_order_relaxed) == id) {
+            ++lock_count_;
+            return true;
+        }
+        int state = kUnlocked;
+        if (!state_.compare_exchange_strong(state, kLocked, std::memory_order_acquire))
+            return false;
+        owner_.store(id, std::memory_order_relaxed);
+        lock_count_ = 1;
+        return true;
+    }
+
+    inline void unlock() {
+        if (isLocal_) return;
+        if (--lock_count_ > 0) return;
+        owner_.store(std::thread::id(), std::memory_order_relaxed);
+        if (state_.exchange(kUnlocked, std::memory_order_release) == kContended)
+            wakeOne();
+    }
+
+    // Lock or unlock for lock_count times at once
     PROMISE_API void lock(size_t lock_count);
     PROMISE_API void unlock(size_t lock_count);
     inline size_t lock_count() const { return lock_count_; }
-    std::condition_variable_any cond_;
+
 private:
-    std::recursive_mutex mutex_;
-    size_t lock_count_;
+    enum {
+        kUnlocked  = 0,
+        kLocked    = 1,
+        kContended = 2  // locked, and some threads may be waiting
+    };
+    PROMISE_API explicit Mutex(bool isLocal);
+    PROMISE_API void lockSlow(int state);
+    PROMISE_API void wakeOne();
+
+    Mutex(const Mutex &) = delete;
+    Mutex &operator=(const Mutex &) = delete;
+
+    const bool                   isLocal_;
+    std::atomic<int>             state_;
+    std::atomic<std::thread::id> owner_;
+    size_t                       lock_count_;
 };
 #endif
 
 /* 
- * Task state in TaskList always be kPending
+ * Task state in TaskList always be kPending.
+ * Promise and Defer objects point to the PromiseHolder they were created with,
+ * and find the one holding the tasks by forward_ after it is joined.
  */
 struct PromiseHolder {
     PROMISE_API PromiseHolder();
+    // The local holder has no lock, see newLocalPromise()
+    PROMISE_API explicit PromiseHolder(bool isLocal);
     PROMISE_API ~PromiseHolder();
-    std::list<std::weak_ptr<SharedPromise>> owners_;
-    std::list<std::shared_ptr<Task>>        pendingTasks_;
+    // Intrusive chain of pending tasks, linked by Task::next_
+    std::shared_ptr<Task>                   pendingHead_;
+    Task                                   *pendingTail_;
+    // Set when joined to another PromiseHolder, which the pending tasks were moved to
+    std::shared_ptr<PromiseHolder>          forward_;
     TaskState                               state_;
     any                                     value_;
+    // Default executor of the tasks added by the promise objects of this holder,
+    // it is kept after joined, protected by the mutex of the root.
+    std::shared_ptr<Executor>               executor_;
 #if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex>                  mutex_;
+    // Points to ownMutex_, or Mutex::local() for the local holder
+    Mutex                                  *mutex_;
+    Mutex                                   ownMutex_;
+    // A task is called without lock, state_ is kPending during the call
+    bool                                    isCalling_;
+    // Called without lock after the running task returns, set by the timeout which expires during the call
+    std::function<void()>                   onCalled_;
 #endif
+#if PROMISE_INSTRUMENT
+    // Entry in the registry of live promises if this holder is sampled, see setLeakSampling()
+    instrument::LiveRecord                 *record_;
+#endif
+
+    inline void pushTask(const std::shared_ptr<Task> &task) {
+        if (pendingTail_ != nullptr)
+            pendingTail_->next_ = task;
+        else
+            pendingHead_ = task;
+        pendingTail_ = task.get();
+        instrument::count(instrument::kPendingTasks);
+    }
+
+    inline void popTask() {
+        std::shared_ptr<Task> next = std::move(pendingHead_->next_);
+        pendingHead_ = std::move(next);
+        if (!pendingHead_)
+            pendingTail_ = nullptr;
+        instrument::count(instrument::kPendingTasks, -1);
+    }
+
+    // Unlink a task which is not the first one, returns the task
+    inline std::shared_ptr<Task> unlinkTask(Task *task) {
+        for (Task *prev = pendingHead_.get(); prev != nullptr; prev = prev->next_.get()) {
+            if (prev->next_.get() != task)
+                continue;
+            std::shared_ptr<Task> removed = std::move(prev->next_);
+            prev->next_ = std::move(removed->next_);
+            if (pendingTail_ == task)
+                pendingTail_ = prev;
+            instrument::count(instrument::kPendingTasks, -1);
+            return removed;
+        }
+        return nullptr;
+    }
+
+    // Move all pending tasks of other to the end of this chain
+    inline void spliceTasks(PromiseHolder &other) {
+        if (!other.pendingHead_) return;
+        if (pendingTail_ != nullptr)
+            pendingTail_->next_ = std::move(other.pendingHead_);
+        else
+            pendingHead_ = std::move(other.pendingHead_);
+        pendingTail_ = other.pendingTail_;
+        other.pendingHead_.reset();
+        other.pendingTail_ = nullptr;
+    }
 
     PROMISE_API void dump() const;
     PROMISE_API static any *getUncaughtExceptionHandler();
@@ -112,12 +260,27 @@ template<typename ...ARGS>
 struct is_one_any : public std::is_same<typename tuple_remove_cvref<std::tuple<ARGS...>>::type, std::tuple<any>> {
 };
 
-struct SharedPromise {
-    std::shared_ptr<PromiseHolder> promiseHolder_;
-    PROMISE_API void dump() const;
-#if PROMISE_MULTITHREAD
-    PROMISE_API std::shared_ptr<Mutex> obtainLock() const;
-#endif
+// Pack the arguments in std::vector<any>, the rvalue arguments are moved to it
+// (std::initializer_list would copy all of them)
+template<typename ...ARGS>
+inline any makeArgs(ARGS &&...args) {
+    std::vector<any> values;
+    values.reserve(sizeof...(ARGS));
+    int dummy[] = { 0, (values.emplace_back(std::forward<ARGS>(args)), 0)... };
+    (void)dummy;
+    return any(std::move(values));
+}
+
+/*
+ * Executor runs the tasks in its own context, such as an event loop, a thread or a strand.
+ * post() queues the task to be called later in that context, and isCurrent() returns true
+ * if the caller is running in that context already.
+ */
+class Executor {
+public:
+    virtual ~Executor() {}
+    virtual void post(const std::function<void()> &task) = 0;
+    virtual bool isCurrent() const = 0;
 };
 
 class Defer {
@@ -125,26 +288,30 @@ public:
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void resolve(ARGS &&...args) const {
-        resolve(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        resolve(makeArgs(std::forward<ARGS>(args)...));
     }
 
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void reject(ARGS &&...args) const {
-        reject(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        reject(makeArgs(std::forward<ARGS>(args)...));
     }
 
     PROMISE_API void resolve(const any &arg) const;
     PROMISE_API void reject(const any &arg) const;
+    PROMISE_API void resolve(any &&arg) const;
+    PROMISE_API void reject(any &&arg) const;
 
     PROMISE_API Promise getPromise() const;
 
 private:
     friend class Promise;
     friend PROMISE_API Promise newPromise(const std::function<void(Defer &defer)> &run);
-    PROMISE_API Defer(const std::shared_ptr<Task> &task);
+    friend PROMISE_API Promise newLocalPromise(const std::function<void(Defer &defer)> &run);
+    friend PROMISE_API std::function<void()> armTimeout(Promise &promise, const std::function<void()> &disarm);
+    PROMISE_API Defer(const std::shared_ptr<PromiseHolder> &promiseHolder, const std::shared_ptr<Task> &task);
     std::shared_ptr<Task>          task_;
-    std::shared_ptr<SharedPromise> sharedPromise_;
+    std::shared_ptr<PromiseHolder> promiseHolder_;
 };
 
 class DeferLoop {
@@ -152,26 +319,35 @@ public:
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void doBreak(ARGS &&...args) const {
-        doBreak(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        doBreak(makeArgs(std::forward<ARGS>(args)...));
     }
 
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void reject(ARGS &&...args) const {
-        reject(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        reject(makeArgs(std::forward<ARGS>(args)...));
     }
 
     PROMISE_API void doContinue() const;
     PROMISE_API void doBreak(const any &arg) const;
     PROMISE_API void reject(const any &arg) const;
+    PROMISE_API void doBreak(any &&arg) const;
+    PROMISE_API void reject(any &&arg) const;
 
-
+    // Returns the promise of the whole loop, which is returned by doWhile()
     PROMISE_API Promise getPromise() const;
 
 private:
+    friend class Promise;
     friend PROMISE_API Promise doWhile(const std::function<void(DeferLoop &loop)> &run);
-    PROMISE_API DeferLoop(const Defer &cb);
-    Defer defer_;
+    // State of the loop shared by all iterations
+    struct State;
+    PROMISE_API DeferLoop(const std::shared_ptr<State> &state, size_t iteration);
+    // The promise is rejected when this iteration is finished
+    PROMISE_API void watch(const Promise &promise) const;
+
+    std::shared_ptr<State> state_;
+    size_t                 iteration_;
 };
 
 class Promise {
@@ -182,31 +358,71 @@ public:
     PROMISE_API Promise &always(const any &onAlways);
     PROMISE_API Promise &finally(const any &onFinally);
 
+    // Same as then(), but the callbacks are called in the executor.
+    // They are called at once if the promise is settled in the executor already.
+    PROMISE_API Promise &thenOn(const std::shared_ptr<Executor> &executor, const any &onResolved);
+    PROMISE_API Promise &thenOn(const std::shared_ptr<Executor> &executor, const any &onResolved, const any &onRejected);
+    // Set the executor of the callbacks added by then(), fail(), always() and finally()
+    // of this promise object later, nullptr to call them in the thread which settles the promise.
+    PROMISE_API Promise &setExecutor(const std::shared_ptr<Executor> &executor);
+
+    // Move the settled value or reason to a SharedValuePromise, which is read by any number
+    // of branches without copy. This promise is resolved with no value after it.
+    PROMISE_API SharedValuePromise share();
+
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void resolve(ARGS &&...args) const {
-        resolve(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        resolve(makeArgs(std::forward<ARGS>(args)...));
     }
     template<typename ...ARGS,
         typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
     inline void reject(ARGS &&...args) const {
-        reject(any{ std::vector<any>{std::forward<ARGS>(args)...} });
+        reject(makeArgs(std::forward<ARGS>(args)...));
     }
 
     PROMISE_API void resolve(const any &arg) const;
     PROMISE_API void reject(const any &arg) const;
+    PROMISE_API void resolve(any &&arg) const;
+    PROMISE_API void reject(any &&arg) const;
 
     PROMISE_API void clear();
     PROMISE_API operator bool() const;
 
     PROMISE_API void dump() const;
 
-    std::shared_ptr<SharedPromise> sharedPromise_;
+    std::shared_ptr<PromiseHolder> promiseHolder_;
 };
 
 
+/*
+ * Enable the trampoline in this thread during the life time of TrampolineScope.
+ * The tasks which are settled inside other tasks are queued, and called by the
+ * outermost task after it returns, instead of by recursion. So the stack depth is
+ * bounded for long synchronous chains, but the nested tasks are called later than
+ * without the trampoline.
+ */
+class TrampolineScope {
+public:
+    PROMISE_API TrampolineScope();
+    PROMISE_API ~TrampolineScope();
+private:
+    TrampolineScope(const TrampolineScope &) = delete;
+    TrampolineScope &operator=(const TrampolineScope &) = delete;
+    bool previous_;
+};
+
 PROMISE_API Promise newPromise(const std::function<void(Defer &defer)> &run);
 PROMISE_API Promise newPromise();
+
+/*
+ * Same as newPromise(), but the promise chain has no lock, so it must be used in one thread only.
+ * The chain is guarded by lock again if a promise of newPromise() is joined to it,
+ * and it can be used by other threads after that.
+ * It is same as newPromise() if PROMISE_MULTITHREAD is 0.
+ */
+PROMISE_API Promise newLocalPromise(const std::function<void(Defer &defer)> &run);
+PROMISE_API Promise newLocalPromise();
 PROMISE_API Promise doWhile(const std::function<void(DeferLoop &loop)> &run);
 template<typename ...ARGS>
 inline Promise resolve(ARGS &&...args) {
@@ -219,23 +435,94 @@ inline Promise reject(ARGS &&...args) {
 }
 
 
+// Element type of the results of allSettled()
+struct SettledResult {
+    TaskState state_;   // kResolved or kRejected
+    any       value_;   // the resolved value or the rejected reason
+};
+
+// Fan-in of all() and allSettled().
+// The promises are added one by one with its index, and the results are stored
+// in a preallocated array shared by all the tasks.
+class AllCollector {
+public:
+    PROMISE_API AllCollector(size_t count, bool isSettled);
+    PROMISE_API void add(const Promise &promise);
+    // Call once after all the promises are added
+    PROMISE_API Promise finish();
+
+private:
+    struct State;
+    std::shared_ptr<State> state_;
+    size_t index_;
+};
+
+template<typename PROMISE_ITERATOR>
+inline Promise collectAll(PROMISE_ITERATOR begin, PROMISE_ITERATOR end, bool isSettled) {
+    AllCollector collector((size_t)std::distance(begin, end), isSettled);
+    for (; begin != end; ++begin)
+        collector.add(*begin);
+    return collector.finish();
+}
+
 /* Returns a promise that resolves when all of the promises in the iterable
    argument have resolved, or rejects with the reason of the first passed
-   promise that rejects. */
+   promise that rejects.
+   The resolved value is std::vector<any> of the values of the promises. */
 PROMISE_API Promise all(const std::list<Promise> &promise_list);
 template<typename PROMISE_LIST,
     typename std::enable_if<is_iterable<PROMISE_LIST>::value
                             && !std::is_same<PROMISE_LIST, std::list<Promise>>::value
     >::type *dummy = nullptr>
 inline Promise all(const PROMISE_LIST &promise_list) {
-    std::list<Promise> copy_list = { std::begin(promise_list), std::end(promise_list) };
-    return all(copy_list);
+    return collectAll(std::begin(promise_list), std::end(promise_list), false);
 }
 template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
 inline Promise all(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
-    return all(std::list<Promise>{ defer0, promise_list ... });
+    return all(std::vector<Promise>{ defer0, promise_list ... });
 }
 
+/* Returns a promise that resolves when all of the promises in the iterable
+   argument have resolved or rejected, it is never rejected.
+   The resolved value is std::vector<SettledResult> of the promises. */
+PROMISE_API Promise allSettled(const std::list<Promise> &promise_list);
+template<typename PROMISE_LIST,
+    typename std::enable_if<is_iterable<PROMISE_LIST>::value
+                            && !std::is_same<PROMISE_LIST, std::list<Promise>>::value
+    >::type *dummy = nullptr>
+inline Promise allSettled(const PROMISE_LIST &promise_list) {
+    return collectAll(std::begin(promise_list), std::end(promise_list), true);
+}
+template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
+inline Promise allSettled(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
+    return allSettled(std::vector<Promise>{ defer0, promise_list ... });
+}
+
+
+// Fan-in of race(), raceAndReject() and raceAndResolve().
+// The first settled promise wins, and the tasks added to the other promises are removed
+// at once, so that they do not keep the race alive.
+class RaceCollector {
+public:
+    // The losers are rejected if loserState is kRejected, resolved if kResolved,
+    // or left as is if kPending.
+    PROMISE_API RaceCollector(size_t count, TaskState loserState);
+    PROMISE_API void add(const Promise &promise);
+    PROMISE_API Promise finish();
+
+private:
+    struct State;
+    std::shared_ptr<State> state_;
+    size_t index_;
+};
+
+template<typename PROMISE_ITERATOR>
+inline Promise collectRace(PROMISE_ITERATOR begin, PROMISE_ITERATOR end, TaskState loserState) {
+    RaceCollector collector((size_t)std::distance(begin, end), loserState);
+    for (; begin != end; ++begin)
+        collector.add(*begin);
+    return collector.finish();
+}
 
 /* returns a promise that resolves or rejects as soon as one of
 the promises in the iterable resolves or rejects, with the value
@@ -246,12 +533,11 @@ template<typename PROMISE_LIST,
                             && !std::is_same<PROMISE_LIST, std::list<Promise>>::value
     >::type *dummy = nullptr>
 inline Promise race(const PROMISE_LIST &promise_list) {
-    std::list<Promise> copy_list = { std::begin(promise_list), std::end(promise_list) };
-    return race(copy_list);
+    return collectRace(std::begin(promise_list), std::end(promise_list), TaskState::kPending);
 }
 template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
 inline Promise race(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
-    return race(std::list<Promise>{ defer0, promise_list ... });
+    return race(std::vector<Promise>{ defer0, promise_list ... });
 }
 
 
@@ -261,12 +547,11 @@ template<typename PROMISE_LIST,
                             && !std::is_same<PROMISE_LIST, std::list<Promise>>::value
     >::type *dummy = nullptr>
 inline Promise raceAndReject(const PROMISE_LIST &promise_list) {
-    std::list<Promise> copy_list = { std::begin(promise_list), std::end(promise_list) };
-    return raceAndReject(copy_list);
+    return collectRace(std::begin(promise_list), std::end(promise_list), TaskState::kRejected);
 }
 template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
 inline Promise raceAndReject(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
-    return raceAndReject(std::list<Promise>{ defer0, promise_list ... });
+    return raceAndReject(std::vector<Promise>{ defer0, promise_list ... });
 }
 
 
@@ -276,14 +561,98 @@ template<typename PROMISE_LIST,
                             && !std::is_same<PROMISE_LIST, std::list<Promise>>::value
     >::type *dummy = nullptr>
 inline Promise raceAndResolve(const PROMISE_LIST &promise_list) {
-    std::list<Promise> copy_list = { std::begin(promise_list), std::end(promise_list) };
-    return raceAndResolve(copy_list);
+    return collectRace(std::begin(promise_list), std::end(promise_list), TaskState::kResolved);
 }
 template <typename PROMISE0, typename ... PROMISE_LIST, typename std::enable_if<!is_iterable<PROMISE0>::value>::type *dummy = nullptr>
 inline Promise raceAndResolve(PROMISE0 defer0, PROMISE_LIST ...promise_list) {
-    return raceAndResolve(std::list<Promise>{ defer0, promise_list ... });
+    return raceAndResolve(std::vector<Promise>{ defer0, promise_list ... });
+}
+
+/* Calls func(index) for each index in [0, count), with at most "limit" of the promises
+   returned by func pending at the same time, the next index is started when one settles.
+   Resolves with std::vector<any> of the values in the order of index, or rejects with the
+   reason of the first promise that rejects, and no more index is started after that. */
+PROMISE_API Promise mapLimit(size_t count, size_t limit, const std::function<Promise(size_t index)> &func);
+
+template<typename ITERATOR, typename FUNC>
+struct MapLimitItems {
+    ITERATOR itr_;
+    FUNC     func_;
+    // Called in the order of index, by one thread at a time
+    Promise operator()(size_t index) {
+        (void)index;
+        return func_(*itr_++);
+    }
+};
+
+/* Same as above, func(item) is called for the items of the range.
+   The range should be kept until the returned promise is settled. */
+template<typename RANGE, typename FUNC,
+    typename std::enable_if<is_iterable<RANGE>::value>::type *dummy = nullptr>
+inline Promise mapLimit(const RANGE &range, size_t limit, FUNC func) {
+    using Items = MapLimitItems<decltype(std::begin(range)), FUNC>;
+    return mapLimit((size_t)std::distance(std::begin(range), std::end(range)), limit,
+                    Items{ std::begin(range), std::move(func) });
 }
 
+/* Counting semaphore, acquire() returns a promise that resolves when one unit is taken.
+   The waiters are resolved in the order of acquire() by release().
+   The promise returned by acquire() should not be settled by others, or the unit is lost.
+   Copies of the semaphore share the same units. */
+class Semaphore {
+public:
+    PROMISE_API explicit Semaphore(size_t count);
+    PROMISE_API Promise acquire() const;
+    // Returns false if no unit is available now
+    PROMISE_API bool tryAcquire() const;
+    PROMISE_API void release() const;
+    // Call func when one unit is taken, and release it when the promise returned by func is settled
+    PROMISE_API Promise run(const std::function<Promise()> &func) const;
+
+private:
+    struct State;
+    std::shared_ptr<State> state_;
+};
+
+/* Settled value of a promise shared by any number of branches, returned by Promise::share().
+   The value is moved from the promise once, and it is not changed after that.
+   The callbacks of the branches are called with the value by reference, so they should take
+   the parameters by const reference, or by value to get a copy.
+   Each branch returns a new promise, as then() of the promise would do. The value is copied
+   only to the branches without the callback of its state, such as fail() of a resolved one.
+   Branches added after it is settled are called at once, without lock.
+   Copies of SharedValuePromise share the same value. */
+class SharedValuePromise {
+public:
+    PROMISE_API Promise then(const any &onResolved) const;
+    PROMISE_API Promise then(const any &onResolved, const any &onRejected) const;
+    PROMISE_API Promise fail(const any &onRejected) const;
+    // Returns true if the value is settled, the branches added after are called at once
+    PROMISE_API bool isSettled() const;
+
+private:
+    friend class Promise;
+    struct State;
+    PROMISE_API explicit SharedValuePromise(const std::shared_ptr<State> &state);
+    std::shared_ptr<State> state_;
+};
+
+// Rejected reason of the promises which are timed out by armTimeout()
+class TimeoutError : public std::runtime_error {
+public:
+    TimeoutError()
+        : std::runtime_error("timeout") {
+    }
+};
+
+/* Attach a deadline to "promise", it is used by withTimeout() of the timer add-ons.
+   Returns the function which should be called by the timer when it expires, it rejects
+   the promise with TimeoutError if it is not settled yet. If the promise is settled first,
+   "disarm" is called once to cancel the timer.
+   Only one finally task is added to the promise, no other promise object is created.
+   An empty function is returned if the promise is settled already. */
+PROMISE_API std::function<void()> armTimeout(Promise &promise, const std::function<void()> &disarm);
+
 inline void handleUncaughtException(const any &onUncaughtException) {
     PromiseHolder::handleUncaughtException(onUncaughtException);
 }
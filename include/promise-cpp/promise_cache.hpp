@@ -0,0 +1,241 @@
+#pragma once
+#ifndef INC_PROMISE_CACHE_HPP_
+#define INC_PROMISE_CACHE_HPP_
+
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Single flight cache of promises, the concurrent get() of the same key share one load().
+//
+//   get(key, load)  returns the shared value of key as SharedValuePromise. If the key is
+//                   loading, it waits for the same load. Otherwise load() is called, and
+//                   the value it resolves is kept for "ttl".
+//   erase(key)      forget the cached value, a loading one is still given to its waiters.
+//
+// Rejected reasons are kept for "negativeTtl" (0 to not keep them), so that failed loads
+// are not retried by every request.
+// Settled entries beyond "maxEntries" are evicted in least recently used order.
+//
+// The keys are spread over shards, each has its own mutex and LRU list.
+// The settled value is moved once to the SharedValuePromise of the entry, and read by reference
+// in the callbacks of all the waiters, see Promise::share().
+//
+// The cache should be kept until all the loading promises are settled.
+//
+
+#include "promise.hpp"
+#include <list>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+namespace promise {
+
+template<typename KEY, typename HASH = std::hash<KEY>>
+class PromiseCache {
+public:
+    using Clock    = std::chrono::steady_clock;
+    using Duration = Clock::duration;
+    using Loader   = std::function<Promise()>;
+
+    struct Options {
+        Options()
+            : maxEntries(1024)
+            , ttl(std::chrono::seconds(60))
+            , negativeTtl(Duration::zero())
+            , shardCount(16) {
+        }
+        size_t   maxEntries;    // count of the settled entries kept, in all shards
+        Duration ttl;           // time to keep the resolved values
+        Duration negativeTtl;   // time to keep the rejected reasons, 0 to not keep them
+        size_t   shardCount;
+    };
+
+    explicit PromiseCache(const Options &options = Options())
+        : options_(options) {
+        size_t shardCount = (options.shardCount == 0 ? 1 : options.shardCount);
+        size_t maxEntries = (options.maxEntries + shardCount - 1) / shardCount;
+        for (size_t i = 0; i < shardCount; ++i)
+            shards_.emplace_back(new Shard(maxEntries));
+    }
+
+    SharedValuePromise get(const KEY &key, const Loader &load) {
+        Shard &shard = shardOf(key);
+        std::shared_ptr<Entry> entry;
+        Promise source;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+#endif
+            auto found = shard.entries_.find(key);
+            if (found != shard.entries_.end()) {
+                Entry &cached = *found->second;
+                if (cached.state_ == TaskState::kPending)
+                    return cached.shared_;
+                if (Clock::now() < cached.expire_) {
+                    // Recently used ones are moved to the front
+                    shard.lru_.splice(shard.lru_.begin(), shard.lru_, cached.lru_);
+                    return cached.shared_;
+                }
+                shard.erase(found);
+            }
+
+            source = newPromise();
+            entry = pm_make_shared<Entry>(key, source.share());
+            shard.entries_.emplace(key, entry);
+        }
+
+        // Called after unlocked, the gets of the same key wait for the shared value of the entry
+        Promise loading;
+        try {
+            loading = load();
+        }
+        catch (...) {
+            loading = reject(any(std::current_exception()));
+        }
+
+        PromiseCache *self = this;
+        entry->shared_.then([self, &shard, entry]() {
+            self->settle(shard, entry, TaskState::kResolved);
+        }, [self, &shard, entry]() {
+            self->settle(shard, entry, TaskState::kRejected);
+        });
+        // The task of share() is moved to "loading", which moves the settled value to the entry
+        loading.then(source);
+        return entry->shared_;
+    }
+
+    void erase(const KEY &key) {
+        Shard &shard = shardOf(key);
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+#endif
+        auto found = shard.entries_.find(key);
+        if (found != shard.entries_.end())
+            shard.erase(found);
+    }
+
+    void clear() {
+        for (auto &shard : shards_) {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(shard->mutex_);
+#endif
+            while (shard->entries_.size() > 0)
+                shard->erase(shard->entries_.begin());
+        }
+    }
+
+    // Count of the loading and settled entries
+    size_t size() const {
+        size_t count = 0;
+        for (auto &shard : shards_) {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(shard->mutex_);
+#endif
+            count += shard->entries_.size();
+        }
+        return count;
+    }
+
+private:
+    struct Entry;
+    using Lru     = std::list<Entry *>;
+    using Entries = std::unordered_map<KEY, std::shared_ptr<Entry>, HASH>;
+
+    struct Entry {
+        Entry(const KEY &key, const SharedValuePromise &shared)
+            : key_(key)
+            , shared_(shared)
+            , state_(TaskState::kPending)
+            , isInCache_(true) {
+        }
+        KEY                  key_;
+        SharedValuePromise   shared_;     // resolved value or rejected reason
+        TaskState            state_;      // kPending until the value is settled and kept
+        Clock::time_point    expire_;
+        bool                 isInCache_;  // false if it is erased
+        typename Lru::iterator lru_;      // valid if settled and in cache
+    };
+
+    struct Shard {
+        explicit Shard(size_t maxEntries)
+            : maxEntries_(maxEntries == 0 ? 1 : maxEntries) {
+        }
+
+        void erase(typename Entries::iterator found) {
+            Entry &entry = *found->second;
+            if (entry.state_ != TaskState::kPending)
+                lru_.erase(entry.lru_);
+            entry.isInCache_ = false;
+            entries_.erase(found);
+        }
+
+        size_t  maxEntries_;
+        Entries entries_;
+        Lru     lru_;         // settled entries, most recently used first
+#if PROMISE_MULTITHREAD
+        mutable std::mutex mutex_;
+#endif
+    };
+
+    Shard &shardOf(const KEY &key) {
+        return *shards_[HASH()(key) % shards_.size()];
+    }
+
+    // Keep the settled entry for its ttl, the value is not touched
+    void settle(Shard &shard, const std::shared_ptr<Entry> &entry, TaskState state) {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+#endif
+        if (!entry->isInCache_)
+            return;
+        Duration ttl = (state == TaskState::kResolved ? options_.ttl : options_.negativeTtl);
+        if (ttl <= Duration::zero()) {
+            shard.erase(shard.entries_.find(entry->key_));
+            return;
+        }
+        entry->state_ = state;
+        entry->expire_ = Clock::now() + ttl;
+        shard.lru_.push_front(entry.get());
+        entry->lru_ = shard.lru_.begin();
+        while (shard.lru_.size() > shard.maxEntries_)
+            shard.erase(shard.entries_.find(shard.lru_.back()->key_));
+    }
+
+    PromiseCache(const PromiseCache &) = delete;
+    PromiseCache &operator=(const PromiseCache &) = delete;
+
+    Options                             options_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+} // namespace promise
+
+#endif
@@ -5,7 +5,14 @@
 #include <cassert>
 #include <stdexcept>
 #include <vector>
+#include <deque>
 #include <atomic>
+#include <new>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <map>
+#include <algorithm>
 #include "promise.hpp"
 
 namespace promise {
@@ -19,47 +26,26 @@ static inline void healthyCheck(int line, PromiseHolder *promiseHolder) {
         throw std::runtime_error("");
     }
 
-    for (const auto &owner_ : promiseHolder->owners_) {
-        auto owner = owner_.lock();
-        if (owner && owner->promiseHolder_.get() != promiseHolder) {
-            fprintf(stderr, "line = %d, %d, owner->promiseHolder_ = %p, promiseHolder = %p\n",
-                line, __LINE__,
-                owner->promiseHolder_.get(),
-                promiseHolder);
-            throw std::runtime_error("");
-        }
-    }
-
-    for (const std::shared_ptr<Task> &task : promiseHolder->pendingTasks_) {
-        if (!task) {
-            fprintf(stderr, "line = %d, %d, promiseHolder = %p, task is null\n", line, __LINE__, promiseHolder);
-            throw std::runtime_error("");
-        }
+    const Task *last = nullptr;
+    for (const Task *task = promiseHolder->pendingHead_.get(); task != nullptr; task = task->next_.get()) {
         if (task->state_ != TaskState::kPending) {
             fprintf(stderr, "line = %d, %d, promiseHolder = %p, task = %p, task->state_ = %d\n", line, __LINE__,
-                promiseHolder, task.get(), (int)task->state_);
-            throw std::runtime_error("");
-        }
-        if (task->promiseHolder_.lock().get() != promiseHolder) {
-            fprintf(stderr, "line = %d, %d, promiseHolder = %p, task = %p, task->promiseHolder_ = %p\n", line, __LINE__,
-                promiseHolder, task.get(), task->promiseHolder_.lock().get());
+                promiseHolder, task, (int)task->state_);
             throw std::runtime_error("");
         }
+        last = task;
+    }
+    if (last != promiseHolder->pendingTail_) {
+        fprintf(stderr, "line = %d, %d, promiseHolder = %p, last task = %p, pendingTail_ = %p\n", line, __LINE__,
+            promiseHolder, last, promiseHolder->pendingTail_);
+        throw std::runtime_error("");
     }
 #endif
 }
 
 void Promise::dump() const {
 #ifndef NDEBUG
-    printf("Promise = %p, SharedPromise = %p\n", this, this->sharedPromise_.get());
-    if (this->sharedPromise_)
-        this->sharedPromise_->dump();
-#endif
-}
-
-void SharedPromise::dump() const {
-#ifndef NDEBUG
-    printf("SharedPromise = %p, PromiseHolder = %p\n", this, this->promiseHolder_.get());
+    printf("Promise = %p, PromiseHolder = %p\n", this, this->promiseHolder_.get());
     if (this->promiseHolder_)
         this->promiseHolder_->dump();
 #endif
@@ -67,20 +53,53 @@ void SharedPromise::dump() const {
 
 void PromiseHolder::dump() const {
 #ifndef NDEBUG
-    printf("PromiseHolder = %p, owners = %d, pendingTasks = %d\n", this, (int)this->owners_.size(), (int)this->pendingTasks_.size());
-    for (const auto &owner_ : owners_) {
-        auto owner = owner_.lock();
-        printf("  owner = %p\n", owner.get());
+    size_t pendingTasks = 0;
+    for (const Task *task = pendingHead_.get(); task != nullptr; task = task->next_.get())
+        ++pendingTasks;
+    printf("PromiseHolder = %p, pendingTasks = %d, forward = %p\n", this, (int)pendingTasks, this->forward_.get());
+    for (const Task *task = pendingHead_.get(); task != nullptr; task = task->next_.get()) {
+        printf("  task = %p\n", task);
     }
-    for (const auto &task : pendingTasks_) {
-        if (task) {
-            auto promiseHolder = task->promiseHolder_.lock();
-            printf("  task = %p, PromiseHolder = %p\n", task.get(), promiseHolder.get());
-        }
-        else {
-            printf("  task = %p\n", task.get());
-        }
+#endif
+}
+
+// Follow the forward pointers to the PromiseHolder which the tasks were moved to,
+// and point the holders in the path to it directly, so that long chains of join()
+// are walked only once.
+static inline std::shared_ptr<PromiseHolder> getRoot(std::shared_ptr<PromiseHolder> promiseHolder) {
+    if (!promiseHolder->forward_)
+        return promiseHolder;
+    std::shared_ptr<PromiseHolder> root = promiseHolder->forward_;
+    size_t hops = 1;
+    for (; root->forward_; ++hops)
+        root = root->forward_;
+    instrument::countForwardHops(hops);
+    while (promiseHolder != root) {
+        std::shared_ptr<PromiseHolder> next = std::move(promiseHolder->forward_);
+        promiseHolder->forward_ = root;
+        promiseHolder = std::move(next);
     }
+    return root;
+}
+
+// Copy the state of a tracked holder to its record, called with the lock of the holder
+static inline void syncRecord(const PromiseHolder *promiseHolder) {
+#if PROMISE_INSTRUMENT
+    instrument::LiveRecord *record = promiseHolder->record_;
+    if (record == nullptr)
+        return;
+    size_t pendingTasks = 0;
+    for (const Task *task = promiseHolder->pendingHead_.get(); task != nullptr; task = task->next_.get())
+        ++pendingTasks;
+    LiveState state = (promiseHolder->forward_ ? LiveState::kJoined
+        : promiseHolder->state_ == TaskState::kResolved ? LiveState::kResolved
+        : promiseHolder->state_ == TaskState::kRejected ? LiveState::kRejected
+        : LiveState::kPending);
+    record->state_.store((int)state, std::memory_order_relaxed);
+    record->pendingTasks_.store(pendingTasks, std::memory_order_relaxed);
+    record->valueSize_.store(promiseHolder->value_.size(), std::memory_order_relaxed);
+#else
+    (void)promiseHolder;
 #endif
 }
 
@@ -90,37 +109,36 @@ static inline void join(const std::shared_ptr<PromiseHolder> &left, const std::s
     //left->dump();
     //right->dump();
 
-    for (const std::shared_ptr<Task> &task : right->pendingTasks_) {
-        task->promiseHolder_ = left;
-    }
-    left->pendingTasks_.splice(left->pendingTasks_.end(), right->pendingTasks_);
+    // "right" may be a reference to the variable which is changed to "left" later
+    std::shared_ptr<PromiseHolder> rightHolder = right;
+
+#if PROMISE_MULTITHREAD
+    // The local chain may be used by other threads from now on, other threads
+    // can not find "left" until the lock of "right" is released.
+    // It is refused while a task of "left" is called, the calling thread goes on
+    // using "left" without lock after the call.
+    bool isShared = (left->mutex_->isLocal() && !rightHolder->mutex_->isLocal());
+    if (isShared && left->isCalling_)
+        throw std::runtime_error("shared promise joined to the local one in its own task");
+#endif
 
-    std::list<std::weak_ptr<SharedPromise>> owners;
-    owners.splice(owners.end(), right->owners_);
+    // O(1) splice, the tasks and the promise objects of "right" find "left" by forward_
+    left->spliceTasks(*rightHolder);
+    rightHolder->forward_ = left;
+#if PROMISE_MULTITHREAD
+    if (isShared)
+        left->mutex_ = &left->ownMutex_;
+#endif
 
     // Looked on resolved if the PromiseHolder was joined to another,
     // so that it will not throw onUncaughtException when destroyed.
-    right->state_ = TaskState::kResolved;
-
-    if(owners.size() > 100) {
-        fprintf(stderr, "Maybe memory leak, too many promise owners: %d", (int)owners.size());
-    }
-
-    for (const std::weak_ptr<SharedPromise> &owner_ : owners) {
-        std::shared_ptr<SharedPromise> owner = owner_.lock();
-        if (owner) {
-            owner->promiseHolder_ = left;
-            left->owners_.push_back(owner);
-        }
-    }
-
-    //left->dump();
-    //right->dump();
-    //fprintf(stderr, "left->promiseHolder_->owners_ size = %d\n", (int)left->promiseHolder_->owners_.size());
-
+    rightHolder->state_ = TaskState::kResolved;
+    instrument::count(instrument::kJoins);
+    syncRecord(left.get());
+    syncRecord(rightHolder.get());
 
     healthyCheck(__LINE__, left.get());
-    healthyCheck(__LINE__, right.get());
+    healthyCheck(__LINE__, rightHolder.get());
 }
 
 //Unlock and then lock
@@ -137,40 +155,123 @@ struct unlock_guard_t {
     std::shared_ptr<Mutex> mutex_;
     size_t lock_count_;
 };
-#endif
 
-static inline void call(std::shared_ptr<Task> task) {
-    std::shared_ptr<PromiseHolder> promiseHolder; //Can hold the temporarily created promise
+// Mark the holder when a task is called without lock, constructed and destructed with the lock
+// onCalled_ of the holder is moved to "onCalled", which is called by the caller after unlocked.
+struct calling_guard_t {
+    inline calling_guard_t(PromiseHolder *promiseHolder, std::function<void()> &onCalled)
+        : promiseHolder_(promiseHolder)
+        , onCalled_(onCalled) {
+        promiseHolder_->isCalling_ = true;
+    }
+    inline ~calling_guard_t() {
+        promiseHolder_->isCalling_ = false;
+        if (promiseHolder_->onCalled_)
+            onCalled_.swap(promiseHolder_->onCalled_);
+    }
+    PromiseHolder         *promiseHolder_;
+    std::function<void()> &onCalled_;
+};
+
+// Point the holders in the path to the locked root directly, same as getRoot().
+// The holders locked by other threads are skipped, so it never blocks.
+static inline void compressPath(std::shared_ptr<PromiseHolder> promiseHolder, const std::shared_ptr<PromiseHolder> &root) {
+    while (promiseHolder != root) {
+        Mutex *mutex = promiseHolder->mutex_;
+        // The local holders joined to a shared chain are not guarded
+        if (mutex->isLocal() && !root->mutex_->isLocal())
+            return;
+        if (!mutex->try_lock())
+            return;
+        std::shared_ptr<PromiseHolder> next = promiseHolder->forward_;
+        promiseHolder->forward_ = root;
+        mutex->unlock();
+        promiseHolder = std::move(next);
+    }
+}
+
+// Lock the PromiseHolder which has no forward pointer, and change promiseHolder to it.
+// The returned mutex keeps the PromiseHolder alive.
+static inline std::shared_ptr<Mutex> lockRoot(std::shared_ptr<PromiseHolder> &promiseHolder) {
+    std::shared_ptr<PromiseHolder> start;
+    size_t hops = 0;
     while (true) {
-        promiseHolder = task->promiseHolder_.lock();
-        if (!promiseHolder) return;
+        Mutex *mutex = promiseHolder->mutex_;
+        mutex->lock();
+        if (!promiseHolder->forward_) {
+            if (start) {
+                instrument::countForwardHops(hops);
+                compressPath(std::move(start), promiseHolder);
+            }
+            return std::shared_ptr<Mutex>(promiseHolder, mutex);
+        }
+        std::shared_ptr<PromiseHolder> next = promiseHolder->forward_;
+        mutex->unlock();
+        if (!start)
+            start = std::move(promiseHolder);
+        promiseHolder = std::move(next);
+        ++hops;
+    }
+}
+#endif
 
+static inline void callTasks(std::shared_ptr<PromiseHolder> promiseHolder, std::shared_ptr<Task> task) {
+    while (true) {
+#if PROMISE_MULTITHREAD
+        std::function<void()> onCalled;
+#endif
         // lock for 1st stage
         {
 #if PROMISE_MULTITHREAD
-            std::shared_ptr<Mutex> mutex = promiseHolder->mutex_;
-            std::unique_lock<Mutex> lock(*mutex);
+            std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
+            std::unique_lock<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+            promiseHolder = getRoot(promiseHolder);
 #endif
 
             if (task->state_ != TaskState::kPending) return;
             if (promiseHolder->state_ == TaskState::kPending) return;
 
-            std::list<std::shared_ptr<Task>> &pendingTasks = promiseHolder->pendingTasks_;
             //promiseHolder->dump();
 
-#if PROMISE_MULTITHREAD
-            while (pendingTasks.front() != task) {
-                mutex->cond_.wait<std::unique_lock<Mutex>>(lock);
-            }
-#else
-            assert(pendingTasks.front() == task);
-#endif
-            pendingTasks.pop_front();
+            // Other thread is running the tasks before this one,
+            // and it will run this task later.
+            if (promiseHolder->pendingHead_ != task) return;
+            promiseHolder->popTask();
             task->state_ = promiseHolder->state_;
             //promiseHolder->dump();
 
             try {
-                if (promiseHolder->state_ == TaskState::kResolved) {
+                if (task->isFinally_) {
+                    if (!task->onResolved_.empty()) {
+                        TaskState state = promiseHolder->state_;
+                        promiseHolder->state_ = TaskState::kPending; // avoid recursive task using this state
+#if PROMISE_MULTITHREAD
+                        // Taken out before unlocked, and put back after the call
+                        any arg = std::move(promiseHolder->value_);
+                        {
+                            calling_guard_t calling(promiseHolder.get(), onCalled);
+                            unlock_guard_t lock_inner(mutex);
+                            instrument::ContinuationScope scope(promiseHolder.get());
+                            try {
+                                task->onResolved_.call(arg);
+                            }
+                            catch (const bad_any_cast &) {}
+                        }
+                        promiseHolder->value_ = std::move(arg);
+#else
+                        {
+                            instrument::ContinuationScope scope(promiseHolder.get());
+                            try {
+                                task->onResolved_.call(promiseHolder->value_);
+                            }
+                            catch (const bad_any_cast &) {}
+                        }
+#endif
+                        promiseHolder->state_ = state;
+                    }
+                }
+                else if (promiseHolder->state_ == TaskState::kResolved) {
                     if (task->onResolved_.empty()
                         || task->onResolved_.type() == type_id<std::nullptr_t>()) {
                         //to next resolved task
@@ -178,98 +279,121 @@ static inline void call(std::shared_ptr<Task> task) {
                     else {
                         promiseHolder->state_ = TaskState::kPending; // avoid recursive task using this state
 #if PROMISE_MULTITHREAD
+                        // Taken out before unlocked, value_ may be set by other threads during the call
+                        any arg = std::move(promiseHolder->value_);
+                        std::shared_ptr<PromiseHolder> root0;
                         std::shared_ptr<Mutex> mutex0 = nullptr;
                         auto call = [&]() -> any {
+                            calling_guard_t calling(promiseHolder.get(), onCalled);
                             unlock_guard_t lock_inner(mutex);
-                            const any &value = task->onResolved_.call(promiseHolder->value_);
+                            instrument::ContinuationScope scope(promiseHolder.get());
+                            any value = task->onResolved_.call(std::move(arg));
                             // Make sure the returned promised is locked before than "mutex"
                             if (value.type() == type_id<Promise>()) {
-                                Promise &promise = value.cast<Promise &>();
-                                mutex0 = promise.sharedPromise_->obtainLock();
+                                root0 = value.cast<Promise &>().promiseHolder_;
+                                mutex0 = lockRoot(root0);
                             }
                             return value;
                         };
-                        const any &value = call();
+                        any value = call();
 
                         if (mutex0 == nullptr) {
-                            promiseHolder->value_ = value;
+                            promiseHolder->value_ = std::move(value);
                             promiseHolder->state_ = TaskState::kResolved;
                         }
                         else {
                             // join the promise
-                            Promise &promise = value.cast<Promise &>();
                             std::lock_guard<Mutex> lock0(*mutex0, std::adopt_lock_t());
-                            join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                            promiseHolder = promise.sharedPromise_->promiseHolder_;
+                            join(root0, promiseHolder);
+                            promiseHolder = root0;
                         }
 #else
-                        const any &value = task->onResolved_.call(promiseHolder->value_);
+                        any value;
+                        {
+                            instrument::ContinuationScope scope(promiseHolder.get());
+                            value = task->onResolved_.call(std::move(promiseHolder->value_));
+                        }
 
                         if (value.type() != type_id<Promise>()) {
-                            promiseHolder->value_ = value;
+                            promiseHolder->value_ = std::move(value);
                             promiseHolder->state_ = TaskState::kResolved;
                         }
                         else {
                             // join the promise
-                            Promise &promise = value.cast<Promise &>();
-                            join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                            promiseHolder = promise.sharedPromise_->promiseHolder_;
+                            std::shared_ptr<PromiseHolder> root0 = getRoot(value.cast<Promise &>().promiseHolder_);
+                            join(root0, promiseHolder);
+                            promiseHolder = root0;
                         }
 #endif
                     }
                 }
                 else if (promiseHolder->state_ == TaskState::kRejected) {
                     if (task->onRejected_.empty()
-                        || task->onRejected_.type() == type_id<std::nullptr_t>()) {
-                        //to next rejected task
+                        || task->onRejected_.type() == type_id<std::nullptr_t>()
+                        || !task->onRejected_.may_call(promiseHolder->value_)) {
+                        //to next rejected task, the exception of other types are skipped without rethrowing
                         //promiseHolder->value_ = promiseHolder->value_;
                         //promiseHolder->state_ = TaskState::kRejected;
                     }
                     else {
+#if PROMISE_MULTITHREAD
+                        // Taken out before unlocked, value_ may be set by other threads during the call
+                        any arg = std::move(promiseHolder->value_);
+#endif
                         try {
                             promiseHolder->state_ = TaskState::kPending; // avoid recursive task using this state
 #if PROMISE_MULTITHREAD
+                            std::shared_ptr<PromiseHolder> root0;
                             std::shared_ptr<Mutex> mutex0 = nullptr;
                             auto call = [&]() -> any {
+                                calling_guard_t calling(promiseHolder.get(), onCalled);
                                 unlock_guard_t lock_inner(mutex);
-                                const any &value = task->onRejected_.call(promiseHolder->value_);
+                                instrument::ContinuationScope scope(promiseHolder.get());
+                                any value = task->onRejected_.call(std::move(arg));
                                 // Make sure the returned promised is locked before than "mutex"
                                 if (value.type() == type_id<Promise>()) {
-                                    Promise &promise = value.cast<Promise &>();
-                                    mutex0 = promise.sharedPromise_->obtainLock();
+                                    root0 = value.cast<Promise &>().promiseHolder_;
+                                    mutex0 = lockRoot(root0);
                                 }
                                 return value;
                             };
-                            const any &value = call();
+                            any value = call();
 
                             if (mutex0 == nullptr) {
-                                promiseHolder->value_ = value;
+                                promiseHolder->value_ = std::move(value);
                                 promiseHolder->state_ = TaskState::kResolved;
                             }
                             else {
                                 // join the promise
-                                Promise promise = value.cast<Promise>();
                                 std::lock_guard<Mutex> lock0(*mutex0, std::adopt_lock_t());
-                                join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                                promiseHolder = promise.sharedPromise_->promiseHolder_;
+                                join(root0, promiseHolder);
+                                promiseHolder = root0;
                             }
 #else
-                            const any &value = task->onRejected_.call(promiseHolder->value_);
+                            any value;
+                            {
+                                instrument::ContinuationScope scope(promiseHolder.get());
+                                value = task->onRejected_.call(std::move(promiseHolder->value_));
+                            }
 
                             if (value.type() != type_id<Promise>()) {
-                                promiseHolder->value_ = value;
+                                promiseHolder->value_ = std::move(value);
                                 promiseHolder->state_ = TaskState::kResolved;
                             }
                             else {
                                 // join the promise
-                                Promise &promise = value.cast<Promise &>();
-                                join(promise.sharedPromise_->promiseHolder_, promiseHolder);
-                                promiseHolder = promise.sharedPromise_->promiseHolder_;
+                                std::shared_ptr<PromiseHolder> root0 = getRoot(value.cast<Promise &>().promiseHolder_);
+                                join(root0, promiseHolder);
+                                promiseHolder = root0;
                             }
 #endif
                         }
                         catch (const bad_any_cast &) {
                             //just go through if argument type is not match
+#if PROMISE_MULTITHREAD
+                            // Not moved if not matched
+                            promiseHolder->value_ = std::move(arg);
+#endif
                             promiseHolder->state_ = TaskState::kRejected;
                         }
                     }
@@ -288,131 +412,568 @@ static inline void call(std::shared_ptr<Task> task) {
             task->onResolved_.clear();
             task->onRejected_.clear();
         }
+#if PROMISE_MULTITHREAD
+        if (onCalled)
+            onCalled();
+#endif
 
         // lock for 2nd stage
         // promiseHolder may be changed, so we need to lock again
         {
             // get next task
 #if PROMISE_MULTITHREAD
-            std::shared_ptr<Mutex> mutex = promiseHolder->mutex_;
-            std::lock_guard<Mutex> lock(*mutex);
+            std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
+            std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+            promiseHolder = getRoot(promiseHolder);
 #endif
-            std::list<std::shared_ptr<Task>> &pendingTasks2 = promiseHolder->pendingTasks_;
-            if (pendingTasks2.size() == 0) {
+            syncRecord(promiseHolder.get());
+            if (!promiseHolder->pendingHead_) {
                 return;
             }
 
-            task = pendingTasks2.front();
+            task = promiseHolder->pendingHead_;
         }
     }
 }
 
-Defer::Defer(const std::shared_ptr<Task> &task) {
-    std::shared_ptr<SharedPromise> sharedPromise(new SharedPromise{ task->promiseHolder_.lock() });
-#if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex> mutex = sharedPromise->obtainLock();
-    std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
-#endif
+// Per-thread queue of the tasks called inside other tasks, enabled by TrampolineScope
+struct Trampoline {
+    using Item  = std::pair<std::shared_ptr<PromiseHolder>, std::shared_ptr<Task>>;
+    // Not allocated by pool_allocator, the queue lives longer than any Arena of this thread
+    using Queue = std::deque<Item>;
+
+    Trampoline()
+        : isEnabled_(false)
+        , depth_(0) {
+    }
+
+    static Trampoline &current() {
+        static thread_local Trampoline s_trampoline;
+        return s_trampoline;
+    }
+
+    bool  isEnabled_;
+    int   depth_;
+    Queue queue_;
+};
+
+TrampolineScope::TrampolineScope()
+    : previous_(Trampoline::current().isEnabled_) {
+    Trampoline::current().isEnabled_ = true;
+}
+
+TrampolineScope::~TrampolineScope() {
+    Trampoline::current().isEnabled_ = previous_;
+}
+
+// Call the tasks from "task" in the chain of promiseHolder.
+// If trampoline is enabled, the calls inside other tasks are queued and called
+// by the outermost one, so that the stack depth is bounded.
+static inline void call(std::shared_ptr<PromiseHolder> promiseHolder, std::shared_ptr<Task> task) {
+    Trampoline &trampoline = Trampoline::current();
+    if (!trampoline.isEnabled_) {
+        callTasks(std::move(promiseHolder), std::move(task));
+        return;
+    }
+    if (trampoline.depth_ > 0) {
+        trampoline.queue_.emplace_back(std::move(promiseHolder), std::move(task));
+        return;
+    }
 
-    task_ = task;
-    sharedPromise_ = sharedPromise;
+    struct DepthGuard {
+        explicit DepthGuard(int &depth) : depth_(depth) { ++depth_; }
+        ~DepthGuard() { --depth_; }
+        int &depth_;
+    } guard(trampoline.depth_);
+
+    callTasks(std::move(promiseHolder), std::move(task));
+    while (!trampoline.queue_.empty()) {
+        Trampoline::Item item = std::move(trampoline.queue_.front());
+        trampoline.queue_.pop_front();
+        callTasks(std::move(item.first), std::move(item.second));
+    }
+}
+
+Defer::Defer(const std::shared_ptr<PromiseHolder> &promiseHolder, const std::shared_ptr<Task> &task)
+    : task_(task)
+    , promiseHolder_(promiseHolder) {
 }
 
 
 void Defer::resolve(const any &arg) const {
+    resolve(any(arg));
+}
+
+void Defer::resolve(any &&arg) const {
+    std::shared_ptr<PromiseHolder> promiseHolder = promiseHolder_;
+    {
 #if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
-    std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+        std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
+        std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+        promiseHolder = getRoot(promiseHolder);
 #endif
 
-    if (task_->state_ != TaskState::kPending) return;
-    std::shared_ptr<PromiseHolder> &promiseHolder = sharedPromise_->promiseHolder_;
-    promiseHolder->state_ = TaskState::kResolved;
-    promiseHolder->value_ = arg;
-    call(task_);
+        if (task_->state_ != TaskState::kPending) return;
+        // If the task was moved to another promise by join(),
+        // it is settled by that promise instead of this defer.
+        if (promiseHolder == promiseHolder_) {
+            promiseHolder->state_ = TaskState::kResolved;
+            promiseHolder->value_ = std::move(arg);
+            instrument::emit(InstrumentEvent::kSettle, promiseHolder.get());
+            syncRecord(promiseHolder.get());
+        }
+    }
+    // Called without lock, the state is checked again in call()
+    call(promiseHolder, task_);
 }
 
 void Defer::reject(const any &arg) const {
+    reject(any(arg));
+}
+
+void Defer::reject(any &&arg) const {
+    std::shared_ptr<PromiseHolder> promiseHolder = promiseHolder_;
+    {
 #if PROMISE_MULTITHREAD
-    std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
-    std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+        std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
+        std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+        promiseHolder = getRoot(promiseHolder);
 #endif
 
-    if (task_->state_ != TaskState::kPending) return;
-    std::shared_ptr<PromiseHolder> &promiseHolder = sharedPromise_->promiseHolder_;
-    promiseHolder->state_ = TaskState::kRejected;
-    promiseHolder->value_ = arg;
-    call(task_);
+        if (task_->state_ != TaskState::kPending) return;
+        // If the task was moved to another promise by join(),
+        // it is settled by that promise instead of this defer.
+        if (promiseHolder == promiseHolder_) {
+            promiseHolder->state_ = TaskState::kRejected;
+            promiseHolder->value_ = std::move(arg);
+            instrument::emit(InstrumentEvent::kSettle, promiseHolder.get());
+            syncRecord(promiseHolder.get());
+        }
+    }
+    // Called without lock, the state is checked again in call()
+    call(promiseHolder, task_);
 }
 
 
 Promise Defer::getPromise() const {
-    return Promise{ sharedPromise_ };
+    return Promise{ promiseHolder_ };
 }
 
 
-struct DoBreakTag {};
+struct DeferLoop::State {
+    explicit State(const std::function<void(DeferLoop &loop)> &run)
+        : run_(run)
+        , promise_(newPromise())
+        , iteration_(0)
+        , isRunning_(false)
+        , isContinued_(false)
+        , isFinished_(false) {
+    }
+
+    // Run the iterations in a loop until one is not continued in the loop body,
+    // the iteration continued later calls this again.
+    void run(const std::shared_ptr<State> &self) {
+        while (true) {
+            size_t iteration;
+            {
+#if PROMISE_MULTITHREAD
+                std::lock_guard<std::mutex> lock(mutex_);
+#endif
+                iteration = iteration_;
+                isRunning_ = true;
+                isContinued_ = false;
+            }
+
+            DeferLoop loop(self, iteration);
+            try {
+                run_(loop);
+            }
+            catch (...) {
+                loop.reject(any(std::current_exception()));
+            }
+
+            std::function<void(DeferLoop &loop)> run;  // released after unlocked
+            {
+#if PROMISE_MULTITHREAD
+                std::lock_guard<std::mutex> lock(mutex_);
+#endif
+                isRunning_ = false;
+                if (isFinished_)
+                    run.swap(run_);
+                if (!isContinued_)
+                    return;
+            }
+        }
+    }
+
+    // Finish the iteration by continue (isLoopFinished is false), break or reject.
+    // Returns false if the iteration was finished already.
+    // isRunLoop is set if the next iteration should be run by the caller.
+    bool finish(size_t iteration, bool isLoopFinished, bool &isRunLoop) {
+        std::vector<Promise> watchers;
+        std::function<void(DeferLoop &loop)> run;  // released after unlocked
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            if (isFinished_ || iteration != iteration_)
+                return false;
+            ++iteration_;
+            watchers.swap(watchers_);
+            isRunLoop = false;
+            if (isLoopFinished) {
+                isFinished_ = true;
+                if (!isRunning_)
+                    run.swap(run_);
+            }
+            else if (isRunning_)
+                isContinued_ = true;
+            else
+                isRunLoop = true;
+        }
+        for (const Promise &watcher : watchers)
+            watcher.reject();
+        return true;
+    }
+
+    std::function<void(DeferLoop &loop)> run_;
+    Promise              promise_;
+    size_t               iteration_;    // count of the finished iterations
+    bool                 isRunning_;    // the loop body is running
+    bool                 isContinued_;  // continued when the loop body is running
+    bool                 isFinished_;
+    std::vector<Promise> watchers_;     // rejected when this iteration is finished
+#if PROMISE_MULTITHREAD
+    std::mutex           mutex_;
+#endif
+};
 
-DeferLoop::DeferLoop(const Defer &defer)
-    : defer_(defer) {
+DeferLoop::DeferLoop(const std::shared_ptr<State> &state, size_t iteration)
+    : state_(state)
+    , iteration_(iteration) {
 }
 
 void DeferLoop::doContinue() const {
-    defer_.resolve();
+    // If called in the loop body, the next iteration is run by State::run() without recursion
+    bool isRunLoop;
+    if (state_->finish(iteration_, false, isRunLoop) && isRunLoop)
+        state_->run(state_);
 }
 
 void DeferLoop::doBreak(const any &arg) const {
-    defer_.reject(DoBreakTag(), arg);
+    doBreak(any(arg));
 }
 
 void DeferLoop::reject(const any &arg) const {
-    defer_.reject(arg);
+    reject(any(arg));
+}
+
+void DeferLoop::doBreak(any &&arg) const {
+    bool isRunLoop;
+    if (state_->finish(iteration_, true, isRunLoop))
+        state_->promise_.resolve(std::move(arg));
+}
+
+void DeferLoop::reject(any &&arg) const {
+    bool isRunLoop;
+    if (state_->finish(iteration_, true, isRunLoop))
+        state_->promise_.reject(std::move(arg));
 }
 
 Promise DeferLoop::getPromise() const {
-    return defer_.getPromise();
+    return state_->promise_;
+}
+
+void DeferLoop::watch(const Promise &promise) const {
+#if PROMISE_MULTITHREAD
+    std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+    if (!state_->isFinished_ && iteration_ == state_->iteration_)
+        state_->watchers_.push_back(promise);
 }
 
 #if PROMISE_MULTITHREAD
 Mutex::Mutex()
-    : cond_()
-    , mutex_()
+    : isLocal_(false)
+    , state_(kUnlocked)
+    , owner_(std::thread::id())
+    , lock_count_(0) {
+}
+
+Mutex::Mutex(bool isLocal)
+    : isLocal_(isLocal)
+    , state_(kUnlocked)
+    , owner_(std::thread::id())
     , lock_count_(0) {
 }
 
-void Mutex::lock() {
-    mutex_.lock();
-    ++lock_count_;
+Mutex *Mutex::local() {
+    static Mutex s_local(true);
+    return &s_local;
+}
+
+// Waiting threads are parked in a shared table, hashed by address of the mutex
+struct ParkingLot {
+    std::mutex              mutex_;
+    std::condition_variable cond_;
+
+    static ParkingLot &get(const void *address) {
+        static ParkingLot s_parkingLots[64];
+        size_t hash = reinterpret_cast<size_t>(address);
+        hash ^= (hash >> 6) ^ (hash >> 12);
+        return s_parkingLots[hash % 64];
+    }
+};
+
+void Mutex::lockSlow(int state) {
+    instrument::count(instrument::kLockContentions);
+    // Spin for a short while, the lock is normally held for short time
+    for (int i = 0; i < 64 && state != kUnlocked; ++i) {
+        std::this_thread::yield();
+        state = state_.load(std::memory_order_relaxed);
+        if (state == kUnlocked
+            && state_.compare_exchange_strong(state, kLocked, std::memory_order_acquire))
+            return;
+    }
+
+    ParkingLot &parkingLot = ParkingLot::get(this);
+    while (state_.exchange(kContended, std::memory_order_acquire) != kUnlocked) {
+        std::unique_lock<std::mutex> lock(parkingLot.mutex_);
+        if (state_.load(std::memory_order_relaxed) == kContended)
+            parkingLot.cond_.wait(lock);
+    }
 }
 
-void Mutex::unlock() {
-    --lock_count_;
-    mutex_.unlock();
+void Mutex::wakeOne() {
+    ParkingLot &parkingLot = ParkingLot::get(this);
+    std::lock_guard<std::mutex> lock(parkingLot.mutex_);
+    // The parking lot is shared by many mutexes, notify all of them to recheck
+    parkingLot.cond_.notify_all();
 }
 
 void Mutex::lock(size_t lock_count) {
-    for (size_t i = 0; i < lock_count; ++i)
-        this->lock();
+    if (lock_count == 0 || isLocal_) return;
+    this->lock();
+    lock_count_ += lock_count - 1;
 }
 
 void Mutex::unlock(size_t lock_count) {
-    for (size_t i = 0; i < lock_count; ++i)
-        this->unlock();
+    if (lock_count == 0 || isLocal_) return;
+    lock_count_ -= lock_count - 1;
+    this->unlock();
 }
 #endif
 
+// Thread local free lists of fixed size blocks
+struct MemoryPool {
+    struct Block {
+        Block *next_;
+    };
+    static const size_t kGranularity = 16;
+    static const size_t kBlockSizes  = (PROMISE_POOL_MAX_BLOCK_SIZE + kGranularity - 1) / kGranularity;
+
+    MemoryPool() {
+        for (size_t i = 0; i < kBlockSizes; ++i) {
+            free_[i] = nullptr;
+            count_[i] = 0;
+        }
+    }
+
+    ~MemoryPool() {
+        *destroyed() = true;
+        for (size_t i = 0; i < kBlockSizes; ++i) {
+            while (free_[i] != nullptr) {
+                Block *block = free_[i];
+                free_[i] = block->next_;
+                ::operator delete(block);
+            }
+        }
+    }
+
+    // Blocks may be released in another thread, or after the pool of this thread was destroyed
+    static bool *destroyed() {
+        static thread_local bool s_destroyed = false;
+        return &s_destroyed;
+    }
+
+    static MemoryPool *instance() {
+        if (*destroyed()) return nullptr;
+        static thread_local MemoryPool s_pool;
+        return &s_pool;
+    }
+
+    static void *allocate(size_t size) {
+        if (size == 0 || size > PROMISE_POOL_MAX_BLOCK_SIZE)
+            return ::operator new(size);
+
+        size_t index = (size - 1) / kGranularity;
+        MemoryPool *pool = instance();
+        if (pool != nullptr && pool->free_[index] != nullptr) {
+            Block *block = pool->free_[index];
+            pool->free_[index] = block->next_;
+            --pool->count_[index];
+            return block;
+        }
+        return ::operator new((index + 1) * kGranularity);
+    }
+
+    static void deallocate(void *ptr, size_t size) {
+        if (ptr == nullptr) return;
+        if (size == 0 || size > PROMISE_POOL_MAX_BLOCK_SIZE) {
+            ::operator delete(ptr);
+            return;
+        }
+
+        size_t index = (size - 1) / kGranularity;
+        MemoryPool *pool = instance();
+        if (pool == nullptr || pool->count_[index] >= PROMISE_POOL_MAX_FREE_BLOCKS) {
+            ::operator delete(ptr);
+            return;
+        }
+        Block *block = static_cast<Block *>(ptr);
+        block->next_ = pool->free_[index];
+        pool->free_[index] = block;
+        ++pool->count_[index];
+    }
+
+    Block *free_[kBlockSizes];
+    size_t count_[kBlockSizes];
+};
+
+static inline Allocator &currentAllocator() {
+    static Allocator s_allocator = getPoolAllocator();
+    return s_allocator;
+}
+
+void setAllocator(const Allocator &allocator) {
+    currentAllocator() = allocator;
+}
+
+const Allocator &getAllocator() {
+    return currentAllocator();
+}
+
+const Allocator &getPoolAllocator() {
+    static const Allocator s_poolAllocator = { &MemoryPool::allocate, &MemoryPool::deallocate };
+    return s_poolAllocator;
+}
+
+struct Arena::Chunk {
+    Chunk *next_;
+};
+
+static const size_t kArenaAlign = alignof(std::max_align_t);
+
+Arena::Arena(size_t chunkSize)
+    : chunks_(nullptr)
+    , pos_(nullptr)
+    , end_(nullptr)
+    , chunkSize_(chunkSize) {
+}
+
+Arena::~Arena() {
+    while (chunks_ != nullptr) {
+        Chunk *chunk = chunks_;
+        chunks_ = chunk->next_;
+        ::operator delete(chunk);
+    }
+}
+
+void *Arena::allocate(size_t size) {
+    // Keep the memory after chunk header aligned
+    const size_t kArenaChunkHeader = (sizeof(Chunk) + kArenaAlign - 1) / kArenaAlign * kArenaAlign;
+    size = (size + kArenaAlign - 1) / kArenaAlign * kArenaAlign;
+    if (pos_ == nullptr || size > (size_t)(end_ - pos_)) {
+        size_t chunkSize = (size > chunkSize_ ? size : chunkSize_);
+        Chunk *chunk = static_cast<Chunk *>(::operator new(kArenaChunkHeader + chunkSize));
+        chunk->next_ = chunks_;
+        chunks_ = chunk;
+        pos_ = reinterpret_cast<char *>(chunk) + kArenaChunkHeader;
+        end_ = pos_ + chunkSize;
+    }
+
+    void *ptr = pos_;
+    pos_ += size;
+    return ptr;
+}
+
+Arena *&Arena::currentRef() {
+    static thread_local Arena *s_current = nullptr;
+    return s_current;
+}
+
+Arena *Arena::current() {
+    return currentRef();
+}
+
+ArenaScope::ArenaScope(Arena &arena)
+    : previous_(Arena::currentRef()) {
+    Arena::currentRef() = &arena;
+}
+
+ArenaScope::~ArenaScope() {
+    Arena::currentRef() = previous_;
+}
+
 PromiseHolder::PromiseHolder() 
-    : owners_()
-    , pendingTasks_()
+    : pendingHead_()
+    , pendingTail_(nullptr)
+    , forward_()
+    , state_(TaskState::kPending)
+    , value_()
+    , executor_()
+#if PROMISE_MULTITHREAD
+    , mutex_(&ownMutex_)
+    , ownMutex_()
+    , isCalling_(false)
+    , onCalled_()
+#endif
+#if PROMISE_INSTRUMENT
+    , record_(nullptr)
+#endif
+{
+    instrument::count(instrument::kLivePromises);
+    instrument::emit(InstrumentEvent::kCreate, this);
+}
+
+PromiseHolder::PromiseHolder(bool isLocal)
+    : pendingHead_()
+    , pendingTail_(nullptr)
+    , forward_()
     , state_(TaskState::kPending)
     , value_()
+    , executor_()
 #if PROMISE_MULTITHREAD
-    , mutex_(std::make_shared<Mutex>())
+    , mutex_(isLocal ? Mutex::local() : &ownMutex_)
+    , ownMutex_()
+    , isCalling_(false)
+    , onCalled_()
+#endif
+#if PROMISE_INSTRUMENT
+    , record_(nullptr)
 #endif
 {
+    (void)isLocal;
+    instrument::count(instrument::kLivePromises);
+    instrument::emit(InstrumentEvent::kCreate, this);
 }
 
 PromiseHolder::~PromiseHolder() {
+#if PROMISE_INSTRUMENT
+    if (record_ != nullptr)
+        instrument::untrack(record_);
+#endif
+    // Release the task chain without recursion
+    while (pendingHead_) {
+        std::shared_ptr<Task> next = std::move(pendingHead_->next_);
+        pendingHead_ = std::move(next);
+        instrument::count(instrument::kPendingTasks, -1);
+    }
+    instrument::count(instrument::kLivePromises, -1);
+
     if (this->state_ == TaskState::kRejected) {
         static thread_local std::atomic<bool> s_inUncaughtExceptionHandler{false};
         if(s_inUncaughtExceptionHandler) return;
@@ -451,6 +1012,7 @@ any *PromiseHolder::getDefaultUncaughtExceptionHandler() {
 }
 
 void PromiseHolder::onUncaughtException(const any &arg) {
+    instrument::count(instrument::kUncaughtRejections);
     any *onUncaughtException = getUncaughtExceptionHandler();
     if (onUncaughtException == nullptr || onUncaughtException->empty()) {
         onUncaughtException = getDefaultUncaughtExceptionHandler();
@@ -468,43 +1030,300 @@ void PromiseHolder::handleUncaughtException(const any &onUncaughtException) {
     (*getUncaughtExceptionHandler()) = onUncaughtException;
 }
 
-#if PROMISE_MULTITHREAD
-std::shared_ptr<Mutex> SharedPromise::obtainLock() const {
-    while (true) {
-        std::shared_ptr<Mutex> mutex = this->promiseHolder_->mutex_;
-        mutex->lock();
+#if PROMISE_INSTRUMENT
+namespace instrument {
 
-        // pointer to mutex may be changed after locked, 
-        // in this case we should try to lock and test again
-        if (mutex == this->promiseHolder_->mutex_)
-            return mutex;
-        mutex->unlock();
-    }
-    return nullptr;
+Shard *shards() {
+    static Shard s_shards[kShardCount];
+    return s_shards;
 }
-#endif
 
-Promise &Promise::then(const any &deferOrPromiseOrOnResolved) {
-    if (deferOrPromiseOrOnResolved.type() == type_id<Defer>()) {
-        Defer &defer = deferOrPromiseOrOnResolved.cast<Defer &>();
-        Promise promise = defer.getPromise();
-        Promise &ret = then([defer](const any &arg) -> any {
-            defer.resolve(arg);
-            return nullptr;
-        }, [defer](const any &arg) ->any {
-            defer.reject(arg);
-            return nullptr;
-        });
+std::atomic<int64_t> &maxForwardHops() {
+    static std::atomic<int64_t> s_maxForwardHops(0);
+    return s_maxForwardHops;
+}
 
-        promise.finally([=]() {
-            ret.reject();
-        });
+std::atomic<InstrumentHook> &hook() {
+    static std::atomic<InstrumentHook> s_hook(nullptr);
+    return s_hook;
+}
 
-        return ret;
-    }
-    else if (deferOrPromiseOrOnResolved.type() == type_id<DeferLoop>()) {
-        DeferLoop &loop = deferOrPromiseOrOnResolved.cast<DeferLoop &>();
-        Promise promise = loop.getPromise();
+std::atomic<void *> &hookData() {
+    static std::atomic<void *> s_hookData(nullptr);
+    return s_hookData;
+}
+
+} // namespace instrument
+#endif
+
+Stats getStats() {
+    int64_t values[instrument::kCounterCount] = {};
+#if PROMISE_INSTRUMENT
+    instrument::Shard *shards = instrument::shards();
+    for (int shard = 0; shard < instrument::kShardCount; ++shard) {
+        for (int counter = 0; counter < instrument::kCounterCount; ++counter)
+            values[counter] += shards[shard].values_[counter].load(std::memory_order_relaxed);
+    }
+#endif
+
+    Stats stats;
+    stats.livePromises       = values[instrument::kLivePromises];
+    stats.liveTasks          = values[instrument::kLiveTasks];
+    stats.pendingTasks       = values[instrument::kPendingTasks];
+    stats.joins              = values[instrument::kJoins];
+#if PROMISE_INSTRUMENT
+    stats.maxForwardHops     = instrument::maxForwardHops().load(std::memory_order_relaxed);
+#else
+    stats.maxForwardHops     = 0;
+#endif
+    stats.uncaughtRejections = values[instrument::kUncaughtRejections];
+    stats.lockContentions    = values[instrument::kLockContentions];
+    return stats;
+}
+
+void setInstrumentHook(InstrumentHook hook, void *userData) {
+#if PROMISE_INSTRUMENT
+    instrument::hookData().store(userData, std::memory_order_relaxed);
+    instrument::hook().store(hook, std::memory_order_release);
+#else
+    (void)hook;
+    (void)userData;
+#endif
+}
+
+#if PROMISE_INSTRUMENT
+namespace instrument {
+
+// Tracked promises created by the threads of the shard
+struct alignas(64) RegistryShard {
+#if PROMISE_MULTITHREAD
+    std::mutex  mutex_;
+#endif
+    LiveRecord *head_;
+};
+
+RegistryShard *registryShards() {
+    static RegistryShard s_shards[kShardCount];
+    return s_shards;
+}
+
+std::atomic<uint32_t> &leakSampling() {
+    static std::atomic<uint32_t> s_rate(0);
+    return s_rate;
+}
+
+const LeakSite *&currentSite() {
+    static thread_local const LeakSite *s_site = nullptr;
+    return s_site;
+}
+
+LiveRecord *trackSlow(const void *id, const void *caller, uint32_t rate) {
+    static thread_local uint32_t s_countdown = 0;
+    if (s_countdown == 0 || s_countdown > rate)
+        s_countdown = rate;
+    if (--s_countdown != 0)
+        return nullptr;
+
+    LiveRecord *record = new LiveRecord();
+    record->prev_    = nullptr;
+    record->shard_   = currentShardIndex();
+    record->id_      = id;
+    record->site_    = currentSite();
+    record->caller_  = caller;
+    record->rate_    = rate;
+    record->created_ = std::chrono::steady_clock::now();
+    record->state_.store((int)LiveState::kPending, std::memory_order_relaxed);
+    record->pendingTasks_.store(0, std::memory_order_relaxed);
+    record->valueSize_.store(0, std::memory_order_relaxed);
+
+    RegistryShard &shard = registryShards()[record->shard_];
+#if PROMISE_MULTITHREAD
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+#endif
+    record->next_ = shard.head_;
+    if (shard.head_ != nullptr)
+        shard.head_->prev_ = record;
+    shard.head_ = record;
+    return record;
+}
+
+void untrack(LiveRecord *record) {
+    {
+        RegistryShard &shard = registryShards()[record->shard_];
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+#endif
+        if (record->prev_ != nullptr)
+            record->prev_->next_ = record->next_;
+        else
+            shard.head_ = record->next_;
+        if (record->next_ != nullptr)
+            record->next_->prev_ = record->prev_;
+    }
+    delete record;
+}
+
+struct LiveSnapshot {
+    LivePromise promise_;
+    uint32_t    rate_;
+};
+
+// Copy the tracked promises, the oldest first
+static inline std::vector<LiveSnapshot> snapshotLivePromises(bool pendingOnly) {
+    std::vector<LiveSnapshot> snapshots;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    RegistryShard *shards = registryShards();
+    for (int index = 0; index < kShardCount; ++index) {
+        RegistryShard &shard = shards[index];
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+#endif
+        for (const LiveRecord *record = shard.head_; record != nullptr; record = record->next_) {
+            LiveState state = (LiveState)record->state_.load(std::memory_order_relaxed);
+            if (pendingOnly && state != LiveState::kPending)
+                continue;
+            LiveSnapshot snapshot;
+            snapshot.promise_.id           = record->id_;
+            snapshot.promise_.site         = record->site_;
+            snapshot.promise_.caller       = record->caller_;
+            snapshot.promise_.age          = now - record->created_;
+            snapshot.promise_.state        = state;
+            snapshot.promise_.pendingTasks = record->pendingTasks_.load(std::memory_order_relaxed);
+            snapshot.promise_.valueSize    = record->valueSize_.load(std::memory_order_relaxed);
+            snapshot.rate_                 = record->rate_;
+            snapshots.push_back(snapshot);
+        }
+    }
+    std::sort(snapshots.begin(), snapshots.end(), [](const LiveSnapshot &left, const LiveSnapshot &right) {
+        return left.promise_.age > right.promise_.age;
+    });
+    return snapshots;
+}
+
+} // namespace instrument
+#endif
+
+void setLeakSampling(uint32_t rate) {
+#if PROMISE_INSTRUMENT
+    instrument::leakSampling().store(rate, std::memory_order_relaxed);
+#else
+    (void)rate;
+#endif
+}
+
+std::vector<LivePromise> getLivePromises(size_t limit, bool pendingOnly) {
+    std::vector<LivePromise> promises;
+#if PROMISE_INSTRUMENT
+    std::vector<instrument::LiveSnapshot> snapshots = instrument::snapshotLivePromises(pendingOnly);
+    for (size_t i = 0; i < snapshots.size() && i < limit; ++i)
+        promises.push_back(snapshots[i].promise_);
+#else
+    (void)limit;
+    (void)pendingOnly;
+#endif
+    return promises;
+}
+
+std::vector<LivePromiseSite> getLivePromiseSites(size_t limit, bool pendingOnly) {
+    std::vector<LivePromiseSite> sites;
+#if PROMISE_INSTRUMENT
+    // The snapshots are the oldest first, so the first one of a site has the oldest age
+    std::map<std::pair<const LeakSite *, const void *>, size_t> indexes;
+    for (const instrument::LiveSnapshot &snapshot : instrument::snapshotLivePromises(pendingOnly)) {
+        const LivePromise &promise = snapshot.promise_;
+        auto found = indexes.emplace(std::make_pair(promise.site, promise.caller), sites.size());
+        if (found.second) {
+            LivePromiseSite site;
+            site.site         = promise.site;
+            site.caller       = promise.caller;
+            site.count        = 0;
+            site.oldestAge    = promise.age;
+            site.pendingTasks = 0;
+            site.valueSize    = 0;
+            sites.push_back(site);
+        }
+        LivePromiseSite &site = sites[found.first->second];
+        ++site.count;
+        site.pendingTasks += promise.pendingTasks;
+        site.valueSize    += promise.valueSize;
+    }
+    if (sites.size() > limit)
+        sites.resize(limit);
+#else
+    (void)limit;
+    (void)pendingOnly;
+#endif
+    return sites;
+}
+
+std::string getLeakProfile(bool pendingOnly) {
+    struct Entry {
+        int64_t count_;
+        int64_t bytes_;
+    };
+    std::map<const void *, Entry> entries;
+    Entry total = { 0, 0 };
+#if PROMISE_INSTRUMENT
+    for (const instrument::LiveSnapshot &snapshot : instrument::snapshotLivePromises(pendingOnly)) {
+        const LivePromise &promise = snapshot.promise_;
+        int64_t bytes = (int64_t)(sizeof(PromiseHolder) + promise.valueSize + promise.pendingTasks * sizeof(Task));
+        Entry &entry = entries.emplace(promise.caller, Entry{ 0, 0 }).first->second;
+        entry.count_ += snapshot.rate_;
+        entry.bytes_ += bytes * snapshot.rate_;
+        total.count_ += snapshot.rate_;
+        total.bytes_ += bytes * snapshot.rate_;
+    }
+#else
+    (void)pendingOnly;
+#endif
+
+    std::string profile;
+    char line[128];
+    snprintf(line, sizeof(line), "heap profile: %6lld: %8lld [%6lld: %8lld] @ heap\n",
+        (long long)total.count_, (long long)total.bytes_, (long long)total.count_, (long long)total.bytes_);
+    profile += line;
+    for (const auto &entry : entries) {
+        snprintf(line, sizeof(line), "%6lld: %8lld [%6lld: %8lld] @ 0x%llx\n",
+            (long long)entry.second.count_, (long long)entry.second.bytes_,
+            (long long)entry.second.count_, (long long)entry.second.bytes_,
+            (unsigned long long)reinterpret_cast<uintptr_t>(entry.first));
+        profile += line;
+    }
+
+#ifdef __linux__
+    // pprof finds the symbols of the callers by the mapped libraries
+    profile += "\nMAPPED_LIBRARIES:\n";
+    if (FILE *maps = fopen("/proc/self/maps", "r")) {
+        char buffer[4096];
+        size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+            profile.append(buffer, size);
+        fclose(maps);
+    }
+#endif
+    return profile;
+}
+
+Promise &Promise::then(const any &deferOrPromiseOrOnResolved) {
+    if (deferOrPromiseOrOnResolved.type() == type_id<Defer>()) {
+        Defer &defer = deferOrPromiseOrOnResolved.cast<Defer &>();
+        Promise promise = defer.getPromise();
+        Promise &ret = then([defer](const any &arg) -> any {
+            defer.resolve(arg);
+            return nullptr;
+        }, [defer](const any &arg) ->any {
+            defer.reject(arg);
+            return nullptr;
+        });
+
+        promise.finally([=]() {
+            ret.reject();
+        });
+
+        return ret;
+    }
+    else if (deferOrPromiseOrOnResolved.type() == type_id<DeferLoop>()) {
+        DeferLoop &loop = deferOrPromiseOrOnResolved.cast<DeferLoop &>();
 
         Promise &ret = then([loop](const any &arg) -> any {
             (void)arg;
@@ -515,33 +1334,34 @@ Promise &Promise::then(const any &deferOrPromiseOrOnResolved) {
             return nullptr;
         });
 
-        promise.finally([=]() {
-            ret.reject();
-        });
-
+        // Rejected if the iteration is finished by others
+        loop.watch(ret);
         return ret;
     }
     else if (deferOrPromiseOrOnResolved.type() == type_id<Promise>()) {
         Promise &promise = deferOrPromiseOrOnResolved.cast<Promise &>();
 
+        std::shared_ptr<PromiseHolder> left = this->promiseHolder_;
+        std::shared_ptr<PromiseHolder> right = promise.promiseHolder_;
         std::shared_ptr<Task> task;
-        {
+        if (right) {
 #if PROMISE_MULTITHREAD
-            std::shared_ptr<Mutex> mutex0 = this->sharedPromise_->obtainLock();
+            std::shared_ptr<Mutex> mutex0 = lockRoot(left);
             std::lock_guard<Mutex> lock0(*mutex0, std::adopt_lock_t());
-            std::shared_ptr<Mutex> mutex1 = promise.sharedPromise_->obtainLock();
+            std::shared_ptr<Mutex> mutex1 = lockRoot(right);
             std::lock_guard<Mutex> lock1(*mutex1, std::adopt_lock_t());
+#else
+            left = getRoot(left);
+            right = getRoot(right);
 #endif
 
-            if (promise.sharedPromise_ && promise.sharedPromise_->promiseHolder_) {
-                join(this->sharedPromise_->promiseHolder_, promise.sharedPromise_->promiseHolder_);
-                if (this->sharedPromise_->promiseHolder_->pendingTasks_.size() > 0) {
-                    task = this->sharedPromise_->promiseHolder_->pendingTasks_.front();
-                }
+            if (left != right) {
+                join(left, right);
+                task = left->pendingHead_;
             }
         }
         if(task)
-            call(task);
+            call(left, task);
         return *this;
     }
     else {
@@ -549,23 +1369,143 @@ Promise &Promise::then(const any &deferOrPromiseOrOnResolved) {
     }
 }
 
-Promise &Promise::then(const any &onResolved, const any &onRejected) {
+// Add a task to the end of the chain, returns the task
+// Call the task in the executor, the task is added before posting,
+// otherwise it may be called in this thread if the executor runs first.
+static inline Promise postTo(const std::shared_ptr<Executor> &executor, const any &task) {
+    Promise promise = newPromise();
+    promise.then(task);
+    executor->post([promise]() {
+        promise.resolve();
+    });
+    return promise;
+}
+
+// Wrap the callback so that it is called in the executor
+static inline any callbackOn(const std::shared_ptr<Executor> &executor, const any &callback, bool isRejected) {
+    if (callback.empty() || callback.type() == type_id<std::nullptr_t>())
+        return callback;
+
+    if (!isRejected) {
+        return [executor, callback](any &&arg) -> any {
+            if (executor->isCurrent())
+                return callback.call(std::move(arg));
+            std::shared_ptr<any> value = pm_make_shared<any>(std::move(arg));
+            return postTo(executor, [callback, value]() -> any {
+                return callback.call(std::move(*value));
+            });
+        };
+    }
+    else {
+        // The reason is not moved, it is passed to the next callback if the type is not matched
+        return [executor, callback](const any &arg) -> any {
+            if (executor->isCurrent())
+                return callback.call(arg);
+            std::shared_ptr<any> value = pm_make_shared<any>(arg);
+            return postTo(executor, [callback, value]() -> any {
+                try {
+                    return callback.call(*value);
+                }
+                catch (const bad_any_cast &) {
+                    return reject(*value);
+                }
+            });
+        };
+    }
+}
+
+// The callbacks are called in the default executor of the promise if isDefaultExecutor is true
+static inline std::shared_ptr<Task> addTask(const Promise &promise, const any &onResolved, const any &onRejected,
+                                            bool isDefaultExecutor = false, bool isFinally = false) {
+    std::shared_ptr<PromiseHolder> promiseHolder = promise.promiseHolder_;
     std::shared_ptr<Task> task;
     {
 #if PROMISE_MULTITHREAD
-        std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
+        std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
         std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+        promiseHolder = getRoot(promiseHolder);
 #endif
 
-        task = std::make_shared<Task>(Task {
-            TaskState::kPending,
-            sharedPromise_->promiseHolder_,
-            onResolved,
-            onRejected
-        });
-        sharedPromise_->promiseHolder_->pendingTasks_.push_back(task);
+        const std::shared_ptr<Executor> &executor = promise.promiseHolder_->executor_;
+        if (isDefaultExecutor && executor) {
+            task = pm_make_shared<Task>(callbackOn(executor, onResolved, false),
+                                        callbackOn(executor, onRejected, true),
+                                        false);
+        }
+        else {
+            task = pm_make_shared<Task>(onResolved, onRejected, isFinally);
+        }
+        promiseHolder->pushTask(task);
+        syncRecord(promiseHolder.get());
     }
-    call(task);
+    call(promiseHolder, task);
+    return task;
+}
+
+// Remove a pending task from the chain, so that the task and its callbacks are released at once.
+// The first pending task may be settling by a defer object, only its callbacks are removed.
+// If keepLast is set and no task follows it, the task is kept with callbacks which do nothing,
+// so that the promise settled later by the caller is still handled.
+static inline void removeTask(std::shared_ptr<PromiseHolder> promiseHolder, const std::shared_ptr<Task> &task, bool keepLast = false) {
+    // Released after unlocked
+    std::shared_ptr<Task> removed;
+    any onResolved;
+    any onRejected;
+    {
+#if PROMISE_MULTITHREAD
+        std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
+        std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+        promiseHolder = getRoot(promiseHolder);
+#endif
+        if (task->state_ != TaskState::kPending)
+            return;
+
+        if (keepLast && !task->next_) {
+            onResolved.swap(task->onResolved_);
+            onRejected.swap(task->onRejected_);
+            task->onRejected_ = []() {};
+        }
+        else if (promiseHolder->pendingHead_ == task) {
+            onResolved.swap(task->onResolved_);
+            onRejected.swap(task->onRejected_);
+        }
+        else {
+            removed = promiseHolder->unlinkTask(task.get());
+            syncRecord(promiseHolder.get());
+        }
+        healthyCheck(__LINE__, promiseHolder.get());
+    }
+}
+
+static inline std::shared_ptr<PromiseHolder> getPromiseHolder(const Promise &promise) {
+    return promise.promiseHolder_;
+}
+
+Promise &Promise::then(const any &onResolved, const any &onRejected) {
+    addTask(*this, onResolved, onRejected, true);
+    return *this;
+}
+
+Promise &Promise::thenOn(const std::shared_ptr<Executor> &executor, const any &onResolved) {
+    return thenOn(executor, onResolved, any());
+}
+
+Promise &Promise::thenOn(const std::shared_ptr<Executor> &executor, const any &onResolved, const any &onRejected) {
+    if (!executor)
+        return then(onResolved, onRejected);
+    addTask(*this, callbackOn(executor, onResolved, false), callbackOn(executor, onRejected, true));
+    return *this;
+}
+
+Promise &Promise::setExecutor(const std::shared_ptr<Executor> &executor) {
+#if PROMISE_MULTITHREAD
+    std::shared_ptr<PromiseHolder> root = this->promiseHolder_;
+    std::shared_ptr<Mutex> mutex = lockRoot(root);
+    std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#endif
+    this->promiseHolder_->executor_ = executor;
     return *this;
 }
 
@@ -578,6 +1518,23 @@ Promise &Promise::always(const any &onAlways) {
 }
 
 Promise &Promise::finally(const any &onFinally) {
+    bool hasExecutor;
+    {
+#if PROMISE_MULTITHREAD
+        std::shared_ptr<PromiseHolder> root = this->promiseHolder_;
+        std::shared_ptr<Mutex> mutex = lockRoot(root);
+        std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#endif
+        hasExecutor = (this->promiseHolder_->executor_ != nullptr);
+    }
+
+    // Called in place by callTasks() without a new promise,
+    // or forwarded by a new promise after onFinally is called in the executor
+    if (!hasExecutor) {
+        addTask(*this, onFinally, any(), false, true);
+        return *this;
+    }
+
     return then([onFinally](const any &arg)->any {
         return newPromise([onFinally, arg](Defer &defer) {
             try {
@@ -599,66 +1556,81 @@ Promise &Promise::finally(const any &onFinally) {
 
 
 void Promise::resolve(const any &arg) const {
-    if (!this->sharedPromise_) return;
+    resolve(any(arg));
+}
+
+void Promise::resolve(any &&arg) const {
+    if (!this->promiseHolder_) return;
+    std::shared_ptr<PromiseHolder> promiseHolder = this->promiseHolder_;
     std::shared_ptr<Task> task;
     {
 #if PROMISE_MULTITHREAD
-        std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
+        std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
         std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+        promiseHolder = getRoot(promiseHolder);
 #endif
-
-        std::list<std::shared_ptr<Task>> &pendingTasks_ = this->sharedPromise_->promiseHolder_->pendingTasks_;
-        if (pendingTasks_.size() > 0) {
-            task = pendingTasks_.front();
-        }
+        task = promiseHolder->pendingHead_;
     }
 
     if (task) {
-        Defer defer(task);
-        defer.resolve(arg);
+        Defer defer(promiseHolder, task);
+        defer.resolve(std::move(arg));
     }
 }
 
 void Promise::reject(const any &arg) const {
-    if (!this->sharedPromise_) return;
+    reject(any(arg));
+}
+
+void Promise::reject(any &&arg) const {
+    if (!this->promiseHolder_) return;
+    std::shared_ptr<PromiseHolder> promiseHolder = this->promiseHolder_;
     std::shared_ptr<Task> task;
     {
 #if PROMISE_MULTITHREAD
-        std::shared_ptr<Mutex> mutex = this->sharedPromise_->obtainLock();
+        std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
         std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+        promiseHolder = getRoot(promiseHolder);
 #endif
-
-        std::list<std::shared_ptr<Task>> &pendingTasks_ = this->sharedPromise_->promiseHolder_->pendingTasks_;
-        if (pendingTasks_.size() > 0) {
-            task = pendingTasks_.front();
-        }
+        task = promiseHolder->pendingHead_;
     }
 
     if (task) {
-        Defer defer(task);
-        defer.reject(arg);
+        Defer defer(promiseHolder, task);
+        defer.reject(std::move(arg));
     }
 }
 
 void Promise::clear() {
-    sharedPromise_.reset();
+    promiseHolder_.reset();
 }
 
 Promise::operator bool() const {
-    return sharedPromise_.operator bool();
+    return promiseHolder_.operator bool();
 }
 
-Promise newPromise(const std::function<void(Defer &defer)> &run) {
+// "caller" is the return address of the public function, recorded if the promise is tracked
+static inline Promise createPromise(bool isLocal, const void *caller) {
     Promise promise;
-    promise.sharedPromise_ = std::make_shared<SharedPromise>();
-    promise.sharedPromise_->promiseHolder_ = std::make_shared<PromiseHolder>();
-    promise.sharedPromise_->promiseHolder_->owners_.push_back(promise.sharedPromise_);
-    
+    promise.promiseHolder_ = pm_make_shared<PromiseHolder>(isLocal);
+#if PROMISE_INSTRUMENT
+    promise.promiseHolder_->record_ = instrument::track(promise.promiseHolder_.get(), caller);
+#else
+    (void)caller;
+#endif
+
     // return as is
     promise.then(any(), any());
-    std::shared_ptr<Task> &task = promise.sharedPromise_->promiseHolder_->pendingTasks_.front();
+    return promise;
+}
+
+Promise newPromise(const std::function<void(Defer &defer)> &run) {
+    Promise promise = createPromise(false, PROMISE_RETURN_ADDRESS());
+    std::shared_ptr<Task> task = promise.promiseHolder_->pendingHead_;
 
-    Defer defer(task);
+    Defer defer(promise.promiseHolder_, task);
     try {
         run(defer);
     }
@@ -670,44 +1642,33 @@ Promise newPromise(const std::function<void(Defer &defer)> &run) {
 }
 
 Promise newPromise() {
-    Promise promise;
-    promise.sharedPromise_ = std::make_shared<SharedPromise>();
-    promise.sharedPromise_->promiseHolder_ = std::make_shared<PromiseHolder>();
-    promise.sharedPromise_->promiseHolder_->owners_.push_back(promise.sharedPromise_);
+    return createPromise(false, PROMISE_RETURN_ADDRESS());
+}
+
+Promise newLocalPromise(const std::function<void(Defer &defer)> &run) {
+    Promise promise = createPromise(true, PROMISE_RETURN_ADDRESS());
+    std::shared_ptr<Task> task = promise.promiseHolder_->pendingHead_;
+
+    Defer defer(promise.promiseHolder_, task);
+    try {
+        run(defer);
+    }
+    catch (...) {
+        defer.reject(std::current_exception());
+    }
 
-    // return as is
-    promise.then(any(), any());
     return promise;
 }
 
-Promise doWhile(const std::function<void(DeferLoop &loop)> &run) {
+Promise newLocalPromise() {
+    return createPromise(true, PROMISE_RETURN_ADDRESS());
+}
 
-    return newPromise([run](Defer &defer) {
-        DeferLoop loop(defer);
-        run(loop);
-    }).then([run](const any &arg) -> any {
-        (void)arg;
-        return doWhile(run);
-    }, [](const any &arg) -> any {
-        return newPromise([arg](Defer &defer) {
-            //printf("arg. type = %s\n", arg.type().name());
-
-            bool isBreak = false;
-            if (arg.type() == type_id<std::vector<any>>()) {
-                std::vector<any> &args = any_cast<std::vector<any> &>(arg);
-                if (args.size() == 2
-                    && args.front().type() == type_id<DoBreakTag>()
-                    && args.back().type() == type_id<std::vector<any>>()) {
-                    isBreak = true;
-                    defer.resolve(args.back());
-                }
-            }
-            
-            if(!isBreak) {
-                defer.reject(arg);
-            }
-        });
-    });
+Promise doWhile(const std::function<void(DeferLoop &loop)> &run) {
+    std::shared_ptr<DeferLoop::State> state = pm_make_shared<DeferLoop::State>(run);
+    Promise promise = state->promise_;
+    state->run(state);
+    return promise;
 }
 
 #if 0
@@ -720,80 +1681,573 @@ Promise resolve(const any &arg) {
 }
 #endif
 
+// The value or reason as seen by a task with "const any &" argument
+inline any collectedValueOf(const any &arg) {
+    if (arg.type() == type_id<std::vector<any>>()) {
+        const std::vector<any> &args = any_cast<std::vector<any> &>(arg);
+        if (args.size() == 0)
+            return any();
+        else if (args.size() == 1)
+            return args.front();
+    }
+    return arg;
+}
+
+struct AllCollector::State {
+    State(size_t count, bool isSettled)
+        : left_(count + 1)  // one more count is released by finish()
+        , isDone_(false)
+        , isSettled_(isSettled)
+        , promise_(newPromise()) {
+        if (isSettled)
+            settled_.resize(count);
+        else
+            results_.resize(count);
+    }
+
+    // The last one resolves the promise, the writes of other threads are visible to it
+    void release() {
+        if (left_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        if (isSettled_)
+            promise_.resolve(any(std::move(settled_)));
+        else if (!isDone_.exchange(true, std::memory_order_acq_rel))
+            promise_.resolve(any(std::move(results_)));
+    }
+
+    std::atomic<size_t>        left_;
+    std::atomic<bool>          isDone_;   // rejected or resolved, for all() only
+    bool                       isSettled_;
+    std::vector<any>           results_;
+    std::vector<SettledResult> settled_;
+    Promise                    promise_;
+};
+
+AllCollector::AllCollector(size_t count, bool isSettled)
+    : state_(pm_make_shared<State>(count, isSettled))
+    , index_(0) {
+}
+
+void AllCollector::add(const Promise &promise) {
+    std::shared_ptr<State> state = state_;
+    size_t index = index_++;
+    Promise child = promise;
+
+    if (state->isSettled_) {
+        child.then([state, index](const any &arg) -> any {
+            state->settled_[index].state_ = TaskState::kResolved;
+            state->settled_[index].value_ = collectedValueOf(arg);
+            state->release();
+            return arg;
+        }, [state, index](const any &arg) {
+            state->settled_[index].state_ = TaskState::kRejected;
+            state->settled_[index].value_ = collectedValueOf(arg);
+            state->release();
+        });
+    }
+    else {
+        child.then([state, index](const any &arg) -> any {
+            if (!state->isDone_.load(std::memory_order_acquire))
+                state->results_[index] = collectedValueOf(arg);
+            state->release();
+            return arg;
+        }, [state](const any &arg) {
+            // Rejected by the first one, the results are not used any more
+            if (!state->isDone_.exchange(true, std::memory_order_acq_rel))
+                state->promise_.reject(arg);
+        });
+    }
+}
+
+Promise AllCollector::finish() {
+    Promise promise = state_->promise_;
+    state_->release();
+    return promise;
+}
+
 Promise all(const std::list<Promise> &promise_list) {
-    if (promise_list.size() == 0) {
-        return resolve();
-    }
-
-    std::shared_ptr<size_t> finished = std::make_shared<size_t>(0);
-    std::shared_ptr<size_t> size = std::make_shared<size_t>(promise_list.size());
-    std::shared_ptr<std::vector<any>> retArr = std::make_shared<std::vector<any>>();
-    retArr->resize(*size);
-
-    return newPromise([=](Defer &defer) {
-        size_t index = 0;
-        for (auto promise : promise_list) {
-            promise.then([=](const any &arg) {
-                (*retArr)[index] = arg;
-                if (++(*finished) >= *size) {
-                    defer.resolve(*retArr);
-                }
-            }, [=](const any &arg) {
-                defer.reject(arg);
-            });
+    return collectAll(promise_list.begin(), promise_list.end(), false);
+}
 
-            ++index;
-        }
-    });
+Promise allSettled(const std::list<Promise> &promise_list) {
+    return collectAll(promise_list.begin(), promise_list.end(), true);
 }
 
-static Promise race(const std::list<Promise> &promise_list, std::shared_ptr<int> winner) {
-    return newPromise([=](Defer &defer) {
-        int index = 0;
-        for (auto it = promise_list.begin(); it != promise_list.end(); ++it, ++index) {
-            auto promise = *it;
-            promise.then([=](const any &arg) {
-                *winner = index;
-                defer.resolve(arg);
-                return arg;
-            }, [=](const any &arg) {
-                *winner = index;
-                defer.reject(arg);
-                return arg;
-            });
+struct RaceCollector::State {
+    struct Entry {
+        std::weak_ptr<PromiseHolder> promiseHolder_;
+        std::weak_ptr<Task>          task_;
+        Promise                      promise_;  // only kept if the losers are settled
+    };
+
+    State(size_t count, TaskState loserState)
+        : hasWinner_(false)
+        , isDetached_(false)
+        , winner_(0)
+        , loserState_(loserState)
+        , promise_(newPromise()) {
+        entries_.reserve(count);
+    }
+
+    // Called by the first settled promise
+    void settle(size_t winner, TaskState state, const any &arg) {
+        std::vector<Entry> entries;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            isDetached_ = true;
+            winner_ = winner;
+            entries.swap(entries_);
         }
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (i == winner) continue;
+            // Detached before settled, so that the loser is settled to its own tasks,
+            // or to the emptied race task if it has none
+            detach(entries[i], loserState_ != TaskState::kPending);
+            if (loserState_ == TaskState::kRejected)
+                entries[i].promise_.reject();
+            else if (loserState_ == TaskState::kResolved)
+                entries[i].promise_.resolve();
+        }
+
+        if (state == TaskState::kResolved)
+            promise_.resolve(arg);
+        else
+            promise_.reject(arg);
+    }
+
+    static void detach(const Entry &entry, bool keepLast) {
+        std::shared_ptr<PromiseHolder> promiseHolder = entry.promiseHolder_.lock();
+        std::shared_ptr<Task> task = entry.task_.lock();
+        if (promiseHolder && task)
+            removeTask(promiseHolder, task, keepLast);
+    }
+
+    std::atomic<bool>  hasWinner_;
+    bool               isDetached_;  // entries_ were taken by the winner, protected by mutex_
+    size_t             winner_;
+    TaskState          loserState_;
+    std::vector<Entry> entries_;
+    Promise            promise_;
+#if PROMISE_MULTITHREAD
+    std::mutex         mutex_;
+#endif
+};
+
+RaceCollector::RaceCollector(size_t count, TaskState loserState)
+    : state_(pm_make_shared<State>(count, loserState))
+    , index_(0) {
+}
+
+void RaceCollector::add(const Promise &promise) {
+    size_t index = index_++;
+    std::shared_ptr<State> state = state_;
+    if (state->hasWinner_.load(std::memory_order_acquire)) {
+        // Already decided by the winner, only a task which handles the settlement is added
+        if (state->loserState_ != TaskState::kPending)
+            addTask(promise, any(), []() {});
+        if (state->loserState_ == TaskState::kRejected)
+            promise.reject();
+        else if (state->loserState_ == TaskState::kResolved)
+            promise.resolve();
+        return;
+    }
+
+    State::Entry entry;
+    entry.promiseHolder_ = getPromiseHolder(promise);
+    if (state->loserState_ != TaskState::kPending)
+        entry.promise_ = promise;
+    entry.task_ = addTask(promise, [state, index](const any &arg) -> any {
+        if (!state->hasWinner_.exchange(true, std::memory_order_acq_rel))
+            state->settle(index, TaskState::kResolved, arg);
+        return arg;
+    }, [state, index](const any &arg) -> any {
+        if (!state->hasWinner_.exchange(true, std::memory_order_acq_rel))
+            state->settle(index, TaskState::kRejected, arg);
+        return arg;
     });
+
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(state->mutex_);
+#endif
+        if (!state->isDetached_) {
+            // Keep the index of entries same as the promises
+            state->entries_.resize(index);
+            state->entries_.push_back(std::move(entry));
+            return;
+        }
+        if (state->winner_ == index)
+            return;
+    }
+
+    // The winner was settled when the task was being added
+    State::detach(entry, state->loserState_ != TaskState::kPending);
+    if (state->loserState_ == TaskState::kRejected)
+        entry.promise_.reject();
+    else if (state->loserState_ == TaskState::kResolved)
+        entry.promise_.resolve();
+}
+
+Promise RaceCollector::finish() {
+    return state_->promise_;
 }
 
 Promise race(const std::list<Promise> &promise_list) {
-    std::shared_ptr<int> winner = std::make_shared<int>(-1);
-    return race(promise_list, winner);
+    return collectRace(promise_list.begin(), promise_list.end(), TaskState::kPending);
 }
 
 Promise raceAndReject(const std::list<Promise> &promise_list) {
-    std::shared_ptr<int> winner = std::make_shared<int>(-1);
-    return race(promise_list, winner).finally([promise_list, winner] {
-        int index = 0;
-        for (auto it = promise_list.begin(); it != promise_list.end(); ++it, ++index) {
-            if (index != *winner) {
-                auto promise = *it;
-                promise.reject();
+    return collectRace(promise_list.begin(), promise_list.end(), TaskState::kRejected);
+}
+
+Promise raceAndResolve(const std::list<Promise> &promise_list) {
+    return collectRace(promise_list.begin(), promise_list.end(), TaskState::kResolved);
+}
+
+struct MapLimitState {
+    MapLimitState(size_t count, size_t limit, const std::function<Promise(size_t index)> &func)
+        : func_(func)
+        , count_(count)
+        , limit_(limit == 0 ? 1 : limit)
+        , next_(0)
+        , running_(0)
+        , isPumping_(false)
+        , isDone_(false)
+        , results_(count)
+        , promise_(newPromise()) {
+    }
+
+    // Start the next indexes until "limit" are running. It is not called recursively,
+    // the promises settled inside func are counted by the loop which is running already.
+    static void pump(const std::shared_ptr<MapLimitState> &self) {
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(self->mutex_);
+#endif
+            if (self->isPumping_)
+                return;
+            self->isPumping_ = true;
+        }
+
+        while (true) {
+            size_t index;
+            bool isFinished = false;
+            {
+#if PROMISE_MULTITHREAD
+                std::lock_guard<std::mutex> lock(self->mutex_);
+#endif
+                if (self->isDone_ || self->running_ >= self->limit_ || self->next_ == self->count_) {
+                    self->isPumping_ = false;
+                    if (self->isDone_ || self->running_ > 0 || self->next_ < self->count_)
+                        return;
+                    self->isDone_ = true;
+                    isFinished = true;
+                }
+                else {
+                    index = self->next_++;
+                    ++self->running_;
+                }
+            }
+
+            if (isFinished) {
+                self->promise_.resolve(any(std::move(self->results_)));
+                return;
             }
+            start(self, index);
         }
+    }
+
+    static void start(const std::shared_ptr<MapLimitState> &self, size_t index) {
+        Promise promise;
+        try {
+            promise = self->func_(index);
+        }
+        catch (...) {
+            complete(self, index, false, any(std::current_exception()));
+            return;
+        }
+
+        promise.then([self, index](const any &arg) -> any {
+            complete(self, index, true, arg);
+            return arg;
+        }, [self, index](const any &arg) {
+            complete(self, index, false, arg);
+        });
+    }
+
+    static void complete(const std::shared_ptr<MapLimitState> &self, size_t index, bool isResolved, const any &arg) {
+        bool isRejected = false;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(self->mutex_);
+#endif
+            --self->running_;
+            if (self->isDone_)
+                return;
+            if (isResolved)
+                self->results_[index] = collectedValueOf(arg);
+            else
+                isRejected = self->isDone_ = true;
+        }
+
+        if (isRejected)
+            self->promise_.reject(arg);
+        else
+            pump(self);
+    }
+
+    std::function<Promise(size_t index)> func_;
+    size_t           count_;
+    size_t           limit_;
+    size_t           next_;       // the next index to start
+    size_t           running_;    // count of the started and not settled ones
+    bool             isPumping_;  // pump() is running
+    bool             isDone_;     // resolved or rejected
+    std::vector<any> results_;
+    Promise          promise_;
+#if PROMISE_MULTITHREAD
+    std::mutex       mutex_;
+#endif
+};
+
+Promise mapLimit(size_t count, size_t limit, const std::function<Promise(size_t index)> &func) {
+    std::shared_ptr<MapLimitState> state = pm_make_shared<MapLimitState>(count, limit, func);
+    Promise promise = state->promise_;
+    MapLimitState::pump(state);
+    return promise;
+}
+
+struct Semaphore::State {
+    explicit State(size_t count)
+        : count_(count) {
+    }
+
+    size_t              count_;     // available units
+    std::deque<Promise> waiters_;
+#if PROMISE_MULTITHREAD
+    std::mutex          mutex_;
+#endif
+};
+
+Semaphore::Semaphore(size_t count)
+    : state_(pm_make_shared<State>(count)) {
+}
+
+Promise Semaphore::acquire() const {
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+        if (state_->count_ == 0) {
+            Promise waiter = newPromise();
+            state_->waiters_.push_back(waiter);
+            return waiter;
+        }
+        --state_->count_;
+    }
+    return resolve();
+}
+
+bool Semaphore::tryAcquire() const {
+#if PROMISE_MULTITHREAD
+    std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+    if (state_->count_ == 0)
+        return false;
+    --state_->count_;
+    return true;
+}
+
+void Semaphore::release() const {
+    Promise waiter;     // resolved after unlocked
+    {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(state_->mutex_);
+#endif
+        if (state_->waiters_.empty()) {
+            ++state_->count_;
+            return;
+        }
+        waiter = std::move(state_->waiters_.front());
+        state_->waiters_.pop_front();
+    }
+    waiter.resolve();
+}
+
+Promise Semaphore::run(const std::function<Promise()> &func) const {
+    Semaphore self = *this;
+    return acquire().then([self, func]() {
+        Promise promise;
+        try {
+            promise = func();
+        }
+        catch (...) {
+            self.release();
+            throw;
+        }
+        return promise.finally([self]() {
+            self.release();
+        });
     });
 }
 
-Promise raceAndResolve(const std::list<Promise> &promise_list) {
-    std::shared_ptr<int> winner = std::make_shared<int>(-1);
-    return race(promise_list, winner).finally([promise_list, winner] {
-        int index = 0;
-        for (auto it = promise_list.begin(); it != promise_list.end(); ++it, ++index) {
-            if (index != *winner) {
-                auto promise = *it;
-                promise.resolve();
-            }
+struct SharedValuePromise::State {
+    State()
+        : state_(TaskState::kPending) {
+    }
+
+    bool isSettled() const {
+        return state_.load(std::memory_order_acquire) != TaskState::kPending;
+    }
+
+    // Called once by the task of share(), the value is not changed after the state is stored
+    void settle(TaskState state, any &value) {
+        std::deque<Promise> branches;   // resolved after unlocked
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<std::mutex> lock(mutex_);
+#endif
+            value_ = std::move(value);
+            state_.store(state, std::memory_order_release);
+            branches.swap(branches_);
+        }
+        for (Promise &branch : branches)
+            branch.resolve();
+    }
+
+    // Call the callback of a branch after settled, the value is passed by reference
+    any call(const any &onResolved, const any &onRejected) const {
+        bool isResolved = (state_.load(std::memory_order_acquire) == TaskState::kResolved);
+        const any &callback = (isResolved ? onResolved : onRejected);
+        if (callback.empty()
+            || callback.type() == type_id<std::nullptr_t>()
+            || !callback.may_call(value_)) {
+            // Passed to the next task of the branch
+            return (isResolved ? resolve(value_) : reject(value_));
         }
+        return callback.call(value_);
+    }
+
+    std::atomic<TaskState> state_;
+    any                    value_;
+    std::deque<Promise>    branches_;   // resolved when it is settled
+#if PROMISE_MULTITHREAD
+    std::mutex             mutex_;
+#endif
+};
+
+SharedValuePromise::SharedValuePromise(const std::shared_ptr<State> &state)
+    : state_(state) {
+}
+
+SharedValuePromise Promise::share() {
+    std::shared_ptr<SharedValuePromise::State> state = pm_make_shared<SharedValuePromise::State>();
+    then([state](any &value) {
+        state->settle(TaskState::kResolved, value);
+    }, [state](any &reason) {
+        state->settle(TaskState::kRejected, reason);
     });
+    return SharedValuePromise(state);
+}
+
+Promise SharedValuePromise::then(const any &onResolved, const any &onRejected) const {
+    std::shared_ptr<State> state = state_;
+    if (!state->isSettled()) {
+#if PROMISE_MULTITHREAD
+        std::lock_guard<std::mutex> lock(state->mutex_);
+#endif
+        if (!state->isSettled()) {
+            Promise branch = newPromise();
+            state->branches_.push_back(branch);
+            return branch.then([state, onResolved, onRejected]() -> any {
+                return state->call(onResolved, onRejected);
+            });
+        }
+    }
+
+    // Settled already, the callback is called here without creating the branch first
+    any value;
+    try {
+        value = state->call(onResolved, onRejected);
+    }
+    catch (...) {
+        return reject(std::current_exception());
+    }
+    if (value.type() == type_id<Promise>())
+        return value.cast<Promise &>();
+    return resolve(std::move(value));
+}
+
+Promise SharedValuePromise::then(const any &onResolved) const {
+    return then(onResolved, any());
+}
+
+Promise SharedValuePromise::fail(const any &onRejected) const {
+    return then(any(), onRejected);
+}
+
+bool SharedValuePromise::isSettled() const {
+    return state_->isSettled();
+}
+
+std::function<void()> armTimeout(Promise &promise, const std::function<void()> &disarm) {
+    // Set by the first one of the timer and the promise
+    std::shared_ptr<std::atomic<bool>> isDone = pm_make_shared<std::atomic<bool>>(false);
+    std::shared_ptr<Task> task = addTask(promise, [isDone, disarm]() {
+        if (!isDone->exchange(true))
+            disarm();
+    }, any(), false, true);
+    if (isDone->load())
+        return std::function<void()>();
+
+    // If a task is being called in other thread when the timer expires,
+    // it is tried again after the call returns, by onCalled_ of the holder.
+    Promise target = promise;
+    std::shared_ptr<std::function<void()>> expire = pm_make_shared<std::function<void()>>();
+    std::weak_ptr<std::function<void()>> weakExpire = expire;
+    *expire = [isDone, target, task, weakExpire]() {
+        if (isDone->exchange(true))
+            return;
+        std::shared_ptr<PromiseHolder> promiseHolder = getPromiseHolder(target);
+        std::shared_ptr<Task> head;
+        {
+#if PROMISE_MULTITHREAD
+            std::shared_ptr<Mutex> mutex = lockRoot(promiseHolder);
+            std::lock_guard<Mutex> lock(*mutex, std::adopt_lock_t());
+#else
+            promiseHolder = getRoot(promiseHolder);
+#endif
+            // Not rejected if the promise is settled
+            if (task->state_ != TaskState::kPending || promiseHolder->state_ != TaskState::kPending)
+                return;
+#if PROMISE_MULTITHREAD
+            if (promiseHolder->isCalling_) {
+                isDone->store(false);
+                // Alive while it is called
+                std::shared_ptr<std::function<void()>> retry = weakExpire.lock();
+                std::function<void()> previous = std::move(promiseHolder->onCalled_);
+                promiseHolder->onCalled_ = [previous, retry]() {
+                    if (previous)
+                        previous();
+                    (*retry)();
+                };
+                return;
+            }
+#endif
+            head = promiseHolder->pendingHead_;
+        }
+        if (head) {
+            Defer defer(promiseHolder, head);
+            // Rejected as exception so that it is caught by the handlers of its base classes
+            defer.reject(std::make_exception_ptr(TimeoutError()));
+        }
+    };
+    return [expire]() {
+        (*expire)();
+    };
 }
 
  
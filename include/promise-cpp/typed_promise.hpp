@@ -0,0 +1,665 @@
+#pragma once
+#ifndef INC_TYPED_PROMISE_HPP_
+#define INC_TYPED_PROMISE_HPP_
+
+/*
+ * Promise API implemented by cpp as Javascript promise style
+ *
+ * Copyright (c) 2016, xhawk18
+ * at gmail.com
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+//
+// Statically typed promise, TypedPromise<T> is resolved with exactly one value of type T
+// (or nothing if T is void).
+//
+// The resolved value is stored as T, and the resolved callbacks are called directly,
+// the result type of "then" is deduced from the callback at compile time --
+//   callback returns U                -> TypedPromise<U>
+//   callback returns TypedPromise<U>  -> TypedPromise<U>, resolved when the returned one is resolved
+//   callback returns Promise          -> Promise
+//
+// The rejected reason is still an "any", rejected callbacks are matched by the argument
+// type as the untyped Promise does.
+//
+// TypedPromise<T> can be converted to Promise by toPromise(), and
+// TypedPromise<T>(promise) converts an untyped Promise.
+//
+
+#include "promise.hpp"
+#include <new>
+#include <utility>
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+
+namespace promise {
+
+template<typename T> class TypedPromise;
+template<typename T> class TypedDefer;
+template<typename T> struct TypedState;
+template<typename T> struct TypedCoroutinePromise;
+template<typename T> struct TypedAwaiter;
+
+// Storage of the resolved value
+template<typename T>
+struct TypedValue {
+    TypedValue() : hasValue_(false) {}
+    ~TypedValue() {
+        if (hasValue_) get().~T();
+    }
+
+    template<typename V>
+    void set(V &&value) {
+        new (&storage_) T(std::forward<V>(value));
+        hasValue_ = true;
+    }
+
+    T &get() {
+        return *reinterpret_cast<T *>(&storage_);
+    }
+
+    void copyFrom(TypedValue &other) {
+        set(other.get());
+    }
+
+    T take() {
+        return std::move(get());
+    }
+
+private:
+    TypedValue(const TypedValue &) = delete;
+    TypedValue &operator=(const TypedValue &) = delete;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+    bool hasValue_;
+};
+
+template<>
+struct TypedValue<void> {
+    void set() {}
+    void copyFrom(TypedValue &) {}
+    void take() {}
+};
+
+// Call func with the resolved value
+template<typename T>
+struct typed_invoke {
+    template<typename FUNC>
+    static auto call(FUNC &func, TypedValue<T> &value) -> decltype(func(value.get())) {
+        return func(value.get());
+    }
+};
+
+template<>
+struct typed_invoke<void> {
+    template<typename FUNC>
+    static auto call(FUNC &func, TypedValue<void> &) -> decltype(func()) {
+        return func();
+    }
+};
+
+template<typename T, typename FUNC>
+struct typed_invoke_result {
+    using type = decltype(typed_invoke<T>::call(std::declval<FUNC &>(), std::declval<TypedValue<T> &>()));
+};
+
+// Resolved callback of TypedPromise::fail, the value is shared with the next promise instead of copied
+template<typename T>
+struct typed_pass_through {
+};
+
+template<>
+struct typed_pass_through<void> {
+    void operator()() const {}
+};
+
+struct typed_no_handler {
+};
+
+// How the result of a callback settles the next promise
+template<typename RESULT>
+struct typed_result_traits {
+    using promise_type = TypedPromise<RESULT>;
+    using target_type  = std::shared_ptr<TypedState<RESULT>>;
+
+    static target_type newTarget() {
+        return pm_make_shared<TypedState<RESULT>>();
+    }
+    static promise_type getPromise(const target_type &target) {
+        return promise_type(target);
+    }
+    template<typename CALL>
+    static void settle(const target_type &target, CALL &&call) {
+        target->resolve(call());
+    }
+    static void reject(const target_type &target, const any &reason) {
+        target->reject(reason);
+    }
+};
+
+template<typename RESULT>
+struct typed_result_traits<TypedPromise<RESULT>> {
+    using promise_type = TypedPromise<RESULT>;
+    using target_type  = std::shared_ptr<TypedState<RESULT>>;
+
+    static target_type newTarget() {
+        return pm_make_shared<TypedState<RESULT>>();
+    }
+    static promise_type getPromise(const target_type &target) {
+        return promise_type(target);
+    }
+    template<typename CALL>
+    static void settle(const target_type &target, CALL &&call) {
+        promise_type promise = call();
+        if (!promise.state_)
+            throw std::logic_error("empty TypedPromise returned by the callback");
+        promise.state_->forwardTo(target);
+    }
+    static void reject(const target_type &target, const any &reason) {
+        target->reject(reason);
+    }
+};
+
+template<>
+struct typed_result_traits<Promise> {
+    using promise_type = Promise;
+    using target_type  = Promise;
+
+    static target_type newTarget() {
+        return newPromise();
+    }
+    static promise_type getPromise(const target_type &target) {
+        return target;
+    }
+    template<typename CALL>
+    static void settle(const target_type &target, CALL &&call) {
+        Promise promise = call();
+        promise.then([target](const any &arg) {
+            target.resolve(arg);
+        }, [target](const any &arg) {
+            target.reject(arg);
+        });
+    }
+    static void reject(const target_type &target, const any &reason) {
+        target.reject(reason);
+    }
+};
+
+// Call the rejected callback, the argument is matched by type as the untyped Promise does,
+// and bad_any_cast is thrown if not matched.
+template<typename RESULT, typename ON_REJECTED>
+struct typed_reject_invoke {
+    static RESULT call(const ON_REJECTED &onRejected, const any &reason) {
+        using func_t = call_traits<ON_REJECTED>;
+        using nocvr_argument_type = typename tuple_remove_cvref<typename func_t::argument_type>::type;
+        typename func_t::fun_type stdFunc = func_t::to_std_function(onRejected);
+        return any_call_t<typename func_t::result_type, nocvr_argument_type, func_t>::call(stdFunc, reason);
+    }
+};
+
+template<typename RESULT>
+struct typed_reject_invoke<RESULT, typed_no_handler> {
+    static RESULT call(const typed_no_handler &, const any &reason) {
+        throw bad_any_cast(reason.type(), type_id<typed_no_handler>());
+    }
+};
+
+// Continuation in the pending chain of TypedState
+template<typename T>
+struct TypedContinuation {
+    virtual ~TypedContinuation() {}
+    virtual void onResolved(TypedState<T> &state) = 0;
+    virtual void onRejected(const any &reason) = 0;
+    std::shared_ptr<TypedContinuation> next_;
+};
+
+template<typename T, typename RESULT, typename ON_RESOLVED, typename ON_REJECTED>
+struct TypedThen : public TypedContinuation<T> {
+    using traits = typed_result_traits<RESULT>;
+
+    TypedThen(const typename traits::target_type &target, ON_RESOLVED &&onResolved, ON_REJECTED &&onRejected)
+        : target_(target)
+        , onResolved_(std::move(onResolved))
+        , onRejected_(std::move(onRejected)) {
+    }
+
+    virtual void onResolved(TypedState<T> &state) {
+        resolveBy(onResolved_, state);
+    }
+
+    virtual void onRejected(const any &reason) {
+        try {
+            traits::settle(target_, [&]() -> RESULT {
+                return typed_reject_invoke<RESULT, ON_REJECTED>::call(onRejected_, reason);
+            });
+        }
+        catch (const bad_any_cast &) {
+            //just go through if argument type is not match
+            traits::reject(target_, reason);
+        }
+        catch (...) {
+            traits::reject(target_, std::current_exception());
+        }
+    }
+
+    template<typename FUNC>
+    void resolveBy(FUNC &onResolved, TypedState<T> &state) {
+        try {
+            traits::settle(target_, [&]() -> RESULT {
+                return typed_invoke<T>::call(onResolved, state.value());
+            });
+        }
+        catch (...) {
+            traits::reject(target_, std::current_exception());
+        }
+    }
+
+    void resolveBy(typed_pass_through<T> &, TypedState<T> &state) {
+        target_->joinTo(state.shared_from_this());
+    }
+
+    typename traits::target_type target_;
+    ON_RESOLVED                  onResolved_;
+    ON_REJECTED                  onRejected_;
+};
+
+template<typename T, typename ON_FINALLY>
+struct TypedFinally : public TypedContinuation<T> {
+    TypedFinally(const std::shared_ptr<TypedState<T>> &target, ON_FINALLY &&onFinally)
+        : target_(target)
+        , onFinally_(std::move(onFinally)) {
+    }
+
+    virtual void onResolved(TypedState<T> &state) {
+        try {
+            onFinally_();
+        }
+        catch (...) {
+            target_->reject(std::current_exception());
+            return;
+        }
+        target_->joinTo(state.shared_from_this());
+    }
+
+    virtual void onRejected(const any &reason) {
+        try {
+            onFinally_();
+        }
+        catch (...) {
+            target_->reject(std::current_exception());
+            return;
+        }
+        target_->reject(reason);
+    }
+
+    std::shared_ptr<TypedState<T>> target_;
+    ON_FINALLY                     onFinally_;
+};
+
+// Settle the untyped promise with the result of typed promise
+template<typename T>
+struct UntypedForward : public TypedContinuation<T> {
+    explicit UntypedForward(const Promise &target)
+        : target_(target) {
+    }
+
+    virtual void onResolved(TypedState<T> &state) {
+        target_.resolve(state.value().get());
+    }
+
+    virtual void onRejected(const any &reason) {
+        target_.reject(reason);
+    }
+
+    Promise target_;
+};
+
+template<>
+inline void UntypedForward<void>::onResolved(TypedState<void> &) {
+    target_.resolve();
+}
+
+// The continuations of one state are called one by one, in the order they are added, by the
+// thread which settles it or which adds one after it is settled. The ones added meanwhile,
+// even by the called continuations, are queued and called by the same loop.
+template<typename T>
+struct TypedState : public std::enable_shared_from_this<TypedState<T>> {
+    TypedState()
+        : state_(TaskState::kPending)
+        , pendingTail_(nullptr)
+        , isRunning_(false)
+        , handled_(false) {
+    }
+
+    ~TypedState() {
+        if (state_ == TaskState::kRejected && !handled_)
+            PromiseHolder::onUncaughtException(reason_);
+    }
+
+    template<typename ...V>
+    void resolve(V &&...value) {
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(mutex_);
+#endif
+            if (state_ != TaskState::kPending) return;
+            value_.set(std::forward<V>(value)...);
+            state_ = TaskState::kResolved;
+            isRunning_ = true;
+        }
+        run();
+    }
+
+    void reject(const any &reason) {
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(mutex_);
+#endif
+            if (state_ != TaskState::kPending) return;
+            reason_ = reason;
+            state_ = TaskState::kRejected;
+            isRunning_ = true;
+        }
+        run();
+    }
+
+    // Resolved with the value of "root", which is shared instead of copied. The continuations
+    // are moved to root, so that the value is read by the loop of root only.
+    void joinTo(const std::shared_ptr<TypedState<T>> &root) {
+        std::shared_ptr<TypedContinuation<T>> head;
+        TypedContinuation<T> *tail;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(mutex_);
+#endif
+            if (state_ != TaskState::kPending) return;
+            root_ = root;
+            state_ = TaskState::kResolved;
+            head = std::move(pendingHead_);
+            pendingHead_.reset();
+            tail = pendingTail_;
+            pendingTail_ = nullptr;
+        }
+        if (head)
+            root->append(head, tail);
+    }
+
+    void addContinuation(const std::shared_ptr<TypedContinuation<T>> &continuation) {
+        append(continuation, continuation.get());
+    }
+
+    void forwardTo(const std::shared_ptr<TypedState<T>> &target) {
+        addContinuation(pm_make_shared<TypedFinally<T, typed_pass_through<void>>>(target, typed_pass_through<void>()));
+    }
+
+    // The resolved value, read by the continuations in the loop of this state
+    TypedValue<T> &value() {
+        return value_;
+    }
+
+private:
+    // Append the continuations from head to tail, and call them if it is settled and not running
+    void append(const std::shared_ptr<TypedContinuation<T>> &head, TypedContinuation<T> *tail) {
+        std::shared_ptr<TypedState<T>> root;
+        {
+#if PROMISE_MULTITHREAD
+            std::lock_guard<Mutex> lock(mutex_);
+#endif
+            handled_ = true;
+            root = root_;
+            if (!root) {
+                if (pendingTail_ != nullptr)
+                    pendingTail_->next_ = head;
+                else
+                    pendingHead_ = head;
+                pendingTail_ = tail;
+                if (state_ == TaskState::kPending || isRunning_)
+                    return;
+                isRunning_ = true;
+            }
+        }
+        if (root)
+            root->append(head, tail);
+        else
+            run();
+    }
+
+    void settle(TypedContinuation<T> &continuation) {
+        if (state_ == TaskState::kResolved)
+            continuation.onResolved(*this);
+        else
+            continuation.onRejected(reason_);
+    }
+
+    // Only one thread is in the loop, value_ and reason_ are never changed after settled
+    void run() {
+        for (;;) {
+            std::shared_ptr<TypedContinuation<T>> continuation;
+            {
+#if PROMISE_MULTITHREAD
+                std::lock_guard<Mutex> lock(mutex_);
+#endif
+                if (!pendingHead_) {
+                    isRunning_ = false;
+                    return;
+                }
+                continuation = std::move(pendingHead_);
+                pendingHead_.reset();
+                pendingTail_ = nullptr;
+            }
+            while (continuation) {
+                settle(*continuation);
+                std::shared_ptr<TypedContinuation<T>> next = std::move(continuation->next_);
+                continuation = std::move(next);
+            }
+        }
+    }
+
+    TypedState(const TypedState &) = delete;
+    TypedState &operator=(const TypedState &) = delete;
+
+    TaskState                              state_;
+    TypedValue<T>                          value_;
+    any                                    reason_;
+    std::shared_ptr<TypedState<T>>         root_;       // set by joinTo()
+    std::shared_ptr<TypedContinuation<T>>  pendingHead_;
+    TypedContinuation<T>                  *pendingTail_;
+    bool                                   isRunning_;
+    bool                                   handled_;
+#if PROMISE_MULTITHREAD
+    Mutex                                  mutex_;
+#endif
+};
+
+template<typename T>
+class TypedDefer {
+public:
+    template<typename ...V>
+    inline void resolve(V &&...value) const {
+        state_->resolve(std::forward<V>(value)...);
+    }
+
+    template<typename ...ARGS,
+        typename std::enable_if<!is_one_any<ARGS...>::value>::type *dummy = nullptr>
+    inline void reject(ARGS &&...args) const {
+        reject(makeArgs(std::forward<ARGS>(args)...));
+    }
+
+    inline void reject(const any &reason) const {
+        state_->reject(reason);
+    }
+
+    inline TypedPromise<T> getPromise() const {
+        return TypedPromise<T>(state_);
+    }
+
+private:
+    template<typename U> friend class TypedPromise;
+    template<typename U, typename FUNC> friend TypedPromise<U> newTypedPromise(FUNC &&run);
+    explicit TypedDefer(const std::shared_ptr<TypedState<T>> &state)
+        : state_(state) {
+    }
+    std::shared_ptr<TypedState<T>> state_;
+};
+
+template<typename T>
+class TypedPromise {
+public:
+    using value_type = T;
+
+    TypedPromise() {}
+
+    // Converted from the untyped promise, which should be resolved with one argument of type T.
+    explicit TypedPromise(const Promise &promise)
+        : state_(pm_make_shared<TypedState<T>>()) {
+        std::shared_ptr<TypedState<T>> state = state_;
+        Promise(promise).then(resolveFrom(state)).fail([state](const any &reason) {
+            state->reject(reason);
+        });
+    }
+
+    template<typename ON_RESOLVED>
+    inline typename typed_result_traits<typename typed_invoke_result<T, ON_RESOLVED>::type>::promise_type
+    then(ON_RESOLVED onResolved) const {
+        return thenImpl<typename typed_invoke_result<T, ON_RESOLVED>::type>(std::move(onResolved), typed_no_handler());
+    }
+
+    template<typename ON_RESOLVED, typename ON_REJECTED>
+    inline typename typed_result_traits<typename typed_invoke_result<T, ON_RESOLVED>::type>::promise_type
+    then(ON_RESOLVED onResolved, ON_REJECTED onRejected) const {
+        return thenImpl<typename typed_invoke_result<T, ON_RESOLVED>::type>(std::move(onResolved), std::move(onRejected));
+    }
+
+    // onRejected should return T (or TypedPromise<T>) to recover the chain
+    template<typename ON_REJECTED>
+    inline TypedPromise<T> fail(ON_REJECTED onRejected) const {
+        return thenImpl<T>(typed_pass_through<T>(), std::move(onRejected));
+    }
+
+    // onFinally is called without argument, and the result is passed through
+    template<typename ON_FINALLY>
+    inline TypedPromise<T> finally(ON_FINALLY onFinally) const {
+        std::shared_ptr<TypedState<T>> target = pm_make_shared<TypedState<T>>();
+        state_->addContinuation(pm_make_shared<TypedFinally<T, ON_FINALLY>>(target, std::move(onFinally)));
+        return TypedPromise<T>(target);
+    }
+
+    inline Promise toPromise() const {
+        Promise promise = newPromise();
+        state_->addContinuation(pm_make_shared<UntypedForward<T>>(promise));
+        return promise;
+    }
+
+    inline void clear() {
+        state_.reset();
+    }
+
+    inline operator bool() const {
+        return state_.operator bool();
+    }
+
+private:
+    template<typename U> friend class TypedPromise;
+    template<typename U> friend class TypedDefer;
+    template<typename U> friend struct typed_result_traits;
+    template<typename U> friend struct TypedCoroutinePromise;
+    template<typename U> friend struct TypedAwaiter;
+    template<typename U, typename FUNC> friend TypedPromise<U> newTypedPromise(FUNC &&run);
+
+    explicit TypedPromise(const std::shared_ptr<TypedState<T>> &state)
+        : state_(state) {
+    }
+
+    template<typename RESULT, typename ON_RESOLVED, typename ON_REJECTED>
+    inline typename typed_result_traits<RESULT>::promise_type
+    thenImpl(ON_RESOLVED &&onResolved, ON_REJECTED &&onRejected) const {
+        using traits = typed_result_traits<RESULT>;
+        typename traits::target_type target = traits::newTarget();
+        state_->addContinuation(pm_make_shared<TypedThen<T, RESULT, ON_RESOLVED, ON_REJECTED>>(
+            target, std::move(onResolved), std::move(onRejected)));
+        return traits::getPromise(target);
+    }
+
+    template<typename U = T>
+    static std::function<void(U &)> resolveFrom(const std::shared_ptr<TypedState<U>> &state,
+        typename std::enable_if<!std::is_void<U>::value>::type *dummy = nullptr) {
+        (void)dummy;
+        return [state](U &value) { state->resolve(value); };
+    }
+
+    template<typename U = T>
+    static std::function<void()> resolveFrom(const std::shared_ptr<TypedState<U>> &state,
+        typename std::enable_if<std::is_void<U>::value>::type *dummy = nullptr) {
+        (void)dummy;
+        return [state]() { state->resolve(); };
+    }
+
+    std::shared_ptr<TypedState<T>> state_;
+};
+
+// Defined after TypedPromise, which is required by the explicit specialization
+template<>
+struct typed_result_traits<void> {
+    using promise_type = TypedPromise<void>;
+    using target_type  = std::shared_ptr<TypedState<void>>;
+
+    static target_type newTarget() {
+        return pm_make_shared<TypedState<void>>();
+    }
+    static promise_type getPromise(const target_type &target) {
+        return promise_type(target);
+    }
+    template<typename CALL>
+    static void settle(const target_type &target, CALL &&call) {
+        call();
+        target->resolve();
+    }
+    static void reject(const target_type &target, const any &reason) {
+        target->reject(reason);
+    }
+};
+
+// Create a TypedPromise<T>, run is called with TypedDefer<T> &
+template<typename T, typename FUNC>
+inline TypedPromise<T> newTypedPromise(FUNC &&run) {
+    std::shared_ptr<TypedState<T>> state = pm_make_shared<TypedState<T>>();
+    TypedDefer<T> defer(state);
+    try {
+        run(defer);
+    }
+    catch (...) {
+        defer.reject(std::current_exception());
+    }
+    return TypedPromise<T>(state);
+}
+
+template<typename T, typename ...V>
+inline TypedPromise<T> resolveTyped(V &&...value) {
+    return newTypedPromise<T>([&](TypedDefer<T> &defer) {
+        defer.resolve(std::forward<V>(value)...);
+    });
+}
+
+} // namespace promise
+
+#endif